@@ -0,0 +1,364 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Headless ASIO host. Loads AsioUAC2 directly (no COM, the SDK's non Windows AsioDriver base)
+// on top of SimTransport in real time and runs init, createBuffers, start, stop and
+// disposeBuffers for every rate, buffer size and host load. Reports the period, jitter,
+// missed deadlines and CPU time of the bufferSwitchTimeInfo callback.
+// A deadline is missed when the device FIFO runs dry or over, exit code is 1 if that happens,
+// the sample position skips or a run fails.
+
+#include <time.h>
+#include <pthread.h>
+#include "asiouac2.h"
+#include "simtransport.h"
+
+#if WINDOWS
+#error AsioHost needs the non Windows build of the driver
+#endif
+
+//one bufferSwitchTimeInfo call, monotonic and thread CPU clocks in seconds
+struct CallbackRecord
+{
+	double		start;
+	double		end;
+	double		cpuStart;
+	double		cpuEnd;
+	pthread_t	thread;
+	double		samplePosition;
+	long		index;
+};
+
+//state of the current run, the callbacks have no context
+struct HostRun
+{
+	CallbackRecord*		records;
+	long				capacity;
+	volatile long		count;
+	volatile double		measureFrom;	//callbacks before that are warmup
+	double				load;			//simulated processing per callback, s
+	long				bufferSize;
+	ASIOBufferInfo*		buffers;
+	long				bufferCount;
+	int*				sampleSizes;
+	volatile long		resets;
+	volatile ULONG		checksum;		//keeps the input reads
+};
+
+static HostRun s_run;
+
+static double Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static double ThreadCpu()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static double SamplesToDouble(const ASIOSamples& samples)
+{
+	return (double)samples.hi * 4294967296. + (double)samples.lo;
+}
+
+static int SampleSize(ASIOSampleType type)
+{
+	switch(type)
+	{
+	case ASIOSTInt16LSB:
+		return 2;
+	case ASIOSTInt24LSB:
+		return 3;
+	}
+	return 4;
+}
+
+ASIOTime* bufferSwitchTimeInfo(ASIOTime* timeInfo, long index, ASIOBool processNow)
+{
+	double start = Now();
+	double cpuStart = ThreadCpu();
+
+	//the host's DSP
+	while(Now() - start < s_run.load)
+		;
+	ULONG checksum = 0;
+	for(long i = 0; i < s_run.bufferCount; i++)
+	{
+		int length = s_run.bufferSize * s_run.sampleSizes[i];
+		UCHAR* buffer = (UCHAR*)s_run.buffers[i].buffers[index];
+		if(s_run.buffers[i].isInput)
+			for(int n = 0; n < length; n += 4)
+				checksum += buffer[n];
+		else
+			memset(buffer, 0, length);
+	}
+	s_run.checksum += checksum;
+
+	if(start >= s_run.measureFrom && s_run.count < s_run.capacity)
+	{
+		CallbackRecord& record = s_run.records[s_run.count];
+		record.start = start;
+		record.cpuStart = cpuStart;
+		record.thread = pthread_self();
+		record.samplePosition = timeInfo ? SamplesToDouble(timeInfo->timeInfo.samplePosition) : -1.;
+		record.index = index;
+		record.cpuEnd = ThreadCpu();
+		record.end = Now();
+		s_run.count++;
+	}
+	return 0;
+}
+
+void bufferSwitch(long index, ASIOBool processNow)
+{
+	bufferSwitchTimeInfo(NULL, index, processNow);
+}
+
+void sampleRateChanged(ASIOSampleRate sampleRate)
+{
+}
+
+long asioMessage(long selector, long value, void* message, double* opt)
+{
+	switch(selector)
+	{
+	case kAsioSelectorSupported:
+		return value == kAsioEngineVersion || value == kAsioSupportsTimeInfo || value == kAsioResetRequest;
+	case kAsioEngineVersion:
+		return 2;
+	case kAsioSupportsTimeInfo:
+		return 1;
+	case kAsioResetRequest:
+		s_run.resets++;
+		return 1;
+	}
+	return 0;
+}
+
+struct RunResult
+{
+	long	callbacks;
+	double	periodMean;		//ms
+	double	jitterRms;		//ms, against the nominal period
+	double	jitterMax;
+	double	lagMax;			//ms behind the buffer schedule, the engine releases buffers in bursts per transfer
+	ULONG	overloads;		//took longer than a period
+	ULONG	sequenceErrors;	//sample position didn't advance by one buffer or same half twice
+	double	hostCpu;		//us per callback
+	double	driverCpu;		//us per callback, callback thread between two callbacks
+	double	driverCpuMax;
+};
+
+void Analyze(double period, RunResult& result)
+{
+	memset(&result, 0, sizeof(result));
+	result.callbacks = s_run.count;
+	if(s_run.count < 2)
+		return;
+
+	double sum = 0., sumSquares = 0., hostCpu = 0., driverCpu = 0.;
+	long driverCount = 0;
+	//schedule starts at the earliest callback, moved back whenever a callback comes earlier
+	double base = s_run.records[0].start;
+	for(long n = 0; n < s_run.count; n++)
+	{
+		const CallbackRecord& record = s_run.records[n];
+		double scheduled = base + n * period;
+		if(record.start < scheduled)
+			base -= scheduled - record.start;
+		else if(record.start - scheduled > result.lagMax)
+			result.lagMax = record.start - scheduled;
+		if(record.end - record.start > period)
+			result.overloads++;
+		hostCpu += record.cpuEnd - record.cpuStart;
+		if(n == 0)
+			continue;
+
+		const CallbackRecord& previous = s_run.records[n - 1];
+		double interval = record.start - previous.start;
+		sum += interval;
+		sumSquares += (interval - period) * (interval - period);
+		if(fabs(interval - period) > result.jitterMax)
+			result.jitterMax = fabs(interval - period);
+		if(record.index == previous.index ||
+			(record.samplePosition >= 0. && record.samplePosition - previous.samplePosition != s_run.bufferSize))
+			result.sequenceErrors++;
+		if(pthread_equal(record.thread, previous.thread))
+		{
+			double cpu = record.cpuStart - previous.cpuEnd;
+			driverCpu += cpu;
+			driverCount++;
+			if(cpu > result.driverCpuMax)
+				result.driverCpuMax = cpu;
+		}
+	}
+	result.periodMean = sum / (s_run.count - 1) * 1000.;
+	result.jitterRms = sqrt(sumSquares / (s_run.count - 1)) * 1000.;
+	result.jitterMax *= 1000.;
+	result.lagMax *= 1000.;
+	result.hostCpu = hostCpu / s_run.count * 1000000.;
+	result.driverCpu = driverCount ? driverCpu / driverCount * 1000000. : 0.;
+	result.driverCpuMax *= 1000000.;
+}
+
+void ParseList(char* list, int* values, int& count, int maxCount)
+{
+	count = 0;
+	for(char* value = strtok(list, ","); value && count < maxCount; value = strtok(NULL, ","))
+		values[count++] = atoi(value);
+}
+
+void Usage()
+{
+	printf("usage: asiohost [-t seconds] [-r rate,rate,...] [-b frames,frames,...] [-l load%%,load%%,...]\n");
+	printf("  -l  host processing per callback in percent of the buffer period\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = 5;
+	int rates[16] = {44100, 48000, 96000, 192000};
+	int rateCount = 4;
+	int bufferSizes[16] = {64, 128, 256, 512};
+	int bufferSizeCount = 4;
+	int loads[16] = {0, 50, 80};
+	int loadCount = 3;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-t") && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+			ParseList(argv[++i], rates, rateCount, 16);
+		else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+			ParseList(argv[++i], bufferSizes, bufferSizeCount, 16);
+		else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+			ParseList(argv[++i], loads, loadCount, 16);
+		else
+		{
+			Usage();
+			return 2;
+		}
+	}
+
+	SimDeviceConfig config;
+	config.realTime = TRUE;
+	SimTransport sim(config);
+	AsioUAC2 driver(&sim);
+	if(!driver.init(NULL))
+	{
+		printf("ERROR: driver init failed\n");
+		return 2;
+	}
+
+	char name[32];
+	long inputs, outputs, minSize, maxSize, preferredSize, granularity;
+	driver.getDriverName(name);
+	driver.getChannels(&inputs, &outputs);
+	driver.getBufferSize(&minSize, &maxSize, &preferredSize, &granularity);
+	printf("%s: %ld inputs, %ld outputs, preferred buffer %ld\n", name, inputs, outputs, preferredSize);
+
+	long bufferCount = inputs + outputs;
+	ASIOBufferInfo* buffers = new ASIOBufferInfo[bufferCount];
+	int* sampleSizes = new int[bufferCount];
+	for(long i = 0; i < bufferCount; i++)
+	{
+		ASIOChannelInfo info;
+		info.channel = buffers[i].channelNum = i < inputs ? i : i - inputs;
+		info.isInput = buffers[i].isInput = i < inputs ? ASIOTrue : ASIOFalse;
+		driver.getChannelInfo(&info);
+		sampleSizes[i] = SampleSize(info.type);
+	}
+
+	ASIOCallbacks callbacks;
+	callbacks.bufferSwitch = bufferSwitch;
+	callbacks.sampleRateDidChange = sampleRateChanged;
+	callbacks.asioMessage = asioMessage;
+	callbacks.bufferSwitchTimeInfo = bufferSwitchTimeInfo;
+
+	int failures = 0;
+	for(int r = 0; r < rateCount; r++)
+	{
+		if(driver.canSampleRate(rates[r]) != ASE_OK || driver.setSampleRate(rates[r]) != ASE_OK)
+		{
+			printf("%6d: not supported\n", rates[r]);
+			continue;
+		}
+		for(int b = 0; b < bufferSizeCount; b++)
+		{
+			for(int l = 0; l < loadCount; l++)
+			{
+				double period = (double)bufferSizes[b] / rates[r];
+				memset(&s_run, 0, sizeof(s_run));
+				s_run.capacity = (long)((seconds + 1) / period) + 64;
+				s_run.records = new CallbackRecord[s_run.capacity];
+				s_run.measureFrom = 1e30;
+				s_run.load = period * loads[l] / 100.;
+				s_run.bufferSize = bufferSizes[b];
+				s_run.buffers = buffers;
+				s_run.bufferCount = bufferCount;
+				s_run.sampleSizes = sampleSizes;
+
+				printf("%6d %5d %3d%%: ", rates[r], bufferSizes[b], loads[l]);
+				if(driver.createBuffers(buffers, bufferCount, bufferSizes[b], &callbacks) != ASE_OK)
+				{
+					printf("createBuffers FAILED\n");
+					delete[] s_run.records;
+					failures++;
+					continue;
+				}
+				if(driver.start() != ASE_OK)
+				{
+					printf("start FAILED\n");
+					driver.disposeBuffers();
+					delete[] s_run.records;
+					failures++;
+					continue;
+				}
+				//startup prefill and feedback lock aren't measured
+				Sleep(1000);
+				sim.ClearStatistics();
+				s_run.measureFrom = Now();
+				Sleep(seconds * 1000);
+				SimStatistics stats;
+				sim.GetStatistics(&stats);
+				driver.stop();
+				driver.disposeBuffers();
+
+				RunResult result;
+				Analyze(period, result);
+				//missed deadlines are the ones the device heard
+				ULONG missed = stats.underruns + stats.overruns;
+				bool failed = result.callbacks < 2 || missed != 0 || result.sequenceErrors != 0 || s_run.resets != 0;
+				printf("period %.3f/%.3f ms jitter %.3f rms %.3f max, lag %.3f ms, overload %u missed %u seq %u reset %ld, cpu host %.1f driver %.1f/%.1f us%s\n",
+					result.periodMean, period * 1000., result.jitterRms, result.jitterMax,
+					result.lagMax, result.overloads, missed, result.sequenceErrors, s_run.resets,
+					result.hostCpu, result.driverCpu, result.driverCpuMax, failed ? " FAILED" : "");
+				if(failed)
+					failures++;
+				delete[] s_run.records;
+			}
+		}
+	}
+	delete[] buffers;
+	delete[] sampleSizes;
+
+	return failures ? 1 : 0;
+}
@@ -147,16 +147,22 @@ HRESULT _stdcall DllUnregisterServer()
 //------------------------------------------------------------------------------------------
 AsioUAC2::AsioUAC2 (LPUNKNOWN pUnk, HRESULT *phr)
 	: CUnknown("ASIOUAC2", pUnk, phr), callbacks(NULL), inputBuffers(NULL), outputBuffers(NULL), 
-	inMap(NULL), outMap(NULL), m_device(NULL), m_AsioSyncEvent(NULL), m_BufferSwitchEvent(NULL), m_StopInProgress(false)
+	inMap(NULL), outMap(NULL), inputChannels(NULL), outputChannels(NULL), m_device(NULL), m_transport(NULL), m_AsioSyncEvent(NULL), m_BufferSwitchEvent(NULL), m_StopInProgress(false),
+	m_sampleKernels(GetSampleKernels()), m_interleave(NULL), m_deinterleave(NULL), m_floatSamples(false), m_ditherType(DitherTPDF),
+	m_dsdSetting(DsdModeNone), m_dsdMode(DsdModeNone), m_unitsPerFrame(1), m_dopMarker(DOP_MARKER), m_dsdSilence(NULL)
 
 
 //------------------------------------------------------------------------------------------
 
 #else
 
+const char driverDescriptionLong[] = "ASIO USB Audio Class 2 Driver";
+
 // when not on windows, we derive from AsioDriver
-AsioUAC2::AsioUAC2 () : AsioDriver (), callbacks(NULL), inputBuffers(NULL), outputBuffers(NULL), 
-	inMap(NULL), outMap(NULL), m_device(NULL), m_AsioSyncEvent(NULL), m_BufferSwitchEvent(NULL), m_StopInProgress(false)
+AsioUAC2::AsioUAC2 (USBTransport* transport) : AsioDriver (), callbacks(NULL), inputBuffers(NULL), outputBuffers(NULL), 
+	inMap(NULL), outMap(NULL), inputChannels(NULL), outputChannels(NULL), m_device(NULL), m_transport(transport), m_AsioSyncEvent(NULL), m_BufferSwitchEvent(NULL), m_StopInProgress(false),
+	m_sampleKernels(GetSampleKernels()), m_interleave(NULL), m_deinterleave(NULL), m_floatSamples(false), m_ditherType(DitherTPDF),
+	m_dsdSetting(DsdModeNone), m_dsdMode(DsdModeNone), m_unitsPerFrame(1), m_dopMarker(DOP_MARKER), m_dsdSilence(NULL)
 
 #endif
 {
@@ -187,6 +193,7 @@ AsioUAC2::AsioUAC2 () : AsioDriver (), callbacks(NULL), inputBuffers(NULL), outp
 	currentInBufferPosition = 0;
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: AsioUAC2::AsioUAC2()\n");
+	debugPrintf("ASIOUAC: Using %s sample kernels\n", m_sampleKernels->name);
 #endif
 }
 
@@ -235,7 +242,73 @@ ASIOBool AsioUAC2::init (void* sysRef)
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: AsioUAC2::init...\n");
 #endif
-	m_device = new USBAudioDevice(true);
+	LoadSettings();
+	return OpenDevice();
+}
+
+//------------------------------------------------------------------------------------------
+//ASIO types of integer and IEEE float USB samples, the first match wins. Int32LSBxx types
+//tell the host the real resolution of a 4 byte slot
+static const struct
+{
+	int				slotSize;
+	int				bitResolution;	//0 - any
+	bool			ieeeFloat;
+	ASIOSampleType	type;
+	int				shift;
+} s_hostFormats[] =
+{
+	{2, 0, false, ASIOSTInt16LSB, 0},
+	{3, 0, false, ASIOSTInt24LSB, 0},
+	{4, 16, false, ASIOSTInt32LSB16, 16},
+	{4, 18, false, ASIOSTInt32LSB18, 14},
+	{4, 20, false, ASIOSTInt32LSB20, 12},
+	{4, 24, false, ASIOSTInt32LSB24, 8},
+	{4, 0, false, ASIOSTInt32LSB, 0},
+	{4, 0, true, ASIOSTFloat32LSB, 0}
+};
+
+void AsioUAC2::ChooseHostFormat (int slotSize, int bitResolution, DWORD dataFormats, HostFormat& format)
+{
+	bool ieeeFloat = (dataFormats & AUDIO_FORMAT_TYPE_I_IEEE_FLOAT) && !(dataFormats & AUDIO_FORMAT_TYPE_I_PCM);
+	if(bitResolution <= 0 || bitResolution > slotSize * 8)
+		bitResolution = slotSize * 8;
+
+	format = HostFormat();
+	for(int i = 0; i < sizeof(s_hostFormats) / sizeof(s_hostFormats[0]); i++)
+	{
+		if(s_hostFormats[i].slotSize != slotSize || s_hostFormats[i].ieeeFloat != ieeeFloat ||
+			(s_hostFormats[i].bitResolution && s_hostFormats[i].bitResolution != bitResolution))
+			continue;
+		format.type = s_hostFormats[i].type;
+		format.sampleSize = slotSize;
+		format.shift = s_hostFormats[i].shift;
+		break;
+	}
+	if(format.type >= 0 && m_floatSamples && !ieeeFloat)
+	{
+		format.type = ASIOSTFloat32LSB;
+		format.sampleSize = sizeof(float);
+		format.shift = 0;
+		format.convertFloat = true;
+	}
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: %d/%d bit %s samples offered as ASIO type %d\n", bitResolution, slotSize * 8, ieeeFloat ? "float" : "integer", format.type);
+#endif
+}
+
+//------------------------------------------------------------------------------------------
+bool AsioUAC2::OpenDevice ()
+{
+	FormatRequest dacRequest;
+	//DoP needs 24 bits for marker and data, native DSD its own alt setting
+	if(m_dsdMode == DsdModeDoP)
+		dacRequest.bitResolution = 24;
+	if(m_dsdMode != DsdModeNone)
+		dacRequest.dataFormat = m_dsdMode == DsdModeRaw ? AUDIO_FORMAT_TYPE_I_RAW_DATA : AUDIO_FORMAT_TYPE_I_PCM;
+
+	m_device = new USBAudioDevice(true, m_transport);
+	m_device->SetDACFormatRequest(dacRequest);
 	m_device->InitDevice();
 
 	if (inputOpen ())
@@ -260,6 +333,13 @@ ASIOBool AsioUAC2::init (void* sysRef)
 	}
 	//timerOff ();		// de-activate 'hardware'
 	//error
+	CloseDevice();
+	return false;
+}
+
+//------------------------------------------------------------------------------------------
+void AsioUAC2::CloseDevice ()
+{
 	if(m_device)
 		m_device->Stop();
 
@@ -268,7 +348,106 @@ ASIOBool AsioUAC2::init (void* sysRef)
 	
 	outputClose ();
 	inputClose ();
-	return false;
+	active = false;
+}
+
+//------------------------------------------------------------------------------------------
+int AsioUAC2::ChooseDsdMode ()
+{
+	if(!m_device)
+		return DsdModeNone;
+	StreamingFormat formats[MAX_STREAMING_FORMATS];
+	int count = m_device->GetDACFormats(formats, MAX_STREAMING_FORMATS);
+	bool raw = false, dop = false;
+	for(int i = 0; i < count; i++)
+	{
+		if(formats[i].subslotSize != 3 && formats[i].subslotSize != 4)
+			continue;
+		if(formats[i].formats & AUDIO_FORMAT_TYPE_I_RAW_DATA)
+			raw = true;
+		if((formats[i].formats == 0 || (formats[i].formats & AUDIO_FORMAT_TYPE_I_PCM)) && formats[i].bitResolution >= 24)
+			dop = true;
+	}
+	if(raw && m_dsdSetting != DsdModeDoP)
+		return DsdModeRaw;
+	if(dop && m_dsdSetting != DsdModeRaw)
+		return DsdModeDoP;
+	return DsdModeNone;
+}
+
+//------------------------------------------------------------------------------------------
+ASIOError AsioUAC2::SetIoFormat (long format)
+{
+	int dsdMode = DsdModeNone;
+	if(format == kASIODSDFormat)
+	{
+		dsdMode = ChooseDsdMode();
+		if(dsdMode == DsdModeNone)
+			return ASE_NotPresent;
+	}
+	else if(format != kASIOPCMFormat)
+		return ASE_NotPresent;
+	if(dsdMode == m_dsdMode)
+		return ASE_SUCCESS;
+	//the stream is reopened on another alt setting
+	if(started || activeInputs || activeOutputs)
+		return ASE_InvalidMode;
+
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: Switching to %s format, DSD mode %d\n", format == kASIODSDFormat ? "DSD" : "PCM", dsdMode);
+#endif
+	CloseDevice();
+	m_dsdMode = dsdMode;
+	if(!OpenDevice() || (dsdMode != DsdModeNone && m_outputSampleSize != 3 && m_outputSampleSize != 4))
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Format switch failed, back to PCM\n");
+#endif
+		CloseDevice();
+		m_dsdMode = DsdModeNone;
+		if(OpenDevice())
+			UpdateFormatRate();
+		return ASE_HWMalfunction;
+	}
+	UpdateFormatRate();
+	return ASE_SUCCESS;
+}
+
+//------------------------------------------------------------------------------------------
+void AsioUAC2::UpdateFormatRate ()
+{
+	//rate and buffer size are counted in the samples of the current format
+	int usbRate = m_device ? m_device->GetCurrentSampleRate() : 0;
+	if(usbRate <= 0)
+		return;
+	sampleRate = (double)usbRate * SamplesPerUsbFrame();
+	milliSeconds = (long)((double)(blockFrames * SamplesPerUnit() * 1000) / sampleRate);
+}
+
+//------------------------------------------------------------------------------------------
+void AsioUAC2::LoadSettings ()
+{
+	//no registry elsewhere, the defaults stay
+#if WINDOWS
+	HKEY key;
+	if(RegOpenKeyEx(HKEY_CURRENT_USER, SETTINGS_KEY, 0, KEY_READ, &key) != ERROR_SUCCESS)
+		return;
+	DWORD value, size = sizeof(value), type;
+	if(RegQueryValueEx(key, SETTINGS_FLOAT, NULL, &type, (LPBYTE)&value, &size) == ERROR_SUCCESS && type == REG_DWORD)
+		m_floatSamples = value != 0;
+	size = sizeof(value);
+	if(RegQueryValueEx(key, SETTINGS_DITHER, NULL, &type, (LPBYTE)&value, &size) == ERROR_SUCCESS && type == REG_DWORD &&
+		value <= DitherNoiseShaped)
+		m_ditherType = value;
+	size = sizeof(value);
+	if(RegQueryValueEx(key, SETTINGS_DSD, NULL, &type, (LPBYTE)&value, &size) == ERROR_SUCCESS && type == REG_DWORD &&
+		value <= DsdModeRaw)
+		m_dsdSetting = value;
+	RegCloseKey(key);
+#endif
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: Settings: float samples %d, dither %d, DSD mode %d\n", (int)m_floatSamples, m_ditherType, m_dsdSetting);
+#endif
 }
 
 //------------------------------------------------------------------------------------------
@@ -300,6 +479,7 @@ ASIOError AsioUAC2::start ()
 		toggle = 0;
 		currentOutBufferPosition = 0;
 		currentInBufferPosition = 0;
+		m_dopMarker = DOP_MARKER;
 
 #ifdef EMULATION_HARDWARE
 		timerOn ();		
@@ -394,8 +574,8 @@ ASIOError AsioUAC2::getChannels (long *numInputChannels, long *numOutputChannels
 //------------------------------------------------------------------------------------------
 ASIOError AsioUAC2::getLatencies (long *_inputLatency, long *_outputLatency)
 {
-	*_inputLatency = inputLatency;
-	*_outputLatency = outputLatency;
+	*_inputLatency = inputLatency * SamplesPerUnit();
+	*_outputLatency = outputLatency * SamplesPerUnit();
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: getLatencies request. Input Latency = %d, Output Latency = %d\n", inputLatency, outputLatency);
 #endif
@@ -406,10 +586,10 @@ ASIOError AsioUAC2::getLatencies (long *_inputLatency, long *_outputLatency)
 ASIOError AsioUAC2::getBufferSize (long *minSize, long *maxSize,
 	long *preferredSize, long *granularity)
 {
-	*minSize = *maxSize = *preferredSize = blockFrames;		// allow this size only
+	*minSize = *maxSize = *preferredSize = blockFrames * SamplesPerUnit();		// allow this size only
 	*granularity = 0;
 #ifdef _ENABLE_TRACE
-	debugPrintf("ASIOUAC: getBufferSize request. MaxSize=maxSize=preferredSize=%d\n", blockFrames);
+	debugPrintf("ASIOUAC: getBufferSize request. MaxSize=maxSize=preferredSize=%d\n", *preferredSize);
 #endif
 	return ASE_OK;
 }
@@ -420,7 +600,8 @@ ASIOError AsioUAC2::canSampleRate (ASIOSampleRate sampleRate)
 	if(!m_device)
 		return ASE_HWMalfunction;
 	int iSampleRate = (int)sampleRate;
-	if(m_device->CanSampleRate(iSampleRate))
+	//DSD rates map to the USB frame rate of the DoP or raw stream
+	if(iSampleRate % SamplesPerUsbFrame() == 0 && m_device->CanSampleRate(iSampleRate / SamplesPerUsbFrame()))
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: canSampleRate request for samplerate %d OK\n", iSampleRate);
@@ -455,12 +636,12 @@ ASIOError AsioUAC2::setSampleRate (ASIOSampleRate sampleRate)
 
 	//if (sampleRate != this->sampleRate)
 	{
-		if(m_device->SetSampleRate(iSampleRate))
+		if(iSampleRate % SamplesPerUsbFrame() == 0 && m_device->SetSampleRate(iSampleRate / SamplesPerUsbFrame()))
 		{
 			this->sampleRate = sampleRate;
 			asioTime.timeInfo.sampleRate = sampleRate;
 			asioTime.timeInfo.flags |= kSampleRateChanged;
-			milliSeconds = (long)((double)(blockFrames * 1000) / this->sampleRate);
+			milliSeconds = (long)((double)(blockFrames * SamplesPerUnit() * 1000) / this->sampleRate);
 			if (callbacks && callbacks->sampleRateDidChange)
 				callbacks->sampleRateDidChange (this->sampleRate);
 
@@ -544,21 +725,10 @@ ASIOError AsioUAC2::getChannelInfo (ASIOChannelInfo *info)
 		return ASE_InvalidParameter;
 
 	int slotSize = info->isInput ? 	m_inputSampleSize : m_outputSampleSize;
-	int bitResolution = info->isInput ? m_device->GetADCBitResolution() : m_device->GetDACBitResolution();
-	switch(slotSize)
-	{
-		case 3:
-			{
-				//TODO: check bit resolution
-				info->type = ASIOSTInt24LSB;
-			}
-			break;
-		default:
-			{
-				//TODO: check bit resolution
-				info->type = ASIOSTInt32LSB;
-			}
-	}
+	if(m_dsdMode != DsdModeNone)
+		info->type = ASIOSTDSDInt8MSB1;
+	else
+		info->type = info->isInput ? m_inputFormat.type : m_outputFormat.type;
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: getChannelInfo request. Channel %d, type %d, slot size %d\n", info->channel, info->type, slotSize);
 #endif
@@ -603,7 +773,10 @@ ASIOError AsioUAC2::createBuffers (ASIOBufferInfo *bufferInfos, long numChannels
 
 	activeInputs = 0;
 	activeOutputs = 0;
-	blockFrames = bufferSize;
+	//DSD buffers are sized in bits, a USB frame must not straddle the two halves
+	if(bufferSize <= 0 || bufferSize % SamplesPerUsbFrame())
+		return ASE_InvalidMode;
+	blockFrames = bufferSize / SamplesPerUnit();
 	for (i = 0; i < numChannels; i++, info++)
 	{
 		if (info->isInput)
@@ -611,15 +784,16 @@ ASIOError AsioUAC2::createBuffers (ASIOBufferInfo *bufferInfos, long numChannels
 			if (info->channelNum < 0 || info->channelNum >= m_NumInputs)
 				goto error;
 			inMap[activeInputs] = info->channelNum;
-			inputBuffers[activeInputs] = new char[m_inputSampleSize * blockFrames * 2];	// double buffer
-			memset(inputBuffers[activeInputs], 0, blockFrames * 2 * m_inputSampleSize);
+			inputBuffers[activeInputs] = new char[HostSampleSize(true) * blockFrames * 2];	// double buffer
+			memset(inputBuffers[activeInputs], 0, blockFrames * 2 * HostSampleSize(true));
+			inputChannels[info->channelNum] = inputBuffers[activeInputs];
 #ifdef _ENABLE_TRACE
-			debugPrintf("ASIOUAC: Buffer for input channel %d allocated with size %d\n", activeInputs, (int)blockFrames * 2 * m_inputSampleSize);
+			debugPrintf("ASIOUAC: Buffer for input channel %d allocated with size %d\n", activeInputs, (int)blockFrames * 2 * HostSampleSize(true));
 #endif
 			if (inputBuffers[activeInputs])
 			{
 				info->buffers[0] = inputBuffers[activeInputs];
-				info->buffers[1] = inputBuffers[activeInputs] + m_inputSampleSize * blockFrames;
+				info->buffers[1] = inputBuffers[activeInputs] + HostSampleSize(true) * blockFrames;
 			}
 			else
 			{
@@ -635,15 +809,16 @@ ASIOError AsioUAC2::createBuffers (ASIOBufferInfo *bufferInfos, long numChannels
 			if (info->channelNum < 0 || info->channelNum >= m_NumOutputs)
 				goto error;
 			outMap[activeOutputs] = info->channelNum;
-			outputBuffers[activeOutputs] = new char[m_outputSampleSize * blockFrames * 2];	// double buffer
-			memset(outputBuffers[activeOutputs], 0, blockFrames * 2 * m_outputSampleSize);
+			outputBuffers[activeOutputs] = new char[HostSampleSize(false) * blockFrames * 2];	// double buffer
+			memset(outputBuffers[activeOutputs], 0, blockFrames * 2 * HostSampleSize(false));
+			outputChannels[info->channelNum] = outputBuffers[activeOutputs];
 #ifdef _ENABLE_TRACE
-			debugPrintf("ASIOUAC: Buffer for output channel %d allocated with size %d\n", activeOutputs, (int)blockFrames * 2 * m_outputSampleSize);
+			debugPrintf("ASIOUAC: Buffer for output channel %d allocated with size %d\n", activeOutputs, (int)blockFrames * 2 * HostSampleSize(false));
 #endif
 			if (outputBuffers[activeOutputs])
 			{
 				info->buffers[0] = outputBuffers[activeOutputs];
-				info->buffers[1] = outputBuffers[activeOutputs] + m_outputSampleSize * blockFrames;
+				info->buffers[1] = outputBuffers[activeOutputs] + HostSampleSize(false) * blockFrames;
 			}
 			else
 			{
@@ -664,6 +839,15 @@ ASIOError AsioUAC2::createBuffers (ASIOBufferInfo *bufferInfos, long numChannels
 		disposeBuffers();
 		return ASE_NoMemory;
 	}
+	//zero bytes aren't DSD silence
+	if (m_dsdMode != DsdModeNone)
+	{
+		m_dsdSilence = new char[blockFrames * 2];
+		memset(m_dsdSilence, DSD_SILENCE, blockFrames * 2);
+		for (i = 0; i < m_NumOutputs; i++)
+			if (outputChannels[i] == NULL)
+				outputChannels[i] = m_dsdSilence;
+	}
 
 	this->callbacks = callbacks;
 	if (callbacks->asioMessage (kAsioSupportsTimeInfo, 0, 0, 0))
@@ -720,10 +904,17 @@ ASIOError AsioUAC2::disposeBuffers()
 	for (i = 0; i < activeInputs; i++)
 		delete inputBuffers[i];
 	activeInputs = 0;
+	for (i = 0; i < m_NumInputs; i++)
+		inputChannels[i] = NULL;
 #endif
 	for (i = 0; i < activeOutputs; i++)
 		delete outputBuffers[i];
 	activeOutputs = 0;
+	for (i = 0; i < m_NumOutputs; i++)
+		outputChannels[i] = NULL;
+	if(m_dsdSilence)
+		delete[] m_dsdSilence;
+	m_dsdSilence = NULL;
 
 	if(m_BufferSwitchEvent)
 		CloseHandle(m_BufferSwitchEvent);
@@ -741,6 +932,26 @@ ASIOError AsioUAC2::controlPanel()
 //---------------------------------------------------------------------------------------------
 ASIOError AsioUAC2::future (long selector, void* opt)	// !!! check properties 
 {
+	ASIOIoFormat* format = (ASIOIoFormat*)opt;
+	switch (selector)
+	{
+		case kAsioCanDoIoFormat:
+			if(!format)
+				return ASE_InvalidParameter;
+			if(format->FormatType == kASIOPCMFormat || 
+				(format->FormatType == kASIODSDFormat && ChooseDsdMode() != DsdModeNone))
+				return ASE_SUCCESS;
+			return ASE_NotPresent;
+		case kAsioGetIoFormat:
+			if(!format)
+				return ASE_InvalidParameter;
+			format->FormatType = m_dsdMode != DsdModeNone ? kASIODSDFormat : kASIOPCMFormat;
+			return ASE_SUCCESS;
+		case kAsioSetIoFormat:
+			if(!format)
+				return ASE_InvalidParameter;
+			return SetIoFormat(format->FormatType);
+	}
 /*
 	ASIOTransportParameters* tp = (ASIOTransportParameters*)opt;
 	switch (selector)
@@ -772,25 +983,36 @@ bool AsioUAC2::inputOpen ()
 
 	m_inputSampleSize = m_device->GetADCSubslotSize();
 
-	m_NumInputs = m_device->GetInputChannelNumber();
+	//DSD is output only, the ADC still runs for implicit feedback
+	ChooseHostFormat(m_inputSampleSize, m_device->GetADCBitResolution(), m_device->GetADCDataFormats(), m_inputFormat);
+	m_NumInputs = m_dsdMode != DsdModeNone || m_inputFormat.type < 0 ? 0 : m_device->GetInputChannelNumber();
 	if(inputBuffers)
 		delete inputBuffers;
 	inputBuffers = new char*[m_NumInputs * 2];
 	if(inMap)
 		delete inMap;
 	inMap = new long[m_NumInputs];
+	if(inputChannels)
+		delete inputChannels;
+	inputChannels = new char*[m_NumInputs];
 	for (int i = 0; i < m_NumInputs; i++)
 	{
 		inputBuffers[i] = NULL;
 		inMap[i] = 0;
+		inputChannels[i] = NULL;
 	}
 
 	if(m_inputSampleSize == 4)
-		m_device->SetADCCallback(AsioUAC2::sFillInputData4, (void*)this);
+		m_device->SetADCScatterCallback(AsioUAC2::sFillInputPackets4, (void*)this);
 	else
 		if(m_inputSampleSize == 3)
-			m_device->SetADCCallback(AsioUAC2::sFillInputData3, (void*)this);
+			m_device->SetADCScatterCallback(AsioUAC2::sFillInputPackets3, (void*)this);
+		else
+			if(m_inputSampleSize == 2)
+				m_device->SetADCScatterCallback(AsioUAC2::sFillInputPackets2, (void*)this);
 
+	m_deinterleave = GetDeinterleaveKernel(m_sampleKernels, m_inputSampleSize, m_NumInputs);
+	m_inputConverter.Init(m_inputSampleSize, m_device->GetADCBitResolution(), DitherNone, m_NumInputs);
 	m_AsioSyncEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 
 	return true;
@@ -803,11 +1025,14 @@ void AsioUAC2::inputClose ()
 		delete inMap;
 	if(inputBuffers)
 		delete inputBuffers;
+	if(inputChannels)
+		delete inputChannels;
 	if(m_AsioSyncEvent)
 		CloseHandle(m_AsioSyncEvent);
 	m_NumInputs = 0;
 	inMap = NULL;
 	inputBuffers = NULL;
+	inputChannels = NULL;
 	m_AsioSyncEvent = NULL;
 }
 
@@ -827,24 +1052,36 @@ bool AsioUAC2::outputOpen()
 		return false;
 
 	m_outputSampleSize = m_device->GetDACSubslotSize();
+	//DoP carries 2 DSD bytes per sample, native DSD fills the whole subslot
+	m_unitsPerFrame = m_dsdMode == DsdModeDoP ? 2 : (m_dsdMode == DsdModeRaw && m_outputSampleSize ? m_outputSampleSize : 1);
 
-	m_NumOutputs = m_device->GetOutputChannelNumber();
+	ChooseHostFormat(m_outputSampleSize, m_device->GetDACBitResolution(), m_device->GetDACDataFormats(), m_outputFormat);
+	m_NumOutputs = m_outputFormat.type < 0 ? 0 : m_device->GetOutputChannelNumber();
 	if(outputBuffers)
 		delete outputBuffers;
 	outputBuffers = new char*[m_NumOutputs * 2];
 	if(outMap)
 		delete outMap;
 	outMap = new long[m_NumOutputs];
+	if(outputChannels)
+		delete outputChannels;
+	outputChannels = new char*[m_NumOutputs];
 	for (int i = 0; i < m_NumOutputs; i++)
 	{
 		outputBuffers[i] = NULL;
 		outMap[i] = 0;
+		outputChannels[i] = NULL;
 	}
 	if(m_outputSampleSize == 4)
 		m_device->SetDACCallback(AsioUAC2::sFillOutputData4, (void*)this);
 	else
 		if(m_outputSampleSize == 3)
 			m_device->SetDACCallback(AsioUAC2::sFillOutputData3, (void*)this);
+		else
+			if(m_outputSampleSize == 2)
+				m_device->SetDACCallback(AsioUAC2::sFillOutputData2, (void*)this);
+	m_interleave = GetInterleaveKernel(m_sampleKernels, m_outputSampleSize, m_NumOutputs);
+	m_outputConverter.Init(m_outputSampleSize, m_device->GetDACBitResolution(), m_ditherType, m_NumOutputs);
 	return true;
 }
 
@@ -855,9 +1092,12 @@ void AsioUAC2::outputClose ()
 		delete outMap;
 	if(outputBuffers)
 		delete outputBuffers;
+	if(outputChannels)
+		delete outputChannels;
 	m_NumOutputs = 0;
 	outMap = NULL;
 	outputBuffers = NULL;
+	outputChannels = NULL;
 }
 
 //---------------------------------------------------------------------------------------------
@@ -873,7 +1113,7 @@ void AsioUAC2::bufferSwitch ()
 		getNanoSeconds(&theSystemTime);			// latch system time
 		input();
 		output();
-		samplePosition += blockFrames;
+		samplePosition += blockFrames * SamplesPerUnit();
 
 		if (timeInfoMode)
 			bufferSwitchX ();
@@ -914,7 +1154,7 @@ ASIOError AsioUAC2::outputReady ()
 void AsioUAC2::DeviceNotify(int reason)
 {
 #ifdef _ENABLE_TRACE
-	debugPrintf("ASIOUAC: Device notification reason: %d, callback enabled=%d\n", reason, (int)callbacks != NULL);
+	debugPrintf("ASIOUAC: Device notification reason: %d, callback enabled=%d\n", reason, (int)(callbacks != NULL));
 #endif
 	if(callbacks)
 		callbacks->asioMessage(kAsioResetRequest, 0, NULL, NULL);
@@ -939,6 +1179,7 @@ struct ThreeByteSample
 };
 
 #define FourByteSample	int
+#define TwoByteSample	short
 /*
 struct FourByteSample
 {
@@ -958,20 +1199,6 @@ struct FourByteSample
 };
 */
 
-struct AudioSample3
-{
-	ThreeByteSample left;
-	ThreeByteSample right;
-};
-
-struct AudioSample4
-{
-	//int left;
-	//int right;
-	FourByteSample left;
-	FourByteSample right;
-};
-
 template <typename T_SRC, typename T_DST> void AsioUAC2::FillOutputData(UCHAR *buffer, int& len)
 {
 	if(activeOutputs == 0 || m_StopInProgress)
@@ -982,16 +1209,15 @@ template <typename T_SRC, typename T_DST> void AsioUAC2::FillOutputData(UCHAR *b
 		len = 0;
 		return;
 	}
-	T_DST *sampleBuff = (T_DST *)buffer;
-	int sampleLength = len / sizeof(T_DST);
+	//one frame holds a sample of every device channel
+	DopKernel packDoP = sizeof(T_DST) == 3 ? m_sampleKernels->packDoP3 : m_sampleKernels->packDoP4;
+	int frameSize = sizeof(T_DST) * m_NumOutputs;
+	int sampleLength = len / frameSize;
 #ifdef _ENABLE_TRACE
 	//debugPrintf("ASIOUAC: Fill output data with length %d, currentBufferPosition %d", sampleLength, currentOutBufferPosition);
 #endif
 
-	T_SRC *hostBuffer0 = toggle ? ((T_SRC*)outputBuffers[0]) + blockFrames : (T_SRC*)outputBuffers[0];
-	T_SRC *hostBuffer1 = toggle ? ((T_SRC*)outputBuffers[1]) + blockFrames : (T_SRC*)outputBuffers[1];
-
-	for(int i = 0; i < sampleLength; i++)
+	while(sampleLength > 0)
 	{
 		if(m_StopInProgress)
 		{
@@ -1001,10 +1227,25 @@ template <typename T_SRC, typename T_DST> void AsioUAC2::FillOutputData(UCHAR *b
 			return;
 		}
 
-		sampleBuff[i].left =  hostBuffer0[currentOutBufferPosition];
-		sampleBuff[i].right = hostBuffer1[currentOutBufferPosition];
+		//convert up to the end of the host buffer in one block, raw DSD moves as whole subslots
+		int frames = (blockFrames - currentOutBufferPosition) / m_unitsPerFrame;
+		long position = ((toggle ? blockFrames : 0) + currentOutBufferPosition) / m_unitsPerFrame;
+		if(frames > sampleLength)
+			frames = sampleLength;
+		if(m_dsdMode == DsdModeDoP)
+			packDoP(buffer, outputChannels, position, m_NumOutputs, frames, &m_dopMarker);
+		else if(m_outputFormat.convertFloat && m_dsdMode == DsdModeNone)
+			m_sampleKernels->interleaveFloat(buffer, outputChannels, position, m_NumOutputs, frames, &m_outputConverter);
+		else
+		{
+			m_interleave(buffer, outputChannels, position, m_NumOutputs, frames);
+			if(m_outputFormat.shift && m_dsdMode == DsdModeNone)
+				m_sampleKernels->justifyLeft((int*)buffer, frames * m_NumOutputs, m_outputFormat.shift);
+		}
+		buffer += frames * frameSize;
+		sampleLength -= frames;
 
-		currentOutBufferPosition ++;
+		currentOutBufferPosition += frames * m_unitsPerFrame;
 		if(currentOutBufferPosition == blockFrames)
 		{
 			currentOutBufferPosition = 0;
@@ -1027,8 +1268,6 @@ template <typename T_SRC, typename T_DST> void AsioUAC2::FillOutputData(UCHAR *b
 				return;
 			}
 			bufferSwitch ();
-			hostBuffer0 = toggle ? ((T_SRC*)outputBuffers[0]) + blockFrames : (T_SRC*)outputBuffers[0];
-			hostBuffer1 = toggle ? ((T_SRC*)outputBuffers[1]) + blockFrames : (T_SRC*)outputBuffers[1];
 		}
 	}
 }
@@ -1043,27 +1282,42 @@ template <typename T_SRC, typename T_DST> void AsioUAC2::FillInputData(UCHAR *bu
 		len = 0;
 		return;
 	}
-	T_SRC *sampleBuff = (T_SRC *)buffer;
-	int sampleLength = len / sizeof(T_SRC);
+	//one frame holds a sample of every device channel
+	int frameSize = sizeof(T_SRC) * m_NumInputs;
+	int sampleLength = len / frameSize;
 #ifdef _ENABLE_TRACE
 	//debugPrintf("ASIOUAC: Fill input data with length %d, currentBufferPosition %d", sampleLength, currentInBufferPosition);
 #endif
 
-	T_DST *hostBuffer0 = toggle ? ((T_DST*)inputBuffers[0]) + blockFrames : (T_DST*)inputBuffers[0];
-	T_DST *hostBuffer1 = toggle ? ((T_DST*)inputBuffers[1]) + blockFrames : (T_DST*)inputBuffers[1];
-
-	for(int i = 0; i < sampleLength; i++)
+	while(sampleLength > 0)
 	{
 		if(m_StopInProgress)
 		{
 #ifdef _ENABLE_TRACE
 			debugPrintf("ASIOUAC: Detected exit flag in input thread!\n");
 #endif
+			return;
+		}
+
+		//convert up to the end of the host buffer in one block
+		int frames = blockFrames - currentInBufferPosition;
+		if(frames > sampleLength)
+			frames = sampleLength;
+		long position = (toggle ? blockFrames : 0) + currentInBufferPosition;
+		if(m_inputFormat.convertFloat)
+			m_sampleKernels->deinterleaveFloat(inputChannels, position, buffer, m_NumInputs, frames, &m_inputConverter);
+		else
+		{
+			m_deinterleave(inputChannels, position, buffer, m_NumInputs, frames);
+			if(m_inputFormat.shift)
+				for(int ch = 0; ch < m_NumInputs; ch++)
+					if(inputChannels[ch])
+						m_sampleKernels->justifyRight((int*)inputChannels[ch] + position, frames, m_inputFormat.shift);
 		}
-		hostBuffer0[currentInBufferPosition] = sampleBuff[i].left;
-		hostBuffer1[currentInBufferPosition] = sampleBuff[i].right;
+		buffer += frames * frameSize;
+		sampleLength -= frames;
 
-		currentInBufferPosition ++;
+		currentInBufferPosition += frames;
 		if(currentInBufferPosition == blockFrames)
 		{
 			currentInBufferPosition = 0;
@@ -1099,35 +1353,76 @@ template <typename T_SRC, typename T_DST> void AsioUAC2::FillInputData(UCHAR *bu
 				}
 				bufferSwitch ();
 			}
-			hostBuffer0 = toggle ? ((T_DST*)inputBuffers[0]) + blockFrames : (T_DST*)inputBuffers[0];
-			hostBuffer1 = toggle ? ((T_DST*)inputBuffers[1]) + blockFrames : (T_DST*)inputBuffers[1];
 		}
 	}
 }
 
+//de-interleave received packets straight from the ISO buffer, no compaction pass
+template <typename T_SRC, typename T_DST> void AsioUAC2::FillInputPackets(UCHAR *buffer, const KISO_PACKET* packets, int packetCount)
+{
+	for(int i = 0; i < packetCount; i++)
+	{
+		int len = packets[i].Length;
+		if(len == 0)
+			continue;
+		FillInputData<T_SRC, T_DST>(buffer + packets[i].Offset, len);
+		if(len == 0) //input closed
+			return;
+	}
+}
+
+void AsioUAC2::sFillOutputData2(void* context, UCHAR *buffer, int& len)
+{
+	if(context)
+		((AsioUAC2*)context)->FillOutputData<TwoByteSample, TwoByteSample>(buffer, len);
+}
+
+void AsioUAC2::sFillInputData2(void* context, UCHAR *buffer, int& len)
+{
+	if(context)
+		((AsioUAC2*)context)->FillInputData<TwoByteSample, TwoByteSample>(buffer, len);
+}
+
+void AsioUAC2::sFillInputPackets2(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount)
+{
+	if(context)
+		((AsioUAC2*)context)->FillInputPackets<TwoByteSample, TwoByteSample>(buffer, packets, packetCount);
+}
 
 void AsioUAC2::sFillOutputData3(void* context, UCHAR *buffer, int& len)
 {
 	if(context)
-		((AsioUAC2*)context)->FillOutputData<ThreeByteSample,AudioSample3>(buffer, len);
+		((AsioUAC2*)context)->FillOutputData<ThreeByteSample, ThreeByteSample>(buffer, len);
 }
 
 void AsioUAC2::sFillInputData3(void* context, UCHAR *buffer, int& len)
 {
 	if(context)
-		((AsioUAC2*)context)->FillInputData<AudioSample3, ThreeByteSample>(buffer, len);
+		((AsioUAC2*)context)->FillInputData<ThreeByteSample, ThreeByteSample>(buffer, len);
+}
+
+void AsioUAC2::sFillInputPackets3(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount)
+{
+	if(context)
+		((AsioUAC2*)context)->FillInputPackets<ThreeByteSample, ThreeByteSample>(buffer, packets, packetCount);
+}
+
+void AsioUAC2::sFillInputPackets4(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount)
+{
+	if(context)
+		((AsioUAC2*)context)->FillInputPackets<FourByteSample, FourByteSample>(buffer, packets, packetCount);
 }
 
 void AsioUAC2::sFillOutputData4(void* context, UCHAR *buffer, int& len)
 {
 	if(context)
-		((AsioUAC2*)context)->FillOutputData<FourByteSample,AudioSample4>(buffer, len);
+		((AsioUAC2*)context)->FillOutputData<FourByteSample, FourByteSample>(buffer, len);
 }
 
 void AsioUAC2::sFillInputData4(void* context, UCHAR *buffer, int& len)
 {
 	if(context)
-		((AsioUAC2*)context)->FillInputData<AudioSample4, FourByteSample>(buffer, len);
+		((AsioUAC2*)context)->FillInputData<FourByteSample, FourByteSample>(buffer, len);
 }
 
 void AsioUAC2::sDeviceNotify(void* context, int reason)
@@ -26,6 +26,19 @@
 
 #define DRIVER_VERSION		0x00000002L
 
+//per user driver settings, DWORD values
+#define SETTINGS_KEY		"Software\\ASIOUAC2"
+#define SETTINGS_FLOAT		"FloatSamples"	//1 - expose ASIOSTFloat32LSB channels
+#define SETTINGS_DITHER		"Dither"		//DitherType for float output
+#define SETTINGS_DSD		"DsdMode"		//DsdMode used for the ASIO DSD format, DsdModeNone - raw if the device has it
+
+enum
+{
+	DsdModeNone = 0,	//PCM
+	DsdModeDoP,			//DSD over PCM in 24 bit samples
+	DsdModeRaw			//Type I raw data alt setting
+};
+
 enum
 {
 	USBAudioClassUnknown = 0,
@@ -47,6 +60,7 @@ enum
 #include "combase.h"
 #include "iasiodrv.h"
 #include "USBAudioDevice.h"
+#include "samplekernels.h"
 
 
 class AsioUAC2 : public IASIO, public CUnknown
@@ -73,12 +87,15 @@ public:
 #else
 
 #include "asiodrvr.h"
+#include "USBAudioDevice.h"
+#include "samplekernels.h"
 
 //---------------------------------------------------------------------------------------------
 class AsioUAC2 : public AsioDriver
 {
 public:
-	AsioUAC2 ();
+	//transport - device behind another USB stack (AsioHost runs on SimTransport), NULL - default one
+	AsioUAC2 (USBTransport* transport = NULL);
 	~AsioUAC2 ();
 #endif
 
@@ -120,10 +137,16 @@ public:
 	template <typename T_SRC, typename T_DST> void FillInputData(UCHAR *buffer, int& len);
 	template <typename T_SRC, typename T_DST> void FillOutputData(UCHAR *buffer, int& len);
 	
+	static void sFillOutputData2(void* context, UCHAR *buffer, int& len);
+	static void sFillInputData2(void* context, UCHAR *buffer, int& len);
 	static void sFillOutputData3(void* context, UCHAR *buffer, int& len);
 	static void sFillInputData3(void* context, UCHAR *buffer, int& len);
 	static void sFillOutputData4(void* context, UCHAR *buffer, int& len);
 	static void sFillInputData4(void* context, UCHAR *buffer, int& len);
+	template <typename T_SRC, typename T_DST> void FillInputPackets(UCHAR *buffer, const KISO_PACKET* packets, int packetCount);
+	static void sFillInputPackets2(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount);
+	static void sFillInputPackets3(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount);
+	static void sFillInputPackets4(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount);
 
 	static void sDeviceNotify(void* context, int reason);
 
@@ -143,6 +166,40 @@ friend void myTimer();
 	void timerOff ();
 #endif
 	void bufferSwitchX ();
+	//how the samples of one direction are offered to the host
+	struct HostFormat
+	{
+		ASIOSampleType	type;			//-1 - the USB format isn't supported
+		int				sampleSize;		//bytes
+		int				shift;			//host samples are LSB justified, USB samples MSB justified
+		bool			convertFloat;	//float host samples for an integer USB format
+
+		HostFormat() : type(-1), sampleSize(0), shift(0), convertFloat(false)
+		{}
+	};
+
+	void LoadSettings ();
+	void ChooseHostFormat (int slotSize, int bitResolution, DWORD dataFormats, HostFormat& format);
+	bool OpenDevice ();
+	void CloseDevice ();
+	int ChooseDsdMode ();
+	ASIOError SetIoFormat (long format);
+	void UpdateFormatRate ();
+	int HostSampleSize (bool input)
+	{
+		if(m_dsdMode != DsdModeNone)
+			return 1;
+		return input ? m_inputFormat.sampleSize : m_outputFormat.sampleSize;
+	}
+	//ASIO samples in one unit of the host buffers: a DSD byte holds 8
+	long SamplesPerUnit ()
+	{
+		return m_dsdMode != DsdModeNone ? 8 : 1;
+	}
+	long SamplesPerUsbFrame ()
+	{
+		return SamplesPerUnit() * m_unitsPerFrame;
+	}
 
 	double samplePosition;
 #ifdef EMULATION_HARDWARE
@@ -164,6 +221,9 @@ private:
 	char **outputBuffers;
 	long *inMap;
 	long *outMap;
+	//double buffer of each device channel, NULL if the channel isn't active
+	char **inputChannels;
+	char **outputChannels;
 
 	long blockFrames;
 	long inputLatency;
@@ -180,6 +240,7 @@ private:
 	int USBAudioClass;
 
 	USBAudioDevice *m_device;
+	USBTransport *m_transport;	//not owned
 
 	ASIOError StartDevice();
 	ASIOError StopDevice();
@@ -189,6 +250,22 @@ private:
 	volatile bool	m_StopInProgress;
 	HANDLE	m_AsioSyncEvent;
 	HANDLE	m_BufferSwitchEvent;
+
+	const SampleKernels* m_sampleKernels;
+	InterleaveKernel	m_interleave;		//picked for the slot size and channel count of the stream
+	DeinterleaveKernel	m_deinterleave;
+	bool	m_floatSamples;
+	int		m_ditherType;
+	FloatConverter	m_outputConverter;
+	FloatConverter	m_inputConverter;
+	HostFormat		m_outputFormat;
+	HostFormat		m_inputFormat;
+
+	int		m_dsdSetting;
+	int		m_dsdMode;
+	int		m_unitsPerFrame;	//host buffer units in one USB frame
+	UCHAR	m_dopMarker;
+	char*	m_dsdSilence;		//idle pattern for inactive DSD outputs
 };
 
 #endif
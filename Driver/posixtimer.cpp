@@ -0,0 +1,31 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+// wintimer.cpp counterpart for builds without Windows (AsioHost)
+
+#include <time.h>
+#include "asiouac2.h"
+
+const double twoRaisedTo32 = 4294967296.;
+
+
+//------------------------------------------------------------------------------------------
+void getNanoSeconds (ASIOTimeStamp* ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double nanoSeconds = (double)now.tv_sec * 1000000000. + (double)now.tv_nsec;
+	ts->hi = (unsigned long)(nanoSeconds / twoRaisedTo32);
+	ts->lo = (unsigned long)(nanoSeconds - (ts->hi * twoRaisedTo32));
+}
@@ -0,0 +1,1002 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include <math.h>
+#include <string.h>
+#include "samplekernels.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <emmintrin.h>
+#define SAMPLE_KERNELS_SSE2
+#elif defined(__x86_64__)
+#include <emmintrin.h>
+#define SAMPLE_KERNELS_SSE2
+#endif
+
+static const int s_silence[4] = {0, 0, 0, 0};
+static const UCHAR s_dsdSilence[8] = {DSD_SILENCE, DSD_SILENCE, DSD_SILENCE, DSD_SILENCE, DSD_SILENCE, DSD_SILENCE, DSD_SILENCE, DSD_SILENCE};
+
+//---------------------------------------------------------------------------------------------
+// float conversion state
+//---------------------------------------------------------------------------------------------
+
+FloatConverter::FloatConverter() : slotSize(4), bitResolution(32), dither(DitherNone), scale(0.f), minValue(0.f), maxValue(0.f),
+	shapingError(NULL), channelNumber(0)
+{
+	Init(4, 32, DitherNone, 0);
+}
+
+FloatConverter::~FloatConverter()
+{
+	Free();
+}
+
+void FloatConverter::Init(int slotSize, int bitResolution, int dither, int channelNumber)
+{
+	Free();
+	if(bitResolution <= 0 || bitResolution > slotSize * 8)
+		bitResolution = slotSize * 8;
+	this->slotSize = slotSize;
+	this->bitResolution = bitResolution;
+	//noise shaping keeps per channel history
+	this->dither = dither == DitherNoiseShaped && channelNumber <= 0 ? DitherTPDF : dither;
+	this->channelNumber = channelNumber;
+
+	//largest float below 2^(bits-1): above 24 bits the step between floats is 2^(bits-25)
+	double fullScale = ldexp(1.0, bitResolution - 1);
+	scale = (float)fullScale;
+	minValue = (float)-fullScale;
+	maxValue = (float)(fullScale - (bitResolution > 24 ? ldexp(1.0, bitResolution - 25) : 1.0));
+
+	seed[0] = 0x9E3779B9;
+	seed[1] = 0x6C078965;
+	seed[2] = 0x2545F491;
+	seed[3] = 0x7FEB352D;
+	if(this->dither == DitherNoiseShaped)
+		shapingError = new float[2 * channelNumber];
+	Reset();
+}
+
+void FloatConverter::Free()
+{
+	if(shapingError)
+		delete[] shapingError;
+	shapingError = NULL;
+}
+
+void FloatConverter::Reset()
+{
+	if(shapingError)
+		memset(shapingError, 0, 2 * channelNumber * sizeof(float));
+}
+
+static inline unsigned int XorShift(unsigned int& x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+//triangular noise in [-1, 1) LSB
+static inline float TpdfNoise(unsigned int* seed)
+{
+	return ((float)(int)XorShift(seed[0]) + (float)(int)XorShift(seed[1])) * (1.f / 4294967296.f);
+}
+
+//quantized sample MSB aligned in 32 bits
+static inline int QuantizeSample(float value, const FloatConverter* converter)
+{
+	if(value < converter->minValue)
+		value = converter->minValue;
+	else if(value > converter->maxValue)
+		value = converter->maxValue;
+	int sample = (int)floor(value + 0.5f);
+	return (int)((unsigned int)sample << (32 - converter->bitResolution));
+}
+
+static inline void WriteSlot(UCHAR* out, int sample, int slotSize)
+{
+	if(slotSize == 4)
+		*(int*)out = sample;
+	else if(slotSize == 2)
+		*(short*)out = (short)(sample >> 16);
+	else
+	{
+		out[0] = (UCHAR)(sample >> 8);
+		out[1] = (UCHAR)(sample >> 16);
+		out[2] = (UCHAR)(sample >> 24);
+	}
+}
+
+static inline int ReadSlot(const UCHAR* in, int slotSize)
+{
+	if(slotSize == 4)
+		return *(const int*)in;
+	if(slotSize == 2)
+		return (int)((unsigned int)*(const USHORT*)in << 16);
+	return (int)(((unsigned int)in[0] << 8) | ((unsigned int)in[1] << 16) | ((unsigned int)in[2] << 24));
+}
+
+//---------------------------------------------------------------------------------------------
+// scalar kernels, one channel at a time: sequential host buffer, strided USB buffer
+//---------------------------------------------------------------------------------------------
+
+static void Interleave2Scalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		short* out = (short*)dst + ch;
+		if(channels[ch] == NULL)
+		{
+			for(int f = 0; f < frames; f++, out += channelNumber)
+				*out = 0;
+			continue;
+		}
+		const short* in = (const short*)channels[ch] + offset;
+		for(int f = 0; f < frames; f++, out += channelNumber)
+			*out = in[f];
+	}
+}
+
+static void Interleave3Scalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	int stride = channelNumber * 3;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		UCHAR* out = dst + ch * 3;
+		if(channels[ch] == NULL)
+		{
+			for(int f = 0; f < frames; f++, out += stride)
+			{
+				*(USHORT*)out = 0;
+				out[2] = 0;
+			}
+			continue;
+		}
+		const UCHAR* in = (const UCHAR*)channels[ch] + offset * 3;
+		for(int f = 0; f < frames; f++, out += stride, in += 3)
+		{
+			*(USHORT*)out = *(const USHORT*)in;
+			out[2] = in[2];
+		}
+	}
+}
+
+template <int CHANNELS> static void Interleave4Scalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	if(CHANNELS)
+		channelNumber = CHANNELS;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		int* out = (int*)dst + ch;
+		if(channels[ch] == NULL)
+		{
+			for(int f = 0; f < frames; f++, out += channelNumber)
+				*out = 0;
+			continue;
+		}
+		const int* in = (const int*)channels[ch] + offset;
+		for(int f = 0; f < frames; f++, out += channelNumber)
+			*out = in[f];
+	}
+}
+
+static void Deinterleave2Scalar(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const short* in = (const short*)src + ch;
+		short* out = (short*)channels[ch] + offset;
+		for(int f = 0; f < frames; f++, in += channelNumber)
+			out[f] = *in;
+	}
+}
+
+static void Deinterleave3Scalar(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	int stride = channelNumber * 3;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const UCHAR* in = src + ch * 3;
+		UCHAR* out = (UCHAR*)channels[ch] + offset * 3;
+		for(int f = 0; f < frames; f++, in += stride, out += 3)
+		{
+			*(USHORT*)out = *(const USHORT*)in;
+			out[2] = in[2];
+		}
+	}
+}
+
+template <int CHANNELS> static void Deinterleave4Scalar(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	if(CHANNELS)
+		channelNumber = CHANNELS;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const int* in = (const int*)src + ch;
+		int* out = (int*)channels[ch] + offset;
+		for(int f = 0; f < frames; f++, in += channelNumber)
+			out[f] = *in;
+	}
+}
+
+static void JustifyLeftScalar(int* samples, int count, int shift)
+{
+	for(int i = 0; i < count; i++)
+		samples[i] = (int)((unsigned int)samples[i] << shift);
+}
+
+static void JustifyRightScalar(int* samples, int count, int shift)
+{
+	for(int i = 0; i < count; i++)
+		samples[i] >>= shift;
+}
+
+static void InterleaveFloatScalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, FloatConverter* converter)
+{
+	int slotSize = converter->slotSize;
+	int stride = channelNumber * slotSize;
+	float scale = converter->scale;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		UCHAR* out = dst + ch * slotSize;
+		if(channels[ch] == NULL)
+		{
+			for(int f = 0; f < frames; f++, out += stride)
+				WriteSlot(out, 0, slotSize);
+			continue;
+		}
+		const float* in = (const float*)channels[ch] + offset;
+		int f;
+		switch(converter->dither)
+		{
+		case DitherTPDF:
+			for(f = 0; f < frames; f++, out += stride)
+				WriteSlot(out, QuantizeSample(in[f] * scale + TpdfNoise(converter->seed), converter), slotSize);
+			break;
+		case DitherNoiseShaped:
+			{
+				//error feedback with (1 - z^-1)^2 noise transfer
+				float* error = converter->shapingError + 2 * ch;
+				float e1 = error[0], e2 = error[1];
+				int shift = 32 - converter->bitResolution;
+				for(f = 0; f < frames; f++, out += stride)
+				{
+					float wanted = in[f] * scale - 2.f * e1 + e2;
+					int sample = QuantizeSample(wanted + TpdfNoise(converter->seed), converter);
+					float e = (float)(sample >> shift) - wanted;
+					//keep the loop stable when the output clips
+					e2 = e1;
+					e1 = e < -2.f ? -2.f : (e > 2.f ? 2.f : e);
+					WriteSlot(out, sample, slotSize);
+				}
+				error[0] = e1;
+				error[1] = e2;
+			}
+			break;
+		default:
+			for(f = 0; f < frames; f++, out += stride)
+				WriteSlot(out, QuantizeSample(in[f] * scale, converter), slotSize);
+		}
+	}
+}
+
+static void DeinterleaveFloatScalar(char** channels, long offset, const UCHAR* src, int channelNumber, int frames, const FloatConverter* converter)
+{
+	int slotSize = converter->slotSize;
+	int stride = channelNumber * slotSize;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const UCHAR* in = src + ch * slotSize;
+		float* out = (float*)channels[ch] + offset;
+		for(int f = 0; f < frames; f++, in += stride)
+			out[f] = (float)ReadSlot(in, slotSize) * (1.f / 2147483648.f);
+	}
+}
+
+//---------------------------------------------------------------------------------------------
+// DoP packing: earlier DSD byte above the later one, marker on top, low byte of 4 byte slots empty
+//---------------------------------------------------------------------------------------------
+
+static void PackDoPScalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, UCHAR* marker, int slotSize)
+{
+	int stride = channelNumber * slotSize;
+	int low = slotSize - 3;
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		UCHAR* out = dst + ch * slotSize;
+		const UCHAR* in = channels[ch] ? (const UCHAR*)channels[ch] + offset * 2 : s_dsdSilence;
+		int step = channels[ch] ? 2 : 0;
+		UCHAR m = *marker;
+		for(int f = 0; f < frames; f++, out += stride, in += step, m ^= 0xFF)
+		{
+			if(low)
+				out[0] = 0;
+			out[low] = in[1];
+			out[low + 1] = in[0];
+			out[low + 2] = m;
+		}
+	}
+	if(frames & 1)
+		*marker ^= 0xFF;
+}
+
+static void PackDoP3Scalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, UCHAR* marker)
+{
+	PackDoPScalar(dst, channels, offset, channelNumber, frames, marker, 3);
+}
+
+static void PackDoP4Scalar(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, UCHAR* marker)
+{
+	PackDoPScalar(dst, channels, offset, channelNumber, frames, marker, 4);
+}
+
+#ifdef SAMPLE_KERNELS_SSE2
+//---------------------------------------------------------------------------------------------
+// SSE2 kernels for 4 byte samples: 4x4 transposes over groups of 4 channels, then pairs.
+// Inactive channels read from (or write to) a 4 sample dummy with zero step, so the inner
+// loops have no branches
+//---------------------------------------------------------------------------------------------
+
+#define TRANSPOSE_4X4(r0, r1, r2, r3)				\
+{													\
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);		\
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);		\
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);		\
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);		\
+	r0 = _mm_unpacklo_epi64(t0, t1);				\
+	r1 = _mm_unpackhi_epi64(t0, t1);				\
+	r2 = _mm_unpacklo_epi64(t2, t3);				\
+	r3 = _mm_unpackhi_epi64(t2, t3);				\
+}
+
+template <int CHANNELS> static void Interleave4SSE2(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	if(CHANNELS)
+		channelNumber = CHANNELS;
+	const int* in[4];
+	int step[4];
+	int ch = 0, f, k;
+
+	for(; ch + 4 <= channelNumber; ch += 4)
+	{
+		for(k = 0; k < 4; k++)
+		{
+			in[k] = channels[ch + k] ? (const int*)channels[ch + k] + offset : s_silence;
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		int* out = (int*)dst + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i*)in[0]);
+			__m128i r1 = _mm_loadu_si128((const __m128i*)in[1]);
+			__m128i r2 = _mm_loadu_si128((const __m128i*)in[2]);
+			__m128i r3 = _mm_loadu_si128((const __m128i*)in[3]);
+			TRANSPOSE_4X4(r0, r1, r2, r3);
+			_mm_storeu_si128((__m128i*)out, r0);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r1);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r2);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r3);
+			out += channelNumber;
+			for(k = 0; k < 4; k++)
+				in[k] += step[k] * 4;
+		}
+		for(; f < frames; f++, out += channelNumber)
+			for(k = 0; k < 4; k++)
+			{
+				out[k] = *in[k];
+				in[k] += step[k];
+			}
+	}
+
+	for(; ch + 2 <= channelNumber; ch += 2)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			in[k] = channels[ch + k] ? (const int*)channels[ch + k] + offset : s_silence;
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		int* out = (int*)dst + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i*)in[0]);
+			__m128i r1 = _mm_loadu_si128((const __m128i*)in[1]);
+			__m128i lo = _mm_unpacklo_epi32(r0, r1);
+			__m128i hi = _mm_unpackhi_epi32(r0, r1);
+			if(CHANNELS == 2)
+			{
+				//stereo frames are contiguous
+				_mm_storeu_si128((__m128i*)out, lo);
+				_mm_storeu_si128((__m128i*)(out + 4), hi);
+				out += 8;
+			}
+			else
+			{
+				_mm_storel_epi64((__m128i*)out, lo);
+				out += channelNumber;
+				_mm_storel_epi64((__m128i*)out, _mm_srli_si128(lo, 8));
+				out += channelNumber;
+				_mm_storel_epi64((__m128i*)out, hi);
+				out += channelNumber;
+				_mm_storel_epi64((__m128i*)out, _mm_srli_si128(hi, 8));
+				out += channelNumber;
+			}
+			in[0] += step[0] * 4;
+			in[1] += step[1] * 4;
+		}
+		for(; f < frames; f++, out += channelNumber)
+		{
+			out[0] = *in[0];
+			out[1] = *in[1];
+			in[0] += step[0];
+			in[1] += step[1];
+		}
+	}
+
+	for(; ch < channelNumber; ch++)
+	{
+		int* out = (int*)dst + ch;
+		const int* src = channels[ch] ? (const int*)channels[ch] + offset : s_silence;
+		int srcStep = channels[ch] ? 1 : 0;
+		for(f = 0; f < frames; f++, out += channelNumber, src += srcStep)
+			*out = *src;
+	}
+}
+
+template <int CHANNELS> static void Deinterleave4SSE2(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	if(CHANNELS)
+		channelNumber = CHANNELS;
+	int* out[4];
+	int step[4];
+	__m128i sink[4];
+	int ch = 0, f, k;
+
+	for(; ch + 4 <= channelNumber; ch += 4)
+	{
+		for(k = 0; k < 4; k++)
+		{
+			out[k] = channels[ch + k] ? (int*)channels[ch + k] + offset : (int*)&sink[k];
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		const int* in = (const int*)src + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i*)in);
+			in += channelNumber;
+			__m128i r1 = _mm_loadu_si128((const __m128i*)in);
+			in += channelNumber;
+			__m128i r2 = _mm_loadu_si128((const __m128i*)in);
+			in += channelNumber;
+			__m128i r3 = _mm_loadu_si128((const __m128i*)in);
+			in += channelNumber;
+			TRANSPOSE_4X4(r0, r1, r2, r3);
+			_mm_storeu_si128((__m128i*)out[0], r0);
+			_mm_storeu_si128((__m128i*)out[1], r1);
+			_mm_storeu_si128((__m128i*)out[2], r2);
+			_mm_storeu_si128((__m128i*)out[3], r3);
+			for(k = 0; k < 4; k++)
+				out[k] += step[k] * 4;
+		}
+		for(; f < frames; f++, in += channelNumber)
+			for(k = 0; k < 4; k++)
+			{
+				*out[k] = in[k];
+				out[k] += step[k];
+			}
+	}
+
+	for(; ch + 2 <= channelNumber; ch += 2)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			out[k] = channels[ch + k] ? (int*)channels[ch + k] + offset : (int*)&sink[k];
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		const int* in = (const int*)src + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			//frames 0,1 and 2,3 as L R L R, then L L R R
+			__m128i r0, r1;
+			if(CHANNELS == 2)
+			{
+				r0 = _mm_loadu_si128((const __m128i*)in);
+				r1 = _mm_loadu_si128((const __m128i*)(in + 4));
+				in += 8;
+			}
+			else
+			{
+				r0 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)in), _mm_loadl_epi64((const __m128i*)(in + channelNumber)));
+				in += 2 * channelNumber;
+				r1 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)in), _mm_loadl_epi64((const __m128i*)(in + channelNumber)));
+				in += 2 * channelNumber;
+			}
+			r0 = _mm_shuffle_epi32(r0, _MM_SHUFFLE(3, 1, 2, 0));
+			r1 = _mm_shuffle_epi32(r1, _MM_SHUFFLE(3, 1, 2, 0));
+			_mm_storeu_si128((__m128i*)out[0], _mm_unpacklo_epi64(r0, r1));
+			_mm_storeu_si128((__m128i*)out[1], _mm_unpackhi_epi64(r0, r1));
+			out[0] += step[0] * 4;
+			out[1] += step[1] * 4;
+		}
+		for(; f < frames; f++, in += channelNumber)
+		{
+			*out[0] = in[0];
+			*out[1] = in[1];
+			out[0] += step[0];
+			out[1] += step[1];
+		}
+	}
+
+	for(; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const int* in = (const int*)src + ch;
+		int* dst = (int*)channels[ch] + offset;
+		for(f = 0; f < frames; f++, in += channelNumber)
+			dst[f] = *in;
+	}
+}
+
+//---------------------------------------------------------------------------------------------
+// SSE2 kernels for 2 byte samples: a channel pair moves as 32 bit words, 8 frames per step
+//---------------------------------------------------------------------------------------------
+
+static void Interleave2SSE2(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	const short* in[2];
+	int step[2];
+	int stride = channelNumber * 2;
+	int ch = 0, f, k;
+
+	for(; ch + 2 <= channelNumber; ch += 2)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			in[k] = channels[ch + k] ? (const short*)channels[ch + k] + offset : (const short*)s_silence;
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		UCHAR* out = dst + ch * 2;
+		for(f = 0; f + 8 <= frames; f += 8)
+		{
+			__m128i r0 = _mm_loadu_si128((const __m128i*)in[0]);
+			__m128i r1 = _mm_loadu_si128((const __m128i*)in[1]);
+			__m128i lo = _mm_unpacklo_epi16(r0, r1);
+			__m128i hi = _mm_unpackhi_epi16(r0, r1);
+			if(channelNumber == 2)
+			{
+				_mm_storeu_si128((__m128i*)out, lo);
+				_mm_storeu_si128((__m128i*)(out + 16), hi);
+				out += 32;
+			}
+			else
+			{
+				for(k = 0; k < 4; k++, out += stride, lo = _mm_srli_si128(lo, 4))
+					*(int*)out = _mm_cvtsi128_si32(lo);
+				for(k = 0; k < 4; k++, out += stride, hi = _mm_srli_si128(hi, 4))
+					*(int*)out = _mm_cvtsi128_si32(hi);
+			}
+			in[0] += step[0] * 8;
+			in[1] += step[1] * 8;
+		}
+		for(; f < frames; f++, out += stride)
+		{
+			((short*)out)[0] = *in[0];
+			((short*)out)[1] = *in[1];
+			in[0] += step[0];
+			in[1] += step[1];
+		}
+	}
+
+	for(; ch < channelNumber; ch++)
+	{
+		short* out = (short*)dst + ch;
+		const short* src = channels[ch] ? (const short*)channels[ch] + offset : (const short*)s_silence;
+		int srcStep = channels[ch] ? 1 : 0;
+		for(f = 0; f < frames; f++, out += channelNumber, src += srcStep)
+			*out = *src;
+	}
+}
+
+static void Deinterleave2SSE2(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	short* out[2];
+	int step[2];
+	__m128i sink[2];
+	int stride = channelNumber * 2;
+	int ch = 0, f, k;
+
+	for(; ch + 2 <= channelNumber; ch += 2)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			out[k] = channels[ch + k] ? (short*)channels[ch + k] + offset : (short*)&sink[k];
+			step[k] = channels[ch + k] ? 1 : 0;
+		}
+		const UCHAR* in = src + ch * 2;
+		for(f = 0; f + 8 <= frames; f += 8)
+		{
+			__m128i r0, r1;
+			if(channelNumber == 2)
+			{
+				r0 = _mm_loadu_si128((const __m128i*)in);
+				r1 = _mm_loadu_si128((const __m128i*)(in + 16));
+				in += 32;
+			}
+			else
+			{
+				r0 = _mm_set_epi32(*(const int*)(in + 3 * stride), *(const int*)(in + 2 * stride), *(const int*)(in + stride), *(const int*)in);
+				in += 4 * stride;
+				r1 = _mm_set_epi32(*(const int*)(in + 3 * stride), *(const int*)(in + 2 * stride), *(const int*)(in + stride), *(const int*)in);
+				in += 4 * stride;
+			}
+			//sign extend each half of the pairs, then pack every channel back to 16 bits
+			__m128i left = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(r0, 16), 16), _mm_srai_epi32(_mm_slli_epi32(r1, 16), 16));
+			__m128i right = _mm_packs_epi32(_mm_srai_epi32(r0, 16), _mm_srai_epi32(r1, 16));
+			_mm_storeu_si128((__m128i*)out[0], left);
+			_mm_storeu_si128((__m128i*)out[1], right);
+			out[0] += step[0] * 8;
+			out[1] += step[1] * 8;
+		}
+		for(; f < frames; f++, in += stride)
+		{
+			*out[0] = ((const short*)in)[0];
+			*out[1] = ((const short*)in)[1];
+			out[0] += step[0];
+			out[1] += step[1];
+		}
+	}
+
+	for(; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const short* in = (const short*)src + ch;
+		short* dstChannel = (short*)channels[ch] + offset;
+		for(f = 0; f < frames; f++, in += channelNumber)
+			dstChannel[f] = *in;
+	}
+}
+
+static void JustifyLeftSSE2(int* samples, int count, int shift)
+{
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	int i = 0;
+	for(; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(samples + i), _mm_sll_epi32(_mm_loadu_si128((const __m128i*)(samples + i)), bits));
+	for(; i < count; i++)
+		samples[i] = (int)((unsigned int)samples[i] << shift);
+}
+
+static void JustifyRightSSE2(int* samples, int count, int shift)
+{
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	int i = 0;
+	for(; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(samples + i), _mm_sra_epi32(_mm_loadu_si128((const __m128i*)(samples + i)), bits));
+	for(; i < count; i++)
+		samples[i] >>= shift;
+}
+
+//---------------------------------------------------------------------------------------------
+// SSE2 DoP: 4 frames of a channel are built in one register and transposed like 4 byte samples.
+// A step of 4 frames keeps the marker phase of every lane
+//---------------------------------------------------------------------------------------------
+
+static inline int DoPSample(const UCHAR* in, UCHAR marker)
+{
+	return (int)(((unsigned int)marker << 24) | ((unsigned int)in[0] << 16) | ((unsigned int)in[1] << 8));
+}
+
+static inline __m128i DoPSamples(const UCHAR* in, __m128i markers)
+{
+	__m128i pairs = _mm_loadl_epi64((const __m128i*)in);
+	//earlier byte of each pair goes high
+	pairs = _mm_or_si128(_mm_slli_epi16(pairs, 8), _mm_srli_epi16(pairs, 8));
+	return _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi16(pairs, _mm_setzero_si128()), 8), markers);
+}
+
+static void PackDoP4SSE2(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, UCHAR* marker)
+{
+	const UCHAR* in[4];
+	int step[4];
+	int ch = 0, f, k;
+	UCHAR first = *marker, m;
+	int m0 = (int)((unsigned int)first << 24), m1 = (int)((unsigned int)(first ^ 0xFF) << 24);
+	__m128i markers = _mm_set_epi32(m1, m0, m1, m0);
+
+	for(; ch + 4 <= channelNumber; ch += 4)
+	{
+		for(k = 0; k < 4; k++)
+		{
+			in[k] = channels[ch + k] ? (const UCHAR*)channels[ch + k] + offset * 2 : s_dsdSilence;
+			step[k] = channels[ch + k] ? 2 : 0;
+		}
+		int* out = (int*)dst + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			__m128i r0 = DoPSamples(in[0], markers);
+			__m128i r1 = DoPSamples(in[1], markers);
+			__m128i r2 = DoPSamples(in[2], markers);
+			__m128i r3 = DoPSamples(in[3], markers);
+			TRANSPOSE_4X4(r0, r1, r2, r3);
+			_mm_storeu_si128((__m128i*)out, r0);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r1);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r2);
+			out += channelNumber;
+			_mm_storeu_si128((__m128i*)out, r3);
+			out += channelNumber;
+			for(k = 0; k < 4; k++)
+				in[k] += step[k] * 4;
+		}
+		for(m = first; f < frames; f++, out += channelNumber, m ^= 0xFF)
+			for(k = 0; k < 4; k++)
+			{
+				out[k] = DoPSample(in[k], m);
+				in[k] += step[k];
+			}
+	}
+
+	for(; ch + 2 <= channelNumber; ch += 2)
+	{
+		for(k = 0; k < 2; k++)
+		{
+			in[k] = channels[ch + k] ? (const UCHAR*)channels[ch + k] + offset * 2 : s_dsdSilence;
+			step[k] = channels[ch + k] ? 2 : 0;
+		}
+		int* out = (int*)dst + ch;
+		for(f = 0; f + 4 <= frames; f += 4)
+		{
+			__m128i r0 = DoPSamples(in[0], markers);
+			__m128i r1 = DoPSamples(in[1], markers);
+			__m128i lo = _mm_unpacklo_epi32(r0, r1);
+			__m128i hi = _mm_unpackhi_epi32(r0, r1);
+			_mm_storel_epi64((__m128i*)out, lo);
+			out += channelNumber;
+			_mm_storel_epi64((__m128i*)out, _mm_srli_si128(lo, 8));
+			out += channelNumber;
+			_mm_storel_epi64((__m128i*)out, hi);
+			out += channelNumber;
+			_mm_storel_epi64((__m128i*)out, _mm_srli_si128(hi, 8));
+			out += channelNumber;
+			in[0] += step[0] * 4;
+			in[1] += step[1] * 4;
+		}
+		for(m = first; f < frames; f++, out += channelNumber, m ^= 0xFF)
+		{
+			out[0] = DoPSample(in[0], m);
+			out[1] = DoPSample(in[1], m);
+			in[0] += step[0];
+			in[1] += step[1];
+		}
+	}
+
+	for(; ch < channelNumber; ch++)
+	{
+		int* out = (int*)dst + ch;
+		const UCHAR* src = channels[ch] ? (const UCHAR*)channels[ch] + offset * 2 : s_dsdSilence;
+		int srcStep = channels[ch] ? 2 : 0;
+		for(f = 0, m = first; f < frames; f++, out += channelNumber, src += srcStep, m ^= 0xFF)
+			*out = DoPSample(src, m);
+	}
+	if(frames & 1)
+		*marker = first ^ 0xFF;
+}
+
+//---------------------------------------------------------------------------------------------
+// SSE2 float kernels: 4 frames of one channel per step, strided slots written one by one.
+// Noise shaping is recursive in time and stays scalar
+//---------------------------------------------------------------------------------------------
+
+static inline __m128i XorShift4(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+static void InterleaveFloatSSE2(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, FloatConverter* converter)
+{
+	if(converter->dither == DitherNoiseShaped)
+	{
+		InterleaveFloatScalar(dst, channels, offset, channelNumber, frames, converter);
+		return;
+	}
+	int slotSize = converter->slotSize;
+	int stride = channelNumber * slotSize;
+	bool tpdf = converter->dither == DitherTPDF;
+	__m128 scale = _mm_set1_ps(converter->scale);
+	__m128 minValue = _mm_set1_ps(converter->minValue);
+	__m128 maxValue = _mm_set1_ps(converter->maxValue);
+	__m128 noiseScale = _mm_set1_ps(1.f / 4294967296.f);
+	__m128i shift = _mm_cvtsi32_si128(32 - converter->bitResolution);
+	__m128i seed = _mm_loadu_si128((const __m128i*)converter->seed);
+	int samples[4];
+
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		UCHAR* out = dst + ch * slotSize;
+		if(channels[ch] == NULL)
+		{
+			for(int f = 0; f < frames; f++, out += stride)
+				WriteSlot(out, 0, slotSize);
+			continue;
+		}
+		const float* in = (const float*)channels[ch] + offset;
+		int f = 0;
+		for(; f + 4 <= frames; f += 4)
+		{
+			__m128 value = _mm_mul_ps(_mm_loadu_ps(in + f), scale);
+			if(tpdf)
+			{
+				__m128i r1 = XorShift4(seed);
+				seed = XorShift4(r1);
+				__m128 noise = _mm_add_ps(_mm_cvtepi32_ps(r1), _mm_cvtepi32_ps(seed));
+				value = _mm_add_ps(value, _mm_mul_ps(noise, noiseScale));
+			}
+			value = _mm_min_ps(_mm_max_ps(value, minValue), maxValue);
+			//round to nearest with the default MXCSR mode
+			__m128i sample = _mm_sll_epi32(_mm_cvtps_epi32(value), shift);
+			if(slotSize == 4)
+			{
+				*(int*)out = _mm_cvtsi128_si32(sample);
+				out += stride;
+				*(int*)out = _mm_cvtsi128_si32(_mm_srli_si128(sample, 4));
+				out += stride;
+				*(int*)out = _mm_cvtsi128_si32(_mm_srli_si128(sample, 8));
+				out += stride;
+				*(int*)out = _mm_cvtsi128_si32(_mm_srli_si128(sample, 12));
+				out += stride;
+			}
+			else
+			{
+				_mm_storeu_si128((__m128i*)samples, sample);
+				for(int k = 0; k < 4; k++, out += stride)
+					WriteSlot(out, samples[k], slotSize);
+			}
+		}
+		if(f == frames)
+			continue;
+		//the scalar tail draws from the same generators as the lanes
+		_mm_storeu_si128((__m128i*)converter->seed, seed);
+		for(; f < frames; f++, out += stride)
+			WriteSlot(out, QuantizeSample(in[f] * converter->scale + (tpdf ? TpdfNoise(converter->seed) : 0.f), converter), slotSize);
+		seed = _mm_loadu_si128((const __m128i*)converter->seed);
+	}
+	_mm_storeu_si128((__m128i*)converter->seed, seed);
+}
+
+static void DeinterleaveFloatSSE2(char** channels, long offset, const UCHAR* src, int channelNumber, int frames, const FloatConverter* converter)
+{
+	int slotSize = converter->slotSize;
+	int stride = channelNumber * slotSize;
+	__m128 scale = _mm_set1_ps(1.f / 2147483648.f);
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		if(channels[ch] == NULL)
+			continue;
+		const UCHAR* in = src + ch * slotSize;
+		float* out = (float*)channels[ch] + offset;
+		int f = 0;
+		for(; f + 4 <= frames; f += 4, in += 4 * stride)
+		{
+			__m128i sample = _mm_set_epi32(ReadSlot(in + 3 * stride, slotSize), ReadSlot(in + 2 * stride, slotSize),
+				ReadSlot(in + stride, slotSize), ReadSlot(in, slotSize));
+			_mm_storeu_ps(out + f, _mm_mul_ps(_mm_cvtepi32_ps(sample), scale));
+		}
+		for(; f < frames; f++, in += stride)
+			out[f] = (float)ReadSlot(in, slotSize) * (1.f / 2147483648.f);
+	}
+}
+
+static bool CpuHasSSE2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return TRUE;
+#else
+	int cpuInfo[4];
+	__cpuid(cpuInfo, 0);
+	if(cpuInfo[0] < 1)
+		return FALSE;
+	__cpuid(cpuInfo, 1);
+	return (cpuInfo[3] & (1 << 26)) != 0;
+#endif
+}
+#endif //SAMPLE_KERNELS_SSE2
+
+//common device profiles with the channel count as a template constant. Stereo 4 byte frames
+//are contiguous and move with whole vector stores; 3 byte and 8 channel builds were no faster
+static const FixedKernels s_scalarFixed[] =
+{
+	{4, 2, Interleave4Scalar<2>, Deinterleave4Scalar<2>},
+	{0, 0, NULL, NULL}
+};
+
+#ifdef SAMPLE_KERNELS_SSE2
+static const FixedKernels s_sse2Fixed[] =
+{
+	{4, 2, Interleave4SSE2<2>, Deinterleave4SSE2<2>},
+	{0, 0, NULL, NULL}
+};
+#endif
+
+//3 byte samples have no SSE2 byte shuffle, the scalar kernels move them as word + byte
+static const SampleKernels s_scalarKernels =
+{
+	"scalar", Interleave2Scalar, Interleave3Scalar, Interleave4Scalar<0>, Deinterleave2Scalar, Deinterleave3Scalar, Deinterleave4Scalar<0>,
+	JustifyLeftScalar, JustifyRightScalar,
+	InterleaveFloatScalar, DeinterleaveFloatScalar, PackDoP3Scalar, PackDoP4Scalar, s_scalarFixed
+};
+
+#ifdef SAMPLE_KERNELS_SSE2
+static const SampleKernels s_sse2Kernels =
+{
+	"SSE2", Interleave2SSE2, Interleave3Scalar, Interleave4SSE2<0>, Deinterleave2SSE2, Deinterleave3Scalar, Deinterleave4SSE2<0>,
+	JustifyLeftSSE2, JustifyRightSSE2,
+	InterleaveFloatSSE2, DeinterleaveFloatSSE2, PackDoP3Scalar, PackDoP4SSE2, s_sse2Fixed
+};
+#endif
+
+const SampleKernels* GetScalarSampleKernels()
+{
+	return &s_scalarKernels;
+}
+
+const SampleKernels* GetSampleKernels()
+{
+#ifdef SAMPLE_KERNELS_SSE2
+	static const SampleKernels* kernels = NULL;
+	if(kernels == NULL)
+		kernels = CpuHasSSE2() ? &s_sse2Kernels : &s_scalarKernels;
+	return kernels;
+#else
+	return &s_scalarKernels;
+#endif
+}
+
+InterleaveKernel GetInterleaveKernel(const SampleKernels* kernels, int slotSize, int channelNumber)
+{
+	for(const FixedKernels* fixed = kernels->fixed; fixed->slotSize; fixed++)
+		if(fixed->slotSize == slotSize && fixed->channelNumber == channelNumber)
+			return fixed->interleave;
+	if(slotSize == 2)
+		return kernels->interleave2;
+	return slotSize == 3 ? kernels->interleave3 : kernels->interleave4;
+}
+
+DeinterleaveKernel GetDeinterleaveKernel(const SampleKernels* kernels, int slotSize, int channelNumber)
+{
+	for(const FixedKernels* fixed = kernels->fixed; fixed->slotSize; fixed++)
+		if(fixed->slotSize == slotSize && fixed->channelNumber == channelNumber)
+			return fixed->deinterleave;
+	if(slotSize == 2)
+		return kernels->deinterleave2;
+	return slotSize == 3 ? kernels->deinterleave3 : kernels->deinterleave4;
+}
@@ -0,0 +1,104 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Block conversion between planar ASIO buffers and interleaved USB frames
+
+#ifndef _samplekernels_
+#define _samplekernels_
+
+#include "platform.h"
+
+enum DitherType
+{
+	DitherNone = 0,		//round to nearest, bit exact for samples within bit resolution
+	DitherTPDF,			//triangular noise of +-1 LSB
+	DitherNoiseShaped	//TPDF with second order error feedback, noise moved to high frequencies
+};
+
+//DSD over PCM (DoP 1.1): marker byte on top of two DSD bytes in a 24 bit sample
+#define DOP_MARKER			0x05	//alternates with its complement 0xFA every frame
+#define DSD_SILENCE			0x69	//idle pattern sent for channels without data
+
+//float host samples <-> integer USB samples. Integer samples are MSB aligned in the slot,
+//output is quantized and dithered at bitResolution
+struct FloatConverter
+{
+	int		slotSize;
+	int		bitResolution;
+	int		dither;
+	float	scale;				//full scale in LSB units
+	float	minValue;			//clip range in LSB units
+	float	maxValue;
+	unsigned int	seed[4];			//xorshift generators, one per SIMD lane
+	float*	shapingError;		//2 per channel, noise-shaped dither only
+	int		channelNumber;
+
+	FloatConverter();
+	~FloatConverter();
+	void Init(int slotSize, int bitResolution, int dither, int channelNumber);
+	void Free();
+	//clears noise shaping history
+	void Reset();
+};
+
+//channels[ch] is the host buffer of device channel ch, offset is the first sample to use in it.
+//NULL channel is sent as silence by interleave and dropped by deinterleave
+typedef void (*InterleaveKernel)(UCHAR* dst, char** channels, long offset, int channelNumber, int frames);
+typedef void (*DeinterleaveKernel)(char** channels, long offset, const UCHAR* src, int channelNumber, int frames);
+typedef void (*InterleaveFloatKernel)(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, FloatConverter* converter);
+typedef void (*DeinterleaveFloatKernel)(char** channels, long offset, const UCHAR* src, int channelNumber, int frames, const FloatConverter* converter);
+//in place shift of 32 bit samples: USB samples are MSB justified, Int32LSBxx host samples LSB justified.
+//Left shift for output, arithmetic right shift for input
+typedef void (*JustifyKernel)(int* samples, int count, int shift);
+//host buffers hold DSD bytes, first bit in MSB. Every frame takes 2 bytes of each channel, offset counts frames.
+//*marker is the DoP marker of the first frame and is advanced past the block
+typedef void (*DopKernel)(UCHAR* dst, char** channels, long offset, int channelNumber, int frames, UCHAR* marker);
+
+//kernels built for one channel count, used for common device profiles
+struct FixedKernels
+{
+	int					slotSize;
+	int					channelNumber;
+	InterleaveKernel	interleave;
+	DeinterleaveKernel	deinterleave;
+};
+
+struct SampleKernels
+{
+	const char*			name;
+	InterleaveKernel	interleave2;	//16 bit in 2 bytes
+	InterleaveKernel	interleave3;	//24 bit in 3 bytes
+	InterleaveKernel	interleave4;	//32 bit in 4 bytes
+	DeinterleaveKernel	deinterleave2;
+	DeinterleaveKernel	deinterleave3;
+	DeinterleaveKernel	deinterleave4;
+	JustifyKernel		justifyLeft;
+	JustifyKernel		justifyRight;
+	InterleaveFloatKernel	interleaveFloat;	//float host buffers, 2, 3 or 4 byte slots
+	DeinterleaveFloatKernel	deinterleaveFloat;
+	DopKernel			packDoP3;		//DoP in 3 byte slots
+	DopKernel			packDoP4;		//DoP in the high 24 bits of 4 byte slots
+	const FixedKernels*	fixed;			//terminated by a zero slot size
+};
+
+//best kernels for the running CPU
+const SampleKernels* GetSampleKernels();
+//portable kernels, always available
+const SampleKernels* GetScalarSampleKernels();
+//fixed kernel for the stream profile if there is one, the generic kernel of the slot size otherwise
+InterleaveKernel GetInterleaveKernel(const SampleKernels* kernels, int slotSize, int channelNumber);
+DeinterleaveKernel GetDeinterleaveKernel(const SampleKernels* kernels, int slotSize, int channelNumber);
+
+#endif
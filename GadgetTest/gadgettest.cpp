@@ -0,0 +1,327 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Integration test of uaclib against the Linux UAC2 gadget (f_uac2 on dummy_hcd, see uac2gadget.sh).
+// Runs the streaming engine at every requested rate and reports throughput, feedback and
+// control request latency. Exit code is 1 if a rate fails or a limit is exceeded.
+
+#include "USBAudioDevice.h"
+#include "usbfstransport.h"
+#include "libusbtransport.h"
+
+#if !defined(_USE_USBFS) && !defined(_USE_LIBUSB)
+#error Build with _USE_USBFS or _USE_LIBUSB
+#endif
+
+#ifdef _ENABLE_TRACE
+
+void debugPrintf(const char *szFormat, ...)
+{
+	va_list argptr;
+	va_start(argptr, szFormat);
+	vprintf(szFormat, argptr);
+	va_end(argptr);
+}
+#endif
+
+enum ControlKind
+{
+	ControlGetDescriptor = 0,
+	ControlGetCur,
+	ControlSetCur,
+	ControlGetRange,
+	ControlSetInterface,
+	ControlOther,
+	ControlKinds
+};
+
+static const char* controlNames[ControlKinds] = {"GET_DESCRIPTOR", "GET CUR", "SET CUR", "GET RANGE", "SET_INTERFACE", "other"};
+
+struct ControlLatency
+{
+	ULONG	count;
+	double	sum;		//ms
+	double	max;
+
+	ControlLatency() : count(0), sum(0.), max(0.)
+	{}
+};
+
+//forwards to the real transport and times every control request
+class TimingTransport : public USBTransport
+{
+	USBTransport*	m_transport;
+	LONGLONG		m_frequency;
+	ControlLatency	m_latency[ControlKinds];
+
+	LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void Add(int kind, LONGLONG start)
+	{
+		double ms = (double)(Now() - start) * 1000. / (double)m_frequency;
+		m_latency[kind].count++;
+		m_latency[kind].sum += ms;
+		if(ms > m_latency[kind].max)
+			m_latency[kind].max = ms;
+	}
+
+	static int Kind(const WINUSB_SETUP_PACKET& setupPacket)
+	{
+		bool toHost = (setupPacket.RequestType & 0x80) != 0;
+		if((setupPacket.RequestType & 0x60) == 0)
+			return setupPacket.Request == USB_REQUEST_GET_DESCRIPTOR ? ControlGetDescriptor : ControlOther;
+		if(setupPacket.Request == AUDIO_CS_REQUEST_CUR)
+			return toHost ? ControlGetCur : ControlSetCur;
+		if(setupPacket.Request == AUDIO_CS_REQUEST_RANGE)
+			return ControlGetRange;
+		return ControlOther;
+	}
+public:
+	TimingTransport(USBTransport* transport) : m_transport(transport)
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		m_frequency = frequency.QuadPart;
+	}
+
+	const ControlLatency& GetLatency(int kind)
+	{ return m_latency[kind]; }
+
+	virtual bool Open()
+	{ return m_transport->Open(); }
+	virtual void Close()
+	{ m_transport->Close(); }
+	virtual bool IsOpen()
+	{ return m_transport->IsOpen(); }
+
+	virtual bool GetDeviceSpeed(int* speed)
+	{ return m_transport->GetDeviceSpeed(speed); }
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+	{
+		LONGLONG start = Now();
+		bool result = m_transport->GetDescriptor(type, index, languageId, buffer, bufferLength, lengthTransferred);
+		Add(ControlGetDescriptor, start);
+		return result;
+	}
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+	{
+		LONGLONG start = Now();
+		bool result = m_transport->ControlTransfer(setupPacket, buffer, bufferLength, lengthTransferred);
+		Add(Kind(setupPacket), start);
+		return result;
+	}
+
+	virtual bool ClaimInterface(UCHAR number)
+	{ return m_transport->ClaimInterface(number); }
+	virtual bool ReleaseInterface(UCHAR number)
+	{ return m_transport->ReleaseInterface(number); }
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting)
+	{
+		LONGLONG start = Now();
+		bool result = m_transport->SetAltInterface(number, altSetting);
+		Add(ControlSetInterface, start);
+		return result;
+	}
+
+	virtual bool ResetPipe(UCHAR pipeId)
+	{ return m_transport->ResetPipe(pipeId); }
+	virtual bool AbortPipe(UCHAR pipeId)
+	{ return m_transport->AbortPipe(pipeId); }
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value)
+	{ return m_transport->SetPipePolicy(pipeId, policyType, valueLength, value); }
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber)
+	{ return m_transport->GetCurrentFrameNumber(frameNumber); }
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount)
+	{ return m_transport->OvlInit(poolHandle, maxOverlappedCount); }
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle)
+	{ return m_transport->OvlFree(poolHandle); }
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle)
+	{ return m_transport->OvlAcquire(overlapped, poolHandle); }
+	virtual bool OvlRelease(KOVL_HANDLE overlapped)
+	{ return m_transport->OvlRelease(overlapped); }
+	virtual bool OvlReUse(KOVL_HANDLE overlapped)
+	{ return m_transport->OvlReUse(overlapped); }
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength)
+	{ return m_transport->OvlWait(overlapped, timeoutMS, waitFlags, transferredLength); }
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength)
+	{ return m_transport->OvlWaitOrCancel(overlapped, timeoutMS, transferredLength); }
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped)
+	{ return m_transport->OvlGetEventHandle(overlapped); }
+
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return m_transport->IsoWritePipe(pipeId, buffer, bufferLength, overlapped, isoContext); }
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return m_transport->IsoReadPipe(pipeId, buffer, bufferLength, overlapped, isoContext); }
+	virtual int GetMaxIsoPackets()
+	{ return m_transport->GetMaxIsoPackets(); }
+};
+
+void FillSilence(void* context, UCHAR *buffer, int& len)
+{
+	memset(buffer, 0, len);
+}
+
+void DropInput(void* context, UCHAR *buffer, int& len)
+{
+}
+
+double Seconds()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+double Ppm(double rate, int freq)
+{
+	return (rate - freq) * 1000000. / freq;
+}
+
+void Usage()
+{
+	printf("usage: gadgettest [-i] [-t seconds] [-r rate,rate,...] [-p max ppm] [-c max control ms]\n");
+	printf("  -i  stream the capture interface too\n");
+}
+
+int main(int argc, char* argv[])
+{
+	bool useInput = FALSE;
+	//samples are counted per completed transfer, a short run sees that as rate error
+	int seconds = 10;
+	int rates[16] = {44100, 48000, 88200, 96000, 176400, 192000};
+	int rateCount = 6;
+	double maxPpm = 500.;
+	double maxControlMs = 50.;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-i"))
+			useInput = TRUE;
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+			maxPpm = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-c") && i + 1 < argc)
+			maxControlMs = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+		{
+			rateCount = 0;
+			for(char* rate = strtok(argv[++i], ","); rate && rateCount < 16; rate = strtok(NULL, ","))
+				rates[rateCount++] = atoi(rate);
+		}
+		else
+		{
+			Usage();
+			return 2;
+		}
+	}
+
+#ifdef _USE_USBFS
+	UsbFsTransport usbTransport;
+#else
+	LibUsbTransport usbTransport;
+#endif
+	TimingTransport transport(&usbTransport);
+	USBAudioDevice device(useInput, &transport);
+
+	double start = Seconds();
+	if(!device.InitDevice())
+	{
+		printf("ERROR: UAC2 gadget not found or can't be opened (%08X)\n", device.GetErrorCode());
+		return 2;
+	}
+	printf("device: %s speed, out %d ch x %d bytes, in %d ch x %d bytes, init %.1f ms\n",
+		device.GetDeviceSpeed() == HighSpeed ? "high" : "full",
+		device.GetOutputChannelNumber(), device.GetDACSubslotSize(),
+		device.GetInputChannelNumber(), device.GetADCSubslotSize(),
+		(Seconds() - start) * 1000.);
+
+	device.SetDACCallback(FillSilence, NULL);
+	if(useInput)
+		device.SetADCCallback(DropInput, NULL);
+
+	int failures = 0;
+	for(int r = 0; r < rateCount; r++)
+	{
+		int freq = rates[r];
+		if(!device.CanSampleRate(freq))
+		{
+			printf("%6d: not supported\n", freq);
+			continue;
+		}
+		if(!device.SetSampleRate(freq) || !device.Start())
+		{
+			printf("%6d: FAILED to start (%08X)\n", freq, device.GetErrorCode());
+			failures++;
+			continue;
+		}
+
+		//startup prefill and feedback lock aren't measured
+		Sleep(1000);
+		EndpointStatistics dac0, adc0, dac1, adc1, fb;
+		device.GetDACStatistics(&dac0);
+		device.GetADCStatistics(&adc0);
+		double time0 = Seconds();
+		Sleep(seconds * 1000);
+		device.GetDACStatistics(&dac1);
+		device.GetADCStatistics(&adc1);
+		double time = Seconds() - time0;
+		device.GetFeedbackStatistics(&fb);
+		float fbRate, fbMin, fbMax;
+		device.GetFeedbackRate(&fbRate, &fbMin, &fbMax);
+		SchedulerStatistics scheduler;
+		device.GetSchedulerStatistics(&scheduler);
+		device.Stop();
+
+		double outRate = (double)(dac1.samples - dac0.samples) / time;
+		double inRate = (double)(adc1.samples - adc0.samples) / time;
+		ULONG errors = dac1.packetsError + dac1.failedTransfers + adc1.packetsError + adc1.failedTransfers + fb.packetsError + fb.failedTransfers;
+		ULONG resyncs = dac1.resyncs + adc1.resyncs;
+		bool failed = errors != 0 || resyncs != 0 || fabs(Ppm(outRate, freq)) > maxPpm ||
+			(useInput && fabs(Ppm(inRate, freq)) > maxPpm);
+
+		printf("%6d: out %.1f/s (%+.0f ppm)", freq, outRate, Ppm(outRate, freq));
+		if(useInput)
+			printf(" in %.1f/s (%+.0f ppm, %u short)", inRate, Ppm(inRate, freq), adc1.packetsShort);
+		if(fb.transfers)
+			printf(" fb %.1f [%.1f..%.1f]", fbRate, fbMin, fbMax);
+		printf(" errors %u resyncs %u wakeups %.0f/s resubmit %.0f/%.0f us%s\n", errors, resyncs,
+			scheduler.GetWakeupsPerSecond(), scheduler.GetAverageResubmitTime(), scheduler.resubmitTimeMax,
+			failed ? " FAILED" : "");
+		if(failed)
+			failures++;
+	}
+
+	for(int kind = 0; kind < ControlKinds; kind++)
+	{
+		const ControlLatency& latency = transport.GetLatency(kind);
+		if(!latency.count)
+			continue;
+		bool failed = latency.max > maxControlMs;
+		printf("%-14s %4u requests, avg %.2f ms, max %.2f ms%s\n", controlNames[kind], latency.count,
+			latency.sum / latency.count, latency.max, failed ? " FAILED" : "");
+		if(failed)
+			failures++;
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# UAC2 gadget (configfs f_uac2) on dummy_hcd for gadgettest, needs root.
+#
+#   uac2gadget.sh up      create and bind the gadget
+#   uac2gadget.sh down    unbind and remove it
+#   uac2gadget.sh pitch N gadget clock against the host, 1000000 = nominal (async feedback)
+#
+# Environment (defaults in brackets):
+#   OUT_CHANNELS  host playback channels, 0 - no playback interface [2]
+#   IN_CHANNELS   host capture channels, 0 - no capture interface [2]
+#   RATES         comma separated sample rates [44100,48000,88200,96000,176400,192000]
+#   SAMPLE_SIZE   bytes per sample, 2..4 [4]
+#   SYNC          async (explicit feedback) or adaptive [async]
+#
+# The gadget takes the widget VID/PID so the transports find it without arguments.
+# Several rates per direction need kernel 5.18 or later.
+
+GADGET=/sys/kernel/config/usb_gadget/uac2test
+FUNCTION=$GADGET/functions/uac2.0
+
+OUT_CHANNELS=${OUT_CHANNELS:-2}
+IN_CHANNELS=${IN_CHANNELS:-2}
+RATES=${RATES:-44100,48000,88200,96000,176400,192000}
+SAMPLE_SIZE=${SAMPLE_SIZE:-4}
+SYNC=${SYNC:-async}
+
+chmask()
+{
+	echo $(( (1 << $1) - 1 ))
+}
+
+up()
+{
+	modprobe libcomposite || exit 1
+	modprobe dummy_hcd is_high_speed=1 || exit 1
+	[ -d /sys/kernel/config/usb_gadget ] || mount -t configfs none /sys/kernel/config || exit 1
+
+	mkdir $GADGET || exit 1
+	echo 0x16C0 > $GADGET/idVendor
+	echo 0x03E8 > $GADGET/idProduct
+	echo 0x0200 > $GADGET/bcdUSB
+	echo 0xEF > $GADGET/bDeviceClass
+	echo 0x02 > $GADGET/bDeviceSubClass
+	echo 0x01 > $GADGET/bDeviceProtocol
+	mkdir $GADGET/strings/0x409
+	echo "uaclib" > $GADGET/strings/0x409/manufacturer
+	echo "UAC2 test gadget" > $GADGET/strings/0x409/product
+
+	# f_uac2 names the directions from the gadget side: c_ is host playback, p_ host capture
+	mkdir $FUNCTION || exit 1
+	echo $(chmask $OUT_CHANNELS) > $FUNCTION/c_chmask
+	echo $RATES > $FUNCTION/c_srate
+	echo $SAMPLE_SIZE > $FUNCTION/c_ssize
+	echo $SYNC > $FUNCTION/c_sync
+	echo $(chmask $IN_CHANNELS) > $FUNCTION/p_chmask
+	echo $RATES > $FUNCTION/p_srate
+	echo $SAMPLE_SIZE > $FUNCTION/p_ssize
+
+	mkdir $GADGET/configs/c.1
+	echo 250 > $GADGET/configs/c.1/MaxPower
+	ln -s $FUNCTION $GADGET/configs/c.1/
+
+	echo $(ls /sys/class/udc | grep dummy_udc | head -n 1) > $GADGET/UDC || exit 1
+	echo "gadget bound, out $OUT_CHANNELS ch, in $IN_CHANNELS ch, $SAMPLE_SIZE bytes, $RATES Hz, $SYNC"
+}
+
+down()
+{
+	[ -d $GADGET ] || return 0
+	echo "" > $GADGET/UDC
+	rm -f $GADGET/configs/c.1/uac2.0
+	rmdir $GADGET/configs/c.1
+	rmdir $FUNCTION
+	rmdir $GADGET/strings/0x409
+	rmdir $GADGET
+}
+
+pitch()
+{
+	# the gadget sound card streams nothing on its own, the control works without a stream
+	# f_uac2 card, not the snd-usb-audio one of the host side
+	card=$(awk '/: UAC2_Gadget/ {print $1; exit}' /proc/asound/cards)
+	[ -n "$card" ] || { echo "gadget sound card not found"; exit 1; }
+	amixer -c $card cset name='Capture Pitch 1000000' $1
+}
+
+case "$1" in
+	up)
+		up
+		;;
+	down)
+		down
+		;;
+	pitch)
+		pitch $2
+		;;
+	*)
+		echo "usage: $0 up|down|pitch <value>"
+		exit 1
+		;;
+esac
@@ -0,0 +1,1063 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Tests of uaclib against the software UAC2 device (simtransport.h), no hardware needed.
+// Every scenario builds its own device, streams through USBAudioDevice and checks what
+// the device received and sent. Bus time is virtual unless -rt is given, so a run takes
+// a fraction of its bus time and gives the same result every time.
+// Exit code is 1 if a scenario fails.
+
+#include <time.h>
+#include "USBAudioDevice.h"
+#include "simtransport.h"
+
+#ifdef _ENABLE_TRACE
+
+void debugPrintf(const char *szFormat, ...)
+{
+	va_list argptr;
+	va_start(argptr, szFormat);
+	vprintf(szFormat, argptr);
+	va_end(argptr);
+}
+#endif
+
+static int s_seconds = 5;			//bus time of one measured run
+static bool s_realTime = FALSE;
+
+//checks the ramp the device sends on the input stream
+struct RampCheck
+{
+	int			channels;
+	int			subslotSize;
+	int			bitResolution;
+	bool		synced;
+	ULONG		expected;
+	ULONG		errors;
+	ULONGLONG	frames;
+
+	RampCheck() : channels(0), subslotSize(0), bitResolution(0), synced(FALSE), expected(0), errors(0), frames(0)
+	{}
+
+	void Init(int ch, int subslot, int bits)
+	{
+		channels = ch;
+		subslotSize = subslot;
+		bitResolution = bits;
+		Reset();
+	}
+	void Reset()
+	{
+		synced = FALSE;
+		expected = 0;
+		errors = 0;
+		frames = 0;
+	}
+};
+
+void FillSilence(void* context, UCHAR *buffer, int& len)
+{
+	memset(buffer, 0, len);
+}
+
+void CheckRamp(void* context, UCHAR *buffer, int& len)
+{
+	RampCheck* ramp = (RampCheck*)context;
+	int frameSize = ramp->channels * ramp->subslotSize;
+	int shift = ramp->subslotSize * 8 - ramp->bitResolution;
+	ULONG mask = ramp->bitResolution >= 32 ? 0xFFFFFFFF : ((ULONG)1 << ramp->bitResolution) - 1;
+	for(int offset = 0; offset + frameSize <= len; offset += frameSize)
+	{
+		ULONG first = 0;
+		for(int ch = 0; ch < ramp->channels; ch++)
+		{
+			ULONG value = 0;
+			for(int i = 0; i < ramp->subslotSize; i++)
+				value |= (ULONG)buffer[offset + ch * ramp->subslotSize + i] << (8 * i);
+			value = (value >> shift) & mask;
+			if(ch == 0)
+				first = value;
+			else if(value != ((first + ch) & mask))
+				ramp->errors++;
+		}
+		if(ramp->synced && first != (ramp->expected & mask))
+			ramp->errors++;
+		ramp->synced = TRUE;
+		ramp->expected = first + 1;
+		ramp->frames++;
+	}
+}
+
+double Seconds()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+//CPU time of the process, the simulated device included
+double CpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernelTime.dwLowDateTime;
+	kernel.HighPart = kernelTime.dwHighDateTime;
+	user.LowPart = userTime.dwLowDateTime;
+	user.HighPart = userTime.dwHighDateTime;
+	return (double)(kernel.QuadPart + user.QuadPart) * 1e-7;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+double Ppm(double rate, double freq)
+{
+	return (rate - freq) * 1000000. / freq;
+}
+
+//waits until the bus has run the given number of microframes since start
+void WaitBusTime(SimTransport& sim, ULONGLONG start, ULONGLONG microframes)
+{
+	SimStatistics stats;
+	for(;;)
+	{
+		sim.GetStatistics(&stats);
+		if(stats.busTime - start >= microframes)
+			return;
+		Sleep(s_realTime ? 20 : 1);
+	}
+}
+
+//one measured stream at one rate
+struct StreamResult
+{
+	SimStatistics		sim;			//measured part only
+	EndpointStatistics	dac;
+	EndpointStatistics	adc;
+	EndpointStatistics	fb;
+	double				busSeconds;
+	double				outRate;		//audio frames per bus second, FIFO change excluded
+	double				wallSeconds;
+	double				cpuSeconds;
+	ULONG				wakeups;		//scheduler wakeups while measured
+	float				resubmitTime;	//average completion to resubmit while measured, microseconds
+	float				resubmitMax;	//since start
+	float				fbRate;			//rate the DAC followed at the end, samples per second
+	bool				started;
+	bool				stopped;		//Stop succeeded
+};
+
+//sets the rate, starts, lets the stream settle for one bus second and measures s_seconds
+bool Stream(SimTransport& sim, USBAudioDevice& device, RampCheck* ramp, int freq, StreamResult& result)
+{
+	result = StreamResult();
+	if(!device.SetSampleRate(freq))
+		return FALSE;
+	device.SetDACCallback(FillSilence, NULL);
+	if(ramp)
+	{
+		ramp->Reset();
+		device.SetADCCallback(CheckRamp, ramp);
+	}
+	SimStatistics start;
+	sim.GetStatistics(&start);
+	if(!device.Start())
+	{
+		device.Stop();
+		return FALSE;
+	}
+	result.started = TRUE;
+
+	//FIFO prefill and feedback lock
+	WaitBusTime(sim, start.busTime, 8000);
+	sim.ClearStatistics();
+	if(ramp)
+		ramp->errors = 0;
+	SimStatistics measure;
+	sim.GetStatistics(&measure);
+	SchedulerStatistics scheduler0, scheduler1;
+	device.GetSchedulerStatistics(&scheduler0);
+	double wall = Seconds();
+	double cpu = CpuSeconds();
+	WaitBusTime(sim, measure.busTime, (ULONGLONG)s_seconds * 8000);
+	sim.GetStatistics(&result.sim);
+	result.cpuSeconds = CpuSeconds() - cpu;
+	result.wallSeconds = Seconds() - wall;
+	device.GetSchedulerStatistics(&scheduler1);
+	result.wakeups = scheduler1.wakeups - scheduler0.wakeups;
+	if(scheduler1.resubmits > scheduler0.resubmits)
+		result.resubmitTime = (scheduler1.resubmitTimeSum - scheduler0.resubmitTimeSum) / (scheduler1.resubmits - scheduler0.resubmits);
+	result.resubmitMax = scheduler1.resubmitTimeMax;
+	device.GetDACStatistics(&result.dac);
+	device.GetADCStatistics(&result.adc);
+	device.GetFeedbackStatistics(&result.fb);
+	float minRate, maxRate;
+	device.GetFeedbackRate(&result.fbRate, &minRate, &maxRate);
+	result.stopped = device.Stop();
+
+	result.busSeconds = (double)(result.sim.busTime - measure.busTime) / 8000.;
+	result.outRate = result.busSeconds > 0. ?
+		((double)result.sim.framesOut - (result.sim.fifoLevel - measure.fifoLevel)) / result.busSeconds : 0.;
+	return TRUE;
+}
+
+//problems every healthy stream must be free of, prints them and returns TRUE if any
+bool StreamFailed(const StreamResult& result, double deviceRate, double maxPpm, const RampCheck* ramp)
+{
+	bool failed = FALSE;
+	if(!result.stopped)
+	{
+		printf(" Stop failed");
+		failed = TRUE;
+	}
+	if(result.sim.underruns || result.sim.overruns)
+	{
+		printf(" FIFO underruns %u overruns %u", result.sim.underruns, result.sim.overruns);
+		failed = TRUE;
+	}
+	if(result.sim.packetsError || result.dac.failedTransfers || result.adc.failedTransfers || result.fb.failedTransfers)
+	{
+		printf(" packet errors %u failed transfers %u", result.sim.packetsError,
+			result.dac.failedTransfers + result.adc.failedTransfers + result.fb.failedTransfers);
+		failed = TRUE;
+	}
+	if(result.sim.lateTransfers || result.sim.stalls)
+	{
+		printf(" late transfers %u stalls %u", result.sim.lateTransfers, result.sim.stalls);
+		failed = TRUE;
+	}
+	//on the wall clock completions come in bursts, the last one can be a whole transfer behind
+	if(!s_realTime && fabs(Ppm(result.outRate, deviceRate)) > maxPpm)
+	{
+		printf(" output %.1f/s is %+.0f ppm off", result.outRate, Ppm(result.outRate, deviceRate));
+		failed = TRUE;
+	}
+	if(ramp && (ramp->errors || ramp->frames == 0))
+	{
+		printf(" input ramp errors %u in %llu frames", ramp->errors, ramp->frames);
+		failed = TRUE;
+	}
+	return failed;
+}
+
+void PrintStream(int freq, const StreamResult& result)
+{
+	printf("  %6d: out %.1f/s fifo %.0f..%.0f fb %.1f, %.1f bus s in %.2f s", freq, result.outRate,
+		result.sim.fifoMin, result.sim.fifoMax, result.fbRate, result.busSeconds, result.wallSeconds);
+}
+
+double WakeupsPerSecond(const StreamResult& result)
+{
+	return result.busSeconds > 0. ? result.wakeups / result.busSeconds : 0.;
+}
+
+//streams every rate of the device, output throughput has to follow the device clock.
+//results gets one entry per rate if given
+bool StreamRates(const SimDeviceConfig& config, bool useInput, double maxPpm, int schedulerMode = SchedulerThreadPerEndpoint,
+	StreamResult* results = NULL)
+{
+	SimTransport sim(config);
+	USBAudioDevice device(useInput, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	if(!device.SetSchedulerMode(schedulerMode))
+	{
+		printf("  SetSchedulerMode %d failed\n", schedulerMode);
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+
+	bool failed = FALSE;
+	for(int i = 0; i < SIM_MAX_RATES && config.rates[i]; i++)
+	{
+		int freq = config.rates[i];
+		StreamResult result;
+		bool started = Stream(sim, device, useInput ? &ramp : NULL, freq, result);
+		if(results)
+			results[i] = result;
+		if(!started)
+		{
+			printf("  %6d: FAILED to start (%08X)\n", freq, device.GetErrorCode());
+			failed = TRUE;
+			continue;
+		}
+		PrintStream(freq, result);
+		bool rateFailed = StreamFailed(result, freq * (1. + config.clockPpm * 1e-6), maxPpm, useInput ? &ramp : NULL);
+		printf("%s\n", rateFailed ? " FAILED" : "");
+		failed |= rateFailed;
+	}
+	return !failed;
+}
+
+//high speed stereo 24 in 32 bit with input (implicit feedback), the device clock 150 ppm fast
+bool TestRates()
+{
+	SimDeviceConfig config;
+	config.clockPpm = 150.;
+	config.realTime = s_realTime;
+	return StreamRates(config, TRUE, 100.);
+}
+
+//output only, the DAC follows the explicit feedback endpoint
+bool TestExplicitFeedback()
+{
+	SimDeviceConfig config;
+	config.inputChannels = 0;
+	config.clockPpm = -250.;
+	config.realTime = s_realTime;
+	return StreamRates(config, FALSE, 100.);
+}
+
+//full speed device, 1 ms frames: with input (implicit feedback) and output only with the 10.14
+//explicit feedback value. Virtual time advances by whole transfers, one DAC transfer is
+//packetPerTransferDAC ms here, the measured window can be that much off
+bool TestFullSpeed()
+{
+	double maxPpm = 100. + 1000. * packetPerTransferDAC / s_seconds;
+	SimDeviceConfig config;
+	config.speed = FullSpeed;
+	config.rates[0] = 44100;
+	config.rates[1] = 48000;
+	config.rates[2] = 96000;
+	config.rates[3] = 0;
+	config.clockPpm = 150.;
+	config.realTime = s_realTime;
+	printf("  with input\n");
+	bool passed = StreamRates(config, TRUE, maxPpm);
+	config.inputChannels = 0;
+	config.clockPpm = -250.;
+	printf("  explicit feedback\n");
+	return StreamRates(config, FALSE, maxPpm) && passed;
+}
+
+//every rate with a thread per pipe and then on the single service thread, wakeups and resubmit
+//latency side by side. Pipes completing together are served in one wakeup of the single thread,
+//it must not wake more often than the threads per pipe together
+static bool CompareSchedulers(const SimDeviceConfig& config, bool useInput)
+{
+	StreamResult perPipe[SIM_MAX_RATES], single[SIM_MAX_RATES];
+	printf("  thread per pipe\n");
+	bool passed = StreamRates(config, useInput, 100., SchedulerThreadPerEndpoint, perPipe);
+	printf("  single thread\n");
+	passed = StreamRates(config, useInput, 100., SchedulerSingleThread, single) && passed;
+
+	printf("    rate   wakeups/s per pipe  single   resubmit us per pipe (max)  single (max)\n");
+	for(int i = 0; i < SIM_MAX_RATES && config.rates[i]; i++)
+	{
+		bool more = WakeupsPerSecond(single[i]) > WakeupsPerSecond(perPipe[i]) * 1.01;
+		printf("  %6d  %18.0f  %6.0f  %20.1f (%5.1f)  %6.1f (%5.1f)%s\n", config.rates[i],
+			WakeupsPerSecond(perPipe[i]), WakeupsPerSecond(single[i]),
+			perPipe[i].resubmitTime, perPipe[i].resubmitMax, single[i].resubmitTime, single[i].resubmitMax,
+			more ? " FAILED" : "");
+		if(more)
+			passed = FALSE;
+	}
+	return passed;
+}
+
+//one service thread runs the DAC, ADC and feedback pipes, Stop has to succeed too. Compared with
+//a thread per pipe on the DAC + ADC device and on the DAC + explicit feedback one
+bool TestSingleThread()
+{
+	SimDeviceConfig config;
+	config.clockPpm = 150.;
+	config.realTime = s_realTime;
+	printf("  with input\n");
+	bool passed = CompareSchedulers(config, TRUE);
+	config.inputChannels = 0;
+	config.clockPpm = -250.;
+	printf("  explicit feedback\n");
+	return CompareSchedulers(config, FALSE) && passed;
+}
+
+//transport without frame numbers (libusb, usbfs): the first failed request turns frame scheduling
+//off, transfers go ASAP and the transport isn't asked again until the next start
+bool TestNoFrameNumber()
+{
+	static const int rates[] = {44100, 192000};
+
+	SimDeviceConfig config;
+	config.frameNumber = FALSE;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])); i++)
+	{
+		StreamResult result;
+		if(!Stream(sim, device, &ramp, rates[i], result))
+		{
+			printf("  %6d: FAILED to start (%08X)\n", rates[i], device.GetErrorCode());
+			failed = TRUE;
+			continue;
+		}
+		PrintStream(rates[i], result);
+		//ASAP transfers don't line up with the measured window, allow one 1 ms transfer more or less
+		bool rateFailed = StreamFailed(result, rates[i], 100. + 1000. / s_seconds, &ramp);
+		if(result.sim.frameNumberRequests)
+		{
+			printf(" %u frame number requests", result.sim.frameNumberRequests);
+			rateFailed = TRUE;
+		}
+		printf("%s\n", rateFailed ? " FAILED" : "");
+		failed |= rateFailed;
+	}
+	return !failed;
+}
+
+//high bandwidth endpoints: 8 channels in 2 transactions of 400 bytes per microframe, 24 channels
+//in 3 of 800, the whole wMaxPacketSize payload has to be used. The reserved transaction count
+//(bits 11..12 = 3) leaves the device without usable formats
+bool TestHighBandwidth()
+{
+	static const struct
+	{
+		const char*	name;
+		int			channels;
+		int			transactions;
+	} runs[] = {{"8 ch, 2 transactions", 8, 2}, {"24 ch, 3 transactions", 24, 0}};
+
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++)
+	{
+		SimDeviceConfig config;
+		config.outputChannels = config.inputChannels = runs[i].channels;
+		config.transactions = runs[i].transactions;
+		config.rates[0] = 48000;
+		config.rates[1] = 192000;
+		config.rates[2] = 0;
+		config.clockPpm = 150.;
+		config.realTime = s_realTime;
+		printf("  %s\n", runs[i].name);
+		if(!StreamRates(config, TRUE, 100.))
+			failed = TRUE;
+	}
+
+	SimDeviceConfig config;
+	config.transactions = 4;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	StreamingFormat formats[MAX_STREAMING_FORMATS];
+	bool initialized = device.InitDevice();
+	int count = device.GetDACFormats(formats, MAX_STREAMING_FORMATS) + device.GetADCFormats(formats, MAX_STREAMING_FORMATS);
+	printf("  reserved transaction count: InitDevice %s, %d formats%s\n", initialized ? "passed" : "failed", count,
+		initialized && count == 0 ? "" : " FAILED");
+	if(!initialized || count != 0)
+		failed = TRUE;
+	return !failed;
+}
+
+//implicit feedback from the input packets, raw per transfer value against the rate estimator.
+//The DAC follows the feedback, so its noise shows up as FIFO excursion at the device. Raw
+//feedback only gives the reference, it may underrun; the filtered stream has to be healthy
+bool TestImplicitFeedback()
+{
+	static const int rates[] = {44100, 48000, 88200, 176400};
+
+	SimDeviceConfig config;
+	config.explicitFeedback = FALSE;
+	config.clockPpm = 150.;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])); i++)
+	{
+		double excursion[2];
+		for(int filter = 0; filter < 2; filter++)
+		{
+			device.SetImplicitFeedbackFilter(filter != 0);
+			StreamResult result;
+			if(!Stream(sim, device, &ramp, rates[i], result))
+			{
+				printf("  %6d: FAILED to start (%08X)\n", rates[i], device.GetErrorCode());
+				failed = TRUE;
+				excursion[filter] = 0.;
+				continue;
+			}
+			excursion[filter] = result.sim.fifoMax - result.sim.fifoMin;
+			PrintStream(rates[i], result);
+			printf(" %s, excursion %.0f", filter ? "filtered" : "raw", excursion[filter]);
+			if(!filter && result.sim.underruns)
+				printf(" underruns %u", result.sim.underruns);
+			bool rateFailed = FALSE;
+			if(filter)
+			{
+				rateFailed = StreamFailed(result, rates[i] * (1. + config.clockPpm * 1e-6), 100., &ramp);
+				if(excursion[1] > excursion[0])
+				{
+					printf(" more than raw");
+					rateFailed = TRUE;
+				}
+			}
+			printf("%s\n", rateFailed ? " FAILED" : "");
+			failed |= rateFailed;
+		}
+	}
+	return !failed;
+}
+
+void CountNotify(void* context, int reason)
+{
+	(*(int*)context)++;
+}
+
+//transfer errors on the output pipe while the input keeps streaming. Three failed transfers in a
+//row restart the pipe in place without notifying the host, two are only counted. Errors come
+//from the engine (InjectDACErrors) or from the bus (every packet of the transfers fails)
+bool TestRecovery()
+{
+	static const int packets = 16;
+	static const struct
+	{
+		const char*	name;
+		bool		bus;
+		int			transfers;
+		ULONG		recoveries;
+	} runs[] = {{"engine 3", FALSE, 3, 1}, {"engine 2", FALSE, 2, 0}, {"bus 3", TRUE, 3, 1}, {"bus 2", TRUE, 2, 0}};
+
+	SimDeviceConfig config;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	int notifications = 0;
+	device.SetNotifyCallback(CountNotify, &notifications);
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+	if(!device.SetDACTransferConfig(4, packets) || !device.SetSampleRate(48000))
+	{
+		printf("  configuration failed\n");
+		return FALSE;
+	}
+	device.SetDACCallback(FillSilence, NULL);
+	device.SetADCCallback(CheckRamp, &ramp);
+	SimStatistics stats;
+	sim.GetStatistics(&stats);
+	if(!device.Start())
+	{
+		printf("  Start failed (%08X)\n", device.GetErrorCode());
+		device.Stop();
+		return FALSE;
+	}
+	WaitBusTime(sim, stats.busTime, 8000);
+	ramp.errors = 0;
+
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++)
+	{
+		EndpointStatistics before, after;
+		device.GetDACStatistics(&before);
+		sim.ClearStatistics();
+		sim.GetStatistics(&stats);
+		if(runs[i].bus)
+			sim.InjectPacketErrors(0x01, runs[i].transfers * packets);
+		else
+			device.InjectDACErrors(runs[i].transfers);
+		WaitBusTime(sim, stats.busTime, 8000);
+		sim.GetStatistics(&stats);
+		device.GetDACStatistics(&after);
+
+		ULONG failedTransfers = after.failedTransfers - before.failedTransfers;
+		ULONG recoveries = after.recoveries - before.recoveries;
+		printf("  %-8s: %u failed transfers, %u recoveries", runs[i].name, failedTransfers, recoveries);
+		if(recoveries)
+			printf(" in %.2f ms", after.recoveryTime / 1000.);
+		printf(", FIFO %.0f..%.0f underruns %u", stats.fifoMin, stats.fifoMax, stats.underruns);
+		bool runFailed = failedTransfers != (ULONG)runs[i].transfers || recoveries != runs[i].recoveries ||
+			(recoveries && after.recoveryTime <= 0) || notifications != 0 || ramp.errors != 0;
+		if(notifications)
+			printf(" host notified");
+		if(ramp.errors)
+			printf(" input ramp errors %u", ramp.errors);
+		printf("%s\n", runFailed ? " FAILED" : "");
+		failed |= runFailed;
+	}
+	if(!device.Stop())
+	{
+		printf("  Stop failed\n");
+		failed = TRUE;
+	}
+	return !failed;
+}
+
+//frames a pipe counted against the frames the device moved: the host can't be ahead of the device
+//and can be behind it only by the transfers in flight
+static bool CheckBytes(const char* name, const EndpointStatistics& endpoint, int frameSize, ULONGLONG devicePrevious,
+	ULONGLONG deviceNow, ULONGLONG inFlight)
+{
+	ULONGLONG frames = endpoint.bytes / frameSize;
+	printf("  %s: %llu frames, device %llu..%llu", name, frames, devicePrevious, deviceNow);
+	bool failed = endpoint.bytes % frameSize != 0 || endpoint.samples != frames || frames > deviceNow ||
+		frames + inFlight < devicePrevious;
+	printf("%s\n", failed ? " FAILED" : "");
+	return !failed;
+}
+
+//rate of a pipe is its samples over the time since start. The pipe started between startTick0
+//and startTick1 and was read between readTick0 and readTick1
+static bool CheckRate(const char* name, const EndpointStatistics& endpoint, DWORD startTick0, DWORD startTick1,
+	DWORD readTick0, DWORD readTick1, double deviceRate)
+{
+	double lowest = endpoint.samples * 1000. / (readTick1 - startTick0);
+	double highest = readTick0 > startTick1 ? endpoint.samples * 1000. / (readTick0 - startTick1) : 1e30;
+	printf("  %s rate %.1f/s, %.1f..%.1f from the samples", name, endpoint.rate, lowest, highest);
+	bool failed = endpoint.rate < lowest * (1. - 1e-6) || endpoint.rate > highest * (1. + 1e-6);
+	//on the wall clock the rate is the device clock, transfers in flight and start up included
+	if(s_realTime && fabs(Ppm(endpoint.rate, deviceRate)) > 20000.)
+	{
+		printf(", %+.0f ppm off the device", Ppm(endpoint.rate, deviceRate));
+		failed = TRUE;
+	}
+	printf("%s\n", failed ? " FAILED" : "");
+	return !failed;
+}
+
+//endpoint counters read while the stream runs: packet errors injected on the OUT and the IN
+//pipe and IN packets cut to 0 and 2 frames have to show up in packetsError and packetsShort of
+//their pipe. Cut frames follow in later packets, the input ramp has no gap
+bool TestCounters()
+{
+	const int freq = 48000, depth = 4, packets = 16;
+	const int outErrors = 5, inErrors = 7, zeroPackets = 6, cutPackets = 6;
+	SimDeviceConfig config;
+	config.clockPpm = 150.;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+	if(!device.SetDACTransferConfig(depth, packets) || !device.SetADCTransferConfig(depth, packets) || !device.SetSampleRate(freq))
+	{
+		printf("  configuration failed\n");
+		return FALSE;
+	}
+	device.SetDACCallback(FillSilence, NULL);
+	device.SetADCCallback(CheckRamp, &ramp);
+	sim.ClearStatistics();
+	SimStatistics stats;
+	sim.GetStatistics(&stats);
+	DWORD startTick0 = GetTickCount();
+	if(!device.Start())
+	{
+		printf("  Start failed (%08X)\n", device.GetErrorCode());
+		device.Stop();
+		return FALSE;
+	}
+	DWORD startTick1 = GetTickCount();
+
+	WaitBusTime(sim, stats.busTime, 8000);
+	sim.InjectPacketErrors(0x01, outErrors);
+	sim.InjectPacketErrors(0x82, inErrors);
+	sim.GetStatistics(&stats);
+	WaitBusTime(sim, stats.busTime, 800);
+	sim.InjectShortPackets(0x82, zeroPackets, 0);
+	sim.GetStatistics(&stats);
+	WaitBusTime(sim, stats.busTime, 800);
+	sim.InjectShortPackets(0x82, cutPackets, 2);
+	sim.GetStatistics(&stats);
+	WaitBusTime(sim, stats.busTime, (ULONGLONG)s_seconds * 8000);
+
+	SimStatistics previous, now;
+	EndpointStatistics dac, adc;
+	sim.GetStatistics(&previous);
+	DWORD readTick0 = GetTickCount();
+	device.GetDACStatistics(&dac);
+	device.GetADCStatistics(&adc);
+	DWORD readTick1 = GetTickCount();
+	sim.GetStatistics(&now);
+	bool stopped = device.Stop();
+
+	bool failed = FALSE;
+	printf("  packet errors: out %u, in %u, device %u; short in packets %u, device %u", dac.packetsError, adc.packetsError,
+		now.packetsError, adc.packetsShort, now.packetsShort);
+	if(dac.packetsError != (ULONG)outErrors || adc.packetsError != (ULONG)inErrors || now.packetsError != (ULONG)(outErrors + inErrors) ||
+		adc.packetsShort != now.packetsShort || now.packetsShort != (ULONG)(zeroPackets + cutPackets) || dac.packetsShort != 0)
+	{
+		printf(" FAILED");
+		failed = TRUE;
+	}
+	printf("\n");
+
+	ULONGLONG inFlight = (ULONGLONG)depth * packets * (freq / 8000 + 1);
+	failed |= !CheckBytes("out", dac, config.outputChannels * config.subslotSize, previous.framesOut, now.framesOut, inFlight);
+	failed |= !CheckBytes("in ", adc, config.inputChannels * config.subslotSize, previous.framesIn, now.framesIn, inFlight);
+	double deviceRate = freq * (1. + config.clockPpm * 1e-6);
+	failed |= !CheckRate("out", dac, startTick0, startTick1, readTick0, readTick1, deviceRate);
+	failed |= !CheckRate("in ", adc, startTick0, startTick1, readTick0, readTick1, deviceRate);
+	if(ramp.errors || ramp.frames == 0)
+	{
+		printf("  input ramp errors %u in %llu frames FAILED\n", ramp.errors, ramp.frames);
+		failed = TRUE;
+	}
+	if(!stopped)
+	{
+		printf("  Stop failed\n");
+		failed = TRUE;
+	}
+	return !failed;
+}
+
+//input as the consumer gets it: ramp check and a checksum over the first checkFrames frames
+struct DeliveryCheck
+{
+	RampCheck	ramp;
+	ULONGLONG	checkFrames;
+	ULONGLONG	checkedBytes;
+	ULONG		checksum;
+	ULONG		emptyPackets;	//zero length packets seen by the scatter callback
+	double		callbackSeconds;
+
+	DeliveryCheck() : checkFrames(0), checkedBytes(0), checksum(0), emptyPackets(0), callbackSeconds(0.)
+	{}
+};
+
+void CheckDelivery(void* context, UCHAR *buffer, int& len)
+{
+	DeliveryCheck* check = (DeliveryCheck*)context;
+	ULONGLONG checkBytes = check->checkFrames * check->ramp.channels * check->ramp.subslotSize;
+	for(int i = 0; i < len && check->checkedBytes < checkBytes; i++, check->checkedBytes++)
+		check->checksum = check->checksum * 31 + buffer[i];
+	CheckRamp(&check->ramp, buffer, len);
+}
+
+void CompactedDelivery(void* context, UCHAR *buffer, int& len)
+{
+	double start = Seconds();
+	CheckDelivery(context, buffer, len);
+	((DeliveryCheck*)context)->callbackSeconds += Seconds() - start;
+}
+
+//walks the packets in place like the driver does
+void ScatterDelivery(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount)
+{
+	double start = Seconds();
+	DeliveryCheck* check = (DeliveryCheck*)context;
+	for(int i = 0; i < packetCount; i++)
+	{
+		int len = packets[i].Length;
+		if(len == 0)
+			check->emptyPackets++;
+		else
+			CheckDelivery(context, buffer + packets[i].Offset, len);
+	}
+	check->callbackSeconds += Seconds() - start;
+}
+
+//one 8 ch 192 kHz input stream through the scatter or the compacting path, zero length and
+//cut packets injected every 100 ms
+static bool StreamDelivery(bool scatter, DeliveryCheck& check, EndpointStatistics& adc, SimStatistics& stats)
+{
+	const int freq = 192000, zeroPackets = 4, cutPackets = 4;
+	SimDeviceConfig config;
+	config.inputChannels = 8;
+	config.rates[0] = freq;
+	config.rates[1] = 0;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice() || !device.SetSampleRate(freq))
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	check.ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+	check.checkFrames = (ULONGLONG)freq * s_seconds;
+	device.SetDACCallback(FillSilence, NULL);
+	if(scatter)
+		device.SetADCScatterCallback(ScatterDelivery, &check);
+	else
+		device.SetADCCallback(CompactedDelivery, &check);
+	sim.ClearStatistics();
+	sim.GetStatistics(&stats);
+	ULONGLONG start = stats.busTime;
+	if(!device.Start())
+	{
+		printf("  Start failed (%08X)\n", device.GetErrorCode());
+		device.Stop();
+		return FALSE;
+	}
+	for(int step = 1; step <= (s_seconds + 1) * 10; step++)
+	{
+		if(step > 10)
+			sim.InjectShortPackets(0x82, step & 1 ? zeroPackets : cutPackets, step & 1 ? 0 : 5);
+		WaitBusTime(sim, start, (ULONGLONG)step * 800);
+	}
+	device.GetADCStatistics(&adc);
+	sim.GetStatistics(&stats);
+	return device.Stop();
+}
+
+//the scatter callback (SetADCScatterCallback) gets the packets in place, the plain callback
+//a buffer compacted by memmove (PACK_ADC_BUFFER). Both have to deliver the same samples with
+//zero length and short packets in the stream; prints the ProcessBuffer time of each path
+//without the time spent in the callback, the scatter callback includes its packet walk
+bool TestScatter()
+{
+	static const char* names[] = {"compacted", "scatter"};
+	DeliveryCheck checks[2];
+	bool failed = FALSE;
+	double nsPerFrame[2] = {0., 0.};
+	for(int i = 0; i < 2; i++)
+	{
+		EndpointStatistics adc;
+		SimStatistics stats;
+		bool stopped = StreamDelivery(i == 1, checks[i], adc, stats);
+		const DeliveryCheck& check = checks[i];
+		double callback = 0.;
+		if(adc.samples > 0)
+		{
+			callback = check.callbackSeconds * 1e9 / adc.samples;
+			nsPerFrame[i] = adc.processTime * 1000. / adc.samples - callback;
+		}
+		printf("  %-9s: %llu frames, short packets %u, empty seen %u, checksum %08X, path %.2f ns/frame, callback %.2f",
+			names[i], check.ramp.frames, adc.packetsShort, check.emptyPackets, check.checksum, nsPerFrame[i], callback);
+		if(!stopped || check.ramp.errors || check.ramp.frames < check.checkFrames || adc.packetsShort == 0 || stats.underruns ||
+			stats.overruns || adc.failedTransfers || (i == 1 && check.emptyPackets == 0))
+		{
+			printf(" FAILED: %sramp errors %u, underruns %u overruns %u, failed transfers %u", stopped ? "" : "Stop failed, ",
+				check.ramp.errors, stats.underruns, stats.overruns, adc.failedTransfers);
+			failed = TRUE;
+		}
+		printf("\n");
+	}
+	if(checks[0].checksum != checks[1].checksum)
+	{
+		printf("  first %llu frames differ FAILED\n", checks[0].checkFrames);
+		failed = TRUE;
+	}
+	if(nsPerFrame[0] > 0.)
+		printf("  scatter path takes %.0f%% of the compacting path\n", nsPerFrame[1] * 100. / nsPerFrame[0]);
+	return !failed;
+}
+
+//rate changes and shorter rings re-partition the buffer arena, each endpoint allocates
+//it once, sized for the fastest rate its max packet size allows
+bool TestAllocations()
+{
+	static const int rates[] = {44100, 192000, 48000, 176400, 88200, 96000, 44100};
+
+	SimDeviceConfig config;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+
+	bool failed = FALSE;
+	int count = (int)(sizeof(rates) / sizeof(rates[0]));
+	for(int i = 0; i <= count; i++)
+	{
+		//last run goes back to 48 kHz on a shorter ring
+		int freq = i < count ? rates[i] : 48000;
+		if(i == count && (!device.SetDACTransferConfig(4, 8) || !device.SetADCTransferConfig(4, 8)))
+		{
+			printf("  can't set 4 x 8 packet ring FAILED\n");
+			failed = TRUE;
+			break;
+		}
+		StreamResult result;
+		if(!Stream(sim, device, &ramp, freq, result))
+		{
+			printf("  %6d: FAILED to start (%08X)\n", freq, device.GetErrorCode());
+			failed = TRUE;
+			continue;
+		}
+		PrintStream(freq, result);
+		printf(" allocations %d/%d", result.dac.allocations, result.adc.allocations);
+		bool rateFailed = StreamFailed(result, freq, 100., &ramp);
+		if(result.dac.allocations != 1 || result.adc.allocations != 1)
+			rateFailed = TRUE;
+		printf("%s\n", rateFailed ? " FAILED" : "");
+		failed |= rateFailed;
+	}
+	return !failed;
+}
+
+//latency against CPU load: ring depth x packets per transfer at 96 kHz with input, each
+//configuration with a thread per pipe and with the single service thread.
+//It's a table, shallow rings are expected to glitch (underruns column). Fails only if
+//a configuration is refused or the 128 packet limit of the transport (as usbfs) isn't
+//checked when the ring is configured
+bool TestTransfers()
+{
+	static const int modes[] = {SchedulerThreadPerEndpoint, SchedulerSingleThread};
+	static const char* modeNames[] = {"per pipe", "single"};
+	static const int depths[] = {1, 2, 4, 8};
+	static const int packets[] = {8, 16, 32, 64, 128};
+	int freq = 96000;
+
+	SimDeviceConfig config;
+	config.maxIsoPackets = 128;
+	config.realTime = s_realTime;
+	SimTransport sim(config);
+	USBAudioDevice device(TRUE, &sim);
+	if(!device.InitDevice())
+	{
+		printf("  InitDevice failed (%08X)\n", device.GetErrorCode());
+		return FALSE;
+	}
+	RampCheck ramp;
+	ramp.Init(config.inputChannels, config.subslotSize, config.bitResolution);
+
+	bool failed = FALSE;
+	if(device.SetDACTransferConfig(2, 256) || device.SetADCTransferConfig(2, 256))
+	{
+		printf("  256 packets per transfer accepted, transport limit is 128 FAILED\n");
+		failed = TRUE;
+	}
+
+	printf("  transfers packets  latency ms  scheduler  wakeups/s  resubmit us  cpu %%  underruns\n");
+	for(int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); d++)
+		for(int p = 0; p < (int)(sizeof(packets) / sizeof(packets[0])); p++)
+			for(int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+			{
+				if(!device.SetSchedulerMode(modes[m]) ||
+					!device.SetDACTransferConfig(depths[d], packets[p]) || !device.SetADCTransferConfig(depths[d], packets[p]))
+				{
+					printf("  %9d %7d  %-10s  can't configure FAILED\n", depths[d], packets[p], modeNames[m]);
+					failed = TRUE;
+					continue;
+				}
+				StreamResult result;
+				if(!Stream(sim, device, &ramp, freq, result))
+				{
+					printf("  %9d %7d  %-10s  FAILED to start (%08X)\n", depths[d], packets[p], modeNames[m], device.GetErrorCode());
+					failed = TRUE;
+					continue;
+				}
+				printf("  %9d %7d  %10.2f  %-9s  %9.0f  %11.1f  %5.1f  %9u\n", depths[d], packets[p], device.GetDACQueuedTime() / 1000.,
+					modeNames[m], WakeupsPerSecond(result), result.resubmitTime, result.cpuSeconds * 100. / result.busSeconds,
+					result.sim.underruns);
+			}
+	return !failed;
+}
+
+struct Scenario
+{
+	const char*	name;
+	bool		(*run)();
+	const char*	description;
+};
+
+static const Scenario s_scenarios[] =
+{
+	{"rates",			TestRates,				"every rate at high speed with input, device clock +150 ppm"},
+	{"explicit",		TestExplicitFeedback,	"every rate at high speed, explicit feedback, device clock -250 ppm"},
+	{"fullspeed",		TestFullSpeed,			"44.1, 48 and 96 kHz on a full speed device, implicit and explicit feedback"},
+	{"singlethread",	TestSingleThread,		"every rate on one service thread for all pipes against a thread per pipe"},
+	{"noframe",			TestNoFrameNumber,		"transport without frame numbers, streams ASAP after the first request"},
+	{"highband",		TestHighBandwidth,		"high bandwidth endpoints with 2 and 3 transactions per microframe, reserved value refused"},
+	{"implicit",		TestImplicitFeedback,	"FIFO excursion at the device with raw and filtered implicit feedback"},
+	{"recovery",		TestRecovery,			"failed output transfers restart the pipe in place, the host isn't notified"},
+	{"counters",		TestCounters,			"endpoint packet, byte and rate counters against injected errors and short input packets"},
+	{"scatter",			TestScatter,			"8 ch 192 kHz input with short and empty packets, scatter callback against the compacted buffer"},
+	{"alloc",			TestAllocations,		"rate changes and a shorter ring reuse the buffer arena of each endpoint"},
+	{"transfers",		TestTransfers,			"latency and CPU load for ring depth x packets per transfer, usbfs limit"},
+};
+
+#define SCENARIO_COUNT	(int)(sizeof(s_scenarios) / sizeof(s_scenarios[0]))
+
+void Usage()
+{
+	printf("usage: simtest [-rt] [-t seconds] [scenario ...]\n");
+	printf("  -rt  bus time follows the wall clock\n");
+	for(int i = 0; i < SCENARIO_COUNT; i++)
+		printf("  %-14s %s\n", s_scenarios[i].name, s_scenarios[i].description);
+}
+
+int main(int argc, char* argv[])
+{
+	bool selected[SCENARIO_COUNT];
+	bool any = FALSE;
+	memset(selected, 0, sizeof(selected));
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-rt"))
+			s_realTime = TRUE;
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+			s_seconds = atoi(argv[++i]);
+		else
+		{
+			int s = 0;
+			while(s < SCENARIO_COUNT && strcmp(argv[i], s_scenarios[s].name))
+				s++;
+			if(s == SCENARIO_COUNT)
+			{
+				Usage();
+				return 2;
+			}
+			selected[s] = TRUE;
+			any = TRUE;
+		}
+	}
+	if(s_seconds <= 0)
+	{
+		Usage();
+		return 2;
+	}
+
+	int failures = 0;
+	for(int s = 0; s < SCENARIO_COUNT; s++)
+	{
+		if(any && !selected[s])
+			continue;
+		printf("%s: %s\n", s_scenarios[s].name, s_scenarios[s].description);
+		bool passed = s_scenarios[s].run();
+		printf("%s: %s\n", s_scenarios[s].name, passed ? "passed" : "FAILED");
+		if(!passed)
+			failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,860 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Tests of the driver sample kernels (Driver/samplekernels.cpp): conversion between planar ASIO
+// buffers and interleaved USB frames. The portable kernels and the ones dispatched for the running
+// CPU are checked against per frame reference loops, benchmarks print the time per frame.
+// Exit code is 1 if a test fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "samplekernels.h"
+
+#define MAX_TEST_CHANNELS	35
+#define GUARD_BYTES			16		//past the end of every buffer, must stay untouched
+#define BENCH_BLOCK			128		//frames of one ASIO buffer half
+#define BENCH_RUNS			5		//best of
+
+//deterministic noise for sample data
+static ULONG s_noise = 1;
+
+static UCHAR NoiseByte()
+{
+	s_noise = s_noise * 1103515245 + 12345;
+	return (UCHAR)(s_noise >> 16);
+}
+
+static void FillNoise(void* buffer, int length)
+{
+	for(int i = 0; i < length; i++)
+		((UCHAR*)buffer)[i] = NoiseByte();
+}
+
+double Seconds()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+//portable kernels first, then the dispatched ones if the CPU has better
+static int KernelSets(const SampleKernels** sets)
+{
+	sets[0] = GetScalarSampleKernels();
+	sets[1] = GetSampleKernels();
+	return sets[1] == sets[0] ? 1 : 2;
+}
+
+//host buffers of channelNumber channels, offset + frames samples each, every third one NULL if asked
+static void AllocChannels(char** channels, int channelNumber, int bytes, bool withNull)
+{
+	for(int ch = 0; ch < channelNumber; ch++)
+	{
+		channels[ch] = withNull && ch % 3 == 1 ? NULL : (char*)malloc(bytes + GUARD_BYTES);
+		if(channels[ch])
+			FillNoise(channels[ch], bytes + GUARD_BYTES);
+	}
+}
+
+static void FreeChannels(char** channels, int channelNumber)
+{
+	for(int ch = 0; ch < channelNumber; ch++)
+		free(channels[ch]);
+}
+
+//per frame loops of the old FillOutputData/FillInputData for any channel count: the stop flag
+//is read every frame, 3 byte samples are copied as ThreeByteSample
+static volatile bool s_stopInProgress = FALSE;
+
+struct ThreeByteSample
+{
+	UCHAR sample[3];
+	ThreeByteSample(int val = 0)
+	{
+		UCHAR *ptrVal = (UCHAR *)&val;
+		sample[0] = *(ptrVal);
+		sample[1] = *(ptrVal+1);
+		sample[2] = *(ptrVal+2);
+	}
+};
+
+template <typename T> void FrameInterleave(UCHAR* dst, char** channels, long offset, int channelNumber, int frames)
+{
+	T* sampleBuff = (T*)dst;
+	for(int i = 0; i < frames; i++, sampleBuff += channelNumber)
+	{
+		if(s_stopInProgress)
+			return;
+		for(int ch = 0; ch < channelNumber; ch++)
+			sampleBuff[ch] = channels[ch] ? ((T*)channels[ch])[offset + i] : T();
+	}
+}
+
+template <typename T> void FrameDeinterleave(char** channels, long offset, const UCHAR* src, int channelNumber, int frames)
+{
+	const T* sampleBuff = (const T*)src;
+	for(int i = 0; i < frames; i++, sampleBuff += channelNumber)
+	{
+		if(s_stopInProgress)
+			return;
+		for(int ch = 0; ch < channelNumber; ch++)
+			if(channels[ch])
+				((T*)channels[ch])[offset + i] = sampleBuff[ch];
+	}
+}
+
+static InterleaveKernel FrameInterleaveKernel(int slotSize)
+{
+	return slotSize == 3 ? FrameInterleave<ThreeByteSample> : FrameInterleave<int>;
+}
+
+static DeinterleaveKernel FrameDeinterleaveKernel(int slotSize)
+{
+	return slotSize == 3 ? FrameDeinterleave<ThreeByteSample> : FrameDeinterleave<int>;
+}
+
+static InterleaveKernel Interleave(const SampleKernels* kernels, int slotSize)
+{
+	if(slotSize == 2)
+		return kernels->interleave2;
+	return slotSize == 3 ? kernels->interleave3 : kernels->interleave4;
+}
+
+static DeinterleaveKernel Deinterleave(const SampleKernels* kernels, int slotSize)
+{
+	if(slotSize == 2)
+		return kernels->deinterleave2;
+	return slotSize == 3 ? kernels->deinterleave3 : kernels->deinterleave4;
+}
+
+//interleave of every channel count up to MAX_TEST_CHANNELS, odd frame counts and NULL channels
+//has to give the bytes of the reference loop and nothing past the frames. Deinterleave has to
+//bring the host samples back and leave the rest of the host buffers alone
+bool TestInterleave()
+{
+	static const int frameCounts[] = {0, 1, 2, 3, 5, 8, 13, 64, 67};
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const long offset = 5;
+	int failures = 0, cases = 0;
+
+	for(int slotSize = 3; slotSize <= 4; slotSize++)
+		for(int channelNumber = 1; channelNumber <= MAX_TEST_CHANNELS; channelNumber++)
+			for(int f = 0; f < (int)(sizeof(frameCounts) / sizeof(frameCounts[0])); f++)
+				for(int withNull = 0; withNull < 2; withNull++)
+				{
+					int frames = frameCounts[f];
+					int hostBytes = (offset + frames) * slotSize;
+					int usbBytes = frames * channelNumber * slotSize;
+					char* channels[MAX_TEST_CHANNELS];
+					AllocChannels(channels, channelNumber, hostBytes, withNull != 0);
+					UCHAR* reference = (UCHAR*)malloc(usbBytes + GUARD_BYTES);
+					UCHAR* usb = (UCHAR*)malloc(usbBytes + GUARD_BYTES);
+					memset(reference, 0x55, usbBytes + GUARD_BYTES);
+					FrameInterleaveKernel(slotSize)(reference, channels, offset, channelNumber, frames);
+
+					for(int s = 0; s < setCount; s++)
+					{
+						cases++;
+						memset(usb, 0x55, usbBytes + GUARD_BYTES);
+						Interleave(sets[s], slotSize)(usb, channels, offset, channelNumber, frames);
+						bool failed = memcmp(usb, reference, usbBytes + GUARD_BYTES) != 0;
+
+						char* back[MAX_TEST_CHANNELS];
+						for(int ch = 0; ch < channelNumber; ch++)
+						{
+							back[ch] = channels[ch] ? (char*)calloc(hostBytes + GUARD_BYTES, 1) : NULL;
+						}
+						Deinterleave(sets[s], slotSize)(back, offset, reference, channelNumber, frames);
+						for(int ch = 0; ch < channelNumber; ch++)
+						{
+							if(back[ch] == NULL)
+								continue;
+							if(memcmp(back[ch] + offset * slotSize, channels[ch] + offset * slotSize, frames * slotSize))
+								failed = TRUE;
+							for(int i = 0; i < hostBytes + GUARD_BYTES; i++)
+								if((i < offset * slotSize || i >= hostBytes) && back[ch][i])
+									failed = TRUE;
+						}
+						FreeChannels(back, channelNumber);
+						if(failed)
+						{
+							printf("  %s %d byte, %d ch, %d frames%s: mismatch\n", sets[s]->name, slotSize, channelNumber,
+								frames, withNull ? ", NULL channels" : "");
+							failures++;
+						}
+					}
+					free(reference);
+					free(usb);
+					FreeChannels(channels, channelNumber);
+				}
+	printf("  %d cases, %d failed\n", cases, failures);
+	return failures == 0;
+}
+
+//nanoseconds per frame of one kernel, best of BENCH_RUNS over double buffered ASIO blocks
+static double BenchInterleave(InterleaveKernel kernel, UCHAR* usb, char** channels, int channelNumber, int blocks)
+{
+	double best = 0.;
+	for(int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = Seconds();
+		for(int i = 0; i < blocks; i++)
+			kernel(usb, channels, (i & 1) * BENCH_BLOCK, channelNumber, BENCH_BLOCK);
+		double time = Seconds() - start;
+		if(run == 0 || time < best)
+			best = time;
+	}
+	return best * 1e9 / ((double)blocks * BENCH_BLOCK);
+}
+
+static double BenchDeinterleave(DeinterleaveKernel kernel, char** channels, const UCHAR* usb, int channelNumber, int blocks)
+{
+	double best = 0.;
+	for(int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = Seconds();
+		for(int i = 0; i < blocks; i++)
+			kernel(channels, (i & 1) * BENCH_BLOCK, usb, channelNumber, BENCH_BLOCK);
+		double time = Seconds() - start;
+		if(run == 0 || time < best)
+			best = time;
+	}
+	return best * 1e9 / ((double)blocks * BENCH_BLOCK);
+}
+
+//reference frame loops against the block kernels at 2, 8 and 32 channels
+bool BenchInterleaveKernels()
+{
+	static const int channelCounts[] = {2, 8, 32};
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+
+	for(int slotSize = 3; slotSize <= 4; slotSize++)
+		for(int c = 0; c < (int)(sizeof(channelCounts) / sizeof(channelCounts[0])); c++)
+		{
+			int channelNumber = channelCounts[c];
+			int blocks = 2000000 / (channelNumber * BENCH_BLOCK) + 1;
+			char* channels[32];
+			AllocChannels(channels, channelNumber, 2 * BENCH_BLOCK * slotSize, FALSE);
+			UCHAR* usb = (UCHAR*)malloc(BENCH_BLOCK * channelNumber * slotSize);
+			FillNoise(usb, BENCH_BLOCK * channelNumber * slotSize);
+
+			printf("  %d byte %2d ch out: frame loop %6.2f", slotSize, channelNumber,
+				BenchInterleave(FrameInterleaveKernel(slotSize), usb, channels, channelNumber, blocks));
+			for(int s = 0; s < setCount; s++)
+				printf(", %s %6.2f", sets[s]->name, BenchInterleave(Interleave(sets[s], slotSize), usb, channels, channelNumber, blocks));
+			printf(" ns/frame\n");
+			printf("  %d byte %2d ch in:  frame loop %6.2f", slotSize, channelNumber,
+				BenchDeinterleave(FrameDeinterleaveKernel(slotSize), channels, usb, channelNumber, blocks));
+			for(int s = 0; s < setCount; s++)
+				printf(", %s %6.2f", sets[s]->name, BenchDeinterleave(Deinterleave(sets[s], slotSize), channels, usb, channelNumber, blocks));
+			printf(" ns/frame\n");
+
+			free(usb);
+			FreeChannels(channels, channelNumber);
+		}
+	return TRUE;
+}
+
+//whole samples of bitResolution MSB aligned, as many significant bits as a float holds
+static unsigned int SampleMask(int bitResolution)
+{
+	int lowBits = 32 - (bitResolution < 24 ? bitResolution : 24);
+	return ~((1u << lowBits) - 1);
+}
+
+static int NoiseSample(int bitResolution)
+{
+	unsigned int sample = ((ULONG)NoiseByte() << 24) | ((ULONG)NoiseByte() << 16) | ((ULONG)NoiseByte() << 8) | NoiseByte();
+	return (int)(sample & SampleMask(bitResolution));
+}
+
+static void PutSlot(UCHAR* out, int sample, int slotSize)
+{
+	for(int i = 0; i < slotSize; i++)
+		out[i] = (UCHAR)(sample >> (32 - 8 * slotSize + 8 * i));
+}
+
+static int GetSlot(const UCHAR* in, int slotSize)
+{
+	unsigned int sample = 0;
+	for(int i = 0; i < slotSize; i++)
+		sample |= (unsigned int)in[i] << (32 - 8 * slotSize + 8 * i);
+	return (int)sample;
+}
+
+//undithered path: integer samples through deinterleaveFloat and back through interleaveFloat
+//come out bit exact for every slot size and resolution, full scale included. Kernel sets agree
+//on arbitrary floats except ties, the scalar code rounds them up, SSE2 to even
+bool TestFloat()
+{
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const int channelNumber = 5, frames = 203;
+	int failures = 0;
+
+	for(int s = 0; s < setCount; s++)
+		for(int slotSize = 2; slotSize <= 4; slotSize++)
+			for(int bitResolution = 16; bitResolution <= slotSize * 8; bitResolution += 8)
+			{
+				FloatConverter input, output;
+				input.Init(slotSize, bitResolution, DitherNone, channelNumber);
+				output.Init(slotSize, bitResolution, DitherNone, channelNumber);
+				int usbBytes = channelNumber * frames * slotSize;
+				UCHAR* usb = (UCHAR*)malloc(usbBytes);
+				UCHAR* back = (UCHAR*)malloc(usbBytes);
+				for(int i = 0; i < channelNumber * frames; i++)
+				{
+					int sample = NoiseSample(bitResolution);
+					if(i % 37 == 0)
+						sample = (int)0x80000000;
+					else if(i % 41 == 0)
+						sample = (int)(0x7FFFFFFF & SampleMask(bitResolution));
+					PutSlot(usb + i * slotSize, sample, slotSize);
+				}
+				char* channels[channelNumber];
+				for(int ch = 0; ch < channelNumber; ch++)
+					channels[ch] = (char*)malloc(frames * sizeof(float));
+				sets[s]->deinterleaveFloat(channels, 0, usb, channelNumber, frames, &input);
+				sets[s]->interleaveFloat(back, channels, 0, channelNumber, frames, &output);
+				int mismatches = 0;
+				for(int i = 0; i < channelNumber * frames; i++)
+					if(GetSlot(usb + i * slotSize, slotSize) != GetSlot(back + i * slotSize, slotSize))
+						mismatches++;
+				printf("  %-6s %d byte %2d bits: %d of %d samples differ\n", sets[s]->name, slotSize, bitResolution,
+					mismatches, channelNumber * frames);
+				if(mismatches)
+					failures++;
+				FreeChannels(channels, channelNumber);
+				free(usb);
+				free(back);
+			}
+
+	if(setCount > 1)
+	{
+		float buffers[8][211];
+		char* channels[8];
+		for(int ch = 0; ch < 8; ch++)
+		{
+			for(int f = 0; f < 211; f++)
+				buffers[ch][f] = ((int)NoiseByte() - 128) / 116.f + NoiseByte() / 65536.f;
+			channels[ch] = ch == 3 ? NULL : (char*)buffers[ch];
+		}
+		for(int slotSize = 2; slotSize <= 4; slotSize++)
+		{
+			FloatConverter first, second;
+			first.Init(slotSize, slotSize * 8 > 24 ? 24 : slotSize * 8, DitherNone, 8);
+			second.Init(slotSize, slotSize * 8 > 24 ? 24 : slotSize * 8, DitherNone, 8);
+			UCHAR a[8 * 211 * 4], b[8 * 211 * 4];
+			sets[0]->interleaveFloat(a, channels, 0, 8, 211, &first);
+			sets[1]->interleaveFloat(b, channels, 0, 8, 211, &second);
+			int differences = 0;
+			for(int i = 0; i < 8 * 211; i++)
+			{
+				int shift = 32 - first.bitResolution;
+				int d = (GetSlot(a + i * slotSize, slotSize) >> shift) - (GetSlot(b + i * slotSize, slotSize) >> shift);
+				float scaled = channels[i % 8] ? buffers[i % 8][i / 8] * first.scale : 0.f;
+				if(d != 0 && (d != 1 || scaled - floorf(scaled) != 0.5f))
+					differences++;
+			}
+			printf("  %s against %s, %d byte: %d samples differ\n", sets[1]->name, sets[0]->name, slotSize, differences);
+			if(differences)
+				failures++;
+		}
+	}
+	return failures == 0;
+}
+
+//TPDF dither of 1 channel in 5 frame blocks: 4 frames in SIMD lanes, 1 in the scalar tail. The
+//tail must not reuse the generator state of the lanes, its noise has to be uncorrelated
+bool TestDither()
+{
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const int blocks = 20000;
+	bool failed = FALSE;
+
+	for(int s = 0; s < setCount; s++)
+	{
+		FloatConverter converter;
+		converter.Init(4, 16, DitherTPDF, 1);
+		float in[5] = {0.25f / 32768.f, 0.25f / 32768.f, 0.25f / 32768.f, 0.25f / 32768.f, 0.25f / 32768.f};
+		char* channels[1] = {(char*)in};
+		int out[5];
+		double sum0 = 0., sum4 = 0., sum04 = 0., sq0 = 0., sq4 = 0.;
+		for(int i = 0; i < blocks; i++)
+		{
+			sets[s]->interleaveFloat((UCHAR*)out, channels, 0, 1, 5, &converter);
+			double e0 = (out[0] >> 16) - 0.25, e4 = (out[4] >> 16) - 0.25;
+			sum0 += e0;
+			sum4 += e4;
+			sum04 += e0 * e4;
+			sq0 += e0 * e0;
+			sq4 += e4 * e4;
+		}
+		double mean0 = sum0 / blocks, mean4 = sum4 / blocks;
+		double correlation = (sum04 / blocks - mean0 * mean4) /
+			sqrt((sq0 / blocks - mean0 * mean0) * (sq4 / blocks - mean4 * mean4));
+		printf("  %-6s mean error %+.4f LSB, lane/tail correlation %+.3f\n", sets[s]->name, mean4, correlation);
+		if(fabs(correlation) > 0.05 || fabs(mean0) > 0.05 || fabs(mean4) > 0.05)
+			failed = TRUE;
+	}
+	return !failed;
+}
+
+static double BenchFloat(const SampleKernels* kernels, bool input, FloatConverter* converter, UCHAR* usb, char** channels,
+	int channelNumber, int blocks)
+{
+	double best = 0.;
+	for(int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = Seconds();
+		for(int i = 0; i < blocks; i++)
+		{
+			if(input)
+				kernels->deinterleaveFloat(channels, (i & 1) * BENCH_BLOCK, usb, channelNumber, BENCH_BLOCK, converter);
+			else
+				kernels->interleaveFloat(usb, channels, (i & 1) * BENCH_BLOCK, channelNumber, BENCH_BLOCK, converter);
+		}
+		double time = Seconds() - start;
+		if(run == 0 || time < best)
+			best = time;
+	}
+	return best * 1e9 / ((double)blocks * BENCH_BLOCK);
+}
+
+//float conversion cost for every dither and the input direction at 2, 8 and 32 channels
+bool BenchFloatKernels()
+{
+	static const int channelCounts[] = {2, 8, 32};
+	static const char* names[] = {"none", "TPDF", "shaped"};
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+
+	for(int slotSize = 3; slotSize <= 4; slotSize++)
+		for(int c = 0; c < (int)(sizeof(channelCounts) / sizeof(channelCounts[0])); c++)
+		{
+			int channelNumber = channelCounts[c];
+			int blocks = 2000000 / (channelNumber * BENCH_BLOCK) + 1;
+			char* channels[32];
+			for(int ch = 0; ch < channelNumber; ch++)
+			{
+				channels[ch] = (char*)malloc(2 * BENCH_BLOCK * sizeof(float));
+				for(int f = 0; f < 2 * BENCH_BLOCK; f++)
+					((float*)channels[ch])[f] = 0.5f * (float)sin(f * 0.01 + ch);
+			}
+			UCHAR* usb = (UCHAR*)malloc(BENCH_BLOCK * channelNumber * slotSize);
+			for(int s = 0; s < setCount; s++)
+			{
+				printf("  %d byte %2d ch %-6s out:", slotSize, channelNumber, sets[s]->name);
+				for(int dither = DitherNone; dither <= DitherNoiseShaped; dither++)
+				{
+					FloatConverter converter;
+					converter.Init(slotSize, 24, dither, channelNumber);
+					printf(" %s %6.2f", names[dither], BenchFloat(sets[s], FALSE, &converter, usb, channels, channelNumber, blocks));
+				}
+				FloatConverter converter;
+				converter.Init(slotSize, 24, DitherNone, channelNumber);
+				printf(", in %6.2f ns/frame\n", BenchFloat(sets[s], TRUE, &converter, usb, channels, channelNumber, blocks));
+			}
+			free(usb);
+			FreeChannels(channels, channelNumber);
+		}
+	return TRUE;
+}
+
+//integer and IEEE float host types of the driver with their slot size and Int32LSBxx shift
+static const struct
+{
+	const char*	name;
+	int			slotSize;
+	int			shift;
+	bool		ieeeFloat;
+} s_hostFormats[] =
+{
+	{"Int16LSB", 2, 0, FALSE},
+	{"Int24LSB", 3, 0, FALSE},
+	{"Int32LSB16", 4, 16, FALSE},
+	{"Int32LSB18", 4, 14, FALSE},
+	{"Int32LSB20", 4, 12, FALSE},
+	{"Int32LSB24", 4, 8, FALSE},
+	{"Int32LSB", 4, 0, FALSE},
+	{"Float32LSB", 4, 0, TRUE}
+};
+
+//host sample of a format in the low slotSize bytes, LSB justified for Int32LSBxx
+static int HostSample(int f)
+{
+	if(s_hostFormats[f].ieeeFloat)
+	{
+		float value = ((int)NoiseByte() - 128) / 128.f + NoiseByte() / 32768.f;
+		int sample;
+		memcpy(&sample, &value, sizeof(sample));
+		return sample;
+	}
+	unsigned int sample = ((ULONG)NoiseByte() << 24) | ((ULONG)NoiseByte() << 16) | ((ULONG)NoiseByte() << 8) | NoiseByte();
+	return (int)sample >> (32 - 8 * s_hostFormats[f].slotSize + s_hostFormats[f].shift);
+}
+
+//output and input path of the driver for every host format: interleave then justifyLeft, deinterleave
+//then justifyRight of each channel. USB slots have to hold the host sample shifted to the MSB, the
+//host buffers get back the sign extended top bits and nothing outside the block
+bool TestFormats()
+{
+	static const int frameCounts[] = {0, 1, 3, 4, 5, 7, 8, 15, 16, 17, 64};
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const long offset = 3;
+	int failures = 0, cases = 0;
+
+	for(int f = 0; f < (int)(sizeof(s_hostFormats) / sizeof(s_hostFormats[0])); f++)
+		for(int s = 0; s < setCount; s++)
+		{
+			int slotSize = s_hostFormats[f].slotSize, shift = s_hostFormats[f].shift;
+			int failed = 0;
+			for(int channelNumber = 1; channelNumber <= 9; channelNumber++)
+				for(int n = 0; n < (int)(sizeof(frameCounts) / sizeof(frameCounts[0])); n++)
+					for(int withNull = 0; withNull < 2; withNull++)
+					{
+						int frames = frameCounts[n];
+						int hostBytes = (offset + frames) * slotSize;
+						int usbBytes = frames * channelNumber * slotSize;
+						char* channels[9];
+						AllocChannels(channels, channelNumber, hostBytes, withNull != 0);
+						for(int ch = 0; ch < channelNumber; ch++)
+							for(int i = 0; channels[ch] && i < frames; i++)
+							{
+								int sample = HostSample(f);
+								memcpy(channels[ch] + (offset + i) * slotSize, &sample, slotSize);
+							}
+
+						UCHAR* usb = (UCHAR*)malloc(usbBytes + GUARD_BYTES);
+						memset(usb, 0x55, usbBytes + GUARD_BYTES);
+						Interleave(sets[s], slotSize)(usb, channels, offset, channelNumber, frames);
+						if(shift)
+							sets[s]->justifyLeft((int*)usb, frames * channelNumber, shift);
+						bool mismatch = FALSE;
+						for(int i = 0; i < frames; i++)
+							for(int ch = 0; ch < channelNumber; ch++)
+							{
+								int sample = 0;
+								if(channels[ch])
+									memcpy(&sample, channels[ch] + (offset + i) * slotSize, slotSize);
+								sample = (int)((unsigned int)sample << shift);
+								if(memcmp(usb + (i * channelNumber + ch) * slotSize, &sample, slotSize))
+									mismatch = TRUE;
+							}
+						for(int i = 0; i < GUARD_BYTES; i++)
+							if(usb[usbBytes + i] != 0x55)
+								mismatch = TRUE;
+
+						FillNoise(usb, usbBytes);
+						char* back[9];
+						for(int ch = 0; ch < channelNumber; ch++)
+							back[ch] = channels[ch] ? (char*)calloc(hostBytes + GUARD_BYTES, 1) : NULL;
+						Deinterleave(sets[s], slotSize)(back, offset, usb, channelNumber, frames);
+						if(shift)
+							for(int ch = 0; ch < channelNumber; ch++)
+								if(back[ch])
+									sets[s]->justifyRight((int*)back[ch] + offset, frames, shift);
+						for(int ch = 0; ch < channelNumber; ch++)
+						{
+							if(back[ch] == NULL)
+								continue;
+							for(int i = 0; i < frames; i++)
+							{
+								int sample = 0;
+								memcpy(&sample, usb + (i * channelNumber + ch) * slotSize, slotSize);
+								sample >>= shift;
+								if(memcmp(back[ch] + (offset + i) * slotSize, &sample, slotSize))
+									mismatch = TRUE;
+							}
+							for(int i = 0; i < hostBytes + GUARD_BYTES; i++)
+								if((i < offset * slotSize || i >= hostBytes) && back[ch][i])
+									mismatch = TRUE;
+						}
+						FreeChannels(back, channelNumber);
+
+						cases++;
+						if(mismatch)
+						{
+							if(failed < 4)
+								printf("  %s %s, %d ch, %d frames%s: mismatch\n", sets[s]->name, s_hostFormats[f].name,
+									channelNumber, frames, withNull ? ", NULL channels" : "");
+							failed++;
+						}
+						free(usb);
+						FreeChannels(channels, channelNumber);
+					}
+			failures += failed;
+		}
+	printf("  %d cases, %d failed\n", cases, failures);
+	return failures == 0;
+}
+
+//every fixed profile of a kernel set against the generic kernel of its slot size: same bytes
+//for every frame count of a transfer, with and without NULL channels
+bool TestFixed()
+{
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const long offset = 5;
+	int failures = 0, cases = 0;
+
+	for(int s = 0; s < setCount; s++)
+		for(const FixedKernels* fixed = sets[s]->fixed; fixed->slotSize; fixed++)
+		{
+			int slotSize = fixed->slotSize, channelNumber = fixed->channelNumber;
+			if(GetInterleaveKernel(sets[s], slotSize, channelNumber) != fixed->interleave ||
+				GetDeinterleaveKernel(sets[s], slotSize, channelNumber) != fixed->deinterleave)
+			{
+				printf("  %s %d byte, %d ch: fixed kernels not selected\n", sets[s]->name, slotSize, channelNumber);
+				failures++;
+			}
+			for(int frames = 0; frames < 70; frames++)
+				for(int withNull = 0; withNull < 2; withNull++)
+				{
+					int hostBytes = (offset + frames) * slotSize;
+					int usbBytes = frames * channelNumber * slotSize;
+					char* channels[MAX_TEST_CHANNELS];
+					AllocChannels(channels, channelNumber, hostBytes, withNull != 0);
+					UCHAR* reference = (UCHAR*)malloc(usbBytes + GUARD_BYTES);
+					UCHAR* usb = (UCHAR*)malloc(usbBytes + GUARD_BYTES);
+					memset(reference, 0x55, usbBytes + GUARD_BYTES);
+					memset(usb, 0x55, usbBytes + GUARD_BYTES);
+					Interleave(sets[s], slotSize)(reference, channels, offset, channelNumber, frames);
+					fixed->interleave(usb, channels, offset, channelNumber, frames);
+					bool failed = memcmp(usb, reference, usbBytes + GUARD_BYTES) != 0;
+
+					char* generic[MAX_TEST_CHANNELS];
+					char* back[MAX_TEST_CHANNELS];
+					for(int ch = 0; ch < channelNumber; ch++)
+					{
+						generic[ch] = channels[ch] ? (char*)calloc(hostBytes + GUARD_BYTES, 1) : NULL;
+						back[ch] = channels[ch] ? (char*)calloc(hostBytes + GUARD_BYTES, 1) : NULL;
+					}
+					Deinterleave(sets[s], slotSize)(generic, offset, reference, channelNumber, frames);
+					fixed->deinterleave(back, offset, reference, channelNumber, frames);
+					for(int ch = 0; ch < channelNumber; ch++)
+						if(back[ch] && memcmp(back[ch], generic[ch], hostBytes + GUARD_BYTES))
+							failed = TRUE;
+					FreeChannels(generic, channelNumber);
+					FreeChannels(back, channelNumber);
+
+					cases++;
+					if(failed)
+					{
+						printf("  %s fixed %d byte, %d ch, %d frames%s: mismatch\n", sets[s]->name, slotSize, channelNumber,
+							frames, withNull ? ", NULL channels" : "");
+						failures++;
+					}
+					free(reference);
+					free(usb);
+					FreeChannels(channels, channelNumber);
+				}
+		}
+	printf("  %d cases, %d failed\n", cases, failures);
+	return failures == 0;
+}
+
+//nanoseconds per frame of one transfer, best of BENCH_RUNS
+static double BenchTransfer(InterleaveKernel interleave, DeinterleaveKernel deinterleave, UCHAR* usb, char** channels,
+	int channelNumber, int frames, int transfers)
+{
+	double best = 0.;
+	for(int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = Seconds();
+		for(int i = 0; i < transfers; i++)
+		{
+			if(interleave)
+				interleave(usb, channels, 0, channelNumber, frames);
+			else
+				deinterleave(channels, 0, usb, channelNumber, frames);
+		}
+		double time = Seconds() - start;
+		if(run == 0 || time < best)
+			best = time;
+	}
+	return best * 1e9 / ((double)transfers * frames);
+}
+
+//generic and fixed kernels of every profile at 6, 48 and 384 frames per call: one full speed
+//packet, one high speed transfer of 8 microframes at 48 kHz and the same at 384 kHz
+bool BenchFixedKernels()
+{
+	static const int transferFrames[] = {6, 48, 384};
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+
+	for(int s = 0; s < setCount; s++)
+		for(const FixedKernels* fixed = sets[s]->fixed; fixed->slotSize; fixed++)
+			for(int t = 0; t < (int)(sizeof(transferFrames) / sizeof(transferFrames[0])); t++)
+			{
+				int slotSize = fixed->slotSize, channelNumber = fixed->channelNumber, frames = transferFrames[t];
+				int transfers = 2000000 / (channelNumber * frames) + 1;
+				char* channels[MAX_TEST_CHANNELS];
+				AllocChannels(channels, channelNumber, frames * slotSize, FALSE);
+				UCHAR* usb = (UCHAR*)malloc(frames * channelNumber * slotSize);
+				FillNoise(usb, frames * channelNumber * slotSize);
+
+				printf("  %-6s %d byte %d ch %3d frames: out generic %6.2f fixed %6.2f, in generic %6.2f fixed %6.2f ns/frame\n",
+					sets[s]->name, slotSize, channelNumber, frames,
+					BenchTransfer(Interleave(sets[s], slotSize), NULL, usb, channels, channelNumber, frames, transfers),
+					BenchTransfer(fixed->interleave, NULL, usb, channels, channelNumber, frames, transfers),
+					BenchTransfer(NULL, Deinterleave(sets[s], slotSize), usb, channels, channelNumber, frames, transfers),
+					BenchTransfer(NULL, fixed->deinterleave, usb, channels, channelNumber, frames, transfers));
+
+				free(usb);
+				FreeChannels(channels, channelNumber);
+			}
+	return TRUE;
+}
+
+//DoP stream cut into transfers of changing length: the marker has to alternate across every call,
+//DSD bytes go to the middle and high byte below it, NULL channels carry the idle pattern
+bool TestDoP()
+{
+	static const int transferFrames[] = {6, 6, 7, 1, 5, 6, 2, 8, 3, 6, 4, 13, 0, 9};
+	const int transferCount = sizeof(transferFrames) / sizeof(transferFrames[0]);
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	const long offset = 5;
+	int failures = 0, cases = 0;
+
+	int frames = 0;
+	for(int t = 0; t < transferCount; t++)
+		frames += transferFrames[t];
+
+	for(int s = 0; s < setCount; s++)
+		for(int slotSize = 3; slotSize <= 4; slotSize++)
+			for(int channelNumber = 1; channelNumber <= 8; channelNumber++)
+				for(int withNull = 0; withNull < 2; withNull++)
+				{
+					DopKernel pack = slotSize == 3 ? sets[s]->packDoP3 : sets[s]->packDoP4;
+					int stride = channelNumber * slotSize;
+					char* channels[8];
+					AllocChannels(channels, channelNumber, (offset + frames) * 2, withNull != 0);
+					UCHAR* usb = (UCHAR*)malloc(frames * stride + GUARD_BYTES);
+					memset(usb, 0x55, frames * stride + GUARD_BYTES);
+
+					UCHAR marker = DOP_MARKER;
+					int pos = 0;
+					for(int t = 0; t < transferCount; t++)
+					{
+						pack(usb + pos * stride, channels, offset + pos, channelNumber, transferFrames[t], &marker);
+						pos += transferFrames[t];
+					}
+
+					bool failed = marker != ((frames & 1) ? (UCHAR)~DOP_MARKER : DOP_MARKER);
+					int low = slotSize - 3;
+					for(int f = 0; f < frames; f++)
+						for(int ch = 0; ch < channelNumber; ch++)
+						{
+							const UCHAR* out = usb + f * stride + ch * slotSize;
+							const UCHAR* in = channels[ch] ? (const UCHAR*)channels[ch] + (offset + f) * 2 : NULL;
+							UCHAR expected = (f & 1) ? (UCHAR)~DOP_MARKER : DOP_MARKER;
+							if(out[low + 2] != expected || (low && out[0] != 0) ||
+								out[low] != (in ? in[1] : DSD_SILENCE) || out[low + 1] != (in ? in[0] : DSD_SILENCE))
+								failed = TRUE;
+						}
+					for(int i = 0; i < GUARD_BYTES; i++)
+						if(usb[frames * stride + i] != 0x55)
+							failed = TRUE;
+
+					cases++;
+					if(failed)
+					{
+						printf("  %s %d byte, %d ch%s: mismatch\n", sets[s]->name, slotSize, channelNumber,
+							withNull ? ", NULL channels" : "");
+						failures++;
+					}
+					free(usb);
+					FreeChannels(channels, channelNumber);
+				}
+	printf("  %d cases, %d failed\n", cases, failures);
+	return failures == 0;
+}
+
+struct Test
+{
+	const char*	name;
+	bool		(*run)();
+	const char*	description;
+};
+
+static const Test s_tests[] =
+{
+	{"interleave",		TestInterleave,			"3 and 4 byte interleave/deinterleave against the frame loop, 1..35 channels"},
+	{"interleavebench",	BenchInterleaveKernels,	"frame loop and block kernels at 2, 8 and 32 channels, ns per frame"},
+	{"float",			TestFloat,				"undithered float conversion bit exact for 2, 3 and 4 byte slots, kernel sets agree"},
+	{"dither",			TestDither,				"TPDF dither of the SIMD lanes and the scalar tail is unbiased and uncorrelated"},
+	{"floatbench",		BenchFloatKernels,		"float conversion per dither type at 2, 8 and 32 channels, ns per frame"},
+	{"formats",			TestFormats,			"output and input path of every integer and IEEE float host type, Int32LSBxx justify"},
+	{"fixed",			TestFixed,				"fixed profile kernels give the bytes of the generic kernels, 0..69 frames"},
+	{"fixedbench",		BenchFixedKernels,		"generic and fixed profile kernels at 6, 48 and 384 frames per transfer, ns per frame"},
+	{"dop",				TestDoP,				"DoP marker continuity across transfers of changing length, 3 and 4 byte slots"},
+};
+
+#define TEST_COUNT	(int)(sizeof(s_tests) / sizeof(s_tests[0]))
+
+void Usage()
+{
+	printf("usage: kerneltest [test ...]\n");
+	for(int i = 0; i < TEST_COUNT; i++)
+		printf("  %-16s %s\n", s_tests[i].name, s_tests[i].description);
+}
+
+int main(int argc, char* argv[])
+{
+	bool selected[TEST_COUNT];
+	bool any = FALSE;
+	memset(selected, 0, sizeof(selected));
+
+	for(int i = 1; i < argc; i++)
+	{
+		int t = 0;
+		while(t < TEST_COUNT && strcmp(argv[i], s_tests[t].name))
+			t++;
+		if(t == TEST_COUNT)
+		{
+			Usage();
+			return 2;
+		}
+		selected[t] = TRUE;
+		any = TRUE;
+	}
+
+	const SampleKernels* sets[2];
+	int setCount = KernelSets(sets);
+	printf("kernels: %s%s%s\n", sets[0]->name, setCount > 1 ? ", " : "", setCount > 1 ? sets[1]->name : "");
+
+	int failures = 0;
+	for(int t = 0; t < TEST_COUNT; t++)
+	{
+		if(any && !selected[t])
+			continue;
+		printf("%s: %s\n", s_tests[t].name, s_tests[t].description);
+		bool passed = s_tests[t].run();
+		printf("%s: %s\n", s_tests[t].name, passed ? "passed" : "FAILED");
+		if(!passed)
+			failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,721 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+// Unit tests of the uaclib parts that are plain arithmetic or parsing and need no device:
+// packet scheduler, feedback decoder, descriptor parser and format selection. Input is synthetic or recorded, every run gives the same result.
+// Exit code is 1 if a test fails.
+
+#include "USBAudioDevice.h"
+
+#ifdef _ENABLE_TRACE
+
+void debugPrintf(const char *szFormat, ...)
+{
+	va_list argptr;
+	va_start(argptr, szFormat);
+	vprintf(szFormat, argptr);
+	va_end(argptr);
+}
+#endif
+
+#define SCHEDULER_HOURS		24		//simulated bus time of one scheduler run
+#define SCHEDULER_PHASE		1000	//packets between feedback changes
+
+//one stream of SCHEDULER_HOURS: feedback cycles through nominal (0), the nominal 16.16 value and
+//two off nominal values. Sent samples are compared with the exact integral of the commanded rate
+//after every packet, the difference has to stay within one sample (floor of the integral)
+static bool RunScheduler(int freq, int packetsPerSecond)
+{
+	PacketScheduler scheduler;
+	scheduler.Init(freq, packetsPerSecond);
+	ULONG nominal = scheduler.GetNominalFeedback();
+	ULONG feedback[4] = {0, nominal, nominal + 37, nominal - 1};
+
+	//commanded rate in 1/unit samples per packet, unit = nominal den * 65536
+	ULONG gcd = freq, b = packetsPerSecond;
+	while(b != 0)
+	{
+		ULONG t = gcd % b;
+		gcd = b;
+		b = t;
+	}
+	ULONGLONG nominalNum = freq / gcd, nominalDen = packetsPerSecond / gcd;
+	ULONGLONG unit = nominalDen << 16;
+
+	ULONGLONG packets = (ULONGLONG)packetsPerSecond * 3600 * SCHEDULER_HOURS;
+	ULONGLONG sent = 0, exact = 0;
+	for(ULONGLONG i = 0; i < packets; i++)
+	{
+		int phase = (int)((i / SCHEDULER_PHASE) % 4);
+		if(i % SCHEDULER_PHASE == 0)
+			scheduler.SetFeedback(feedback[phase]);
+		exact += feedback[phase] == 0 || feedback[phase] == nominal ? nominalNum << 16 : feedback[phase] * nominalDen;
+		sent += scheduler.NextPacket();
+		if(sent * unit > exact || exact - sent * unit >= unit)
+		{
+			printf("  %6d Hz %4d packets/s: packet %llu sent %llu samples, exact %.4f\n", freq, packetsPerSecond,
+				i, sent, (double)exact / unit);
+			return FALSE;
+		}
+	}
+	printf("  %6d Hz %4d packets/s: %llu samples in %d h, exact %.4f\n", freq, packetsPerSecond,
+		sent, SCHEDULER_HOURS, (double)exact / unit);
+	return TRUE;
+}
+
+bool TestScheduler()
+{
+	//44.1 kHz family has a 80 (high speed) or 10 (full speed) packet pattern, 48 kHz family an integer rate
+	static const int runs[][2] = {{44100, 8000}, {48000, 1000}, {88200, 4000}, {11025, 8000}};
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(runs) / sizeof(runs[0])); i++)
+		if(!RunScheduler(runs[i][0], runs[i][1]))
+			failed = TRUE;
+	return !failed;
+}
+
+//deterministic noise for synthetic traces
+static ULONG s_noise = 1;
+
+static int Noise(int range)
+{
+	s_noise = s_noise * 1103515245 + 12345;
+	return (int)((s_noise >> 16) % (2 * range + 1)) - range;
+}
+
+static void PutValue(UCHAR* value, ULONG raw)
+{
+	value[0] = (UCHAR)raw;
+	value[1] = (UCHAR)(raw >> 8);
+	value[2] = (UCHAR)(raw >> 16);
+	value[3] = (UCHAR)(raw >> 24);
+}
+
+static double Ppm(double rate, double reference)
+{
+	return (rate / reference - 1.) * 1e6;
+}
+
+#define FEEDBACK_SECONDS	20		//synthetic trace length
+
+//one device: feedback format as the firmware sends it
+struct FeedbackCase
+{
+	const char*	name;
+	bool		highSpeed;
+	int			valueSize;
+	int			fractionBits;	//binary point the firmware uses
+	int			perMicroframe;	//value is per microframe (1) or per 1 ms frame (0)
+	int			nominalRate;
+};
+
+//synthetic trace of a device 120 ppm fast, the firmware dithers the value by one 10.14 step.
+//The decoder has to find the binary point and settle within 1 ppm of the rate the truncated
+//value stands for
+static bool RunFeedbackFormat(const FeedbackCase& c)
+{
+	int updateRate = c.highSpeed ? 8000 : 1000;
+	double unitsPerSecond = c.perMicroframe ? 8000. : 1000.;
+	ULONG value = (ULONG)(c.nominalRate * (1. + 120e-6) / unitsPerSecond * (double)(1 << c.fractionBits));
+	double deviceRate = value * unitsPerSecond / (double)(1 << c.fractionBits);
+
+	FeedbackDecoder decoder;
+	decoder.Init(c.valueSize, c.highSpeed, updateRate, c.nominalRate);
+	s_noise = 1;
+	double worst = 0.;
+	for(int i = 0; i < updateRate * FEEDBACK_SECONDS; i++)
+	{
+		UCHAR raw[4];
+		PutValue(raw, value + Noise(1) * (1 << (c.fractionBits - 14)));
+		decoder.AddValue(raw);
+		if(i >= updateRate * FEEDBACK_SECONDS / 2 && fabs(Ppm(decoder.GetRate(), deviceRate)) > worst)
+			worst = fabs(Ppm(decoder.GetRate(), deviceRate));
+	}
+	printf("  %-28s rate %.3f (%+.3f ppm), max error in the second half %.3f ppm\n", c.name, decoder.GetRate(),
+		Ppm(decoder.GetRate(), deviceRate), worst);
+	return decoder.IsValid() && worst < 1.;
+}
+
+bool TestFeedbackFormats()
+{
+	static const FeedbackCase cases[] =
+	{
+		{"high speed 16.16",			TRUE,	4, 16, 1, 44100},
+		{"high speed 15.17 firmware",	TRUE,	4, 17, 1, 192000},
+		{"high speed value per frame",	TRUE,	4, 16, 0, 48000},
+		{"full speed 10.14",			FALSE,	3, 14, 0, 48000},
+		{"full speed 16.16",			FALSE,	4, 16, 0, 96000},
+		{"full speed 10.14 in 4 bytes",	FALSE,	4, 14, 0, 44100},
+	};
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+		if(!RunFeedbackFormat(cases[i]))
+			failed = TRUE;
+
+	//no binary point within 4 bits gives a rate near the nominal one: the value is never used
+	FeedbackDecoder decoder;
+	decoder.Init(4, TRUE, 8000, 48000.);
+	UCHAR raw[4];
+	PutValue(raw, (6 << 16) >> 6);
+	for(int i = 0; i < 100; i++)
+		decoder.AddValue(raw);
+	printf("  %-28s %s\n", "6 bits off", decoder.IsValid() ? "accepted" : "ignored");
+	if(decoder.IsValid())
+		failed = TRUE;
+	return !failed;
+}
+
+//single bad values are rejected and don't move the estimate, a lasting rate step is taken over
+//after FEEDBACK_MAX_OUTLIERS values, steps within FEEDBACK_OUTLIER_RATIO go through the loop
+bool TestFeedbackOutliers()
+{
+	const double rate = 48000. * (1. - 80e-6);
+	const ULONG value = (ULONG)(rate / 8000. * 65536. + 0.5);
+	FeedbackDecoder decoder;
+	decoder.Init(4, TRUE, 8000, 48000.);
+	UCHAR raw[4];
+	bool failed = FALSE;
+
+	//1 s settled, then a 2% spike every 997 values
+	PutValue(raw, value);
+	for(int i = 0; i < 8000; i++)
+		decoder.AddValue(raw);
+	double settled = decoder.GetRate();
+	ULONG spikes = 0;
+	for(int i = 1; i <= 8000 * 5; i++)
+	{
+		PutValue(raw, i % 997 == 0 ? value + value / 50 : value);
+		if(i % 997 == 0)
+			spikes++;
+		decoder.AddValue(raw);
+	}
+	printf("  spikes: %u of %u rejected, rate moved %.4f ppm\n", decoder.GetRejectedCount(), spikes, Ppm(decoder.GetRate(), settled));
+	if(decoder.GetRejectedCount() != spikes || fabs(Ppm(decoder.GetRate(), settled)) > 0.01)
+		failed = TRUE;
+
+	//FEEDBACK_MAX_OUTLIERS - 1 values of a 1% step and back: all rejected, no re-acquisition
+	ULONG rejected = decoder.GetRejectedCount();
+	PutValue(raw, value + value / 100);
+	for(int i = 0; i < FEEDBACK_MAX_OUTLIERS - 1; i++)
+		decoder.AddValue(raw);
+	PutValue(raw, value);
+	decoder.AddValue(raw);
+	printf("  short step: %u rejected, rate moved %.4f ppm\n", decoder.GetRejectedCount() - rejected, Ppm(decoder.GetRate(), settled));
+	if(decoder.GetRejectedCount() - rejected != FEEDBACK_MAX_OUTLIERS - 1 || fabs(Ppm(decoder.GetRate(), settled)) > 0.01)
+		failed = TRUE;
+
+	//lasting 1% step: re-acquired on the value after FEEDBACK_MAX_OUTLIERS rejected ones
+	ULONG stepValue = value + value / 100;
+	double stepRate = stepValue * 8000. / 65536.;
+	PutValue(raw, stepValue);
+	int count = 0;
+	while(count < 100 && fabs(Ppm(decoder.GetRate(), stepRate)) > 1.)
+	{
+		decoder.AddValue(raw);
+		count++;
+	}
+	printf("  lasting step: re-acquired after %d values\n", count);
+	if(count != FEEDBACK_MAX_OUTLIERS + 1)
+		failed = TRUE;
+
+	//0.1% step is within the outlier ratio, the loop follows it without rejecting values
+	rejected = decoder.GetRejectedCount();
+	ULONG smallValue = stepValue + stepValue / 1000;
+	double smallRate = smallValue * 8000. / 65536.;
+	PutValue(raw, smallValue);
+	for(int i = 0; i < 8000 * 5; i++)
+		decoder.AddValue(raw);
+	printf("  small step: %u rejected, %+.3f ppm after 5 s\n", decoder.GetRejectedCount() - rejected, Ppm(decoder.GetRate(), smallRate));
+	if(decoder.GetRejectedCount() != rejected || fabs(Ppm(decoder.GetRate(), smallRate)) > 1.)
+		failed = TRUE;
+	return !failed;
+}
+
+double Seconds()
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+#define FBINFO_CENTER		(6 * 32768)		//48 kHz, raw values are exact as float
+#define FBINFO_WRITES		180000			//even, stays below the 1.5 x default halving
+
+//raw value the writer sets as its i-th value, alternately a new maximum and a new minimum
+static int FeedbackInfoRaw(int i)
+{
+	return i & 1 ? FBINFO_CENTER + (i + 1) / 2 : FBINFO_CENTER - i / 2;
+}
+
+struct FeedbackInfoRun
+{
+	FeedbackInfo	info;
+	volatile LONG	started;
+	volatile LONG	done;
+	double			writeSeconds;
+	double			readSeconds;
+	ULONG			reads;
+	ULONG			notWritten;		//values, minima or maxima the writer never set
+	ULONG			outOfRange;		//value outside min..max read after it
+};
+
+static bool IsWrittenValue(float value)
+{
+	float raw = value * 32768.f;
+	return raw >= FeedbackInfoRaw(FBINFO_WRITES - 2) && raw <= FeedbackInfoRaw(FBINFO_WRITES - 1) && raw == (float)(int)raw;
+}
+
+static DWORD WINAPI FeedbackInfoWriter(LPVOID context)
+{
+	FeedbackInfoRun* run = (FeedbackInfoRun*)context;
+	while(!run->started)
+		;
+	double start = Seconds();
+	for(int i = 1; i < FBINFO_WRITES; i++)
+		run->info.SetValue(FeedbackInfoRaw(i));
+	run->writeSeconds = Seconds() - start;
+	InterlockedExchange(&run->done, 1);
+	return 0;
+}
+
+static DWORD WINAPI FeedbackInfoReader(LPVOID context)
+{
+	FeedbackInfoRun* run = (FeedbackInfoRun*)context;
+	InterlockedExchange(&run->started, 1);
+	double start = Seconds();
+	while(!run->done)
+	{
+		float value = run->info.GetValue();
+		float minValue = run->info.GetMinValue();
+		float maxValue = run->info.GetMaxValue();
+		if(!IsWrittenValue(value) || !IsWrittenValue(minValue) || !IsWrittenValue(maxValue))
+			run->notWritten++;
+		if(minValue > value || value > maxValue)
+			run->outOfRange++;
+		run->reads++;
+	}
+	run->readSeconds = Seconds() - start;
+	return 0;
+}
+
+//one thread sets raw feedback values, each a new minimum or maximum, another reads value, min
+//and max meanwhile. Each read has to be a value that was set and lie within the min and max
+//read after it
+bool TestFeedbackInfo()
+{
+	FeedbackInfoRun run;
+	run.started = run.done = 0;
+	run.writeSeconds = run.readSeconds = 0.;
+	run.reads = run.notWritten = run.outOfRange = 0;
+	run.info.SetDefaultValue(6.f);
+	run.info.SetValue(FeedbackInfoRaw(0)); //min and max are unset before the first value
+
+	HANDLE reader = CreateThread(NULL, 0, FeedbackInfoReader, &run, 0, NULL);
+	HANDLE writer = CreateThread(NULL, 0, FeedbackInfoWriter, &run, 0, NULL);
+	if(reader == NULL || writer == NULL)
+	{
+		printf("  CreateThread failed\n");
+		InterlockedExchange(&run.started, 1);
+		InterlockedExchange(&run.done, 1);
+		if(reader)
+			WaitForSingleObject(reader, INFINITE);
+		return FALSE;
+	}
+	WaitForSingleObject(writer, INFINITE);
+	WaitForSingleObject(reader, INFINITE);
+	CloseHandle(writer);
+	CloseHandle(reader);
+
+	float minValue = run.info.GetMinValue() * 32768.f, maxValue = run.info.GetMaxValue() * 32768.f;
+	printf("  SetValue %.1f ns/op, %u reads of value, min and max %.1f ns/op; min %.0f max %.0f\n",
+		run.writeSeconds * 1e9 / (FBINFO_WRITES - 1), run.reads, run.reads ? run.readSeconds * 1e9 / run.reads : 0.,
+		minValue, maxValue);
+	bool failed = FALSE;
+	if(run.notWritten || run.outOfRange || run.reads == 0)
+	{
+		printf("  %u values never written, %u outside min..max FAILED\n", run.notWritten, run.outOfRange);
+		failed = TRUE;
+	}
+	if(minValue != FeedbackInfoRaw(FBINFO_WRITES - 2) || maxValue != FeedbackInfoRaw(FBINFO_WRITES - 1))
+	{
+		printf("  min..max isn't the written range FAILED\n");
+		failed = TRUE;
+	}
+	return !failed;
+}
+
+//configuration descriptor of an Audio-Widget style UAC2 DAC/ADC: speaker streaming interface with
+//24 bit in 4 and 3 byte subslots and 16 bit, explicit feedback, microphone interface with one alt setting
+static const BYTE s_widgetDescriptor[] =
+{
+	0x09, 0x02, 0x44, 0x01, 0x03, 0x01, 0x00, 0x80, 0xFA,			//configuration, 324 bytes
+	0x08, 0x0B, 0x00, 0x03, 0x01, 0x00, 0x20, 0x00,					//interface association
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x20, 0x00,			//audio control interface
+	0x09, 0x24, 0x01, 0x00, 0x02, 0x0A, 0x4B, 0x00, 0x00,			//AC header, UAC 2.0
+	0x08, 0x24, 0x0A, 0x04, 0x03, 0x07, 0x00, 0x00,					//clock source 4
+	0x11, 0x24, 0x02, 0x01, 0x01, 0x01, 0x00, 0x04, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//input terminal 1, USB streaming
+	0x0C, 0x24, 0x03, 0x02, 0x01, 0x03, 0x00, 0x01, 0x04, 0x00, 0x00, 0x00,	//output terminal 2, speaker
+	0x11, 0x24, 0x02, 0x03, 0x01, 0x02, 0x00, 0x04, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//input terminal 3, microphone
+	0x0C, 0x24, 0x03, 0x04, 0x01, 0x01, 0x00, 0x03, 0x04, 0x00, 0x00, 0x00,	//output terminal 4, USB streaming
+
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x01, 0x02, 0x20, 0x00,			//speaker interface 1, alt 0
+	0x09, 0x04, 0x01, 0x01, 0x02, 0x01, 0x02, 0x20, 0x00,			//alt 1
+	0x10, 0x24, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00,	//AS general, PCM, 2 channels
+	0x06, 0x24, 0x02, 0x01, 0x04, 0x18,								//type I, 4 byte subslot, 24 bits
+	0x07, 0x05, 0x01, 0x05, 0xC8, 0x00, 0x01,						//OUT 0x01 async, 200 bytes
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x11, 0x04, 0x00, 0x04,						//feedback IN 0x81
+	0x09, 0x04, 0x01, 0x02, 0x02, 0x01, 0x02, 0x20, 0x00,			//alt 2
+	0x10, 0x24, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00,
+	0x06, 0x24, 0x02, 0x01, 0x03, 0x18,								//3 byte subslot, 24 bits
+	0x07, 0x05, 0x01, 0x05, 0x96, 0x00, 0x01,						//150 bytes
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x11, 0x04, 0x00, 0x04,
+	0x09, 0x04, 0x01, 0x03, 0x02, 0x01, 0x02, 0x20, 0x00,			//alt 3
+	0x10, 0x24, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00,
+	0x06, 0x24, 0x02, 0x01, 0x02, 0x10,								//2 byte subslot, 16 bits
+	0x07, 0x05, 0x01, 0x05, 0x64, 0x00, 0x01,						//100 bytes
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x11, 0x04, 0x00, 0x04,
+
+	0x09, 0x04, 0x02, 0x00, 0x00, 0x01, 0x02, 0x20, 0x00,			//microphone interface 2, alt 0
+	0x09, 0x04, 0x02, 0x01, 0x01, 0x01, 0x02, 0x20, 0x00,			//alt 1
+	0x10, 0x24, 0x01, 0x04, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00,
+	0x06, 0x24, 0x02, 0x01, 0x04, 0x18,
+	0x07, 0x05, 0x82, 0x05, 0xC8, 0x00, 0x01,						//IN 0x82 async, 200 bytes
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+//8 channel DAC with PCM and IEEE float alt settings, AS general leaves the channel count
+//to the input terminal (bNrChannels 0)
+static const BYTE s_multichannelDescriptor[] =
+{
+	0x09, 0x02, 0xB3, 0x00, 0x02, 0x01, 0x00, 0x80, 0xFA,			//configuration, 179 bytes
+	0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x20, 0x00,			//audio control interface
+	0x09, 0x24, 0x01, 0x00, 0x02, 0x08, 0x2E, 0x00, 0x00,			//AC header, UAC 2.0
+	0x08, 0x24, 0x0A, 0x04, 0x01, 0x01, 0x00, 0x00,					//clock source 4, fixed
+	0x11, 0x24, 0x02, 0x01, 0x01, 0x01, 0x00, 0x04, 0x08, 0x3F, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//input terminal 1, 8 channels
+	0x0C, 0x24, 0x03, 0x02, 0x01, 0x03, 0x00, 0x01, 0x04, 0x00, 0x00, 0x00,	//output terminal 2
+
+	0x09, 0x04, 0x01, 0x00, 0x00, 0x01, 0x02, 0x20, 0x00,			//streaming interface 1, alt 0
+	0x09, 0x04, 0x01, 0x01, 0x02, 0x01, 0x02, 0x20, 0x00,			//alt 1
+	0x10, 0x24, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//AS general, PCM
+	0x06, 0x24, 0x02, 0x01, 0x04, 0x18,								//4 byte subslot, 24 bits
+	0x07, 0x05, 0x01, 0x05, 0x20, 0x03, 0x01,						//800 bytes
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x11, 0x04, 0x00, 0x04,
+	0x09, 0x04, 0x01, 0x02, 0x02, 0x01, 0x02, 0x20, 0x00,			//alt 2
+	0x10, 0x24, 0x01, 0x01, 0x00, 0x01, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//AS general, IEEE float
+	0x06, 0x24, 0x02, 0x01, 0x04, 0x20,								//4 byte subslot, 32 bits
+	0x07, 0x05, 0x01, 0x05, 0x20, 0x03, 0x01,
+	0x08, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x11, 0x04, 0x00, 0x04,
+};
+
+//what EnumerateFormats has to find in a descriptor
+struct FormatCase
+{
+	int		alternateSetting;
+	int		channels;
+	int		subslotSize;
+	int		bitResolution;
+	DWORD	formats;
+	int		maxPacketSize;
+	int		feedbackAddress;	//0 - no explicit feedback
+};
+
+//one SelectFormat request and the alt setting it has to give, -1 - none fits
+struct SelectCase
+{
+	const char*	name;
+	int			freq;
+	int			channels;
+	int			bitResolution;
+	int			alternateSetting;
+	DWORD		dataFormat;
+	bool		highSpeed;
+	int			expected;
+};
+
+static bool CheckFormats(const char* name, const StreamingFormat* formats, int count, const FormatCase* expected, int expectedCount)
+{
+	bool failed = count != expectedCount;
+	for(int i = 0; i < count; i++)
+	{
+		const StreamingFormat& f = formats[i];
+		int feedbackAddress = f.feedbackEndpoint ? f.feedbackEndpoint->Descriptor().bEndpointAddress : 0;
+		printf("  %s alt %d: %d ch, %d/%d bits, formats 0x%X, %d bytes, feedback 0x%02X\n", name, f.alternateSetting,
+			f.channels, f.subslotSize, f.bitResolution, f.formats, f.maxPacketSize, feedbackAddress);
+		if(i >= expectedCount)
+			continue;
+		const FormatCase& e = expected[i];
+		if(f.alternateSetting != e.alternateSetting || f.channels != e.channels || f.subslotSize != e.subslotSize ||
+			f.bitResolution != e.bitResolution || f.formats != e.formats || f.maxPacketSize != e.maxPacketSize ||
+			feedbackAddress != e.feedbackAddress)
+			failed = TRUE;
+	}
+	if(failed)
+		printf("  %s: %d formats, %d expected\n", name, count, expectedCount);
+	return !failed;
+}
+
+static bool CheckSelect(const StreamingFormat* formats, int count, const SelectCase* cases, int caseCount)
+{
+	bool failed = FALSE;
+	for(int i = 0; i < caseCount; i++)
+	{
+		const SelectCase& c = cases[i];
+		FormatRequest request;
+		request.freq = c.freq;
+		request.channels = c.channels;
+		request.bitResolution = c.bitResolution;
+		request.alternateSetting = c.alternateSetting;
+		request.dataFormat = c.dataFormat;
+		int selected = USBAudioDevice::SelectFormat(formats, count, request, c.highSpeed);
+		int alternateSetting = selected >= 0 ? formats[selected].alternateSetting : -1;
+		printf("  %-34s alt %2d, expected %2d\n", c.name, alternateSetting, c.expected);
+		if(alternateSetting != c.expected)
+			failed = TRUE;
+	}
+	return !failed;
+}
+
+bool TestDescriptors()
+{
+	static const FormatCase widgetDac[] =
+	{
+		{1, 2, 4, 24, AUDIO_FORMAT_TYPE_I_PCM, 200, 0x81},
+		{2, 2, 3, 24, AUDIO_FORMAT_TYPE_I_PCM, 150, 0x81},
+		{3, 2, 2, 16, AUDIO_FORMAT_TYPE_I_PCM, 100, 0x81},
+	};
+	static const FormatCase widgetAdc[] =
+	{
+		{1, 2, 4, 24, AUDIO_FORMAT_TYPE_I_PCM, 200, 0},
+	};
+	static const SelectCase widgetSelect[] =
+	{
+		{"default",							0,		0, 0,	-1, 0,							TRUE,	2},
+		{"192 kHz, 24 bits",				192000,	0, 24,	-1, 0,							TRUE,	2},
+		{"192 kHz, 16 bits",				192000,	0, 16,	-1, 0,							TRUE,	3},
+		{"384 kHz doesn't fit",				384000,	0, 0,	-1, 0,							TRUE,	-1},
+		{"200 kHz, extra frame doesn't fit",	200000,	0, 16,	-1, 0,						TRUE,	-1},
+		{"4 channels",						48000,	4, 0,	-1, 0,							TRUE,	-1},
+		{"alt 1 requested",					192000,	0, 0,	1,	0,							TRUE,	1},
+		{"alt 5 requested",					0,		0, 0,	5,	0,							TRUE,	-1},
+		{"full speed 48 kHz doesn't fit",	48000,	0, 0,	-1, 0,							FALSE,	-1},
+		{"DSD raw data",					0,		0, 0,	-1, AUDIO_FORMAT_TYPE_I_RAW_DATA,	TRUE,	-1},
+	};
+	static const FormatCase multichannelDac[] =
+	{
+		{1, 8, 4, 24, AUDIO_FORMAT_TYPE_I_PCM,			800, 0x81},
+		{2, 8, 4, 32, AUDIO_FORMAT_TYPE_I_IEEE_FLOAT,	800, 0x81},
+	};
+	static const SelectCase multichannelSelect[] =
+	{
+		{"default takes 32 bit float",		192000,	0, 0,	-1, 0,								TRUE,	2},
+		{"PCM",								192000,	0, 0,	-1, AUDIO_FORMAT_TYPE_I_PCM,		TRUE,	1},
+		{"IEEE float",						96000,	8, 0,	-1, AUDIO_FORMAT_TYPE_I_IEEE_FLOAT,	TRUE,	2},
+		{"PCM 32 bits",						0,		0, 32,	-1, AUDIO_FORMAT_TYPE_I_PCM,		TRUE,	-1},
+		{"full speed 44.1 kHz doesn't fit",	44100,	0, 0,	-1, 0,								FALSE,	-1},
+	};
+	StreamingFormat formats[MAX_STREAMING_FORMATS];
+	bool failed = FALSE;
+	int count;
+
+	USBAudioDevice widget(FALSE);
+	if(!widget.LoadDescriptors((BYTE*)s_widgetDescriptor, sizeof(s_widgetDescriptor)) || widget.GetAudioClass() != 2)
+	{
+		printf("  widget descriptor not parsed\n");
+		return FALSE;
+	}
+	count = widget.GetDACFormats(formats, MAX_STREAMING_FORMATS);
+	if(!CheckFormats("widget DAC", formats, count, widgetDac, sizeof(widgetDac) / sizeof(widgetDac[0])))
+		failed = TRUE;
+	if(!CheckSelect(formats, count, widgetSelect, sizeof(widgetSelect) / sizeof(widgetSelect[0])))
+		failed = TRUE;
+	count = widget.GetADCFormats(formats, MAX_STREAMING_FORMATS);
+	if(!CheckFormats("widget ADC", formats, count, widgetAdc, sizeof(widgetAdc) / sizeof(widgetAdc[0])))
+		failed = TRUE;
+
+	USBAudioDevice multichannel(FALSE);
+	if(!multichannel.LoadDescriptors((BYTE*)s_multichannelDescriptor, sizeof(s_multichannelDescriptor)))
+	{
+		printf("  multichannel descriptor not parsed\n");
+		return FALSE;
+	}
+	count = multichannel.GetDACFormats(formats, MAX_STREAMING_FORMATS);
+	if(!CheckFormats("8 ch DAC", formats, count, multichannelDac, sizeof(multichannelDac) / sizeof(multichannelDac[0])))
+		failed = TRUE;
+	if(!CheckSelect(formats, count, multichannelSelect, sizeof(multichannelSelect) / sizeof(multichannelSelect[0])))
+		failed = TRUE;
+
+	//a descriptor running past the end of the capture is refused
+	bool truncated = multichannel.LoadDescriptors((BYTE*)s_multichannelDescriptor, sizeof(s_multichannelDescriptor) - 3);
+	printf("  truncated descriptor %s\n", truncated ? "accepted" : "refused");
+	if(truncated)
+		failed = TRUE;
+	return !failed;
+}
+
+#define PATTERN_SECONDS		20		//stream length of one pattern case
+#define PATTERN_TRANSFER	8		//packets per DAC transfer
+
+//device off nominal by some ppm, smoothed by the feedback decoder
+struct PatternCase
+{
+	int		freq;
+	double	ppm;
+	bool	pattern;		//expected to run on the nominal pattern after settling
+};
+
+//explicit feedback of a high speed device with a 10.14 step of dither goes through FeedbackDecoder
+//and FeedbackInfo the way AudioDACTask::FillBuffer takes it. Within PACKET_PATTERN_BAND_PPM the
+//scheduler has to stay on the pattern, farther off it must not, and the samples sent have to
+//follow the integral of the commanded rate like the fraction path
+static bool RunPattern(const PatternCase& c)
+{
+	const int packetsPerSecond = 8000;
+	PacketScheduler scheduler;
+	scheduler.Init(c.freq, packetsPerSecond);
+	FeedbackDecoder decoder;
+	decoder.Init(4, TRUE, packetsPerSecond, c.freq);
+	FeedbackInfo info;
+	info.SetIntervalValue((float)packetsPerSecond / 1000.f);
+	ULONG value = (ULONG)(c.freq * (1. + c.ppm * 1e-6) / packetsPerSecond * 65536. + 0.5);
+
+	ULONG gcd = c.freq, b = packetsPerSecond;
+	while(b != 0)
+	{
+		ULONG t = gcd % b;
+		gcd = b;
+		b = t;
+	}
+	ULONGLONG nominalNum = c.freq / gcd, nominalDen = packetsPerSecond / gcd;
+	ULONGLONG unit = nominalDen << 16;
+
+	s_noise = 1;
+	ULONGLONG sent = 0, exact = 0;
+	int transfers = 0, patternTransfers = 0;
+	for(int i = 0; i < PATTERN_SECONDS * packetsPerSecond / PATTERN_TRANSFER; i++)
+	{
+		for(int k = 0; k < PATTERN_TRANSFER; k++)
+		{
+			UCHAR raw[4];
+			PutValue(raw, value + Noise(1) * 4);
+			decoder.AddValue(raw);
+		}
+		if(decoder.IsValid())
+			info.SetRateValue((float)decoder.GetRate());
+		ULONG feedback = info.GetValue() > 0.f ? (ULONG)(info.GetValue() * 65536.f + 0.5f) : 0;
+		scheduler.SetFeedback(feedback);
+		if(i >= packetsPerSecond / PATTERN_TRANSFER * 5)
+		{
+			transfers++;
+			if(scheduler.IsPatternUsed())
+				patternTransfers++;
+		}
+		for(int k = 0; k < PATTERN_TRANSFER; k++)
+		{
+			exact += feedback == 0 || feedback == scheduler.GetNominalFeedback() ? nominalNum << 16 : feedback * nominalDen;
+			sent += scheduler.NextPacket();
+			if(sent * unit > exact || exact - sent * unit >= unit)
+			{
+				printf("  %6d Hz %+4.0f ppm: transfer %d sent %llu samples, exact %.4f\n", c.freq, c.ppm, i, sent, (double)exact / unit);
+				return FALSE;
+			}
+		}
+	}
+	printf("  %6d Hz %+4.0f ppm: pattern in %d of %d transfers after 5 s\n", c.freq, c.ppm, patternTransfers, transfers);
+	return c.pattern ? patternTransfers == transfers : patternTransfers == 0;
+}
+
+bool TestPattern()
+{
+	static const PatternCase cases[] =
+	{
+		{44100, 0., TRUE},
+		{44100, 23., TRUE},
+		{48000, -41., TRUE},
+		{96000, 87., TRUE},
+		{48000, 250., FALSE},
+		{192000, -400., FALSE},
+	};
+	bool failed = FALSE;
+	for(int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+		if(!RunPattern(cases[i]))
+			failed = TRUE;
+	return !failed;
+}
+
+struct Test
+{
+	const char*	name;
+	bool		(*run)();
+	const char*	description;
+};
+
+static const Test s_tests[] =
+{
+	{"scheduler",	TestScheduler,			"24 h of packet lengths with feedback changes, zero cumulative error"},
+	{"fbformat",	TestFeedbackFormats,	"feedback binary point detection (10.14, 16.16, firmware variants) and settling"},
+	{"pattern",		TestPattern,			"smoothed feedback near nominal runs on the packet pattern, exact sample count"},
+	{"fboutlier",	TestFeedbackOutliers,	"feedback outlier rejection and re-acquisition after a rate step"},
+	{"fbinfo",		TestFeedbackInfo,		"feedback value, min and max read while another thread sets values, ns/op"},
+	{"descriptor",	TestDescriptors,		"format enumeration and selection from captured configuration descriptors"},
+};
+
+#define TEST_COUNT	(int)(sizeof(s_tests) / sizeof(s_tests[0]))
+
+void Usage()
+{
+	printf("usage: unittest [test ...]\n");
+	for(int i = 0; i < TEST_COUNT; i++)
+		printf("  %-14s %s\n", s_tests[i].name, s_tests[i].description);
+}
+
+int main(int argc, char* argv[])
+{
+	bool selected[TEST_COUNT];
+	bool any = FALSE;
+	memset(selected, 0, sizeof(selected));
+
+	for(int i = 1; i < argc; i++)
+	{
+		int t = 0;
+		while(t < TEST_COUNT && strcmp(argv[i], s_tests[t].name))
+			t++;
+		if(t == TEST_COUNT)
+		{
+			Usage();
+			return 2;
+		}
+		selected[t] = TRUE;
+		any = TRUE;
+	}
+
+	int failures = 0;
+	for(int t = 0; t < TEST_COUNT; t++)
+	{
+		if(any && !selected[t])
+			continue;
+		printf("%s: %s\n", s_tests[t].name, s_tests[t].description);
+		bool passed = s_tests[t].run();
+		printf("%s: %s\n", s_tests[t].name, passed ? "passed" : "FAILED");
+		if(!passed)
+			failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -44,15 +44,18 @@
 #include "USBAudioDevice.h"
 
 
-USBAudioDevice::USBAudioDevice(bool useInput) : m_fbInfo(), m_dac(NULL), m_adc(NULL), m_feedback(NULL), m_useInput(useInput),
+USBAudioDevice::USBAudioDevice(bool useInput, USBTransport* transport) : USBDevice(transport), m_fbInfo(), m_dac(NULL), m_adc(NULL), m_feedback(NULL), m_useInput(useInput),
 	m_lastParsedInterface(NULL), m_lastParsedEndpoint(NULL), m_audioClass(0),
-	m_dacEndpoint(NULL), m_adcEndpoint(NULL), m_fbEndpoint(NULL), m_notifyCallback(NULL), m_notifyCallbackContext(NULL), m_isStarted(FALSE)
+	m_dacEndpoint(NULL), m_adcEndpoint(NULL), m_fbEndpoint(NULL), m_notifyCallback(NULL), m_notifyCallbackContext(NULL), m_isStarted(FALSE),
+	m_schedulerMode(SchedulerThreadPerEndpoint), m_service(NULL), m_startTick(0)
 {
 	InitDescriptors();
 }
 
 USBAudioDevice::~USBAudioDevice()
 {
+	if(m_service)
+		delete m_service;
 	if(m_dac)
 		delete m_dac;
 	if(m_feedback)
@@ -76,6 +79,8 @@ void USBAudioDevice::FreeDevice()
 void USBAudioDevice::FreeDeviceInternal()
 {
 	InitDescriptors();
+	if(m_service)
+		delete m_service;
 	if(m_dac)
 		delete m_dac;
 	if(m_feedback)
@@ -83,6 +88,7 @@ void USBAudioDevice::FreeDeviceInternal()
 	if(m_adc)
 		delete m_adc;
 
+	m_service = NULL;
 	m_feedback = NULL;
 	m_adc = NULL;
 	m_dac = NULL;
@@ -162,127 +168,250 @@ bool USBAudioDevice::ParseDescriptorInternal(USB_DESCRIPTOR_HEADER* uDescriptor)
 	return FALSE;
 }
 
-bool USBAudioDevice::InitDevice()
+int USBAudioDevice::GetStreamingChannelNumber(USBAudioStreamingInterface* iface, bool input)
 {
-	if(!USBDevice::InitDevice())
-		return FALSE;
-	if(m_useInput)
+	if(iface->m_asgDescriptor.bNrChannels != 0)
+		return iface->m_asgDescriptor.bNrChannels;
+
+	int channelNumber = 2;
+	if(input)
 	{
-		USBAudioStreamingInterface * iface = m_asInterfaceList.First();
-		while(iface)
+		USBAudioOutTerminal* outTerm = FindOutTerminal(iface->m_asgDescriptor.bTerminalLink);
+		if(outTerm)
 		{
-			USBAudioStreamingEndpoint * epoint = iface->m_endpointsList.First();
-			while(epoint)
+			USBAudioFeatureUnit* unit = FindFeatureUnit(outTerm->m_outTerminal.bSourceID);
+			if(unit)
 			{
-				if(USB_ENDPOINT_DIRECTION_IN(epoint->m_descriptor.bEndpointAddress) && 
-					(epoint->m_descriptor.bmAttributes & 0x03) == USB_ENDPOINT_TYPE_ISOCHRONOUS &&
-					(epoint->m_descriptor.bmAttributes & 0x0C) != 0) //not feedback
-				{
-#ifdef _ENABLE_TRACE
-				    debugPrintf("ASIOUAC: Found input endpoint 0x%X\n",  (int)epoint->m_descriptor.bEndpointAddress);
-#endif
-					int channelNumber = 2;
-					USBAudioOutTerminal* outTerm = FindOutTerminal(iface->m_asgDescriptor.bTerminalLink);
-					if(outTerm)
-					{
-						USBAudioFeatureUnit* unit = FindFeatureUnit(outTerm->m_outTerminal.bSourceID);
-						if(unit)
-						{
-							USBAudioInTerminal* inTerm = FindInTerminal(unit->m_featureUnit.bSourceID);
-							if(inTerm)
-								channelNumber = inTerm->m_inTerminal.bNrChannels;
-						}
-					}
-
-					m_adc = new AudioADC();
-					m_adc->Init(this, &m_fbInfo, epoint->m_descriptor.bEndpointAddress, 
-						epoint->m_descriptor.wMaxPacketSize, 
-						epoint->m_descriptor.bInterval, 
-						channelNumber, 
-						iface->m_formatDescriptor.bSubslotSize);
-					m_adcEndpoint = epoint;
-					break;
-				}
-				epoint = iface->m_endpointsList.Next(epoint);
+				USBAudioInTerminal* inTerm = FindInTerminal(unit->m_featureUnit.bSourceID);
+				if(inTerm)
+					channelNumber = inTerm->m_inTerminal.bNrChannels;
 			}
-			if(m_adc != NULL)
-				break;
-			iface = m_asInterfaceList.Next(iface);
 		}
-		if(m_adc == NULL)
-			m_useInput = FALSE;
 	}
+	else
+	{
+		USBAudioInTerminal* inTerm = FindInTerminal(iface->m_asgDescriptor.bTerminalLink);
+		if(inTerm)
+			channelNumber = inTerm->m_inTerminal.bNrChannels;
+	}
+	return channelNumber;
+}
 
-	if(m_adc == NULL)
+int USBAudioDevice::EnumerateFormats(bool input, StreamingFormat* formats, int maxCount)
+{
+	int count = 0;
+	USBAudioStreamingInterface * iface = m_asInterfaceList.First();
+	while(iface && count < maxCount)
 	{
-		USBAudioStreamingInterface * iface = m_asInterfaceList.First();
-		while(iface)
+		StreamingFormat* format = formats + count;
+		memset(format, 0, sizeof(StreamingFormat));
+
+		USBAudioStreamingEndpoint * epoint = iface->m_endpointsList.First();
+		while(epoint)
 		{
-			USBAudioStreamingEndpoint * epoint = iface->m_endpointsList.First();
-			while(epoint)
+			if((epoint->m_descriptor.bmAttributes & 0x03) == USB_ENDPOINT_TYPE_ISOCHRONOUS)
 			{
-				if(USB_ENDPOINT_DIRECTION_IN(epoint->m_descriptor.bEndpointAddress) && 
-					(epoint->m_descriptor.bmAttributes & 0x03) == USB_ENDPOINT_TYPE_ISOCHRONOUS &&
-					(epoint->m_descriptor.bmAttributes & 0x0C) == 0) //feedback
+				if(USB_ENDPOINT_MAX_PAYLOAD(epoint->m_descriptor.wMaxPacketSize) == 0) //reserved transaction count
 				{
 #ifdef _ENABLE_TRACE
-					debugPrintf("ASIOUAC: Found feedback endpoint 0x%X\n",  (int)epoint->m_descriptor.bEndpointAddress);
+					debugPrintf("ASIOUAC: Endpoint 0x%X has invalid wMaxPacketSize 0x%X, skipped\n", (int)epoint->m_descriptor.bEndpointAddress,
+						(int)epoint->m_descriptor.wMaxPacketSize);
 #endif
-					m_feedback = new AudioFeedback();
-					m_feedback->Init(this, &m_fbInfo, epoint->m_descriptor.bEndpointAddress, epoint->m_descriptor.wMaxPacketSize, epoint->m_descriptor.bInterval, 4);
-					m_fbEndpoint = epoint;
-					break;
 				}
-				epoint = iface->m_endpointsList.Next(epoint);
+				else if((epoint->m_descriptor.bmAttributes & 0x0C) == 0) //feedback
+				{
+					if(USB_ENDPOINT_DIRECTION_IN(epoint->m_descriptor.bEndpointAddress) && format->feedbackEndpoint == NULL)
+						format->feedbackEndpoint = epoint;
+				}
+				else if((USB_ENDPOINT_DIRECTION_IN(epoint->m_descriptor.bEndpointAddress) != 0) == input && format->endpoint == NULL)
+					format->endpoint = epoint;
 			}
-			if(m_feedback != NULL)
-				break;
-			iface = m_asInterfaceList.Next(iface);
+			epoint = iface->m_endpointsList.Next(epoint);
 		}
-	}
-//	return TRUE;
-
-	USBAudioStreamingInterface * iface = m_asInterfaceList.First();
-	while(iface)
-	{
-		if(!m_fbEndpoint || m_fbEndpoint->m_interface == iface) //out endpoint and feedback endpoint in same interface
+		//output endpoint without explicit sync is accepted too (old code took any OUT iso endpoint)
+		if(format->endpoint == NULL && !input)
 		{
-			USBAudioStreamingEndpoint * epoint = iface->m_endpointsList.First();
+			epoint = iface->m_endpointsList.First();
 			while(epoint)
 			{
-				if(USB_ENDPOINT_DIRECTION_OUT(epoint->m_descriptor.bEndpointAddress) && 
-					(epoint->m_descriptor.bmAttributes & 0x03) == USB_ENDPOINT_TYPE_ISOCHRONOUS)
+				if(USB_ENDPOINT_DIRECTION_OUT(epoint->m_descriptor.bEndpointAddress) &&
+					(epoint->m_descriptor.bmAttributes & 0x03) == USB_ENDPOINT_TYPE_ISOCHRONOUS &&
+					USB_ENDPOINT_MAX_PAYLOAD(epoint->m_descriptor.wMaxPacketSize) != 0)
 				{
-#ifdef _ENABLE_TRACE
-					debugPrintf("ASIOUAC: Found output endpoint 0x%X\n",  (int)epoint->m_descriptor.bEndpointAddress);
-#endif
-					int channelNumber = 2;
-					USBAudioInTerminal* inTerm = FindInTerminal(iface->m_asgDescriptor.bTerminalLink);
-					if(inTerm)
-						channelNumber = inTerm->m_inTerminal.bNrChannels;
-
-					m_dac = new AudioDAC();
-					m_dac->Init(this, &m_fbInfo, epoint->m_descriptor.bEndpointAddress, epoint->m_descriptor.wMaxPacketSize, 
-						epoint->m_descriptor.bInterval, 
-						channelNumber, 
-						iface->m_formatDescriptor.bSubslotSize);
-					m_dacEndpoint = epoint;
+					format->endpoint = epoint;
 					break;
 				}
 				epoint = iface->m_endpointsList.Next(epoint);
 			}
 		}
-		if(m_dac != NULL)
-			break;
+
+		if(format->endpoint != NULL)
+		{
+			format->iface = iface;
+			format->interfaceNumber = iface->Descriptor().bInterfaceNumber;
+			format->alternateSetting = iface->Descriptor().bAlternateSetting;
+			format->channels = GetStreamingChannelNumber(iface, input);
+			format->subslotSize = iface->m_formatDescriptor.bSubslotSize;
+			format->bitResolution = iface->m_formatDescriptor.bBitResolution;
+			format->formats = iface->m_asgDescriptor.bmFormats;
+			format->maxPacketSize = USB_ENDPOINT_MAX_PAYLOAD(format->endpoint->m_descriptor.wMaxPacketSize);
+			format->interval = format->endpoint->m_descriptor.bInterval;
+			count++;
+		}
 		iface = m_asInterfaceList.Next(iface);
 	}
+	return count;
+}
+
+//alt settings without bmFormats are taken as PCM
+static bool HasDataFormat(const StreamingFormat& format, DWORD dataFormat)
+{
+	if(format.formats == 0)
+		return dataFormat == 0 || dataFormat == AUDIO_FORMAT_TYPE_I_PCM;
+	if(dataFormat)
+		return (format.formats & dataFormat) != 0;
+	return (format.formats & (AUDIO_FORMAT_TYPE_I_PCM | AUDIO_FORMAT_TYPE_I_IEEE_FLOAT)) != 0;
+}
+
+int USBAudioDevice::SelectFormat(const StreamingFormat* formats, int count, const FormatRequest& request, bool highSpeed)
+{
+	int i;
+	if(request.alternateSetting >= 0)
+	{
+		for(i = 0; i < count; i++)
+			if(formats[i].alternateSetting == request.alternateSetting)
+				return i;
+		return -1;
+	}
+
+	//not requested channels and resolution mean the best ones available
+	int channels = request.channels;
+	int bitResolution = request.bitResolution;
+	for(i = 0; i < count; i++)
+	{
+		if(!HasDataFormat(formats[i], request.dataFormat))
+			continue;
+		if(request.channels <= 0 && formats[i].channels > channels)
+			channels = formats[i].channels;
+		if(request.bitResolution <= 0 && formats[i].bitResolution > bitResolution)
+			bitResolution = formats[i].bitResolution;
+	}
+
+	int selected = -1;
+	LONGLONG selectedReserved = 0;
+	int selectedFrameSize = 0;
+	for(i = 0; i < count; i++)
+	{
+		const StreamingFormat& format = formats[i];
+		if(format.channels < channels || format.bitResolution < bitResolution || format.subslotSize == 0)
+			continue;
+		if(!HasDataFormat(format, request.dataFormat))
+			continue;
+
+		int packetsPerSecond = (highSpeed ? 8000 : 1000) >> (format.interval > 0 ? format.interval - 1 : 0);
+		if(packetsPerSecond == 0)
+			continue;
+		int frameSize = format.channels * format.subslotSize;
+		//nominal packet plus one extra frame must fit
+		if(request.freq > 0 && (request.freq / packetsPerSecond + 1) * frameSize > format.maxPacketSize)
+			continue;
+
+		//periodic bandwidth reserved on the bus, then bytes actually streamed
+		LONGLONG reserved = (LONGLONG)format.maxPacketSize * packetsPerSecond;
+		if(selected < 0 || reserved < selectedReserved ||
+			(reserved == selectedReserved && frameSize < selectedFrameSize))
+		{
+			selected = i;
+			selectedReserved = reserved;
+			selectedFrameSize = frameSize;
+		}
+	}
+	return selected;
+}
+
+bool USBAudioDevice::LoadDescriptors(BYTE* configDescriptor, DWORD length)
+{
+	m_acInterfaceList.Clear();
+	m_asInterfaceList.Clear();
+	m_lastParsedInterface = NULL;
+	m_lastParsedEndpoint = NULL;
+	m_audioClass = 0;
+	return ParseDescriptors(configDescriptor, length);
+}
+
+bool USBAudioDevice::InitDevice()
+{
+	if(!USBDevice::InitDevice())
+		return FALSE;
+
+	StreamingFormat formats[MAX_STREAMING_FORMATS];
+	int count, selected;
+	bool highSpeed = GetDeviceSpeed() == HighSpeed;
+
+	if(m_useInput)
+	{
+		count = EnumerateFormats(TRUE, formats, MAX_STREAMING_FORMATS);
+		selected = SelectFormat(formats, count, m_adcRequest, highSpeed);
+		if(selected >= 0)
+		{
+			StreamingFormat& format = formats[selected];
+			USBAudioStreamingEndpoint * epoint = format.endpoint;
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: Found input endpoint 0x%X (alt 0x%X, %d channels, %d/%d bits)\n", (int)epoint->m_descriptor.bEndpointAddress,
+				format.alternateSetting, format.channels, format.bitResolution, format.subslotSize * 8);
+#endif
+			m_adc = new AudioADC();
+			m_adc->Init(this, &m_fbInfo, epoint->m_descriptor.bEndpointAddress, 
+				USB_ENDPOINT_MAX_PAYLOAD(epoint->m_descriptor.wMaxPacketSize), 
+				epoint->m_descriptor.bInterval, 
+				format.channels, 
+				format.subslotSize);
+			m_adcEndpoint = epoint;
+		}
+		if(m_adc == NULL)
+			m_useInput = FALSE;
+	}
+
+	count = EnumerateFormats(FALSE, formats, MAX_STREAMING_FORMATS);
+	selected = SelectFormat(formats, count, m_dacRequest, highSpeed);
+	if(selected >= 0)
+	{
+		StreamingFormat& format = formats[selected];
+		USBAudioStreamingEndpoint * epoint = format.endpoint;
+
+		//explicit feedback of the same alt setting is used only without implicit feedback from ADC
+		if(m_adc == NULL && format.feedbackEndpoint != NULL)
+		{
+			USBAudioStreamingEndpoint * fbpoint = format.feedbackEndpoint;
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: Found feedback endpoint 0x%X\n",  (int)fbpoint->m_descriptor.bEndpointAddress);
+#endif
+			//10.14 feedback value takes 3 bytes, 16.16 takes 4
+			int valueSize = USB_ENDPOINT_TRANSACTION_SIZE(fbpoint->m_descriptor.wMaxPacketSize) == 3 ? 3 : 4;
+			m_feedback = new AudioFeedback();
+			m_feedback->Init(this, &m_fbInfo, fbpoint->m_descriptor.bEndpointAddress, USB_ENDPOINT_MAX_PAYLOAD(fbpoint->m_descriptor.wMaxPacketSize), fbpoint->m_descriptor.bInterval, valueSize);
+			m_fbEndpoint = fbpoint;
+		}
+
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Found output endpoint 0x%X (alt 0x%X, %d channels, %d/%d bits)\n", (int)epoint->m_descriptor.bEndpointAddress,
+			format.alternateSetting, format.channels, format.bitResolution, format.subslotSize * 8);
+#endif
+		m_dac = new AudioDAC();
+		m_dac->Init(this, &m_fbInfo, epoint->m_descriptor.bEndpointAddress, USB_ENDPOINT_MAX_PAYLOAD(epoint->m_descriptor.wMaxPacketSize), 
+			epoint->m_descriptor.bInterval, 
+			format.channels, 
+			format.subslotSize);
+		m_dacEndpoint = epoint;
+	}
 	return TRUE;
 }
 
 
 bool USBAudioDevice::CheckSampleRate(USBAudioClockSource* clocksrc, int newfreq)
 {
-	unsigned char buff[64];
+	//wNumSubRanges and up to 21 subranges
+	unsigned char buff[256];
 	UINT lengthTransferred = 0;
 	bool retVal = FALSE;
 	if(UsbClaimInterface(clocksrc->m_interface->Descriptor().bInterfaceNumber))
@@ -307,6 +436,11 @@ bool USBAudioDevice::CheckSampleRate(USBAudioClockSource* clocksrc, int newfreq)
 			}
 		unsigned short length = *((unsigned short*)buff);
 		struct sample_rate_triplets *triplets = (sample_rate_triplets *)(buff + 2);
+		//devices report all subranges, only those which fit into the buffer were received
+		if(!retValue)
+			length = 0;
+		else if(length > (lengthTransferred - 2) / sizeof(sample_rate_triplets))
+			length = (unsigned short)((lengthTransferred - 2) / sizeof(sample_rate_triplets));
 
 #ifdef _ENABLE_TRACE
 		//debugPrintf("ASIOUAC: Enumerate samplerate OK\n");
@@ -361,19 +495,42 @@ USBAudioClockSource* USBAudioDevice::FindClockSource(int freq)
 	return NULL;
 }
 
+//devices with a clock per terminal (f_uac2 gadget) need every clock which can run at the rate set,
+//read only and external clocks follow it on their own
 bool USBAudioDevice::SetSampleRateInternal(int freq)
 {
-	UINT lengthTransferred = 0;
-	bool retValue = FALSE;
-	USBAudioClockSource* clockSource = FindClockSource(freq);
-	if(!clockSource)
+	int clockCount = 0;
+	USBAudioControlInterface * iface = m_acInterfaceList.First();
+	while(iface)
+	{
+		USBAudioClockSource* clockSource = iface->m_clockSourceList.First();
+		while(clockSource)
+		{
+			if(CheckSampleRate(clockSource, freq))
+			{
+				if(AUDIO_CONTROL_PROGRAMMABLE(clockSource->m_clockSource.bmControls, AUDIO_CS_CONTROL_SAM_FREQ) &&
+					!SetClockSampleRate(clockSource, freq))
+					return FALSE;
+				clockCount++;
+			}
+			clockSource = iface->m_clockSourceList.Next(clockSource);
+		}
+		iface = m_acInterfaceList.Next(iface);
+	}
+	if(!clockCount)
 	{
 #ifdef _ENABLE_TRACE
         debugPrintf("ASIOUAC: Not found clock source for sample rate %d\n", freq);
 #endif
 		return FALSE;
 	}
+	return TRUE;
+}
 
+bool USBAudioDevice::SetClockSampleRate(USBAudioClockSource* clockSource, int freq)
+{
+	UINT lengthTransferred = 0;
+	bool retValue = FALSE;
 	if(UsbClaimInterface(clockSource->m_interface->Descriptor().bInterfaceNumber))
 	{
 		retValue = SendUsbControl(BMREQUEST_DIR_HOST_TO_DEVICE, BMREQUEST_TYPE_CLASS, BMREQUEST_RECIPIENT_INTERFACE, 
@@ -485,6 +642,11 @@ bool USBAudioDevice::CanSampleRate(int freq)
 {
 	if(!IsValidDevice())
 		return FALSE;
+	//high rates may need more bandwidth than the selected alt settings reserve
+	if(m_dac != NULL && !m_dac->GetTask()->CanSampleFreq(freq))
+		return FALSE;
+	if(m_adc != NULL && !m_adc->GetTask()->CanSampleFreq(freq))
+		return FALSE;
 	return 	FindClockSource(freq) != NULL;
 }
 
@@ -499,6 +661,13 @@ bool USBAudioDevice::Start()
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: USBAudioDevice start\n");
 #endif
+	bool singleThread = m_schedulerMode == SchedulerSingleThread;
+	if(singleThread)
+	{
+		if(m_service == NULL)
+			m_service = new AudioService();
+		m_service->ClearTasks();
+	}
 
 	if(m_adcEndpoint)
 	{
@@ -509,7 +678,12 @@ bool USBAudioDevice::Start()
 			m_adcEndpoint->m_interface->Descriptor().bAlternateSetting);
 #endif
 		if(m_adc != NULL)
-			retVal &= m_adc->Start();
+		{
+			if(singleThread)
+				m_service->AddTask(m_adc->GetTask());
+			else
+				retVal &= m_adc->Start();
+		}
 	}
 
 	if(m_dacEndpoint)
@@ -521,11 +695,24 @@ bool USBAudioDevice::Start()
 			m_dacEndpoint->m_interface->Descriptor().bAlternateSetting);
 #endif
 		if(m_dac != NULL)
-			retVal &= m_dac->Start();
+		{
+			if(singleThread)
+				m_service->AddTask(m_dac->GetTask());
+			else
+				retVal &= m_dac->Start();
+		}
 
 		if(m_feedback != NULL)
-			retVal &= m_feedback->Start();
+		{
+			if(singleThread)
+				m_service->AddTask(m_feedback->GetTask());
+			else
+				retVal &= m_feedback->Start();
+		}
 	}
+	if(singleThread)
+		retVal &= m_service->Start();
+	m_startTick = GetTickCount();
 	m_isStarted = TRUE;
 	return retVal;
 }
@@ -540,14 +727,19 @@ bool USBAudioDevice::Stop()
 #endif
 	bool retVal = TRUE;
 
-	if(m_dac != NULL)
-		retVal &= m_dac->Stop();
+	if(m_service != NULL && m_service->IsStarted())
+		retVal &= m_service->Stop(); //the service thread ran every pipe, the endpoint threads weren't started
+	else
+	{
+		if(m_dac != NULL)
+			retVal &= m_dac->Stop();
 
-	if(m_feedback != NULL)
-		retVal &= m_feedback->Stop();
+		if(m_feedback != NULL)
+			retVal &= m_feedback->Stop();
 
-	if(m_adc != NULL)
-		retVal &= m_adc->Stop();
+		if(m_adc != NULL)
+			retVal &= m_adc->Stop();
+	}
 
 	if(!IsConnected())
 	{
@@ -619,18 +811,169 @@ void USBAudioDevice::SetADCCallback(FillDataCallback writeDataCb, void* context)
 		m_adc->SetCallback(writeDataCb, context);
 }
 
+void USBAudioDevice::SetADCScatterCallback(ScatterDataCallback scatterDataCb, void* context)
+{
+	if(m_adc != NULL)
+		m_adc->SetScatterCallback(scatterDataCb, context);
+}
+
+bool USBAudioDevice::SetDACTransferConfig(int outstandingTransfers, int packetPerTransfer)
+{
+	if(m_isStarted || m_dac == NULL)
+		return FALSE;
+	return m_dac->SetTransferConfig(outstandingTransfers, packetPerTransfer);
+}
+
+bool USBAudioDevice::SetADCTransferConfig(int outstandingTransfers, int packetPerTransfer)
+{
+	if(m_isStarted || m_adc == NULL)
+		return FALSE;
+	return m_adc->SetTransferConfig(outstandingTransfers, packetPerTransfer);
+}
+
+bool USBAudioDevice::SetFeedbackTransferConfig(int outstandingTransfers, int packetPerTransfer)
+{
+	if(m_isStarted || m_feedback == NULL)
+		return FALSE;
+	return m_feedback->SetTransferConfig(outstandingTransfers, packetPerTransfer);
+}
+
+int USBAudioDevice::GetDACQueuedTime()
+{
+	return m_dac != NULL ? m_dac->GetQueuedTime() : 0;
+}
+
+int USBAudioDevice::GetADCQueuedTime()
+{
+	return m_adc != NULL ? m_adc->GetQueuedTime() : 0;
+}
+
+bool USBAudioDevice::SetSchedulerMode(int mode)
+{
+	if(m_isStarted || (mode != SchedulerThreadPerEndpoint && mode != SchedulerSingleThread))
+		return FALSE;
+	m_schedulerMode = mode;
+	return TRUE;
+}
+
+bool USBAudioDevice::SetScheduleLead(int microframes)
+{
+	if(m_isStarted)
+		return FALSE;
+	bool retVal = TRUE;
+	if(m_dac != NULL)
+		retVal &= m_dac->GetTask()->SetScheduleLead(microframes);
+	if(m_adc != NULL)
+		retVal &= m_adc->GetTask()->SetScheduleLead(microframes);
+	if(m_feedback != NULL)
+		retVal &= m_feedback->GetTask()->SetScheduleLead(microframes);
+	return retVal;
+}
+
+int USBAudioDevice::GetDACScheduleDelay()
+{
+	return m_dac != NULL ? m_dac->GetTask()->GetScheduleDelay() : 0;
+}
+
+int USBAudioDevice::GetADCScheduleDelay()
+{
+	return m_adc != NULL ? m_adc->GetTask()->GetScheduleDelay() : 0;
+}
+
+void USBAudioDevice::GetSchedulerStatistics(SchedulerStatistics* stats)
+{
+	*stats = SchedulerStatistics();
+	if(m_schedulerMode == SchedulerSingleThread)
+	{
+		if(m_service != NULL)
+			m_service->GetSchedulerStatistics(*stats);
+	}
+	else
+	{
+		if(m_dac != NULL)
+			m_dac->GetTask()->GetSchedulerStatistics(*stats);
+		if(m_adc != NULL)
+			m_adc->GetTask()->GetSchedulerStatistics(*stats);
+		if(m_feedback != NULL)
+			m_feedback->GetTask()->GetSchedulerStatistics(*stats);
+	}
+	if(m_isStarted)
+		stats->elapsedTime = (GetTickCount() - m_startTick) / 1000.f;
+}
+
+bool USBAudioDevice::GetDACStatistics(EndpointStatistics* stats)
+{
+	*stats = EndpointStatistics();
+	if(m_dac == NULL)
+		return FALSE;
+	m_dac->GetTask()->GetEndpointStatistics(*stats);
+	return TRUE;
+}
+
+bool USBAudioDevice::GetADCStatistics(EndpointStatistics* stats)
+{
+	*stats = EndpointStatistics();
+	if(m_adc == NULL)
+		return FALSE;
+	m_adc->GetTask()->GetEndpointStatistics(*stats);
+	return TRUE;
+}
+
+bool USBAudioDevice::GetFeedbackStatistics(EndpointStatistics* stats)
+{
+	*stats = EndpointStatistics();
+	if(m_feedback == NULL)
+		return FALSE;
+	m_feedback->GetTask()->GetEndpointStatistics(*stats);
+	return TRUE;
+}
+
+void USBAudioDevice::SetImplicitFeedbackFilter(bool enable)
+{
+	if(m_adc != NULL)
+		m_adc->GetTask()->SetFeedbackFilter(enable);
+}
+
+bool USBAudioDevice::GetImplicitFeedbackRate(double* rate, double* uncertainty)
+{
+	if(m_adc == NULL)
+	{
+		*rate = 0.;
+		*uncertainty = 0.;
+		return FALSE;
+	}
+	RateEstimator* estimator = m_adc->GetTask()->GetRateEstimator();
+	*rate = estimator->GetRate();
+	*uncertainty = estimator->GetUncertainty();
+	return estimator->IsLocked();
+}
+
+bool USBAudioDevice::GetFeedbackRate(float* rate, float* minRate, float* maxRate)
+{
+	*rate = m_fbInfo.GetFreqValue();
+	*minRate = m_fbInfo.GetMinValue();
+	*maxRate = m_fbInfo.GetMaxValue();
+	return m_dac != NULL;
+}
+
+void USBAudioDevice::InjectDACErrors(int count)
+{
+	if(m_dac != NULL)
+		m_dac->GetTask()->InjectTransferErrors(count);
+}
+
 int USBAudioDevice::GetInputChannelNumber()
 {
-	if(!IsValidDevice())
+	if(!IsValidDevice() || !m_useInput || m_adcEndpoint == NULL)
 		return 0;
-	return m_useInput ? 2 : 0;
+	return GetStreamingChannelNumber(m_adcEndpoint->m_interface, TRUE);
 }
 
 int USBAudioDevice::GetOutputChannelNumber()
 {
-	if(!IsValidDevice())
+	if(!IsValidDevice() || m_dacEndpoint == NULL)
 		return 0;
-	return 2;
+	return GetStreamingChannelNumber(m_dacEndpoint->m_interface, FALSE);
 }
 
 USBAudioInTerminal* USBAudioDevice::FindInTerminal(int id)
@@ -44,7 +44,7 @@
 #ifndef __USBAUDIO_DEVICE_H__
 #define __USBAUDIO_DEVICE_H__
 
-#include "usbdevice.h"
+#include "UsbDevice.h"
 #include "audiotask.h"
 #include "tlist.h"
 #include "descriptors.h"
@@ -55,6 +55,43 @@ typedef void (*NotifyCallback)(void* context, int reason);
 typedef TList<USBAudioControlInterface> USBACInterfaceList;
 typedef TList<USBAudioStreamingInterface> USBASInterfaceList;
 
+enum
+{
+	SchedulerThreadPerEndpoint = 0,	//one thread per ISO pipe
+	SchedulerSingleThread			//one event driven thread for all ISO pipes
+};
+
+#define MAX_STREAMING_FORMATS		32
+
+//one alternate setting of a streaming interface able to carry audio
+struct StreamingFormat
+{
+	USBAudioStreamingInterface*	iface;
+	USBAudioStreamingEndpoint*	endpoint;
+	USBAudioStreamingEndpoint*	feedbackEndpoint;	//explicit feedback of the same alt setting, if any
+	int							interfaceNumber;
+	int							alternateSetting;
+	int							channels;
+	int							subslotSize;
+	int							bitResolution;
+	DWORD						formats;			//bmFormats of AS_GENERAL, 0 if not declared
+	int							maxPacketSize;		//bytes per packet
+	int							interval;
+};
+
+//what the host wants from the stream, zero fields mean "don't care"
+struct FormatRequest
+{
+	int							freq;				//highest sample rate the alt setting must carry
+	int							channels;			//minimum channels, 0 - as many as the device has
+	int							bitResolution;		//minimum bits, 0 - the best resolution
+	int							alternateSetting;	//-1 - choose automatically
+	DWORD						dataFormat;			//bmFormats bit the alt setting must declare, 0 - PCM or IEEE float
+
+	FormatRequest() : freq(0), channels(0), bitResolution(0), alternateSetting(-1), dataFormat(0)
+	{}
+};
+
 class USBAudioDevice : public USBDevice
 {
 	//IAD
@@ -81,6 +118,7 @@ protected:
 	virtual bool ParseDescriptorInternal(USB_DESCRIPTOR_HEADER* uDescriptor);
 
 	bool SetSampleRateInternal(int freq);
+	bool SetClockSampleRate(USBAudioClockSource* clockSource, int freq);
 
 	USBAudioClockSource* FindClockSource(int freq);
 	bool CheckSampleRate(USBAudioClockSource* clocksrc, int freq);
@@ -90,11 +128,37 @@ protected:
 	USBAudioFeatureUnit*		FindFeatureUnit(int id);
 	USBAudioOutTerminal*		FindOutTerminal(int id);
 
+	int GetStreamingChannelNumber(USBAudioStreamingInterface* iface, bool input);
+	int EnumerateFormats(bool input, StreamingFormat* formats, int maxCount);
+
 public:
-	USBAudioDevice(bool useInput);
+	USBAudioDevice(bool useInput, USBTransport* transport = NULL);
 	virtual ~USBAudioDevice();
 	virtual bool InitDevice();
 
+	//parses a configuration descriptor without a device, for offline format checks
+	bool LoadDescriptors(BYTE* configDescriptor, DWORD length);
+	//returns index of the cheapest format satisfying request or -1
+	static int SelectFormat(const StreamingFormat* formats, int count, const FormatRequest& request, bool highSpeed);
+
+	//must be called before InitDevice()
+	void SetDACFormatRequest(const FormatRequest& request)
+	{
+		m_dacRequest = request;
+	}
+	void SetADCFormatRequest(const FormatRequest& request)
+	{
+		m_adcRequest = request;
+	}
+	int GetDACFormats(StreamingFormat* formats, int maxCount)
+	{
+		return EnumerateFormats(FALSE, formats, maxCount);
+	}
+	int GetADCFormats(StreamingFormat* formats, int maxCount)
+	{
+		return EnumerateFormats(TRUE, formats, maxCount);
+	}
+
 	bool CanSampleRate(int freq);
 	bool SetSampleRate(int freq);
 	int GetCurrentSampleRate();
@@ -107,6 +171,38 @@ public:
 
 	void SetDACCallback(FillDataCallback readDataCb, void* context);
 	void SetADCCallback(FillDataCallback writeDataCb, void* context);
+	void SetADCScatterCallback(ScatterDataCallback scatterDataCb, void* context);
+
+	//must be called after InitDevice() and before Start()
+	bool SetDACTransferConfig(int outstandingTransfers, int packetPerTransfer);
+	bool SetADCTransferConfig(int outstandingTransfers, int packetPerTransfer);
+	bool SetFeedbackTransferConfig(int outstandingTransfers, int packetPerTransfer);
+	int GetDACQueuedTime();
+	int GetADCQueuedTime();
+
+	//must be called before Start()
+	bool SetSchedulerMode(int mode);
+	//microframes between current bus frame and first transfer, 0 - start ASAP
+	bool SetScheduleLead(int microframes);
+	int GetDACScheduleDelay();
+	int GetADCScheduleDelay();
+	int GetSchedulerMode()
+	{
+		return m_schedulerMode;
+	}
+	void GetSchedulerStatistics(SchedulerStatistics* stats);
+	//can be called while the stream is running
+	bool GetDACStatistics(EndpointStatistics* stats);
+	bool GetADCStatistics(EndpointStatistics* stats);
+	bool GetFeedbackStatistics(EndpointStatistics* stats);
+	//implicit feedback from ADC packets: filtered estimate (default) or raw transfer length
+	void SetImplicitFeedbackFilter(bool enable);
+	//device rate in samples per second and its uncertainty in ppm, FALSE if the estimator isn't locked
+	bool GetImplicitFeedbackRate(double* rate, double* uncertainty);
+	//rate the DAC follows (explicit or implicit feedback) and its range since start, samples per second
+	bool GetFeedbackRate(float* rate, float* minRate, float* maxRate);
+	//test hook: next count DAC transfers are handled as failed
+	void InjectDACErrors(int count);
 	void SetNotifyCallback(NotifyCallback notifyCallback, void* notifyCallbackContext)
 	{
 		m_notifyCallback = notifyCallback;
@@ -121,6 +217,15 @@ public:
 	{
 		return m_adcEndpoint ? m_adcEndpoint->m_interface->m_formatDescriptor.bSubslotSize : 0;
 	}
+	//bmFormats of the streaming alt setting, 0 if not declared
+	DWORD GetDACDataFormats()
+	{
+		return m_dacEndpoint ? m_dacEndpoint->m_interface->m_asgDescriptor.bmFormats : 0;
+	}
+	DWORD GetADCDataFormats()
+	{
+		return m_adcEndpoint ? m_adcEndpoint->m_interface->m_asgDescriptor.bmFormats : 0;
+	}
 	int GetDACBitResolution()
 	{
 		return m_dacEndpoint ? m_dacEndpoint->m_interface->m_formatDescriptor.bBitResolution : 0;
@@ -146,8 +251,14 @@ private:
 	AudioDAC*			m_dac;
 	AudioADC*			m_adc;
 	AudioFeedback*		m_feedback;
+	AudioService*		m_service;
+
+	FormatRequest		m_dacRequest;
+	FormatRequest		m_adcRequest;
 
 	bool				m_isStarted;
+	int					m_schedulerMode;
+	DWORD				m_startTick;
 };
 
 #endif //__USBAUDIO_DEVICE_H__
@@ -14,6 +14,13 @@
 */
 
 #include "UsbDevice.h"
+#ifdef _WIN32
+#include "libusbktransport.h"
+#elif defined(_USE_LIBUSB)
+#include "libusbtransport.h"
+#elif defined(_USE_USBFS)
+#include "usbfstransport.h"
+#endif
 
 
 union DESCRIPTORS_UNION
@@ -25,25 +32,27 @@ union DESCRIPTORS_UNION
 	USB_ENDPOINT_DESCRIPTOR*		Endpoint;
 };
 
-/*
-struct DeviceID
-{
-	USHORT vid;
-	USHORT pid;
-};
-
-DeviceID deviceID[] = { 
-	{0x16C0, 0x03E8},
-	{0x16C0, 0x05dc}
-};
-
-int deviceIDNum = sizeof(deviceID)/sizeof(DeviceID);
-*/
-
-#define _DeviceInterfaceGUID "{09e4c63c-ce0f-168c-1862-06410a764a35}"
-
-USBDevice::USBDevice() : m_usbDeviceHandle(NULL), m_deviceInfo(NULL), m_errorCode(ERROR_SUCCESS), m_deviceSpeed(HighSpeed), m_deviceMutex(NULL), m_deviceIsConnected(FALSE)
+USBDevice::USBDevice(USBTransport* transport) : m_transport(transport), m_ownTransport(FALSE), m_errorCode(ERROR_SUCCESS), m_deviceSpeed(HighSpeed), m_deviceMutex(NULL), m_deviceIsConnected(FALSE)
 {
+#ifdef _WIN32
+	if(m_transport == NULL)
+	{
+		m_transport = new LibUsbKTransport();
+		m_ownTransport = TRUE;
+	}
+#elif defined(_USE_LIBUSB)
+	if(m_transport == NULL)
+	{
+		m_transport = new LibUsbTransport();
+		m_ownTransport = TRUE;
+	}
+#elif defined(_USE_USBFS)
+	if(m_transport == NULL)
+	{
+		m_transport = new UsbFsTransport();
+		m_ownTransport = TRUE;
+	}
+#endif
 	InitDescriptors();
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: USBDevice()\n");
@@ -58,13 +67,14 @@ USBDevice::~USBDevice()
 #endif
 	if(m_deviceMutex)
 		CloseHandle(m_deviceMutex);
+	if(m_ownTransport)
+		delete m_transport;
 }
 
 void USBDevice::FreeDevice()
 {
-    // Close the device handle
-    // if handle is invalid (NULL), has no effect
-    UsbK_Free(m_usbDeviceHandle);
+	if(m_transport != NULL)
+		m_transport->Close();
 }
 
 void USBDevice::InitDescriptors()
@@ -86,6 +96,13 @@ bool USBDevice::ParseDescriptors(BYTE *configDescr, DWORD length)
 	{
 		curDescrPtr.Bytes = configDescr;
 		UCHAR curLen = curDescrPtr.Common->bLength;
+		if(curLen < sizeof(USB_DESCRIPTOR_HEADER) || curLen > remaining)
+		{
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: Malformed descriptor of length %d, %d bytes remaining\n", (int)curLen, (int)remaining);
+#endif
+			return FALSE;
+		}
 		if(curDescrPtr.Common->bDescriptorType == USB_DESCRIPTOR_TYPE_CONFIGURATION)
 			memcpy(&m_configDescriptor, curDescrPtr.Config, sizeof(USB_CONFIGURATION_DESCRIPTOR));
 		else
@@ -114,90 +131,15 @@ bool USBDevice::SendUsbControl(int dir, int type, int recipient, int request, in
 	defPkt->Length			= 0;
 
 	*lengthTransferred = 0;
-	if(UsbK_ControlTransfer(m_usbDeviceHandle, packet, buff, size, lengthTransferred, NULL))
+	if(m_transport->ControlTransfer(packet, buff, size, lengthTransferred))
 		return TRUE;
 	m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-	debugPrintf("ASIOUAC: UsbK_ControlTransfer failed. ErrorCode: %08Xh\n",  m_errorCode);
+	debugPrintf("ASIOUAC: ControlTransfer failed. ErrorCode: %08Xh\n",  m_errorCode);
 #endif
 	return FALSE;
 }
 
-KUSB_HANDLE USBDevice::FindDevice()
-{
-	KLST_HANDLE DeviceList = NULL;
-	KUSB_HANDLE handle = NULL;
-
-	m_deviceInfo = NULL;
-	KLST_DEVINFO_HANDLE tmpDeviceInfo = NULL;
-
-	UINT deviceCount = 0;
-	m_errorCode = ERROR_SUCCESS;
-
-	// Get the device list
-	if (!LstK_Init(&DeviceList, KLST_FLAG_NONE))
-	{
-#ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: Error initializing device list.\n");
-#endif
-		return NULL;
-	}
-
-	LstK_Count(DeviceList, &deviceCount);
-	if (!deviceCount)
-	{
-#ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: No devices in device list.\n");
-#endif
-		SetLastError(ERROR_DEVICE_NOT_CONNECTED);
-		// If LstK_Init returns TRUE, the list must be freed.
-		LstK_Free(DeviceList);
-		return NULL;
-	}
-
-#ifdef _ENABLE_TRACE
-	debugPrintf("ASIOUAC: Looking for device with DeviceInterfaceGUID %s\n", _T(_DeviceInterfaceGUID));
-#endif
-	LstK_MoveReset(DeviceList);
-    //
-    //
-    // Call LstK_MoveNext after a LstK_MoveReset to advance to the first
-    // element.
-    while(LstK_MoveNext(DeviceList, &tmpDeviceInfo)
-		&& m_deviceInfo == NULL)
-    {
-		if(!_stricmp(tmpDeviceInfo->DeviceInterfaceGUID, _DeviceInterfaceGUID) && tmpDeviceInfo->Connected)
-		{
-			m_deviceInfo = tmpDeviceInfo;
-			break;
-		}
-    }
-
-	if (!m_deviceInfo)
-	{
-#ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: Device not found.\n");
-#endif
-		// If LstK_Init returns TRUE, the list must be freed.
-		LstK_Free(DeviceList);
-		return NULL;
-	}
-
-    // Initialize the device with the "dynamic" Open function
-    if (!UsbK_Init(&handle, m_deviceInfo))
-    {
-		m_deviceInfo = NULL;
-		handle = NULL;
-        m_errorCode = GetLastErrorInternal();
-#ifdef _ENABLE_TRACE
-        debugPrintf("ASIOUAC: UsbK_Init failed. ErrorCode: %08Xh\n",  m_errorCode);
-#endif
-    }
-
-	LstK_Free(DeviceList);
-	return handle;
-}
-
 bool USBDevice::InitDevice()
 {
 	BYTE configDescriptorBuffer[4096];
@@ -221,36 +163,42 @@ bool USBDevice::InitDevice()
 	FreeDevice();
 	InitDescriptors();
 
-	m_usbDeviceHandle = FindDevice();
-	if(m_usbDeviceHandle == NULL)
+	if(m_transport == NULL)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: No USB transport on this platform\n");
+#endif
+		m_errorCode = ERROR_NOT_SUPPORTED;
 		return FALSE;
+	}
+	if(!m_transport->Open())
+	{
+		m_errorCode = GetLastError();
+		return FALSE;
+	}
 
-	lengthTransferred = sizeof(configDescriptorBuffer);
-	if(!UsbK_QueryDeviceInformation( m_usbDeviceHandle, DEVICE_SPEED, &lengthTransferred, configDescriptorBuffer))
+	if(!m_transport->GetDeviceSpeed(&m_deviceSpeed))
 	{
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-        debugPrintf("ASIOUAC: UsbK_QueryDeviceInformation failed. ErrorCode: %08Xh\n",  m_errorCode);
+        debugPrintf("ASIOUAC: Query device speed failed. ErrorCode: %08Xh\n",  m_errorCode);
 #endif
-	    UsbK_Free(m_usbDeviceHandle);
-		m_usbDeviceHandle = NULL;
+		m_transport->Close();
 		return FALSE;
 	}
-	m_deviceSpeed = (int)configDescriptorBuffer[0];
 #ifdef _ENABLE_TRACE
 	if(m_deviceSpeed == HighSpeed)
         debugPrintf("ASIOUAC: Device speed: high\n");
 	else
         debugPrintf("ASIOUAC: Device speed: low/full\n");
 #endif
-	if(!UsbK_GetDescriptor(m_usbDeviceHandle, USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, configDescriptorBuffer, sizeof(configDescriptorBuffer), &lengthTransferred))
+	if(!m_transport->GetDescriptor(USB_DESCRIPTOR_TYPE_DEVICE, 0, 0, configDescriptorBuffer, sizeof(configDescriptorBuffer), &lengthTransferred))
 	{
         m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
         debugPrintf("ASIOUAC: Get device descriptor failed. ErrorCode: %08Xh\n",  m_errorCode);
 #endif
-	    UsbK_Free(m_usbDeviceHandle);
-		m_usbDeviceHandle = NULL;
+		m_transport->Close();
 		return FALSE;
 	}
 	memcpy(&m_deviceDescriptor, configDescriptorBuffer, sizeof(USB_DEVICE_DESCRIPTOR));
@@ -261,7 +209,7 @@ bool USBDevice::InitDevice()
 	{
 		ParseDescriptors(configDescriptorBuffer, lengthTransferred);
 		m_deviceIsConnected = TRUE;
-		return m_usbDeviceHandle != NULL;
+		return TRUE;
 	}
 	else
 	{
@@ -269,8 +217,7 @@ bool USBDevice::InitDevice()
 #ifdef _ENABLE_TRACE
         debugPrintf("ASIOUAC: Get config descriptor failed. ErrorCode: %08Xh\n",  m_errorCode);
 #endif
-	    UsbK_Free(m_usbDeviceHandle);
-		m_usbDeviceHandle = NULL;
+		m_transport->Close();
 		return FALSE;
 	}
 }
@@ -16,12 +16,8 @@
 #ifndef __USB_DEVICE_H__
 #define __USB_DEVICE_H__
 
-#include "targetver.h"
-#include <stdio.h>
-#include <tchar.h>
-#include <windows.h>
-
-#include <libusbk.h>
+#include "platform.h"
+#include "usbtransport.h"
 #include "usb_audio.h"
 
 #ifdef _ENABLE_TRACE
@@ -49,10 +45,9 @@ class USBDevice
 	USB_DEVICE_DESCRIPTOR			m_deviceDescriptor;
 	//
 	USB_CONFIGURATION_DESCRIPTOR	m_configDescriptor;
-	//
-	KUSB_HANDLE						m_usbDeviceHandle;
-
-	KLST_DEVINFO_HANDLE				m_deviceInfo;
+	//bus access, owned if the device created it
+	USBTransport*					m_transport;
+	bool							m_ownTransport;
 
 
 	//device speed LowSpeed=0x01, FullSpeed=0x02, HighSpeed=0x03
@@ -60,14 +55,14 @@ class USBDevice
 	HANDLE							m_deviceMutex;
 
 
-	KUSB_HANDLE FindDevice();
-	bool ParseDescriptors(BYTE *configDescr, DWORD length);
 	void InitDescriptors();
 
 	bool							m_deviceIsConnected;
 protected:
 	DWORD							m_errorCode;
 
+	bool ParseDescriptors(BYTE *configDescr, DWORD length);
+
 	virtual void FreeDevice();
 
 	bool SendUsbControl(int dir, int type, int recipient, int request, int value, int index,
@@ -75,7 +70,7 @@ protected:
 
 	virtual bool ParseDescriptorInternal(USB_DESCRIPTOR_HEADER* uDescriptor) = 0;
 
-	bool IsConnected() { return m_deviceInfo != NULL && m_deviceIsConnected; }
+	bool IsConnected() { return IsValidDevice() && m_deviceIsConnected; }
 
 	void CheckError(int currentError)
 	{
@@ -95,11 +90,17 @@ protected:
 		return lastError;
 	}
 public:
-	USBDevice();
+	//without a transport the platform default one is used (libusbK on Windows, libusb-1.0 with _USE_LIBUSB, usbfs with _USE_USBFS)
+	USBDevice(USBTransport* transport = NULL);
 	virtual ~USBDevice();
 	virtual bool InitDevice();
 
-	virtual bool IsValidDevice() { return m_usbDeviceHandle != NULL; }
+	virtual bool IsValidDevice() { return m_transport != NULL && m_transport->IsOpen(); }
+
+	USBTransport* GetTransport()
+	{
+		return m_transport;
+	}
 
 	DWORD GetErrorCode() 
 	{
@@ -111,48 +112,65 @@ public:
 		m_errorCode = ERROR_SUCCESS;
 	}
 
+	//transfers went through again after failed ones, the device wasn't lost
+	void ClearDisconnected()
+	{
+		m_deviceIsConnected = IsValidDevice();
+	}
+
 	bool OvlInit(KOVL_POOL_HANDLE* PoolHandle, LONG MaxOverlappedCount)
 	{
-		if(OvlK_Init(PoolHandle, m_usbDeviceHandle, MaxOverlappedCount, KOVL_POOL_FLAG_NONE))
+		if(m_transport->OvlInit(PoolHandle, MaxOverlappedCount))
+			return TRUE;
+		m_errorCode = GetLastErrorInternal();
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: OvlInit failed. ErrorCode: %08Xh\n", m_errorCode);
+#endif
+		return FALSE;
+	}
+
+	bool OvlFree(KOVL_POOL_HANDLE PoolHandle)
+	{
+		if(m_transport->OvlFree(PoolHandle))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: OvlK_Init failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: OvlFree failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
     bool OvlAcquire(KOVL_HANDLE* OverlappedK, KOVL_POOL_HANDLE PoolHandle)
 	{
-		if(OvlK_Acquire(OverlappedK, PoolHandle))
+		if(m_transport->OvlAcquire(OverlappedK, PoolHandle))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: OvlK_Acquire failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: OvlAcquire failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
 	bool OvlWait(KOVL_HANDLE OverlappedK, LONG TimeoutMS, KOVL_WAIT_FLAG WaitFlags, PUINT TransferredLength)
 	{
-		if(OvlK_Wait(OverlappedK, TimeoutMS, WaitFlags, TransferredLength))
+		if(m_transport->OvlWait(OverlappedK, TimeoutMS, WaitFlags, TransferredLength))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: OvlK_Wait failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: OvlWait failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
     bool OvlWaitOrCancel(KOVL_HANDLE OverlappedK, LONG TimeoutMS, PUINT TransferredLength)
 	{
-		if(OvlK_WaitOrCancel(OverlappedK, TimeoutMS, TransferredLength))
+		if(m_transport->OvlWaitOrCancel(OverlappedK, TimeoutMS, TransferredLength))
 			return TRUE;
 		if(TimeoutMS != 0) // we are just cancel request, no errors report
 		{
 			m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-			debugPrintf("ASIOUAC: OvlK_WaitOrCancel failed. ErrorCode: %08Xh\n", m_errorCode);
+			debugPrintf("ASIOUAC: OvlWaitOrCancel failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		}
 		return FALSE;
@@ -160,78 +178,109 @@ public:
 
 	bool OvlRelease(KOVL_HANDLE OverlappedK)
 	{
-		if(OvlK_Release(OverlappedK))
+		if(m_transport->OvlRelease(OverlappedK))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: OvlK_Release failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: OvlRelease failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
 	bool OvlReUse(KOVL_HANDLE OverlappedK)
 	{
-		if(OvlK_ReUse(OverlappedK))
+		if(m_transport->OvlReUse(OverlappedK))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: OvlK_ReUse failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: OvlReUse failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
+	HANDLE OvlGetEventHandle(KOVL_HANDLE OverlappedK)
+	{
+		return m_transport->OvlGetEventHandle(OverlappedK);
+	}
+
 
     bool UsbResetPipe(UCHAR PipeId)
 	{
-		if(UsbK_ResetPipe(m_usbDeviceHandle, PipeId))
+		if(m_transport->ResetPipe(PipeId))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_ResetPipe failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: ResetPipe failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
     bool UsbAbortPipe(UCHAR PipeId)
 	{
-		if(UsbK_AbortPipe(m_usbDeviceHandle, PipeId))
+		if(m_transport->AbortPipe(PipeId))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_AbortPipe failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: AbortPipe failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
-	bool UsbIsoWritePipe(UCHAR PipeID, PUCHAR Buffer, ULONG BufferLength, LPOVERLAPPED Overlapped, PKISO_CONTEXT IsoContext)
+	bool UsbIsoWritePipe(UCHAR PipeID, PUCHAR Buffer, ULONG BufferLength, KOVL_HANDLE OverlappedK, PKISO_CONTEXT IsoContext)
 	{
 		DWORD lastError;
-		if(UsbK_IsoWritePipe (m_usbDeviceHandle, PipeID, Buffer, BufferLength, Overlapped, IsoContext) || 
+		if(m_transport->IsoWritePipe(PipeID, Buffer, BufferLength, OverlappedK, IsoContext) || 
 			ERROR_IO_PENDING == (lastError = GetLastErrorInternal()))
 			return TRUE;
 		m_errorCode = lastError;
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_IsoWritePipe failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: IsoWritePipe failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
-	bool UsbIsoReadPipe (UCHAR PipeID, PUCHAR Buffer, ULONG BufferLength, LPOVERLAPPED Overlapped, PKISO_CONTEXT IsoContext)
+	bool UsbIsoReadPipe (UCHAR PipeID, PUCHAR Buffer, ULONG BufferLength, KOVL_HANDLE OverlappedK, PKISO_CONTEXT IsoContext)
 	{
 		DWORD lastError;
-		if(UsbK_IsoReadPipe (m_usbDeviceHandle, PipeID, Buffer, BufferLength, Overlapped, IsoContext) || 
+		if(m_transport->IsoReadPipe(PipeID, Buffer, BufferLength, OverlappedK, IsoContext) || 
 			ERROR_IO_PENDING == (lastError = GetLastErrorInternal()))
 			return TRUE;
 		m_errorCode = lastError;
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_IsoReadPipe failed. ErrorCode: %08Xh\n", m_errorCode);
+		debugPrintf("ASIOUAC: IsoReadPipe failed. ErrorCode: %08Xh\n", m_errorCode);
+#endif
+		return FALSE;
+	}
+
+	//LowSpeed=0x01, FullSpeed=0x02, HighSpeed=0x03
+	int GetDeviceSpeed()
+	{
+		return m_deviceSpeed;
+	}
+
+	//most packets per ISO transfer, 0 - no limit of the transport
+	int UsbGetMaxIsoPackets()
+	{
+		return m_transport->GetMaxIsoPackets();
+	}
+
+	bool UsbGetCurrentFrameNumber(PUINT FrameNumber)
+	{
+		if(m_transport->GetCurrentFrameNumber(FrameNumber))
+			return TRUE;
+		m_errorCode = GetLastError();
+		//libusb and usbfs have no frame number, the device is still there
+		if(m_errorCode != ERROR_NOT_SUPPORTED)
+			CheckError(m_errorCode);
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: GetCurrentFrameNumber failed. ErrorCode: %08Xh\n", m_errorCode);
 #endif
 		return FALSE;
 	}
 
 	bool UsbSetPipePolicy(UCHAR PipeID, ULONG PolicyType, ULONG ValueLength, PVOID Value)
 	{
-		if(UsbK_SetPipePolicy(m_usbDeviceHandle, PipeID, PolicyType, ValueLength,  Value))
+		if(m_transport->SetPipePolicy(PipeID, PolicyType, ValueLength, Value))
 			return TRUE;
 
 		return FALSE;
@@ -239,33 +288,33 @@ public:
 
 	bool UsbClaimInterface(UCHAR Number)
 	{
-		if(UsbK_ClaimInterface (m_usbDeviceHandle, Number, FALSE))
+		if(m_transport->ClaimInterface(Number))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_ClaimInterface %d failed. ErrorCode: %08Xh\n", Number, m_errorCode);
+		debugPrintf("ASIOUAC: ClaimInterface %d failed. ErrorCode: %08Xh\n", Number, m_errorCode);
 #endif
 		return FALSE;
 	}
 
 	bool UsbSetAltInterface(UCHAR Number, UCHAR AltSettingNumber)
 	{
-		if(UsbK_SetAltInterface(m_usbDeviceHandle, Number, FALSE, AltSettingNumber))
+		if(m_transport->SetAltInterface(Number, AltSettingNumber))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_SetAltInterface %d (alt %d) failed. ErrorCode: %08Xh\n", Number, AltSettingNumber, m_errorCode);
+		debugPrintf("ASIOUAC: SetAltInterface %d (alt %d) failed. ErrorCode: %08Xh\n", Number, AltSettingNumber, m_errorCode);
 #endif
 		return FALSE;
 	}
 
 	bool UsbReleaseInterface(UCHAR Number)
 	{
-		if(UsbK_ReleaseInterface (m_usbDeviceHandle, Number, FALSE))
+		if(m_transport->ReleaseInterface(Number))
 			return TRUE;
 		m_errorCode = GetLastErrorInternal();
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: UsbK_ReleaseInterface %d failed. ErrorCode: %08Xh\n", Number, m_errorCode);
+		debugPrintf("ASIOUAC: ReleaseInterface %d failed. ErrorCode: %08Xh\n", Number, m_errorCode);
 #endif
 		return FALSE;
 	}
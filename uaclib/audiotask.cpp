@@ -17,12 +17,337 @@
 #include "audiotask.h"
 
 
-#define NEXT_INDEX(x)		((x + 1) % (sizeof(m_isoBuffers) / sizeof(ISOBuffer)))
+#define NEXT_INDEX(x)		((x + 1) % m_isoBuffersCount)
 
 #define MAX_OVL_ERROR_COUNT	3
+//consecutive in-place recoveries before the host is asked to reset
+#define MAX_RECOVERY_ATTEMPTS	3
 #define OVL_WAIT_TIMEOUT	100
 
 
+static LONGLONG PerfCounter()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+static float PerfTicksToUs(LONGLONG ticks)
+{
+	static LONGLONG frequency = 0;
+	if(frequency == 0)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		frequency = freq.QuadPart;
+	}
+	return (float)((double)ticks * 1000000. / (double)frequency);
+}
+
+
+static ULONG GreatestCommonDivisor(ULONG a, ULONG b)
+{
+	while(b != 0)
+	{
+		ULONG t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+void PacketScheduler::Init(int freq, int packetsPerSecond)
+{
+	m_nominalNum = 0;
+	m_nominalDen = 1;
+	m_nominalFeedback = 0;
+	m_patternBand = 0;
+	m_patternLength = 0;
+	if(freq <= 0 || packetsPerSecond <= 0)
+	{
+		Reset();
+		return;
+	}
+	ULONG gcd = GreatestCommonDivisor(freq, packetsPerSecond);
+	m_nominalNum = freq / gcd;
+	m_nominalDen = packetsPerSecond / gcd;
+	m_nominalFeedback = (ULONG)((((ULONGLONG)m_nominalNum << 16) + m_nominalDen / 2) / m_nominalDen);
+	m_patternBand = ((ULONGLONG)m_nominalNum << 16) * PACKET_PATTERN_BAND_PPM / 1000000;
+
+	//one cycle of nominal lengths (e.g. 80 packets of 5 or 6 samples for 44.1 kHz)
+	if(m_nominalDen <= PACKET_PATTERN_MAX)
+	{
+		ULONG remainder = 0;
+		for(ULONG i = 0; i < m_nominalDen; i++)
+		{
+			remainder += m_nominalNum;
+			m_pattern[i] = (USHORT)(remainder / m_nominalDen);
+			remainder %= m_nominalDen;
+			m_patternRemainder[i] = (USHORT)remainder;
+		}
+		m_patternLength = m_nominalDen;
+	}
+	Reset();
+}
+
+void PacketScheduler::Reset()
+{
+	m_num = (ULONGLONG)m_nominalNum << 16;
+	m_den = m_nominalDen << 16;
+	m_remainder = 0;
+	m_patternPos = 0;
+	m_usePattern = m_patternLength > 0;
+	m_patternDelta = 0;
+	m_patternDrift = 0;
+	m_stableCount = PACKET_PATTERN_HOLD;
+}
+
+void PacketScheduler::SetRate(ULONGLONG num)
+{
+	ULONGLONG nominal = (ULONGLONG)m_nominalNum << 16;
+	if(num > nominal + m_patternBand || num + m_patternBand < nominal)
+	{
+		//drifted off nominal
+		m_stableCount = 0;
+		if(m_usePattern)
+			LeavePattern();
+	}
+	else if(m_stableCount < PACKET_PATTERN_HOLD)
+		m_stableCount++;
+	m_num = num;
+	m_patternDelta = (LONGLONG)(num - nominal);
+	if(!m_usePattern && m_stableCount >= PACKET_PATTERN_HOLD && m_patternLength > 0)
+		EnterPattern();
+}
+
+void PacketScheduler::EnterPattern()
+{
+	//pattern position p has accumulated fraction (p * num) % den in the high part of the remainder,
+	//nominal packets never change the low 16 bits left over from feedback rates
+	ULONG target = m_remainder >> 16;
+	ULONG remainder = 0;
+	for(int i = 0; i < m_patternLength; i++)
+	{
+		if(remainder == target)
+		{
+			m_patternPos = i;
+			m_patternDrift = m_remainder & 0xFFFF;
+			m_usePattern = TRUE;
+			return;
+		}
+		remainder = (remainder + m_nominalNum) % m_nominalDen;
+	}
+}
+
+void PacketScheduler::LeavePattern()
+{
+	//drift is kept within the fraction range by NextPacket
+	ULONG high = (ULONG)(((ULONGLONG)m_patternPos * m_nominalNum) % m_nominalDen) << 16;
+	m_remainder = (ULONG)(high + m_patternDrift);
+	m_usePattern = FALSE;
+}
+
+void PacketScheduler::SetFeedback(ULONG feedback)
+{
+	//device runs at nominal rate: use exact fraction instead of rounded 16.16 value
+	ULONGLONG num = feedback == 0 || feedback == m_nominalFeedback ? (ULONGLONG)m_nominalNum << 16 : (ULONGLONG)feedback * m_nominalDen;
+	if(num == m_num)
+	{
+		if(!m_usePattern && m_stableCount < PACKET_PATTERN_HOLD)
+			SetRate(num);
+		return;
+	}
+	SetRate(num);
+}
+
+int PacketScheduler::NextPacket()
+{
+	if(m_usePattern)
+	{
+		int len = m_pattern[m_patternPos];
+		ULONG high = m_patternRemainder[m_patternPos];
+		if(++m_patternPos == m_patternLength)
+			m_patternPos = 0;
+		//same lengths as the fraction path: remainder is the pattern fraction + drift
+		m_patternDrift += m_patternDelta;
+		LONGLONG remainder = ((LONGLONG)high << 16) + m_patternDrift;
+		if(remainder >= (LONGLONG)m_den)
+		{
+			len++;
+			m_patternDrift -= m_den;
+		}
+		else if(remainder < 0)
+		{
+			len--;
+			m_patternDrift += m_den;
+		}
+		return len;
+	}
+	ULONGLONG acc = m_remainder + m_num;
+	ULONG len = (ULONG)(acc / m_den);
+	m_remainder = (ULONG)(acc - (ULONGLONG)len * m_den);
+	return (int)len;
+}
+
+
+void RateEstimator::Init(int freq, int packetsPerSecond)
+{
+	m_packetsPerSecond = packetsPerSecond;
+	m_nominal = packetsPerSecond > 0 ? (double)freq / packetsPerSecond : 0.;
+	Reset();
+}
+
+void RateEstimator::Reset()
+{
+	m_windowPos = 0;
+	m_windowCount = 0;
+	m_windowSum = 0;
+	m_estimate = m_nominal;
+	m_phaseError = 0.;
+	m_absError = 0.;
+	m_packets = 0;
+	SetBandwidth(RATE_ACQUIRE_BANDWIDTH);
+}
+
+void RateEstimator::SetBandwidth(double bandwidth)
+{
+	//second order loop, damping 0.707, natural frequency in radians per packet
+	double omega = m_packetsPerSecond > 0 ? 2. * 3.14159265358979 * bandwidth / m_packetsPerSecond : 0.;
+	m_k1 = 2. * RATE_LOOP_DAMPING * omega;
+	m_k2 = omega * omega;
+	m_tau = omega > 0. ? 1. / omega : 1.;
+}
+
+void RateEstimator::AddPacket(int samples)
+{
+	if(m_windowCount == RATE_WINDOW_PACKETS)
+		m_windowSum -= m_window[m_windowPos];
+	else
+		m_windowCount++;
+	m_window[m_windowPos] = (USHORT)samples;
+	m_windowSum += samples;
+	m_windowPos = (m_windowPos + 1) & (RATE_WINDOW_PACKETS - 1);
+	m_packets++;
+
+	if(m_packets <= RATE_WINDOW_PACKETS)
+	{
+		//acquisition: plain window average
+		m_estimate = (double)m_windowSum / m_windowCount;
+		return;
+	}
+	if(m_packets == 2 * RATE_WINDOW_PACKETS)
+		SetBandwidth(RATE_TRACK_BANDWIDTH);
+
+	//second order loop: phase error corrects phase proportionally and rate integrally
+	double error = m_phaseError + samples - m_estimate;
+	m_estimate += m_k2 * error;
+	m_phaseError = error - m_k1 * error;
+	m_absError += (fabs(error) - m_absError) / RATE_WINDOW_PACKETS;
+}
+
+double RateEstimator::GetUncertainty()
+{
+	if(m_estimate <= 0. || m_packets <= RATE_WINDOW_PACKETS)
+		return 1e6;
+	//phase error kept over the loop time constant is the rate error
+	return (m_absError / m_tau) / m_estimate * 1e6;
+}
+
+
+void FeedbackDecoder::Init(int valueSize, bool highSpeed, int updateRate, double nominalRate)
+{
+	m_valueSize = valueSize;
+	m_highSpeed = highSpeed;
+	m_updateRate = updateRate > 0 ? updateRate : 1;
+	m_nominalRate = nominalRate;
+
+	//same loop as RateEstimator, natural frequency in radians per feedback update
+	double omega = 2. * 3.14159265358979 * FEEDBACK_LOOP_BANDWIDTH / m_updateRate;
+	m_k1 = 2. * RATE_LOOP_DAMPING * omega;
+	m_k2 = omega * omega;
+	Reset();
+}
+
+void FeedbackDecoder::Reset()
+{
+	m_shift = 0;
+	m_shiftDetected = FALSE;
+	m_estimate = 0.;
+	m_phaseError = 0.;
+	m_valid = FALSE;
+	m_outliers = 0;
+	m_rejectedCount = 0;
+}
+
+double FeedbackDecoder::Decode(const UCHAR* value)
+{
+	ULONG raw = value[0] | (value[1] << 8) | (value[2] << 16);
+	if(m_valueSize >= 4)
+		raw |= (ULONG)value[3] << 24;
+	if(raw == 0)
+		return 0.;
+
+	double freq;
+	if(m_highSpeed)
+		freq = raw / 65536. * 8000.;	//16.16 per microframe
+	else if(m_valueSize == 3)
+		freq = raw / 16384. * 1000.;	//10.14 per frame
+	else
+		freq = raw / 65536. * 1000.;	//16.16 per frame
+
+	if(!m_shiftDetected && m_nominalRate > 0.)
+	{
+		//look for the binary point which gives a value near the nominal rate
+		for(int shift = -4; shift <= 4; shift++)
+		{
+			double f = ldexp(freq, shift);
+			if(f > m_nominalRate * 0.75 && f < m_nominalRate * 1.25)
+			{
+				m_shift = shift;
+				m_shiftDetected = TRUE;
+#ifdef _ENABLE_TRACE
+				if(shift != 0)
+					debugPrintf("ASIOUAC: Feedback format corrected by %d bits\n", shift);
+#endif
+				break;
+			}
+		}
+		if(!m_shiftDetected)
+			return 0.;
+	}
+	return ldexp(freq, m_shift);
+}
+
+void FeedbackDecoder::AddValue(const UCHAR* value)
+{
+	double freq = Decode(value);
+	if(freq <= 0.)
+		return;
+	double samples = freq / m_updateRate;
+
+	if(!m_valid || m_outliers >= FEEDBACK_MAX_OUTLIERS)
+	{
+		//(re)acquisition: start from the measured value
+		m_estimate = samples;
+		m_phaseError = 0.;
+		m_outliers = 0;
+		m_valid = TRUE;
+		return;
+	}
+	if(fabs(samples - m_estimate) > m_estimate * FEEDBACK_OUTLIER_RATIO)
+	{
+		m_outliers++;
+		m_rejectedCount++;
+		return;
+	}
+	m_outliers = 0;
+
+	double error = m_phaseError + samples - m_estimate;
+	m_estimate += m_k2 * error;
+	m_phaseError = error - m_k1 * error;
+}
+
+
 bool AudioTask::BeforeStart()
 {
 	if(m_DataBufferSize == 0 || m_packetPerTransfer == 0 || m_packetSize == 0)
@@ -32,7 +357,7 @@ bool AudioTask::BeforeStart()
 #endif
 		return FALSE;
 	}
-	if(!m_isoBuffers[0].DataBuffer)
+	if(!BufferIsAllocated())
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. Can't start AudioTask thread: buffers not allocated\n", TaskName());
@@ -44,17 +369,30 @@ bool AudioTask::BeforeStart()
 	m_CompletedCount = 0;
 	m_FrameNumber = 0;
 	m_LastStartFrame = 0;
+	m_scheduleValid = FALSE;
+	m_scheduleDelay = 0;
+	m_scheduleDelayMax = 0;
+	m_scheduleResyncCount = 0;
 	m_isoTransferErrorCount = 0;
+	m_injectedErrors = 0;
+	m_recoveryAttempts = 0;
+	m_recoveryStart = 0;
+	ClearStatistics();
+	m_wakeupCount = 0;
+	m_resubmitCount = 0;
+	m_completionTime = 0;
+	m_resubmitTimeSum = 0;
+	m_resubmitTimeMax = 0;
 
-	bool r = m_device->OvlInit(&m_OvlPool, MAX_OUTSTANDING_TRANSFERS);
+	bool r = m_device->OvlInit(&m_OvlPool, m_isoBuffersCount);
 	if(!r)
 	{
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: %s. Can't start AudioTask thread: OvlK_Init failed\n", TaskName());
+		debugPrintf("ASIOUAC: %s. Can't start AudioTask thread: OvlInit failed\n", TaskName());
 #endif
 		return FALSE;
 	}
-	for(int i = 0; i < sizeof(m_isoBuffers) / sizeof(ISOBuffer); i++)
+	for(int i = 0; i < m_isoBuffersCount; i++)
 	{
 		ISOBuffer* bufferEL = m_isoBuffers + i;
 		memset(bufferEL->DataBuffer, 0xAA, m_DataBufferSize);
@@ -70,6 +408,12 @@ bool AudioTask::BeforeStart()
     r = m_device->UsbResetPipe((UCHAR)m_pipeId);
 
 	BeforeStartInternal();
+
+	//with frame scheduling StartFrame of every transfer is set explicitly,
+	//the configured lead is tried again on every start
+	m_scheduleActive = m_scheduleLead != 0;
+	UCHAR policyValue = !m_scheduleActive;
+	m_device->UsbSetPipePolicy((UCHAR)m_pipeId, ISO_ALWAYS_START_ASAP, 1, &policyValue);
 	m_isStarted = TRUE;
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: %s. Before start thread is OK\n", TaskName());
@@ -79,18 +423,10 @@ bool AudioTask::BeforeStart()
 	return TRUE;
 }
 
-bool AudioTask::AfterStop()
+void AudioTask::CancelTransfers()
 {
-	if(!m_isStarted)
-		return TRUE;
-
 	m_device->UsbAbortPipe((UCHAR)m_pipeId);
 
-	//index of last buffer in queue
-	m_outstandingIndex;
-	//index of last received buffer
-	m_completedIndex;
-
     //  Cancel all transfers left outstanding.
 #ifdef _ENABLE_TRACE
 	debugPrintf("ASIOUAC: %s. Cancel outstanding transfers\n", TaskName());
@@ -103,17 +439,61 @@ bool AudioTask::AfterStop()
 		m_completedIndex = NEXT_INDEX(m_completedIndex);
     }
 	m_device->ClearErrorCode();
-	for(int i = 0; i < sizeof(m_isoBuffers) / sizeof(ISOBuffer); i++)
+}
+
+bool AudioTask::RecoverStream()
+{
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: %s. Try recover stream (attempt %d)\n", TaskName(), m_recoveryAttempts + 1);
+#endif
+	if(m_recoveryStart == 0)
+		m_recoveryStart = PerfCounter();
+
+	CancelTransfers();
+	if(!m_device->UsbResetPipe((UCHAR)m_pipeId))
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Recover stream failed: can't reset pipe\n", TaskName());
+#endif
+		return FALSE;
+	}
+
+	//ring is empty, restart it from the first buffer on a new schedule
+	m_outstandingIndex = 0;
+	m_completedIndex = 0;
+	m_scheduleValid = FALSE;
+	m_completionTime = 0;
+	m_isoTransferErrorCount = 0;
+	m_recoveryAttempts++;
+	InterlockedIncrement(&m_statRecoveries);
+	RecoverInternal();
+	return TRUE;
+}
+
+void AudioTask::InjectTransferErrors(int count)
+{
+	InterlockedExchange(&m_injectedErrors, count);
+}
+
+bool AudioTask::AfterStop()
+{
+	if(!m_isStarted)
+		return TRUE;
+
+	CancelTransfers();
+	for(int i = 0; i < m_isoBuffersCount; i++)
 	{
 		//  Free the iso buffer resources.
 		ISOBuffer* bufferEL = m_isoBuffers + i;
 		m_device->OvlRelease(bufferEL->OvlHandle);
 	}
     // Free the overlapped pool.
-    OvlK_Free(m_OvlPool);
+    m_device->OvlFree(m_OvlPool);
 	m_isStarted = FALSE;
 	AfterStopInternal();
 #ifdef _ENABLE_TRACE
+	if(m_scheduleActive)
+		debugPrintf("ASIOUAC: %s. Schedule delay max %d us, resync count %d\n", TaskName(), m_scheduleDelayMax, m_scheduleResyncCount);
 	debugPrintf("ASIOUAC: %s. After stop thread is OK\n", TaskName());
 #endif
 
@@ -123,15 +503,12 @@ bool AudioTask::AfterStop()
 bool AudioTask::FreeBuffers()
 {
     //  Free the iso buffer resources.
-	if(m_isoBuffers[0].DataBuffer != NULL)
-		for(int i = 0; i < sizeof(m_isoBuffers) / sizeof(ISOBuffer); i++)
-		{
-			ISOBuffer* nextBufferEL = m_isoBuffers + i;
-			IsoK_Free(nextBufferEL->IsoContext);
-			nextBufferEL->IsoContext = NULL;
-			delete nextBufferEL->DataBuffer;
-			nextBufferEL->DataBuffer = NULL;
-		}
+	if(m_arena != NULL)
+		VirtualFree(m_arena, 0, MEM_RELEASE);
+	m_arena = NULL;
+	m_arenaSize = 0;
+	m_isoBuffers = NULL;
+	m_isoBuffersCount = 0;
 	m_outstandingIndex = 0;
 	m_completedIndex = 0;
 #ifdef _ENABLE_TRACE
@@ -151,14 +528,52 @@ bool AudioTask::AllocBuffers()
 	}
 	m_DataBufferSize = m_packetPerTransfer * m_packetSize;
 
-    for (int i = 0; i < sizeof(m_isoBuffers) / sizeof(ISOBuffer); i++)
+	//arena is sized by the endpoint max packet size (i.e. the highest sample rate),
+	//so sample rate changes only re-partition it
+	int maxPacketSize = m_maximumPacketSize > m_packetSize ? m_maximumPacketSize : m_packetSize;
+	int ringSize = m_outstandingTransfers + 1;
+	ULONG dataStride = ALIGN_SIZE(m_packetPerTransfer * maxPacketSize, CACHE_LINE_SIZE);
+	ULONG isoStride = ALIGN_SIZE(sizeof(KISO_CONTEXT) + m_packetPerTransfer * sizeof(KISO_PACKET), CACHE_LINE_SIZE);
+	ULONG arenaSize = ringSize * (dataStride + isoStride) + ringSize * sizeof(ISOBuffer);
+
+	if(arenaSize > m_arenaSize)
+	{
+		FreeBuffers();
+		m_arena = (PUCHAR)VirtualAlloc(NULL, arenaSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if(m_arena == NULL)
+		{
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: %s. Can't allocate %d bytes for buffers\n", TaskName(), arenaSize);
+#endif
+			return FALSE;
+		}
+		m_arenaSize = arenaSize;
+		m_arenaAllocCount++;
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Allocated buffers arena %d bytes (allocation #%d)\n", TaskName(), arenaSize, m_arenaAllocCount);
+#endif
+	}
+
+	//data buffers first (page aligned), then ISO contexts, then ring descriptors
+	PUCHAR isoBlock = m_arena + ringSize * dataStride;
+	m_isoBuffers = (ISOBuffer*)(isoBlock + ringSize * isoStride);
+	m_isoBuffersCount = ringSize;
+	m_outstandingIndex = 0;
+	m_completedIndex = 0;
+
+    for (int i = 0; i < m_isoBuffersCount; i++)
     {
         ISOBuffer* bufferEL = m_isoBuffers + i;
-        bufferEL->DataBuffer = new UCHAR[m_DataBufferSize];
+		bufferEL->OvlHandle = NULL;
+		bufferEL->DataBuffer = m_arena + i * dataStride;
         memset(bufferEL->DataBuffer, 0xAA, m_DataBufferSize);
         //memset(bufferEL->DataBuffer, 0, m_DataBufferSize);
-        IsoK_Init(&bufferEL->IsoContext, m_packetPerTransfer, 0);
+		//same layout as IsoK_Init allocates
+		bufferEL->IsoContext = (KISO_CONTEXT*)(isoBlock + i * isoStride);
+		memset(bufferEL->IsoContext, 0, isoStride);
+		bufferEL->IsoContext->NumberOfPackets = m_packetPerTransfer;
         IsoK_SetPackets(bufferEL->IsoContext, m_packetSize);
+		bufferEL->IsoPackets = bufferEL->IsoContext->IsoPackets;
     }
 
 #ifdef _ENABLE_TRACE
@@ -167,58 +582,289 @@ bool AudioTask::AllocBuffers()
 		return TRUE;
 }
 
-bool AudioTask::Work(volatile TaskState& taskState)
+bool AudioTask::CanSampleFreq(int freq)
+{
+	if(m_maximumPacketSize == 0)
+		return TRUE;
+	//nominal packet rounded up must fit into the endpoint payload
+	double packetFrames = (double)freq / PacketsPerSecond();
+	return m_channelNumber * m_sampleSize * (int)ceil(packetFrames) <= m_maximumPacketSize;
+}
+
+bool AudioTask::SetPacketSize(int freq)
+{
+	if(!CanSampleFreq(freq))
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Sample rate %d exceeds endpoint bandwidth (%d bytes per packet)\n", TaskName(), freq, (int)m_maximumPacketSize);
+#endif
+		return FALSE;
+	}
+	int frameSize = m_channelNumber * m_sampleSize;
+	m_defaultPacketSize = (float)freq / PacketsPerSecond(); // size in stereo samples in packet
+	m_packetSize = frameSize * ((int)m_defaultPacketSize + 1); //size in bytes = (packetSize + 1 extra frame) * size of frame
+	//endpoint without room for the extra frame
+	if(m_maximumPacketSize != 0 && m_packetSize > m_maximumPacketSize)
+		m_packetSize = m_maximumPacketSize / frameSize * frameSize;
+	return TRUE;
+}
+
+bool AudioTask::IsHighSpeed()
+{
+	return m_device == NULL || m_device->GetDeviceSpeed() == HighSpeed;
+}
+
+int AudioTask::PacketsPerSecond()
+{
+	//isochronous endpoint serviced every 2^(bInterval-1) microframes (high speed) or frames (full speed)
+	int packetsPerSecond = IsHighSpeed() ? 8000 : 1000;
+	if(m_interval > 1)
+		packetsPerSecond >>= m_interval - 1;
+	return packetsPerSecond > 0 ? packetsPerSecond : 1;
+}
+
+int AudioTask::PacketsPerFrame()
+{
+	int packetsPerFrame = PacketsPerSecond() / 1000;
+	return packetsPerFrame > 0 ? packetsPerFrame : 1;
+}
+
+int AudioTask::FramesPerTransfer()
+{
+	//1 ms frames covered by the transfer, packet service interval is 8000 / packets per second microframes
+	int interval = 8000 / PacketsPerSecond();
+	return (m_packetPerTransfer * interval + 7) / 8;
+}
+
+void AudioTask::SetNextFrameNumber(ISOBuffer* buffer)
+{
+	if(!m_scheduleActive)
+	{
+		buffer->IsoContext->StartFrame = 0;
+		return;
+	}
+
+	UINT currentFrame = 0;
+	if(!m_device->UsbGetCurrentFrameNumber(&currentFrame))
+	{
+		//transport has no frame number (libusb, usbfs): stream ASAP until the next start
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Can't get current frame number, frame scheduling is off\n", TaskName());
+#endif
+		m_device->ClearErrorCode();
+		m_scheduleActive = FALSE;
+		m_scheduleValid = FALSE;
+		UCHAR policyValue = 1;
+		m_device->UsbSetPipePolicy((UCHAR)m_pipeId, ISO_ALWAYS_START_ASAP, 1, &policyValue);
+		buffer->IsoContext->StartFrame = 0;
+		return;
+	}
+
+	//start frames are in 1 ms frames, lead is in microframes
+	int leadFrames = (m_scheduleLead + 7) / 8;
+	if(!m_scheduleValid || (int)(m_FrameNumber - currentFrame) < leadFrames)
+	{
+		//first transfer or the ring has fallen behind the bus
+		if(m_scheduleValid)
+		{
+			m_scheduleResyncCount++;
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: %s. Schedule is late (frame %d, current %d), resync\n", TaskName(), m_FrameNumber, currentFrame);
+#endif
+		}
+		m_FrameNumber = currentFrame + leadFrames;
+		m_scheduleValid = TRUE;
+	}
+
+	buffer->IsoContext->StartFrame = m_FrameNumber;
+	m_scheduleDelay = (int)(m_FrameNumber - currentFrame) * 1000;
+	if(m_scheduleDelay > m_scheduleDelayMax)
+		m_scheduleDelayMax = m_scheduleDelay;
+	m_FrameNumber += FramesPerTransfer();
+}
+
+bool AudioTask::SetScheduleLead(int microframes)
+{
+	if(m_isStarted || microframes < 0 || microframes > MAX_SCHEDULE_LEAD)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Can't set schedule lead %d\n", TaskName(), microframes);
+#endif
+		return FALSE;
+	}
+	m_scheduleLead = microframes;
+	return TRUE;
+}
+
+bool AudioTask::SetTransferConfig(int outstandingTransfers, int packetPerTransfer)
+{
+	if(m_isStarted)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Can't change transfer config: task is started\n", TaskName());
+#endif
+		return FALSE;
+	}
+	if(outstandingTransfers < MIN_OUTSTANDING_TRANSFERS || outstandingTransfers > MAX_OUTSTANDING_TRANSFERS ||
+		packetPerTransfer <= 0 || packetPerTransfer > MAX_PACKETS_PER_TRANSFER)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Invalid transfer config (transfers=%d, packets=%d)\n", TaskName(), outstandingTransfers, packetPerTransfer);
+#endif
+		return FALSE;
+	}
+	//the transport may take fewer packets per transfer than the engine (usbfs URB)
+	int maxIsoPackets = m_device != NULL ? m_device->UsbGetMaxIsoPackets() : 0;
+	if(maxIsoPackets > 0 && packetPerTransfer > maxIsoPackets)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Packets per transfer %d exceed transport limit %d\n", TaskName(), packetPerTransfer, maxIsoPackets);
+#endif
+		return FALSE;
+	}
+	//each transfer must cover whole 1 ms frames
+	if(packetPerTransfer % PacketsPerFrame() != 0)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Packets per transfer %d isn't multiple of %d packets per frame (interval %d)\n", 
+			TaskName(), packetPerTransfer, PacketsPerFrame(), (int)m_interval);
+#endif
+		return FALSE;
+	}
+
+	//drop the partition, the arena itself is kept and reused
+	m_isoBuffers = NULL;
+	m_isoBuffersCount = 0;
+	m_outstandingTransfers = outstandingTransfers;
+	m_packetPerTransfer = packetPerTransfer;
+	if(m_sampleFreq != 0)
+		InitBuffers(m_sampleFreq);
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: %s. Transfer config: %d transfers x %d packets, queued time %d us\n", 
+		TaskName(), m_outstandingTransfers, m_packetPerTransfer, GetQueuedTime());
+#endif
+	return TRUE;
+}
+
+int AudioTask::GetQueuedTime()
+{
+	//packet interval in microseconds
+	int packetTime = 1000000 / PacketsPerSecond();
+	return m_outstandingTransfers * m_packetPerTransfer * packetTime;
+}
+
+void AudioTask::SubmitTransfers(volatile TaskState& taskState)
 {
 	ISOBuffer* nextXfer;
-	UINT transferred;
 	int dataLength = 0;
 
-	m_buffersGuard.Enter();
 	while(taskState == TaskStarted && NEXT_INDEX(m_outstandingIndex) != m_completedIndex && m_device->GetErrorCode() == ERROR_SUCCESS)
 	{
 		nextXfer = m_isoBuffers + m_outstandingIndex;
 		dataLength = FillBuffer(nextXfer);
+		if(!HasPendingTransfers())
+			m_oldestQueuedTime = PerfCounter();
 		m_outstandingIndex = NEXT_INDEX(m_outstandingIndex);
 		m_device->OvlReUse(nextXfer->OvlHandle);
 		SetNextFrameNumber(nextXfer);
 
 		RWBuffer(nextXfer, dataLength);
+
+		if(m_completionTime != 0)
+		{
+			LONGLONG latency = PerfCounter() - m_completionTime;
+			m_resubmitTimeSum += latency;
+			if(latency > m_resubmitTimeMax)
+				m_resubmitTimeMax = latency;
+			m_resubmitCount++;
+			m_completionTime = 0;
+		}
 	}
+}
+
+HANDLE AudioTask::GetCompletionEvent()
+{
+	if(!HasPendingTransfers())
+		return NULL;
+	return m_device->OvlGetEventHandle(m_isoBuffers[m_completedIndex].OvlHandle);
+}
 
-	//find next waiting buffer in queue
-	nextXfer = m_isoBuffers + m_completedIndex;
-	if (!nextXfer || taskState != TaskStarted) 
+bool AudioTask::IsTransferOverdue(LONG timeout)
+{
+	if(!HasPendingTransfers())
+		return FALSE;
+	return PerfTicksToUs(PerfCounter() - m_oldestQueuedTime) >= timeout * 1000.f;
+}
+
+bool AudioTask::TransferFailed()
+{
+#ifdef _ENABLE_TRACE
+	int deviceErrorCode = m_device->GetErrorCode();
+	debugPrintf("ASIOUAC: %s OvlWait failed. ErrorCode: %08Xh\n", TaskName(), deviceErrorCode);
+#endif
+	m_isoTransferErrorCount++;
+	//a transfer missed its start frame, schedule next ones from the current frame
+	m_scheduleValid = FALSE;
+	if(//deviceErrorCode == ERROR_GEN_FAILURE ||
+		m_isoTransferErrorCount >= MAX_OVL_ERROR_COUNT)
 	{
+		//restart the pipe in place, the host is asked to reset only if it doesn't help
+		if(m_recoveryAttempts < MAX_RECOVERY_ATTEMPTS && RecoverStream())
+			return TRUE;
 #ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: %s. No more packets!\n", TaskName());
+		debugPrintf("ASIOUAC: Notify to device about error\n"); //report to device error
 #endif
-		return TRUE;
+		m_device->Notify(0);
+		return FALSE;
 	}
+	m_device->ClearErrorCode();
+	return TRUE;
+}
 
-	if(!m_device->OvlWait(nextXfer->OvlHandle, OVL_WAIT_TIMEOUT, KOVL_WAIT_FLAG_NONE, &transferred))
-//	if(!m_device->OvlWaitOrCancel(nextXfer->OvlHandle, OVL_WAIT_TIMEOUT, &transferred))
+bool AudioTask::CompleteTransfer(LONG timeout)
+{
+	//oldest transfer in queue
+	ISOBuffer* nextXfer = m_isoBuffers + m_completedIndex;
+	UINT transferred = 0;
+
+	bool completed = m_device->OvlWait(nextXfer->OvlHandle, timeout, KOVL_WAIT_FLAG_NONE, &transferred);
+//	bool completed = m_device->OvlWaitOrCancel(nextXfer->OvlHandle, timeout, &transferred);
+	if(completed && m_injectedErrors > 0)
 	{
-		int deviceErrorCode = m_device->GetErrorCode();
-#ifdef _ENABLE_TRACE
-		debugPrintf("ASIOUAC: %s OvlK_Wait failed. ErrorCode: %08Xh\n", TaskName(), deviceErrorCode);
-#endif
-		m_isoTransferErrorCount++;
-		if(//deviceErrorCode == ERROR_GEN_FAILURE ||
-			m_isoTransferErrorCount >= MAX_OVL_ERROR_COUNT)
-		{
-#ifdef _ENABLE_TRACE
-			debugPrintf("ASIOUAC: Notify to device about error\n"); //report to device error
-#endif
-			m_device->Notify(0);
+		InterlockedDecrement(&m_injectedErrors);
+		completed = FALSE;
+	}
+	if(!completed)
+	{
+		InterlockedIncrement(&m_statFailedTransfers);
+		LONG recoveries = m_statRecoveries;
+		if(!TransferFailed())
 			return FALSE;
-		}
-		else
-			m_device->ClearErrorCode();
+		if(recoveries != m_statRecoveries)
+			return TRUE; //ring was restarted
 	}
 	else
 	{
+		UpdateStatistics(nextXfer, transferred);
+		LONGLONG processStart = PerfCounter();
 		ProcessBuffer(nextXfer);
+		InterlockedExchangeAdd64(&m_statProcessTime, PerfCounter() - processStart);
+		if(m_isoTransferErrorCount > 0 || m_recoveryStart != 0)
+			m_device->ClearDisconnected(); //failed wait marked the device as lost
 		m_isoTransferErrorCount = 0; //reset error count
+		m_recoveryAttempts = 0;
+		if(m_recoveryStart != 0)
+		{
+			//first good transfer after recovery
+			LONG recoveryTime = (LONG)PerfTicksToUs(PerfCounter() - m_recoveryStart);
+			InterlockedExchange(&m_statRecoveryTime, recoveryTime);
+			if(recoveryTime > m_statRecoveryTimeMax)
+				InterlockedExchange(&m_statRecoveryTimeMax, recoveryTime);
+			m_recoveryStart = 0;
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: %s. Stream recovered in %d us\n", TaskName(), recoveryTime);
+#endif
+		}
 	}
 
 	IsoXferComplete(nextXfer, transferred);
@@ -226,11 +872,219 @@ bool AudioTask::Work(volatile TaskState& taskState)
 	CalcStatistics(transferred);
 #endif
 	m_completedIndex = NEXT_INDEX(m_completedIndex);
+	m_completionTime = PerfCounter();
+	m_oldestQueuedTime = m_completionTime;
+	return TRUE;
+}
+
+bool AudioTask::Work(volatile TaskState& taskState)
+{
+	bool retVal = TRUE;
+
+	m_buffersGuard.Enter();
+	SubmitTransfers(taskState);
+
+	if (taskState != TaskStarted) 
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. No more packets!\n", TaskName());
+#endif
+	}
+	else
+	{
+		retVal = CompleteTransfer(OVL_WAIT_TIMEOUT);
+		m_wakeupCount++;
+	}
 	m_buffersGuard.Leave();
 
+	return retVal;
+}
+
+void AudioTask::ClearStatistics()
+{
+	InterlockedExchange(&m_statTransfers, 0);
+	InterlockedExchange(&m_statFailedTransfers, 0);
+	InterlockedExchange(&m_statPacketsOk, 0);
+	InterlockedExchange(&m_statPacketsError, 0);
+	InterlockedExchange(&m_statPacketsShort, 0);
+	InterlockedExchange64(&m_statBytes, 0);
+	InterlockedExchange64(&m_statProcessTime, 0);
+	InterlockedExchange(&m_statRecoveries, 0);
+	InterlockedExchange(&m_statRecoveryTime, 0);
+	InterlockedExchange(&m_statRecoveryTimeMax, 0);
+	m_statStartTick = GetTickCount();
+}
+
+void AudioTask::UpdateStatistics(ISOBuffer* buffer, ULONG transferLength)
+{
+	LONG packetsOk = 0, packetsError = 0, packetsShort = 0;
+	ULONG bytes = 0;
+	int numberOfPackets = buffer->IsoContext->NumberOfPackets;
+
+	if(m_pipeId & 0x80)
+	{
+		//IN pipe: actual length is reported for every packet
+		int minLength = MinPacketLength();
+		for(int i = 0; i < numberOfPackets; i++)
+		{
+			KISO_PACKET* packet = buffer->IsoPackets + i;
+			if(packet->Status != 0)
+				packetsError++;
+			else
+			{
+				packetsOk++;
+				if(packet->Length < minLength)
+					packetsShort++;
+				bytes += packet->Length;
+			}
+		}
+	}
+	else
+	{
+		//OUT pipe: packet length isn't reported back, count the whole transfer less the failed
+		//packets, each ends where the next one starts
+		bytes = transferLength;
+		for(int i = 0; i < numberOfPackets; i++)
+			if(buffer->IsoPackets[i].Status != 0)
+			{
+				packetsError++;
+				ULONG end = i + 1 < numberOfPackets ? buffer->IsoPackets[i + 1].Offset : transferLength;
+				if(end > buffer->IsoPackets[i].Offset && end - buffer->IsoPackets[i].Offset <= bytes)
+					bytes -= end - buffer->IsoPackets[i].Offset;
+			}
+		packetsOk = numberOfPackets - packetsError;
+	}
+
+	InterlockedIncrement(&m_statTransfers);
+	InterlockedExchangeAdd(&m_statPacketsOk, packetsOk);
+	if(packetsError)
+		InterlockedExchangeAdd(&m_statPacketsError, packetsError);
+	if(packetsShort)
+		InterlockedExchangeAdd(&m_statPacketsShort, packetsShort);
+	InterlockedExchangeAdd64(&m_statBytes, bytes);
+}
+
+void AudioTask::GetEndpointStatistics(EndpointStatistics& stats)
+{
+	stats.transfers = m_statTransfers;
+	stats.failedTransfers = m_statFailedTransfers;
+	stats.packetsOk = m_statPacketsOk;
+	stats.packetsError = m_statPacketsError;
+	stats.packetsShort = m_statPacketsShort;
+	stats.resyncs = m_scheduleResyncCount;
+	stats.recoveries = m_statRecoveries;
+	stats.recoveryTime = m_statRecoveryTime;
+	stats.recoveryTimeMax = m_statRecoveryTimeMax;
+	stats.bytes = InterlockedCompareExchange64(&m_statBytes, 0, 0); //atomic 64 bit read
+	int frameSize = m_channelNumber * m_sampleSize;
+	stats.samples = frameSize > 0 ? stats.bytes / frameSize : 0;
+	DWORD elapsed = GetTickCount() - m_statStartTick;
+	stats.rate = m_isStarted && elapsed > 0 ? (float)stats.samples * 1000.f / elapsed : 0.f;
+	stats.processTime = PerfTicksToUs(InterlockedCompareExchange64(&m_statProcessTime, 0, 0));
+	stats.allocations = m_arenaAllocCount;
+}
+
+void AudioTask::GetSchedulerStatistics(SchedulerStatistics& stats)
+{
+	stats.wakeups += m_wakeupCount;
+	stats.resubmits += m_resubmitCount;
+	stats.resubmitTimeSum += PerfTicksToUs(m_resubmitTimeSum);
+	float maxTime = PerfTicksToUs(m_resubmitTimeMax);
+	if(maxTime > stats.resubmitTimeMax)
+		stats.resubmitTimeMax = maxTime;
+}
+
+
+bool AudioServiceTask::AddTask(AudioTask* task)
+{
+	if(task == NULL || m_taskCount >= MAX_SERVICED_TASKS)
+		return FALSE;
+	m_tasks[m_taskCount++] = task;
 	return TRUE;
 }
 
+bool AudioServiceTask::BeforeStart()
+{
+	for(int i = 0; i < m_taskCount; i++)
+		if(!m_tasks[i]->BeforeStart())
+		{
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: %s. Can't start %s\n", TaskName(), m_tasks[i]->TaskName());
+#endif
+			while(--i >= 0)
+				m_tasks[i]->AfterStop();
+			return FALSE;
+		}
+	m_wakeupCount = 0;
+	return m_taskCount > 0;
+}
+
+bool AudioServiceTask::AfterStop()
+{
+	for(int i = 0; i < m_taskCount; i++)
+		m_tasks[i]->AfterStop();
+	return TRUE;
+}
+
+bool AudioServiceTask::Work(volatile TaskState& taskState)
+{
+	HANDLE events[MAX_SERVICED_TASKS];
+	int eventCount = 0;
+
+	for(int i = 0; i < m_taskCount; i++)
+	{
+		m_tasks[i]->SubmitTransfers(taskState);
+		if(taskState != TaskStarted)
+			return TRUE;
+		HANDLE event = m_tasks[i]->GetCompletionEvent();
+		if(event != NULL)
+			events[eventCount++] = event;
+		else if(!m_tasks[i]->TransferFailed()) //pipe can't submit transfers
+			return FALSE;
+	}
+	if(eventCount == 0)
+		return TRUE;
+
+	//wait for the oldest transfer of any pipe
+	DWORD waitResult = WaitForMultipleObjects(eventCount, events, FALSE, OVL_WAIT_TIMEOUT);
+	m_wakeupCount++;
+	if(waitResult == WAIT_TIMEOUT || waitResult == WAIT_FAILED)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: %s. Wait transfers failed (%d)\n", TaskName(), waitResult);
+#endif
+		//a timeout is accounted only by the pipes whose oldest transfer is past its own deadline,
+		//a transfer queued just before the wait isn't late yet
+		for(int i = 0; i < m_taskCount; i++)
+		{
+			bool failed = waitResult == WAIT_FAILED ? m_tasks[i]->HasPendingTransfers() : m_tasks[i]->IsTransferOverdue(OVL_WAIT_TIMEOUT);
+			if(failed && !m_tasks[i]->CompleteTransfer(0))
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	//service every pipe which has completed transfers, not only the signaled one
+	for(int i = 0; i < m_taskCount; i++)
+	{
+		HANDLE event;
+		while(taskState == TaskStarted && (event = m_tasks[i]->GetCompletionEvent()) != NULL &&
+			WaitForSingleObject(event, 0) == WAIT_OBJECT_0)
+		{
+			if(!m_tasks[i]->CompleteTransfer(0))
+				return FALSE;
+			m_tasks[i]->SubmitTransfers(taskState);
+		}
+	}
+	return TRUE;
+}
+
+void AudioServiceTask::GetSchedulerStatistics(SchedulerStatistics& stats)
+{
+	for(int i = 0; i < m_taskCount; i++)
+		m_tasks[i]->GetSchedulerStatistics(stats);
+	stats.wakeups = m_wakeupCount;
+}
 
 
 bool AudioDACTask::BeforeStartInternal()
@@ -242,16 +1096,17 @@ bool AudioDACTask::BeforeStartInternal()
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. Clear feedback statistics\n", TaskName());
 #endif
-		m_feedbackInfo->SetIntervalValue((float)(8 / (1 << (m_interval - 1))));
+		m_feedbackInfo->SetIntervalValue((float)PacketsPerSecond() / 1000.f);
 //		m_feedbackInfo->SetValue(0);
 		m_feedbackInfo->SetDefaultValue(m_defaultPacketSize);
 	}
+	m_packetScheduler.Reset();
+	m_silentTransfers = 0;
 #ifdef _ENABLE_TRACE
 		m_sampleNumbers = 0;
 		m_tickCount = 0;
 #endif
-	return m_device->UsbSetPipePolicy((UCHAR)m_pipeId, ISO_ALWAYS_START_ASAP, 1, &policyValue) &&
-		m_device->UsbSetPipePolicy((UCHAR)m_pipeId, RESET_PIPE_ON_RESUME, 1, &policyValue); //experimental
+	return m_device->UsbSetPipePolicy((UCHAR)m_pipeId, RESET_PIPE_ON_RESUME, 1, &policyValue); //experimental
 }
 
 bool AudioDACTask::AfterStopInternal()
@@ -265,53 +1120,50 @@ bool AudioDACTask::AfterStopInternal()
 
 int AudioDACTask::FillBuffer(ISOBuffer* nextXfer)
 {
-	float raw_cur_feedback = m_feedbackInfo == NULL || m_feedbackInfo->GetValue() == 0.0f 
-						?  m_defaultPacketSize
-						:  m_feedbackInfo->GetValue(); //value in stereo samples in one second // BSB: or in one milisecond??
+	int frameSize = m_channelNumber * m_sampleSize;
+	int maxSamplesInPacket = m_packetSize / frameSize; //max stereo samples in one packet
 
-	int maxSamplesInPacket = m_packetSize / m_channelNumber / m_sampleSize; //max stereo samples in one packet
-	if(raw_cur_feedback > (float)(maxSamplesInPacket))
+	//feedback value in 16.16 stereo samples per packet, 0 - nominal rate
+	ULONG feedback = 0;
+	float raw_cur_feedback = m_feedbackInfo == NULL ? 0.0f : m_feedbackInfo->GetValue();
+	if(raw_cur_feedback > 0.0f)
+		feedback = (ULONG)(raw_cur_feedback * 65536.f + 0.5f);
+	if(feedback > ((ULONG)maxSamplesInPacket << 16))
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. Feedback value (%f) larger than the maximum packet size\n", TaskName(), raw_cur_feedback);
 #endif
-		raw_cur_feedback = (float)maxSamplesInPacket;
+		feedback = (ULONG)maxSamplesInPacket << 16;
 	}
+	m_packetScheduler.SetFeedback(feedback);
+
 	int dataLength = 0;
-	if(raw_cur_feedback > 0)
+	if(m_silentTransfers > 0 && m_packetScheduler.IsValid())
 	{
-		//raw_cur_feedback = m_defaultPacketSize;
-		//in one second we have 8 / (1 << (m_interval - 1)) packets
-		//one packet must contain samples number = [cur_feedback * (1 << (m_interval - 1)) / 8]
-		float cur_feedback = raw_cur_feedback; //number stereo samples in one packet
-		int icur_feedback = (int)(cur_feedback + 0.5f); // BSB: added +0.5f to get round() function. (int)(f) === floor(f), f>=0
+		//re-prime after recovery: silence doesn't consume samples from the callback
 		int nextOffSet = 0;
-		static float addSample = 0; // BSB: added static.
-		float frac = cur_feedback - icur_feedback;
-		if(raw_cur_feedback == (float)maxSamplesInPacket) 
+		for (int packetIndex = 0; packetIndex < nextXfer->IsoContext->NumberOfPackets; packetIndex++)
 		{
-			frac = 0.f;
-			addSample = 0;
+			int packetLength = m_packetScheduler.NextPacket() * frameSize;
+			nextXfer->IsoContext->IsoPackets[packetIndex].Offset = nextOffSet;
+			nextXfer->IsoContext->IsoPackets[packetIndex].Length = packetLength;
+			nextOffSet += packetLength;
 		}
-		icur_feedback *= m_channelNumber * m_sampleSize;
+		dataLength = nextOffSet;
+		memset(nextXfer->DataBuffer, 0, dataLength);
+		m_silentTransfers--;
+	}
+	else if(m_packetScheduler.IsValid())
+	{
+		int nextOffSet = 0;
 		for (int packetIndex = 0; packetIndex < nextXfer->IsoContext->NumberOfPackets; packetIndex++)
 		{
+			int packetLength = m_packetScheduler.NextPacket() * frameSize;
 			nextXfer->IsoContext->IsoPackets[packetIndex].Offset = nextOffSet;
-			nextOffSet += icur_feedback;
-			addSample += frac;
-			if(addSample > 0.5f) // 1.f)
-			{
-				nextOffSet += m_channelNumber * m_sampleSize; //append additional stereo sample
-				addSample -= 1.f;
-			}
-			else if(addSample < -0.5f) // -1.f)	// BSB: Added negative case
-			{
-				nextOffSet -= m_channelNumber * m_sampleSize; //append additional stereo sample
-				addSample += 1.f;
-			}
-			nextXfer->IsoContext->IsoPackets[packetIndex].Length = nextOffSet - nextXfer->IsoContext->IsoPackets[packetIndex].Offset;
+			nextXfer->IsoContext->IsoPackets[packetIndex].Length = packetLength;
+			nextOffSet += packetLength;
 		}
-		dataLength = (int)nextOffSet;
+		dataLength = nextOffSet;
 
 		if(m_readDataCb)
 			m_readDataCb(m_readDataCbContext, nextXfer->DataBuffer, dataLength);
@@ -340,7 +1192,7 @@ int AudioDACTask::FillBuffer(ISOBuffer* nextXfer)
 
 bool AudioDACTask::RWBuffer(ISOBuffer* nextXfer, int len)
 {
-	if(!m_device->UsbIsoWritePipe(m_pipeId, nextXfer->DataBuffer, len, (LPOVERLAPPED)nextXfer->OvlHandle, nextXfer->IsoContext))
+	if(!m_device->UsbIsoWritePipe(m_pipeId, nextXfer->DataBuffer, len, nextXfer->OvlHandle, nextXfer->IsoContext))
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. IsoWritePipe failed. ErrorCode: %08Xh\n", TaskName(),  m_device->GetErrorCode());
@@ -384,14 +1236,13 @@ bool AudioADCTask::BeforeStartInternal()
 	if(m_feedbackInfo != NULL)
 		//m_feedbackInfo->SetValue(0);
 		m_feedbackInfo->SetDefaultValue(m_defaultPacketSize);
+	m_rateEstimator.Reset();
 	//return TRUE;
 #ifdef _ENABLE_TRACE
 		m_sampleNumbers = 0;
 		m_tickCount = 0;
 #endif
-
-	UCHAR policyValue = 1;
-	return m_device->UsbSetPipePolicy((UCHAR)m_pipeId, ISO_ALWAYS_START_ASAP, 1, &policyValue);
+	return TRUE;
 }
 
 bool AudioADCTask::AfterStopInternal()
@@ -406,7 +1257,7 @@ int AudioADCTask::FillBuffer(ISOBuffer* nextXfer)
 
 bool AudioADCTask::RWBuffer(ISOBuffer* nextXfer, int len)
 {
-	if(!m_device->UsbIsoReadPipe(m_pipeId, nextXfer->DataBuffer, len, (LPOVERLAPPED)nextXfer->OvlHandle, nextXfer->IsoContext))
+	if(!m_device->UsbIsoReadPipe(m_pipeId, nextXfer->DataBuffer, len, nextXfer->OvlHandle, nextXfer->IsoContext))
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. IsoReadPipe (ADC) failed. ErrorCode: %08Xh\n", TaskName(), m_device->GetErrorCode());
@@ -422,23 +1273,42 @@ void AudioADCTask::ProcessBuffer(ISOBuffer* buffer)
 {
 	int packetLength = 0;
 	int recLength = 0;
-	for(int i = 0; i < buffer->IsoContext->NumberOfPackets; i++)
+	if(m_scatterDataCb)
+	{
+		//consumer reads packets straight from the transfer buffer
+		for(int i = 0; i < buffer->IsoContext->NumberOfPackets; i++)
+			recLength += buffer->IsoPackets[i].Length;
+		m_scatterDataCb(m_scatterDataCbContext, buffer->DataBuffer, buffer->IsoPackets, buffer->IsoContext->NumberOfPackets);
+	}
+	else
 	{
-		packetLength = buffer->IsoContext->IsoPackets[i].Length;
+		for(int i = 0; i < buffer->IsoContext->NumberOfPackets; i++)
+		{
+			packetLength = buffer->IsoContext->IsoPackets[i].Length;
 #ifdef PACK_ADC_BUFFER
-		memcpy(buffer->DataBuffer + recLength, buffer->DataBuffer + buffer->IsoPackets[i].Offset, packetLength);
-		recLength += packetLength;
+			//regions overlap when packets are not full
+			memmove(buffer->DataBuffer + recLength, buffer->DataBuffer + buffer->IsoPackets[i].Offset, packetLength);
+			recLength += packetLength;
 #else
-		recLength += packetLength;
-		if(m_writeDataCb && packetLength > 0)
-			m_writeDataCb(m_writeDataCbContext, buffer->DataBuffer + buffer->IsoPackets[i].Offset, packetLength);
+			recLength += packetLength;
+			if(m_writeDataCb && packetLength > 0)
+				m_writeDataCb(m_writeDataCbContext, buffer->DataBuffer + buffer->IsoPackets[i].Offset, packetLength);
 #endif
-	}
+		}
 #ifdef PACK_ADC_BUFFER
-	if(m_writeDataCb)
-		m_writeDataCb(m_writeDataCbContext, buffer->DataBuffer, recLength);
+		if(m_writeDataCb)
+			m_writeDataCb(m_writeDataCbContext, buffer->DataBuffer, recLength);
 #endif
-	if(m_feedbackInfo)
+	}
+	if(m_feedbackInfo && m_filterFeedback)
+	{
+		int frameSize = m_channelNumber * m_sampleSize;
+		for(int i = 0; i < buffer->IsoContext->NumberOfPackets; i++)
+			if(buffer->IsoPackets[i].Status == 0)
+				m_rateEstimator.AddPacket(buffer->IsoPackets[i].Length / frameSize);
+		m_feedbackInfo->SetImplicitValue((float)m_rateEstimator.GetEstimate());
+	}
+	else if(m_feedbackInfo)
 	{
 /*
 		int div = buffer->IsoContext->NumberOfPackets * m_channelNumber * m_sampleSize * (1 << (m_interval - 1)) / 8;
@@ -468,7 +1338,7 @@ int AudioFeedbackTask::FillBuffer(ISOBuffer* nextXfer)
 
 bool AudioFeedbackTask::RWBuffer(ISOBuffer* nextXfer, int len)
 {
-	if(!m_device->UsbIsoReadPipe(m_pipeId, nextXfer->DataBuffer, len, (LPOVERLAPPED)nextXfer->OvlHandle, nextXfer->IsoContext))
+	if(!m_device->UsbIsoReadPipe(m_pipeId, nextXfer->DataBuffer, len, nextXfer->OvlHandle, nextXfer->IsoContext))
 	{
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. IsoReadPipe (feedback) failed. ErrorCode: %08Xh\n", TaskName(), m_device->GetErrorCode());
@@ -482,13 +1352,14 @@ void AudioFeedbackTask::ProcessBuffer(ISOBuffer* nextXfer)
 {
 	if(m_feedbackInfo == NULL)
 		return;
-	KISO_PACKET isoPacket = nextXfer->IsoPackets[nextXfer->IsoContext->NumberOfPackets - 1];
-	//TODO: isoPacket.Length may be 3 or 4
-	if (isoPacket.Length > 1)
+	for(int i = 0; i < nextXfer->IsoContext->NumberOfPackets; i++)
 	{
-		int feedback = *((int*)(nextXfer->DataBuffer + isoPacket.Offset));
-		m_feedbackInfo->SetValue(feedback);
+		KISO_PACKET* isoPacket = nextXfer->IsoPackets + i;
+		if(isoPacket->Status == 0 && isoPacket->Length >= m_sampleSize)
+			m_decoder.AddValue(nextXfer->DataBuffer + isoPacket->Offset);
 	}
+	if(m_decoder.IsValid())
+		m_feedbackInfo->SetRateValue((float)m_decoder.GetRate());
 }
 
 
@@ -496,6 +1367,7 @@ bool AudioFeedbackTask::BeforeStartInternal()
 {
 	//if(m_feedbackInfo != NULL)
 	//	m_feedbackInfo->SetValue(0);
+	m_decoder.Init(m_sampleSize, IsHighSpeed(), PacketsPerSecond(), m_feedbackInfo ? m_feedbackInfo->GetDefaultFreqValue() : 0.);
 	return TRUE;
 }
 
@@ -14,10 +14,8 @@
 */
 
 #pragma once
-#include "targetver.h"
-#include <windows.h>
+#include "platform.h"
 #include <string.h>
-#include <tchar.h>
 #include <math.h>
 
 #ifdef _ENABLE_TRACE
@@ -28,9 +26,28 @@ extern void debugPrintf(const _TCHAR *szFormat, ...);
 #define packetPerTransferADC	16
 #define packetPerTransferFb		8
 
+//number of transfers kept in flight by default (ring holds one more buffer)
+#define DEFAULT_OUTSTANDING_TRANSFERS	5
+#define MIN_OUTSTANDING_TRANSFERS		1
+#define MAX_OUTSTANDING_TRANSFERS		63
+#define MAX_PACKETS_PER_TRANSFER		1024
+
+#define CACHE_LINE_SIZE					64
+#define ALIGN_SIZE(x, a)				(((x) + (a) - 1) & ~((a) - 1))
+
+//first transfer is scheduled this number of microframes after the current bus frame,
+//0 - let the host controller start transfers ASAP
+#define DEFAULT_SCHEDULE_LEAD			16
+#define MAX_SCHEDULE_LEAD				256
+
+//pipes serviced by one scheduler thread: DAC, ADC and feedback
+#define MAX_SERVICED_TASKS				3
+
 class USBAudioDevice;
 
 typedef void (*FillDataCallback)(void* context, UCHAR *buffer, int& len);
+//received transfer as is: packets are (offset, length) pairs inside buffer, zero length packets included
+typedef void (*ScatterDataCallback)(void* context, UCHAR *buffer, const KISO_PACKET* packets, int packetCount);
 
 class Mutex 
 { 
@@ -45,119 +62,339 @@ public:
 	~Mutex() { DeleteCriticalSection(&cs); } 
 };
 
+//Feedback value shared by the feedback (or ADC) thread and the DAC thread without locks.
+//Values are floats stored as 32 bit patterns, aligned 32 bit loads and stores are atomic,
+//so the DAC reads the current value with a plain load on every transfer
 class FeedbackInfo
 {
-	Mutex m_guard;
-	float cur_value;
+	volatile LONG cur_value;
 
-	float playback_value; // BSB 20121222 added default sample rate value for playback
+	volatile LONG playback_value; // BSB 20121222 added default sample rate value for playback
 
-	float max_value;
-	float min_value;
+	volatile LONG max_value;
+	volatile LONG min_value;
 #ifdef _ENABLE_TRACE
 	float last_value;
 #endif
-	float interval;
+	volatile LONG interval;
+
+	static LONG ToBits(float value)
+	{
+		LONG bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+	static float FromBits(LONG bits)
+	{
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	//min/max first: a value a reader can see is always within them
+	void Store(float value)
+	{
+		UpdateStatistics(value);
+		InterlockedExchange(&cur_value, ToBits(value));
+	}
+
+	//relaxed min/max, lost updates are retried only if the value is still out of range
+	void UpdateStatistics(float value)
+	{
+		LONG bits = ToBits(value);
+		LONG oldBits;
+		while(((oldBits = max_value) == 0 || FromBits(oldBits) < value) &&
+			InterlockedCompareExchange(&max_value, bits, oldBits) != oldBits)
+			;
+		while(((oldBits = min_value) == 0 || FromBits(oldBits) > value) &&
+			InterlockedCompareExchange(&min_value, bits, oldBits) != oldBits)
+			;
+	}
 public:
 	FeedbackInfo()
 	{
-		cur_value = 0.f;
+		cur_value = ToBits(0.f);
+		playback_value = ToBits(0.f);
+		max_value = ToBits(0.f);
+		min_value = ToBits(0.f);
 #ifdef _ENABLE_TRACE
 		last_value = 0.f;
 #endif
-		interval = 1.f;
+		interval = ToBits(1.f);
 	}
 
 	void SetIntervalValue(float value)
 	{
-		interval = 1000.f * value; //for output real freq
+		InterlockedExchange(&interval, ToBits(1000.f * value)); //for output real freq
 	}
 
 	void SetDefaultValue(float feedbackValue)
 	{
-		m_guard.Enter();
-		cur_value = feedbackValue;
-		playback_value = feedbackValue; // BSB 20121222 added
+		InterlockedExchange(&playback_value, ToBits(feedbackValue)); // BSB 20121222 added
+		InterlockedExchange(&cur_value, ToBits(feedbackValue));
 
 #ifdef _ENABLE_TRACE
 		last_value = feedbackValue;
-		debugPrintf("ASIOUAC: Set default value: %f\n", interval * feedbackValue);
+		debugPrintf("ASIOUAC: Set default value: %f\n", FromBits(interval) * feedbackValue);
 #endif
-		m_guard.Leave();
 	}
 	void SetValue(int feedbackValue)
 	{
-		m_guard.Enter();
-
 		// BSB 20121222 revised to support both 16.16 and 15.17 feedback
 		float newValue = (float)feedbackValue / 32768.0f;	// Must divide by 32768.0f when FW uses 16.16 samples / 125s microframe
 
-		if (newValue > playback_value * 1.5) {				// Must divide by 65536.0f when FW uses 15.17 samples / 125s microframe
+		if (newValue > FromBits(playback_value) * 1.5) {				// Must divide by 65536.0f when FW uses 15.17 samples / 125s microframe
 			newValue = newValue / 2;						// Inspired by https://git.kernel.org/?p=linux/kernel/git/tiwai/sound.git;a=blob;f=sound/usb/endpoint.c l 1081
 		}
 
 #ifdef _ENABLE_TRACE
-		if(newValue != 0.f && fabs(last_value - newValue)/newValue > 0.5f / interval)
+		float intervalValue = FromBits(interval);
+		if(newValue != 0.f && fabs(last_value - newValue)/newValue > 0.5f / intervalValue)
 			//(int)(10*last_value) != (int)(10*newValue))
-//			debugPrintf("ASIOUAC: Set fb value: %f (raw = %d, curVal = %f)\n", interval * newValue, feedbackValue, interval * cur_value);
-			debugPrintf("ASIOUAC: Set fb value: %f (raw=%d, cur_value=%f, playback_value=%f)\n", interval * newValue, feedbackValue, interval * cur_value, interval * playback_value);
+//			debugPrintf("ASIOUAC: Set fb value: %f (raw = %d, curVal = %f)\n", intervalValue * newValue, feedbackValue, intervalValue * GetValue());
+			debugPrintf("ASIOUAC: Set fb value: %f (raw=%d, cur_value=%f, playback_value=%f)\n", intervalValue * newValue, feedbackValue, intervalValue * GetValue(), intervalValue * FromBits(playback_value));
 
 		last_value = newValue;
 #endif
 
-		cur_value = newValue;
+		Store(newValue);
+	}
+
+	//implicit feedback: rate estimate in samples per packet
+	void SetImplicitValue(float samplesPerPacket)
+	{
+		Store(samplesPerPacket);
+	}
 
-		if(max_value == 0.f || max_value < cur_value)
-			max_value = cur_value;
-		if(min_value == 0.f || min_value > cur_value)
-			min_value = cur_value;
-		m_guard.Leave();
+	//explicit feedback: device rate in samples per second
+	void SetRateValue(float freq)
+	{
+		Store(freq / FromBits(interval));
+	}
+
+	float GetDefaultFreqValue()
+	{
+		return FromBits(interval) * FromBits(playback_value);
 	}
 
 	float GetValue()
 	{
-		float retVal;
-		m_guard.Enter();
-		retVal = cur_value;
-		m_guard.Leave();
-		return retVal;
+		return FromBits(cur_value);
 	}
 
 	float GetFreqValue()
 	{
-		float retVal;
-		m_guard.Enter();
-		retVal = interval * cur_value;
-		m_guard.Leave();
-		return retVal;
+		return FromBits(interval) * FromBits(cur_value);
 	}
 
 	void ClearStatistics()
 	{
-		max_value = 0.f;
-		min_value = 0.f;
+		InterlockedExchange(&max_value, ToBits(0.f));
+		InterlockedExchange(&min_value, ToBits(0.f));
 	}
 
 	float GetMaxValue()
 	{
-		float retVal;
-		m_guard.Enter();
-		retVal = interval * max_value;
-		m_guard.Leave();
-		return retVal;
+		return FromBits(interval) * FromBits(max_value);
 	}
 
 	float GetMinValue()
 	{
-		float retVal;
-		m_guard.Enter();
-		retVal = interval * min_value;
-		m_guard.Leave();
-		return retVal;
+		return FromBits(interval) * FromBits(min_value);
 	}
 };
 
-class TaskThread abstract
+#define PACKET_PATTERN_MAX	1024
+#define PACKET_PATTERN_BAND_PPM		100		//feedback within this of nominal keeps the pattern
+#define PACKET_PATTERN_HOLD			8		//feedback updates within the band before the pattern is entered
+
+//Exact packet length generator. Rate is kept as integer fraction num/den samples per packet,
+//so packet lengths over any window sum to the commanded rate without drift
+class PacketScheduler
+{
+	//nominal rate = sample freq / packets per second
+	ULONG	m_nominalNum;
+	ULONG	m_nominalDen;
+	ULONG	m_nominalFeedback;	//nominal rate in 16.16 format
+
+	//current rate in 1/m_den samples per packet. m_den = nominal den * 65536 is common to
+	//the nominal fraction and to 16.16 feedback, rate changes never round the fraction
+	ULONGLONG	m_num;
+	ULONG	m_den;
+	ULONG	m_remainder;		//accumulated fraction in 1/m_den units
+
+	//cyclic packet lengths for nominal rate and the accumulated fraction (1/nominal den) after each
+	USHORT	m_pattern[PACKET_PATTERN_MAX];
+	USHORT	m_patternRemainder[PACKET_PATTERN_MAX];
+	int		m_patternLength;
+	int		m_patternPos;
+	bool	m_usePattern;
+	//feedback near nominal runs on the pattern: m_num - nominal num is added to m_patternDrift every
+	//packet, a packet gets one sample more or less when the sum leaves the pattern fraction range
+	LONGLONG	m_patternDelta;
+	LONGLONG	m_patternDrift;		//low 16 bits of the fraction + drift, 1/m_den units
+	ULONGLONG	m_patternBand;		//PACKET_PATTERN_BAND_PPM of the nominal num
+	int		m_stableCount;
+
+	void SetRate(ULONGLONG num);
+	void EnterPattern();
+	void LeavePattern();
+public:
+	PacketScheduler() : m_nominalNum(0), m_nominalDen(1), m_nominalFeedback(0), m_num(0), m_den(1), m_remainder(0),
+		m_patternLength(0), m_patternPos(0), m_usePattern(FALSE), m_patternDelta(0), m_patternDrift(0), m_patternBand(0), m_stableCount(0)
+	{}
+
+	void Init(int freq, int packetsPerSecond);
+	void Reset();
+	//feedback in 16.16 samples per packet, 0 - use nominal rate
+	void SetFeedback(ULONG feedback);
+	int NextPacket();
+
+	bool IsValid()
+	{ return m_nominalNum != 0; }
+	ULONG GetNominalFeedback()
+	{ return m_nominalFeedback; }
+	bool IsPatternUsed()
+	{ return m_usePattern; }
+};
+
+//Wakeup and resubmit latency counters of the ISO schedulers
+struct SchedulerStatistics
+{
+	ULONG	wakeups;			//scheduler thread wakeups
+	ULONG	resubmits;			//transfers resubmitted after completion
+	float	resubmitTimeSum;	//completion to resubmit time, microseconds
+	float	resubmitTimeMax;
+	float	elapsedTime;		//time since start, seconds
+
+	SchedulerStatistics() : wakeups(0), resubmits(0), resubmitTimeSum(0.f), resubmitTimeMax(0.f), elapsedTime(0.f)
+	{}
+
+	float GetWakeupsPerSecond()
+	{ return elapsedTime > 0.f ? wakeups / elapsedTime : 0.f; }
+	float GetAverageResubmitTime()
+	{ return resubmits > 0 ? resubmitTimeSum / resubmits : 0.f; }
+};
+
+//Transfer and packet counters of one ISO endpoint
+struct EndpointStatistics
+{
+	ULONG		transfers;			//completed transfers
+	ULONG		failedTransfers;	//transfers failed as a whole
+	ULONG		packetsOk;
+	ULONG		packetsError;		//packets completed with error status
+	ULONG		packetsShort;		//IN packets shorter than expected (incl. zero length)
+	ULONG		resyncs;			//schedule restarts after falling behind the bus
+	ULONG		recoveries;			//in-place pipe restarts after transfer errors
+	LONG		recoveryTime;		//last recovery, first error to first good transfer, microseconds
+	LONG		recoveryTimeMax;
+	ULONGLONG	bytes;
+	ULONGLONG	samples;			//audio frames (feedback values for feedback endpoint)
+	float		rate;				//samples per second since start
+	float		processTime;		//time spent handing completed transfers to the callback, microseconds
+	int			allocations;		//buffer arena allocations since the endpoint was set up
+
+	EndpointStatistics() : transfers(0), failedTransfers(0), packetsOk(0), packetsError(0), packetsShort(0), resyncs(0),
+		recoveries(0), recoveryTime(0), recoveryTimeMax(0), bytes(0), samples(0), rate(0.f), processTime(0.f), allocations(0)
+	{}
+};
+
+#define RATE_WINDOW_PACKETS		1024	//power of two
+#define RATE_ACQUIRE_BANDWIDTH	4.0		//loop bandwidth while acquiring, Hz
+#define RATE_TRACK_BANDWIDTH	0.5		//loop bandwidth while tracking, Hz
+#define RATE_LOOP_DAMPING		0.707	//damping of the second order loops, 1.0 would be critically damped
+#define RATE_LOCK_PPM			100.0
+
+//Device rate estimator for implicit feedback. Per packet sample counts are averaged over
+//a sliding window until it's full, then a second order loop (phase and rate correction)
+//tracks the device clock, so pattern jitter of received packets doesn't reach the estimate
+class RateEstimator
+{
+	USHORT	m_window[RATE_WINDOW_PACKETS];
+	int		m_windowPos;
+	int		m_windowCount;
+	ULONG	m_windowSum;
+
+	int		m_packetsPerSecond;
+	double	m_nominal;			//samples per packet
+	double	m_estimate;			//samples per packet
+	double	m_phaseError;		//received minus predicted samples
+	double	m_absError;			//smoothed |phase error|
+	ULONG	m_packets;
+
+	double	m_k1;				//phase gain
+	double	m_k2;				//rate gain
+	double	m_tau;				//loop time constant, packets
+
+	void SetBandwidth(double bandwidth);
+public:
+	RateEstimator() : m_windowPos(0), m_windowCount(0), m_windowSum(0), m_packetsPerSecond(0), m_nominal(0.), m_estimate(0.),
+		m_phaseError(0.), m_absError(0.), m_packets(0), m_k1(0.), m_k2(0.), m_tau(1.)
+	{}
+
+	void Init(int freq, int packetsPerSecond);
+	void Reset();
+	//lost packets are not added, prediction is kept for them
+	void AddPacket(int samples);
+
+	//samples per packet
+	double GetEstimate()
+	{ return m_estimate; }
+	//samples per second
+	double GetRate()
+	{ return m_estimate * m_packetsPerSecond; }
+	//estimated error of the rate, ppm
+	double GetUncertainty();
+	bool IsLocked()
+	{ return m_packets >= 2 * RATE_WINDOW_PACKETS && GetUncertainty() < RATE_LOCK_PPM; }
+};
+
+#define FEEDBACK_OUTLIER_RATIO		0.005	//values this far from the estimate are rejected
+#define FEEDBACK_MAX_OUTLIERS		16		//consecutive rejected values before re-acquisition
+#define FEEDBACK_LOOP_BANDWIDTH		1.0		//Hz
+
+//Explicit feedback decoder. Format is 10.14 samples per frame for 3 byte full speed endpoints,
+//16.16 samples per frame for 4 byte full speed and 16.16 samples per microframe for high
+//speed ones. Firmwares using another binary point are detected against the nominal rate.
+//Every value is smoothed by a second order loop, so the DAC follows the average device rate.
+class FeedbackDecoder
+{
+	int		m_valueSize;
+	bool	m_highSpeed;
+	int		m_shift;			//binary point correction
+	bool	m_shiftDetected;
+	double	m_nominalRate;		//samples per second
+	int		m_updateRate;		//feedback packets per second
+
+	double	m_estimate;			//samples per feedback packet
+	double	m_phaseError;
+	double	m_k1;
+	double	m_k2;
+	bool	m_valid;
+	int		m_outliers;
+	ULONG	m_rejectedCount;
+
+	double Decode(const UCHAR* value);
+public:
+	FeedbackDecoder() : m_valueSize(4), m_highSpeed(TRUE), m_shift(0), m_shiftDetected(FALSE), m_nominalRate(0.), m_updateRate(8000),
+		m_estimate(0.), m_phaseError(0.), m_k1(0.), m_k2(0.), m_valid(FALSE), m_outliers(0), m_rejectedCount(0)
+	{}
+
+	void Init(int valueSize, bool highSpeed, int updateRate, double nominalRate);
+	void Reset();
+	//value of one feedback packet, m_valueSize bytes
+	void AddValue(const UCHAR* value);
+
+	bool IsValid()
+	{ return m_valid; }
+	//samples per second
+	double GetRate()
+	{ return m_estimate * m_updateRate; }
+	ULONG GetRejectedCount()
+	{ return m_rejectedCount; }
+};
+
+class TaskThread
 {
 public:
 	enum TaskState
@@ -178,6 +415,7 @@ template <class TaskClass> class BaseThread
 {
 	HANDLE			m_Thread;
 	DWORD			m_ThreadID;
+	int				m_priority;
 
 	//
 	Mutex			m_inWork;
@@ -222,21 +460,31 @@ template <class TaskClass> class BaseThread
 #endif
 		ExitThread(0);
 	}
+
+	//thread is created on first start, so tasks serviced by another thread don't own one
+	bool CreateTaskThread()
+	{
+		if(m_Thread != INVALID_HANDLE_VALUE)
+			return TRUE;
+		m_Thread = CreateThread(NULL, 0, LPTHREAD_START_ROUTINE(sThreadFunc), this, CREATE_SUSPENDED, &m_ThreadID);
+		if(m_Thread == NULL)
+		{
+			m_Thread = INVALID_HANDLE_VALUE;
+			return FALSE;
+		}
+		SetThreadPriority(m_Thread, m_priority);
+		return TRUE;
+	}
 protected:
 	//
 	TaskClass		m_Task;
 
 public:
-	BaseThread(int nPriority = THREAD_PRIORITY_TIME_CRITICAL) : m_Task(), m_taskState(TaskThread::TaskCreated), m_Thread(INVALID_HANDLE_VALUE)
+	BaseThread(int nPriority = THREAD_PRIORITY_TIME_CRITICAL) : m_Task(), m_taskState(TaskThread::TaskCreated), m_Thread(INVALID_HANDLE_VALUE), m_priority(nPriority)
 	{
 #ifdef _ENABLE_TRACE
 			debugPrintf("ASIOUAC: %s. Thread constructor\n", m_Task.TaskName());
 #endif
-		m_Thread = CreateThread(NULL, 0, LPTHREAD_START_ROUTINE(sThreadFunc), this, CREATE_SUSPENDED, &m_ThreadID);
-		if(m_Thread == INVALID_HANDLE_VALUE)
-		{
-		}
-		SetThreadPriority(m_Thread, nPriority);
 	}
 
 	virtual ~BaseThread(void)
@@ -264,7 +512,7 @@ public:
 #ifdef _ENABLE_TRACE
 		debugPrintf("ASIOUAC: %s. Try start...\n", m_Task.TaskName());
 #endif
-		if(m_Thread == INVALID_HANDLE_VALUE)
+		if(!CreateTaskThread())
 		{
 #ifdef _ENABLE_TRACE
 			debugPrintf("ASIOUAC: %s. Can't start thread. Invalid handle\n", m_Task.TaskName());
@@ -305,7 +553,7 @@ public:
 			return FALSE;
 		}
 
-		if(m_taskState == TaskThread::TaskStopped)
+		if(m_taskState != TaskThread::TaskStarted)
 		{
 #ifdef _ENABLE_TRACE
 			debugPrintf("ASIOUAC: %s. Can't stop thread. Already stopped\n", m_Task.TaskName());
@@ -340,6 +588,11 @@ public:
 	{
 		return m_taskState == TaskThread::TaskStarted;
 	}
+
+	TaskClass* GetTask()
+	{
+		return &m_Task;
+	}
 };
 
 struct ISOBuffer
@@ -351,9 +604,6 @@ struct ISOBuffer
 	KISO_PACKET*    IsoPackets;
 };
 
-#define MAX_OUTSTANDING_TRANSFERS	6
-
-
 class AudioTask : public TaskThread
 {
 	KOVL_POOL_HANDLE    m_OvlPool;
@@ -363,17 +613,28 @@ class AudioTask : public TaskThread
 	ULONG               m_FrameNumber;
 	ULONG				m_LastStartFrame;
 
-	ISOBuffer			m_isoBuffers[MAX_OUTSTANDING_TRANSFERS];
+	//one page aligned block per task: data buffers, KISO contexts and ring descriptors
+	PUCHAR				m_arena;
+	ULONG				m_arenaSize;
+	int					m_arenaAllocCount;
+
+	ISOBuffer*			m_isoBuffers;			//carved from m_arena
+	int					m_isoBuffersCount;		//ring size = outstanding transfers + 1
 	int					m_outstandingIndex;
 	int					m_completedIndex;
 
 	Mutex				m_buffersGuard;
 
-	void SetNextFrameNumber(ISOBuffer* buffer)
-	{
-		buffer->IsoContext->StartFrame = m_FrameNumber;
-		m_FrameNumber += m_channelNumber * m_sampleSize;
-	}
+	//frame scheduling
+	int					m_scheduleLead;			//microframes
+	bool				m_scheduleActive;		//StartFrame is set per transfer, off if the transport has no frame number
+	bool				m_scheduleValid;		//m_FrameNumber is the start frame of next transfer
+	int					m_scheduleDelay;		//last FillBuffer to wire delay, microseconds
+	int					m_scheduleDelayMax;
+	ULONG				m_scheduleResyncCount;
+
+	void SetNextFrameNumber(ISOBuffer* buffer);
+	int FramesPerTransfer();
 
 	void IsoXferComplete(ISOBuffer* buffer, ULONG transferLength)
 	{
@@ -381,10 +642,42 @@ class AudioTask : public TaskThread
 		m_LastStartFrame = buffer->IsoContext->StartFrame;
 	}
 
+	//endpoint statistics, written by the servicing thread only, read by any thread
+	volatile LONG		m_statTransfers;
+	volatile LONG		m_statFailedTransfers;
+	volatile LONG		m_statPacketsOk;
+	volatile LONG		m_statPacketsError;
+	volatile LONG		m_statPacketsShort;
+	volatile LONGLONG	m_statBytes;
+	volatile LONGLONG	m_statProcessTime;		//performance counter ticks
+	volatile LONG		m_statRecoveries;
+	volatile LONG		m_statRecoveryTime;
+	volatile LONG		m_statRecoveryTimeMax;
+	DWORD				m_statStartTick;
+
+	//in-place recovery
+	volatile LONG		m_injectedErrors;
+	int					m_recoveryAttempts;		//consecutive recoveries without a good transfer
+	LONGLONG			m_recoveryStart;		//performance counter at recovery start, 0 - not recovering
+
+	void CancelTransfers();
+	bool RecoverStream();
+
+	void ClearStatistics();
+	void UpdateStatistics(ISOBuffer* buffer, ULONG transferLength);
+
 
 	_TCHAR				m_taskName[64];
 	int					m_isoTransferErrorCount;
 
+	//scheduler statistics
+	ULONG				m_wakeupCount;
+	ULONG				m_resubmitCount;
+	LONGLONG			m_completionTime;		//performance counter at last completion, 0 - resubmitted
+	LONGLONG			m_oldestQueuedTime;		//performance counter when the oldest queued transfer became the oldest
+	LONGLONG			m_resubmitTimeSum;
+	LONGLONG			m_resubmitTimeMax;
+
 protected:
 	USBAudioDevice*		m_device;
 
@@ -398,6 +691,7 @@ protected:
 	UCHAR				m_channelNumber;
 
 	int					m_packetPerTransfer;
+	int					m_outstandingTransfers;
 	int					m_packetSize;
 	float				m_defaultPacketSize;
 
@@ -407,9 +701,18 @@ protected:
 
 	bool AllocBuffers();
 	bool FreeBuffers();
+	bool SetPacketSize(int freq);
+	bool IsHighSpeed();
+	int PacketsPerSecond();
+	int PacketsPerFrame();
+	//received packets shorter than this are counted as short
+	virtual int MinPacketLength()
+	{ return m_channelNumber * m_sampleSize * (int)m_defaultPacketSize; }
 	virtual bool InitBuffers(int freq) = 0;
 	virtual bool BeforeStartInternal() = 0;
 	virtual bool AfterStopInternal() = 0;
+	//called after the pipe was restarted by in-place recovery
+	virtual void RecoverInternal() {}
 
 	virtual int FillBuffer(ISOBuffer* buffer) = 0;
 	virtual bool RWBuffer(ISOBuffer* buffer, int len) = 0;
@@ -432,21 +735,52 @@ public:
 		m_FrameNumber(0),
 		m_LastStartFrame(0),
 		m_packetPerTransfer(packetPerTransfer), 
+		m_outstandingTransfers(DEFAULT_OUTSTANDING_TRANSFERS),
 		m_packetSize(0), 
 		m_defaultPacketSize(0), 
+		m_arena(NULL),
+		m_arenaSize(0),
+		m_arenaAllocCount(0),
+		m_isoBuffers(NULL),
+		m_isoBuffersCount(0),
 		m_outstandingIndex(0),
 		m_completedIndex(0),
 		m_isStarted(FALSE),
 		m_sampleFreq(0),
 		m_sampleSize(4), //default sample size in bytes
 		m_channelNumber(2),
-		m_isoTransferErrorCount(0)
+		m_isoTransferErrorCount(0),
+		m_scheduleLead(DEFAULT_SCHEDULE_LEAD),
+		m_scheduleActive(FALSE),
+		m_scheduleValid(FALSE),
+		m_scheduleDelay(0),
+		m_scheduleDelayMax(0),
+		m_scheduleResyncCount(0),
+		m_statTransfers(0),
+		m_statFailedTransfers(0),
+		m_statPacketsOk(0),
+		m_statPacketsError(0),
+		m_statPacketsShort(0),
+		m_statBytes(0),
+		m_statProcessTime(0),
+		m_statRecoveries(0),
+		m_statRecoveryTime(0),
+		m_statRecoveryTimeMax(0),
+		m_statStartTick(0),
+		m_injectedErrors(0),
+		m_recoveryAttempts(0),
+		m_recoveryStart(0),
+		m_wakeupCount(0),
+		m_resubmitCount(0),
+		m_completionTime(0),
+		m_oldestQueuedTime(0),
+		m_resubmitTimeSum(0),
+		m_resubmitTimeMax(0)
 #ifdef _ENABLE_TRACE
 		, m_sampleNumbers(0)
 		, m_tickCount(0)
 #endif
 	{
-		memset(m_isoBuffers, 0, sizeof(m_isoBuffers));
 		_tcscpy_s(m_taskName, taskName);
 	}
 
@@ -463,6 +797,7 @@ public:
 		return m_taskName;
 	}
 
+	//maximumPacketSize is the payload per service interval, all transactions of a high-bandwidth endpoint included
 	void Init(USBAudioDevice *device, UCHAR pipeId, USHORT maximumPacketSize, UCHAR interval, UCHAR channelNumber, UCHAR sampleSize)
 	{
 		FreeBuffers();
@@ -478,6 +813,7 @@ public:
 #endif
 	}
 
+	bool CanSampleFreq(int freq);
 	void SetSampleFreq(int freq)
 	{
 		if(m_sampleFreq != freq)
@@ -485,13 +821,57 @@ public:
 		m_sampleFreq = freq;
 	}
 
+	bool SetTransferConfig(int outstandingTransfers, int packetPerTransfer);
+	int GetOutstandingTransfers()
+	{ return m_outstandingTransfers; }
+	int GetPacketPerTransfer()
+	{ return m_packetPerTransfer; }
+	//time covered by the queued transfers, microseconds
+	int GetQueuedTime();
+	//must be called before start, 0 - start transfers ASAP
+	bool SetScheduleLead(int microframes);
+	int GetScheduleLead()
+	{ return m_scheduleLead; }
+	//delay between filling of the last transfer and its start on the bus, microseconds
+	int GetScheduleDelay()
+	{ return m_scheduleDelay; }
+	int GetMaxScheduleDelay()
+	{ return m_scheduleDelayMax; }
+	//number of times the schedule fell behind the bus and was restarted
+	ULONG GetScheduleResyncCount()
+	{ return m_scheduleResyncCount; }
+
+	//number of arena allocations made by this task
+	int GetAllocationCount()
+	{ return m_arenaAllocCount; }
+
 	bool BufferIsAllocated()
-	{ return m_isoBuffers[0].DataBuffer != NULL; }
+	{ return m_isoBuffers != NULL && m_isoBuffers[0].DataBuffer != NULL; }
+
+	//building blocks of Work, used by the single service thread too
+	void SubmitTransfers(volatile TaskState& taskState);
+	bool HasPendingTransfers()
+	{ return m_completedIndex != m_outstandingIndex; }
+	//event of the oldest queued transfer, NULL if nothing queued
+	HANDLE GetCompletionEvent();
+	//the oldest queued transfer waits for timeout ms or longer
+	bool IsTransferOverdue(LONG timeout);
+	bool CompleteTransfer(LONG timeout);
+	//account failed transfer, FALSE if the device was notified about error
+	bool TransferFailed();
+
+	void GetSchedulerStatistics(SchedulerStatistics& stats);
+	//safe to call while the stream is running
+	void GetEndpointStatistics(EndpointStatistics& stats);
+	//next count completed transfers are handled as failed, for testing of recovery
+	void InjectTransferErrors(int count);
 };
 
 class AudioDACTask : public AudioTask
 {
 	FeedbackInfo*				m_feedbackInfo;
+	PacketScheduler				m_packetScheduler;
+	int							m_silentTransfers;	//transfers to fill with silence after recovery
 	FillDataCallback			m_readDataCb;
 	void*						m_readDataCbContext;
 #ifdef _ENABLE_TRACE
@@ -503,15 +883,17 @@ protected:
 		if(m_isStarted)
 			return FALSE;
 
-		m_defaultPacketSize = (float)freq / 8000.f * (1 << (m_interval - 1)); // size in stereo samples in microframe
-		m_packetSize = m_channelNumber * m_sampleSize * ((int)m_defaultPacketSize + 1); //size in bytes = (packetSize + 1 extra frame) * size of frame
-		if(BufferIsAllocated())
-			FreeBuffers();
-		AllocBuffers();
-		return TRUE;
+		if(!SetPacketSize(freq))
+			return FALSE;
+		m_packetScheduler.Init(freq, PacketsPerSecond());
+		return AllocBuffers();
 	}
 	bool BeforeStartInternal();
 	bool AfterStopInternal();
+	void RecoverInternal()
+	{
+		m_silentTransfers = m_outstandingTransfers;
+	}
 
 	virtual int FillBuffer(ISOBuffer* buffer);
 	virtual bool RWBuffer(ISOBuffer* buffer, int len);
@@ -522,7 +904,7 @@ protected:
 #endif
 
 public:
-	AudioDACTask() : AudioTask(packetPerTransferDAC, "Audio DAC task"), m_feedbackInfo(NULL), m_readDataCb(NULL), m_readDataCbContext(NULL)
+	AudioDACTask() : AudioTask(packetPerTransferDAC, "Audio DAC task"), m_feedbackInfo(NULL), m_silentTransfers(0), m_readDataCb(NULL), m_readDataCbContext(NULL)
 	{
 #ifdef _ENABLE_TRACE
 		m_dumpFile = fopen("c:\\dac_dump.bin", "wb");
@@ -555,19 +937,20 @@ class AudioADCTask : public AudioTask
 	FeedbackInfo*				m_feedbackInfo;
 	FillDataCallback			m_writeDataCb;
 	void*						m_writeDataCbContext;
+	ScatterDataCallback			m_scatterDataCb;
+	void*						m_scatterDataCbContext;
+	RateEstimator				m_rateEstimator;
+	bool						m_filterFeedback;
 protected:
 	bool InitBuffers(int freq)
 	{
 		if(m_isStarted)
 			return FALSE;
 
-		m_defaultPacketSize = (float)freq / 8000.f * (1 << (m_interval - 1)); // size in stereo samples in microframe
-		m_packetSize = m_channelNumber * m_sampleSize * ((int)m_defaultPacketSize + 1); //size in bytes = (packetSize + 1 extra frame) * size of frame
-
-		if(BufferIsAllocated())
-			FreeBuffers();
-		AllocBuffers();
-		return TRUE;
+		if(!SetPacketSize(freq))
+			return FALSE;
+		m_rateEstimator.Init(freq, PacketsPerSecond());
+		return AllocBuffers();
 	}
 	bool BeforeStartInternal();
 	bool AfterStopInternal();
@@ -581,7 +964,8 @@ protected:
 #endif
 
 public:
-	AudioADCTask() : AudioTask(packetPerTransferADC, "Audio ADC task"), m_feedbackInfo(NULL), m_writeDataCb(NULL), m_writeDataCbContext(NULL)
+	AudioADCTask() : AudioTask(packetPerTransferADC, "Audio ADC task"), m_feedbackInfo(NULL), m_writeDataCb(NULL), m_writeDataCbContext(NULL),
+		m_scatterDataCb(NULL), m_scatterDataCbContext(NULL), m_filterFeedback(TRUE)
 	{}
 
 	~AudioADCTask()
@@ -597,25 +981,40 @@ public:
 		m_writeDataCbContext = context;
 		m_writeDataCb = writeDataCb;
 	}
+
+	//if set, it's used instead of FillDataCallback and gets packets without compaction
+	void SetScatterCallback(ScatterDataCallback scatterDataCb, void* context)
+	{
+		m_scatterDataCbContext = context;
+		m_scatterDataCb = scatterDataCb;
+	}
+
+	//FALSE - implicit feedback is the raw length of every transfer
+	void SetFeedbackFilter(bool enable)
+	{
+		m_filterFeedback = enable;
+	}
+	RateEstimator* GetRateEstimator()
+	{
+		return &m_rateEstimator;
+	}
 };
 
 class AudioFeedbackTask : public AudioTask
 {
 	FeedbackInfo*	m_feedbackInfo;
+	FeedbackDecoder	m_decoder;
 protected:
 	bool InitBuffers(int freq)
 	{
 		if(m_isStarted)
 			return FALSE;
-		if(!BufferIsAllocated())
-		{
-			m_packetSize = m_maximumPacketSize;
-			m_defaultPacketSize = m_maximumPacketSize;
-			AllocBuffers();
-		}
-
-		return TRUE;
+		m_packetSize = m_maximumPacketSize;
+		m_defaultPacketSize = m_maximumPacketSize;
+		return AllocBuffers();
 	}
+	int MinPacketLength()
+	{ return 3; } //10.14 full speed feedback
 	bool BeforeStartInternal();
 	bool AfterStopInternal();
 
@@ -635,6 +1034,32 @@ public:
 	}
 };
 
+//Services all ISO pipes of the device from one thread: waits for the first completion
+//of any pipe, then drains and refills every pipe which has completed transfers
+class AudioServiceTask : public TaskThread
+{
+	AudioTask*		m_tasks[MAX_SERVICED_TASKS];
+	int				m_taskCount;
+	ULONG			m_wakeupCount;
+public:
+	AudioServiceTask() : m_taskCount(0), m_wakeupCount(0)
+	{}
+
+	void ClearTasks()
+	{ m_taskCount = 0; }
+	bool AddTask(AudioTask* task);
+
+	bool BeforeStart();
+	bool AfterStop();
+	bool Work(volatile TaskState& taskState);
+	_TCHAR* TaskName()
+	{
+		return _T("Audio service task");
+	}
+
+	void GetSchedulerStatistics(SchedulerStatistics& stats);
+};
+
 class AudioDAC : public BaseThread<AudioDACTask>
 {
 public:
@@ -650,6 +1075,14 @@ public:
 	{
 		m_Task.SetSampleFreq(freq);
 	}
+	bool SetTransferConfig(int outstandingTransfers, int packetPerTransfer)
+	{
+		return m_Task.SetTransferConfig(outstandingTransfers, packetPerTransfer);
+	}
+	int GetQueuedTime()
+	{
+		return m_Task.GetQueuedTime();
+	}
 	void SetCallback(FillDataCallback readDataCb, void* context)
 	{
 		m_Task.SetCallback(readDataCb, context);
@@ -671,10 +1104,22 @@ public:
 	{
 		m_Task.SetSampleFreq(freq);
 	}
+	bool SetTransferConfig(int outstandingTransfers, int packetPerTransfer)
+	{
+		return m_Task.SetTransferConfig(outstandingTransfers, packetPerTransfer);
+	}
+	int GetQueuedTime()
+	{
+		return m_Task.GetQueuedTime();
+	}
 	void SetCallback(FillDataCallback readDataCb, void* context)
 	{
 		m_Task.SetCallback(readDataCb, context);
 	}
+	void SetScatterCallback(ScatterDataCallback scatterDataCb, void* context)
+	{
+		m_Task.SetScatterCallback(scatterDataCb, context);
+	}
 };
 
 class AudioFeedback : public BaseThread<AudioFeedbackTask>
@@ -690,5 +1135,28 @@ public:
 		m_Task.SetFeedbackInfo(fb);
 		m_Task.SetSampleFreq(48000); //set any sample rate only for allocate buffers
 	}
+	bool SetTransferConfig(int outstandingTransfers, int packetPerTransfer)
+	{
+		return m_Task.SetTransferConfig(outstandingTransfers, packetPerTransfer);
+	}
 };
 
+class AudioService : public BaseThread<AudioServiceTask>
+{
+public:
+	AudioService()
+	{
+	}
+	void ClearTasks()
+	{
+		m_Task.ClearTasks();
+	}
+	bool AddTask(AudioTask* task)
+	{
+		return m_Task.AddTask(task);
+	}
+	void GetSchedulerStatistics(SchedulerStatistics& stats)
+	{
+		m_Task.GetSchedulerStatistics(stats);
+	}
+};
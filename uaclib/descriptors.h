@@ -16,12 +16,8 @@
 #ifndef __DESCRIPTORS_H__
 #define __DESCRIPTORS_H__
 
-#include "targetver.h"
-#include <tchar.h>
-#include <windows.h>
-
-#include <libusbk.h>
-#include "usbdevice.h"
+#include "platform.h"
+#include "UsbDevice.h"
 #include "tlist.h"
 
 
@@ -45,7 +41,7 @@ public:
 	friend class USBAudioDevice;
 };
 
-class USBAudioClockSource : public TElement<USBAudioClockSource, TList<USBAudioClockSource>>
+class USBAudioClockSource : public TElement<USBAudioClockSource, TList<USBAudioClockSource> >
 {
 protected:
 	usb_clock_source_descriptor		m_clockSource;	// Clock source
@@ -59,7 +55,7 @@ public:
 	friend class USBAudioControlInterface;
 };
 
-class USBAudioInTerminal : public TElement<USBAudioInTerminal, TList<USBAudioInTerminal>>
+class USBAudioInTerminal : public TElement<USBAudioInTerminal, TList<USBAudioInTerminal> >
 {
 protected:
 	usb_in_ter_descriptor_2		m_inTerminal;
@@ -73,7 +69,7 @@ public:
 	friend class USBAudioControlInterface;
 };
 
-class USBAudioOutTerminal : public TElement<USBAudioOutTerminal, TList<USBAudioOutTerminal>>
+class USBAudioOutTerminal : public TElement<USBAudioOutTerminal, TList<USBAudioOutTerminal> >
 {
 protected:
 	usb_out_ter_descriptor_2		m_outTerminal;
@@ -88,7 +84,7 @@ public:
 };
 
 
-class USBAudioFeatureUnit : public TElement<USBAudioFeatureUnit, TList<USBAudioFeatureUnit>>
+class USBAudioFeatureUnit : public TElement<USBAudioFeatureUnit, TList<USBAudioFeatureUnit> >
 {
 protected:
 	usb_feature_unit_descriptor_2		m_featureUnit;
@@ -109,13 +105,14 @@ protected:
 public:
 	USBEndpoint(USB_ENDPOINT_DESCRIPTOR* descriptor);
 	~USBEndpoint() {}
+	const USB_ENDPOINT_DESCRIPTOR& Descriptor() { return m_descriptor; }
 	virtual bool SetCSDescriptor(USB_DESCRIPTOR_HEADER *csDescriptor) = 0;
 	friend class USBAudioDevice;
 	friend class USBAudioControlInterface;
 	friend class USBAudioStreamingInterface;
 };
 
-class USBAudioStreamingEndpoint : public USBEndpoint, public TElement<USBAudioStreamingEndpoint, TList<USBAudioStreamingEndpoint>>
+class USBAudioStreamingEndpoint : public USBEndpoint, public TElement<USBAudioStreamingEndpoint, TList<USBAudioStreamingEndpoint> >
 {
 protected:
 	usb_endpoint_audio_specific_2	m_asDescriptor;
@@ -131,7 +128,7 @@ public:
 	friend class USBAudioStreamingInterface;
 };
 
-class USBAudioControlInterface : public USBAudioInterface, public TElement<USBAudioControlInterface, TList<USBAudioControlInterface>>
+class USBAudioControlInterface : public USBAudioInterface, public TElement<USBAudioControlInterface, TList<USBAudioControlInterface> >
 {
 protected:
 	usb_ac_interface_descriptor_2				m_acDescriptor;
@@ -155,7 +152,7 @@ public:
 	friend class USBAudioDevice;
 };
 
-class USBAudioStreamingInterface : public USBAudioInterface, public TElement<USBAudioStreamingInterface, TList<USBAudioStreamingInterface>>
+class USBAudioStreamingInterface : public USBAudioInterface, public TElement<USBAudioStreamingInterface, TList<USBAudioStreamingInterface> >
 {
 protected:
 	usb_as_g_interface_descriptor_2				m_asgDescriptor;
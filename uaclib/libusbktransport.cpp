@@ -0,0 +1,141 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include "libusbktransport.h"
+
+#ifdef _WIN32
+
+/*
+struct DeviceID
+{
+	USHORT vid;
+	USHORT pid;
+};
+
+DeviceID deviceID[] = {
+	{0x16C0, 0x03E8},
+	{0x16C0, 0x05dc}
+};
+
+int deviceIDNum = sizeof(deviceID)/sizeof(DeviceID);
+*/
+
+#define _DeviceInterfaceGUID "{09e4c63c-ce0f-168c-1862-06410a764a35}"
+
+KUSB_HANDLE LibUsbKTransport::FindDevice()
+{
+	KLST_HANDLE DeviceList = NULL;
+	KUSB_HANDLE handle = NULL;
+
+	m_deviceInfo = NULL;
+	KLST_DEVINFO_HANDLE tmpDeviceInfo = NULL;
+
+	UINT deviceCount = 0;
+
+	// Get the device list
+	if (!LstK_Init(&DeviceList, KLST_FLAG_NONE))
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Error initializing device list.\n");
+#endif
+		return NULL;
+	}
+
+	LstK_Count(DeviceList, &deviceCount);
+	if (!deviceCount)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: No devices in device list.\n");
+#endif
+		SetLastError(ERROR_DEVICE_NOT_CONNECTED);
+		// If LstK_Init returns TRUE, the list must be freed.
+		LstK_Free(DeviceList);
+		return NULL;
+	}
+
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: Looking for device with DeviceInterfaceGUID %s\n", _T(_DeviceInterfaceGUID));
+#endif
+	LstK_MoveReset(DeviceList);
+    //
+    //
+    // Call LstK_MoveNext after a LstK_MoveReset to advance to the first
+    // element.
+    while(LstK_MoveNext(DeviceList, &tmpDeviceInfo)
+		&& m_deviceInfo == NULL)
+    {
+		if(!_stricmp(tmpDeviceInfo->DeviceInterfaceGUID, _DeviceInterfaceGUID) && tmpDeviceInfo->Connected)
+		{
+			m_deviceInfo = tmpDeviceInfo;
+			break;
+		}
+    }
+
+	if (!m_deviceInfo)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Device not found.\n");
+#endif
+		// If LstK_Init returns TRUE, the list must be freed.
+		LstK_Free(DeviceList);
+		SetLastError(ERROR_DEVICE_NOT_CONNECTED);
+		return NULL;
+	}
+
+    // Initialize the device with the "dynamic" Open function
+    if (!UsbK_Init(&handle, m_deviceInfo))
+    {
+		DWORD errorCode = GetLastError();
+		m_deviceInfo = NULL;
+		handle = NULL;
+#ifdef _ENABLE_TRACE
+        debugPrintf("ASIOUAC: UsbK_Init failed. ErrorCode: %08Xh\n",  errorCode);
+#endif
+		LstK_Free(DeviceList);
+		SetLastError(errorCode);
+		return NULL;
+    }
+
+	LstK_Free(DeviceList);
+	return handle;
+}
+
+bool LibUsbKTransport::Open()
+{
+	Close();
+	m_usbDeviceHandle = FindDevice();
+	return m_usbDeviceHandle != NULL;
+}
+
+void LibUsbKTransport::Close()
+{
+    // Close the device handle
+    // if handle is invalid (NULL), has no effect
+    UsbK_Free(m_usbDeviceHandle);
+	m_usbDeviceHandle = NULL;
+	m_deviceInfo = NULL;
+}
+
+bool LibUsbKTransport::GetDeviceSpeed(int* speed)
+{
+	UCHAR information[16];
+	UINT length = sizeof(information);
+	if(!UsbK_QueryDeviceInformation(m_usbDeviceHandle, DEVICE_SPEED, &length, information))
+		return FALSE;
+	*speed = (int)information[0];
+	return TRUE;
+}
+
+#endif //_WIN32
@@ -0,0 +1,93 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#pragma once
+#ifndef __LIBUSBK_TRANSPORT_H__
+#define __LIBUSBK_TRANSPORT_H__
+
+#include "usbtransport.h"
+
+#ifdef _WIN32
+
+#ifdef _ENABLE_TRACE
+extern void debugPrintf(const _TCHAR *szFormat, ...);
+#endif
+
+//device bound to the libusbK driver, found by its device interface GUID
+class LibUsbKTransport : public USBTransport
+{
+	KUSB_HANDLE						m_usbDeviceHandle;
+	KLST_DEVINFO_HANDLE				m_deviceInfo;
+
+	KUSB_HANDLE FindDevice();
+public:
+	LibUsbKTransport() : m_usbDeviceHandle(NULL), m_deviceInfo(NULL)
+	{}
+	virtual ~LibUsbKTransport()
+	{ Close(); }
+
+	virtual bool Open();
+	virtual void Close();
+	virtual bool IsOpen()
+	{ return m_usbDeviceHandle != NULL; }
+
+	virtual bool GetDeviceSpeed(int* speed);
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+	{ return UsbK_GetDescriptor(m_usbDeviceHandle, type, index, languageId, buffer, bufferLength, lengthTransferred) != FALSE; }
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+	{ return UsbK_ControlTransfer(m_usbDeviceHandle, setupPacket, buffer, bufferLength, lengthTransferred, NULL) != FALSE; }
+
+	virtual bool ClaimInterface(UCHAR number)
+	{ return UsbK_ClaimInterface(m_usbDeviceHandle, number, FALSE) != FALSE; }
+	virtual bool ReleaseInterface(UCHAR number)
+	{ return UsbK_ReleaseInterface(m_usbDeviceHandle, number, FALSE) != FALSE; }
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting)
+	{ return UsbK_SetAltInterface(m_usbDeviceHandle, number, FALSE, altSetting) != FALSE; }
+
+	virtual bool ResetPipe(UCHAR pipeId)
+	{ return UsbK_ResetPipe(m_usbDeviceHandle, pipeId) != FALSE; }
+	virtual bool AbortPipe(UCHAR pipeId)
+	{ return UsbK_AbortPipe(m_usbDeviceHandle, pipeId) != FALSE; }
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value)
+	{ return UsbK_SetPipePolicy(m_usbDeviceHandle, pipeId, policyType, valueLength, value) != FALSE; }
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber)
+	{ return UsbK_GetCurrentFrameNumber(m_usbDeviceHandle, frameNumber) != FALSE; }
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount)
+	{ return OvlK_Init(poolHandle, m_usbDeviceHandle, maxOverlappedCount, KOVL_POOL_FLAG_NONE) != FALSE; }
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle)
+	{ return OvlK_Free(poolHandle) != FALSE; }
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle)
+	{ return OvlK_Acquire(overlapped, poolHandle) != FALSE; }
+	virtual bool OvlRelease(KOVL_HANDLE overlapped)
+	{ return OvlK_Release(overlapped) != FALSE; }
+	virtual bool OvlReUse(KOVL_HANDLE overlapped)
+	{ return OvlK_ReUse(overlapped) != FALSE; }
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength)
+	{ return OvlK_Wait(overlapped, timeoutMS, waitFlags, transferredLength) != FALSE; }
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength)
+	{ return OvlK_WaitOrCancel(overlapped, timeoutMS, transferredLength) != FALSE; }
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped)
+	{ return OvlK_GetEventHandle(overlapped); }
+
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return UsbK_IsoWritePipe(m_usbDeviceHandle, pipeId, buffer, bufferLength, (LPOVERLAPPED)overlapped, isoContext) != FALSE; }
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return UsbK_IsoReadPipe(m_usbDeviceHandle, pipeId, buffer, bufferLength, (LPOVERLAPPED)overlapped, isoContext) != FALSE; }
+};
+
+#endif //_WIN32
+
+#endif //__LIBUSBK_TRANSPORT_H__
@@ -0,0 +1,566 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include "libusbtransport.h"
+
+#ifdef _USE_LIBUSB
+
+#define LIBUSB_CONTROL_TIMEOUT		1000	//ms
+#define LIBUSB_EVENT_TIMEOUT		100000	//us, event thread checks for exit
+#define LIBUSB_CANCEL_TIMEOUT		1000	//ms to wait for the callback of a cancelled transfer
+
+enum LibUsbTransferState
+{
+	TransferIdle = 0,
+	TransferQueued,
+	TransferCompleted
+};
+
+struct LibUsbOverlapped
+{
+	LibUsbTransport*	transport;
+	HANDLE				event;			//manual reset, signaled from the transfer callback
+	bool				acquired;
+	volatile int		state;
+	libusb_transfer*	transfer;
+	int					isoCapacity;	//packets the transfer was allocated for
+	PKISO_CONTEXT		isoContext;
+	DWORD				status;
+	UINT				transferred;
+	LibUsbOverlapped*	next;			//in the inflight list
+};
+
+struct LibUsbPool
+{
+	int					count;
+	LibUsbOverlapped*	overlapped;
+};
+
+LibUsbTransport::LibUsbTransport(USHORT vendorId, USHORT productId) : m_vendorId(vendorId), m_productId(productId), m_context(NULL), m_handle(NULL),
+	m_eventThread(NULL), m_exit(0), m_inflight(NULL)
+{
+	InitializeCriticalSection(&m_lock);
+}
+
+LibUsbTransport::~LibUsbTransport()
+{
+	Close();
+	DeleteCriticalSection(&m_lock);
+}
+
+//libusb error codes to the Win32 ones USBDevice reports
+bool LibUsbTransport::CheckResult(int result)
+{
+	if(result >= 0)
+		return TRUE;
+	DWORD errorCode;
+	switch(result)
+	{
+		case LIBUSB_ERROR_INVALID_PARAM:
+			errorCode = ERROR_INVALID_PARAMETER;
+			break;
+		case LIBUSB_ERROR_NO_DEVICE:
+			errorCode = ERROR_DEVICE_NOT_CONNECTED;
+			break;
+		case LIBUSB_ERROR_NOT_FOUND:
+			errorCode = ERROR_NOT_FOUND;
+			break;
+		case LIBUSB_ERROR_BUSY:
+			errorCode = ERROR_BUSY;
+			break;
+		case LIBUSB_ERROR_TIMEOUT:
+			errorCode = ERROR_SEM_TIMEOUT;
+			break;
+		case LIBUSB_ERROR_NO_MEM:
+			errorCode = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		case LIBUSB_ERROR_NOT_SUPPORTED:
+			errorCode = ERROR_NOT_SUPPORTED;
+			break;
+		default:
+			errorCode = ERROR_GEN_FAILURE;
+			break;
+	}
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: libusb error %s\n", libusb_error_name(result));
+#endif
+	SetLastError(errorCode);
+	return FALSE;
+}
+
+bool LibUsbTransport::Open()
+{
+	Close();
+
+	int result = libusb_init(&m_context);
+	if(result < 0)
+	{
+		m_context = NULL;
+		return CheckResult(result);
+	}
+
+	libusb_device** list = NULL;
+	ssize_t count = libusb_get_device_list(m_context, &list);
+	result = LIBUSB_ERROR_NO_DEVICE;
+	for(ssize_t i = 0; i < count && m_handle == NULL; i++)
+	{
+		libusb_device_descriptor descriptor;
+		if(libusb_get_device_descriptor(list[i], &descriptor) < 0 ||
+			descriptor.idVendor != m_vendorId || descriptor.idProduct != m_productId)
+			continue;
+		result = libusb_open(list[i], &m_handle);
+		if(result < 0)
+			m_handle = NULL;
+	}
+	if(list)
+		libusb_free_device_list(list, 1);
+
+	if(m_handle == NULL)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Device %04X:%04X not found or can't be opened\n", m_vendorId, m_productId);
+#endif
+		libusb_exit(m_context);
+		m_context = NULL;
+		return CheckResult(result);
+	}
+	//snd-usb-audio holds the audio interfaces otherwise
+	libusb_set_auto_detach_kernel_driver(m_handle, 1);
+
+	m_exit = 0;
+	m_eventThread = CreateThread(NULL, 0, sEventThread, this, 0, NULL);
+	if(m_eventThread == NULL)
+	{
+		DWORD errorCode = GetLastError();
+		libusb_close(m_handle);
+		libusb_exit(m_context);
+		m_handle = NULL;
+		m_context = NULL;
+		SetLastError(errorCode);
+		return FALSE;
+	}
+	//completion latency of every stream depends on this thread
+	SetThreadPriority(m_eventThread, THREAD_PRIORITY_TIME_CRITICAL);
+	return TRUE;
+}
+
+void LibUsbTransport::Close()
+{
+	if(m_handle == NULL)
+		return;
+
+	//callbacks of cancelled transfers still need the event thread
+	EnterCriticalSection(&m_lock);
+	for(LibUsbOverlapped* overlapped = m_inflight; overlapped; overlapped = overlapped->next)
+		libusb_cancel_transfer(overlapped->transfer);
+	LeaveCriticalSection(&m_lock);
+	DWORD start = GetTickCount();
+	while(m_inflight != NULL && GetTickCount() - start < LIBUSB_CANCEL_TIMEOUT)
+		Sleep(1);
+
+	m_exit = 1;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(m_context);
+#endif
+	WaitForSingleObject(m_eventThread, INFINITE);
+	CloseHandle(m_eventThread);
+	m_eventThread = NULL;
+
+	libusb_close(m_handle);
+	libusb_exit(m_context);
+	m_handle = NULL;
+	m_context = NULL;
+}
+
+DWORD WINAPI LibUsbTransport::sEventThread(LPVOID context)
+{
+	LibUsbTransport* transport = (LibUsbTransport*)context;
+	transport->EventThread();
+	return 0;
+}
+
+void LibUsbTransport::EventThread()
+{
+	while(!m_exit)
+	{
+		timeval timeout = {0, LIBUSB_EVENT_TIMEOUT};
+		libusb_handle_events_timeout_completed(m_context, &timeout, (int*)&m_exit);
+	}
+}
+
+bool LibUsbTransport::GetDeviceSpeed(int* speed)
+{
+	switch(libusb_get_device_speed(libusb_get_device(m_handle)))
+	{
+		case LIBUSB_SPEED_LOW:
+			*speed = LowSpeed;
+			return TRUE;
+		case LIBUSB_SPEED_FULL:
+			*speed = FullSpeed;
+			return TRUE;
+		case LIBUSB_SPEED_UNKNOWN:
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return FALSE;
+		default:
+			//super speed devices stream through the high speed descriptors
+			*speed = HighSpeed;
+			return TRUE;
+	}
+}
+
+bool LibUsbTransport::GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	int result;
+	if(type == USB_DESCRIPTOR_TYPE_STRING)
+		result = libusb_get_string_descriptor(m_handle, index, languageId, buffer, bufferLength);
+	else
+		result = libusb_get_descriptor(m_handle, type, index, buffer, bufferLength);
+	if(!CheckResult(result))
+		return FALSE;
+	if(lengthTransferred)
+		*lengthTransferred = result;
+	return TRUE;
+}
+
+bool LibUsbTransport::ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	int result = libusb_control_transfer(m_handle, setupPacket.RequestType, setupPacket.Request, setupPacket.Value, setupPacket.Index,
+		buffer, (uint16_t)bufferLength, LIBUSB_CONTROL_TIMEOUT);
+	if(!CheckResult(result))
+		return FALSE;
+	if(lengthTransferred)
+		*lengthTransferred = result;
+	return TRUE;
+}
+
+bool LibUsbTransport::ClaimInterface(UCHAR number)
+{
+	return CheckResult(libusb_claim_interface(m_handle, number));
+}
+
+bool LibUsbTransport::ReleaseInterface(UCHAR number)
+{
+	return CheckResult(libusb_release_interface(m_handle, number));
+}
+
+bool LibUsbTransport::SetAltInterface(UCHAR number, UCHAR altSetting)
+{
+	return CheckResult(libusb_set_interface_alt_setting(m_handle, number, altSetting));
+}
+
+//isochronous endpoints have no halt state, a reset drops the queued transfers as WinUSB does
+bool LibUsbTransport::ResetPipe(UCHAR pipeId)
+{
+	return AbortPipe(pipeId);
+}
+
+bool LibUsbTransport::AbortPipe(UCHAR pipeId)
+{
+	EnterCriticalSection(&m_lock);
+	for(LibUsbOverlapped* overlapped = m_inflight; overlapped; overlapped = overlapped->next)
+		if(overlapped->transfer->endpoint == pipeId)
+			libusb_cancel_transfer(overlapped->transfer);
+	LeaveCriticalSection(&m_lock);
+	return TRUE;
+}
+
+//transfers are always queued ASAP, the policies have nothing to change
+bool LibUsbTransport::SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value)
+{
+	return TRUE;
+}
+
+bool LibUsbTransport::GetCurrentFrameNumber(PUINT frameNumber)
+{
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+bool LibUsbTransport::OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount)
+{
+	if(maxOverlappedCount <= 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	LibUsbPool* pool = new LibUsbPool();
+	pool->count = maxOverlappedCount;
+	pool->overlapped = new LibUsbOverlapped[maxOverlappedCount];
+	memset(pool->overlapped, 0, maxOverlappedCount * sizeof(LibUsbOverlapped));
+	for(int i = 0; i < maxOverlappedCount; i++)
+	{
+		pool->overlapped[i].transport = this;
+		pool->overlapped[i].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	*poolHandle = pool;
+	return TRUE;
+}
+
+bool LibUsbTransport::OvlFree(KOVL_POOL_HANDLE poolHandle)
+{
+	LibUsbPool* pool = (LibUsbPool*)poolHandle;
+	if(pool == NULL)
+		return FALSE;
+	for(int i = 0; i < pool->count; i++)
+	{
+		LibUsbOverlapped* overlapped = pool->overlapped + i;
+		if(overlapped->state == TransferQueued && !Cancel(overlapped, LIBUSB_CANCEL_TIMEOUT))
+		{
+			//the callback may still come, the transfer can't be freed
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: Transfer isn't cancelled, pool is leaked\n");
+#endif
+			return FALSE;
+		}
+	}
+	for(int i = 0; i < pool->count; i++)
+	{
+		if(pool->overlapped[i].transfer)
+			libusb_free_transfer(pool->overlapped[i].transfer);
+		CloseHandle(pool->overlapped[i].event);
+	}
+	delete [] pool->overlapped;
+	delete pool;
+	return TRUE;
+}
+
+bool LibUsbTransport::OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle)
+{
+	LibUsbPool* pool = (LibUsbPool*)poolHandle;
+	for(int i = 0; pool && i < pool->count; i++)
+		if(!pool->overlapped[i].acquired)
+		{
+			pool->overlapped[i].acquired = TRUE;
+			pool->overlapped[i].state = TransferIdle;
+			ResetEvent(pool->overlapped[i].event);
+			*overlapped = pool->overlapped + i;
+			return TRUE;
+		}
+	SetLastError(ERROR_BUSY);
+	return FALSE;
+}
+
+bool LibUsbTransport::OvlRelease(KOVL_HANDLE overlapped)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	if(ovl == NULL)
+		return FALSE;
+	if(ovl->state == TransferQueued && !Cancel(ovl, LIBUSB_CANCEL_TIMEOUT))
+		return FALSE;
+	ovl->state = TransferIdle;
+	ovl->acquired = FALSE;
+	return TRUE;
+}
+
+bool LibUsbTransport::OvlReUse(KOVL_HANDLE overlapped)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	if(ovl == NULL)
+		return FALSE;
+	if(ovl->state == TransferQueued)
+	{
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+	ovl->state = TransferIdle;
+	ResetEvent(ovl->event);
+	return TRUE;
+}
+
+bool LibUsbTransport::GetResult(LibUsbOverlapped* overlapped, PUINT transferredLength)
+{
+	if(overlapped->state != TransferCompleted)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	if(transferredLength)
+		*transferredLength = overlapped->transferred;
+	if(overlapped->status != ERROR_SUCCESS)
+	{
+		SetLastError(overlapped->status);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool LibUsbTransport::OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	if(ovl == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(WaitForSingleObject(ovl->event, (DWORD)timeoutMS) != WAIT_OBJECT_0)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	return GetResult(ovl, transferredLength);
+}
+
+bool LibUsbTransport::OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	if(ovl == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(WaitForSingleObject(ovl->event, (DWORD)timeoutMS) != WAIT_OBJECT_0)
+		Cancel(ovl, LIBUSB_CANCEL_TIMEOUT);
+	return GetResult(ovl, transferredLength);
+}
+
+HANDLE LibUsbTransport::OvlGetEventHandle(KOVL_HANDLE overlapped)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	return ovl ? ovl->event : NULL;
+}
+
+//cancellation is asynchronous, the transfer is done when its callback has run
+bool LibUsbTransport::Cancel(LibUsbOverlapped* overlapped, DWORD timeoutMS)
+{
+	EnterCriticalSection(&m_lock);
+	if(overlapped->state == TransferQueued)
+		libusb_cancel_transfer(overlapped->transfer);
+	LeaveCriticalSection(&m_lock);
+	return WaitForSingleObject(overlapped->event, timeoutMS) == WAIT_OBJECT_0;
+}
+
+void LibUsbTransport::Unlink(LibUsbOverlapped* overlapped)
+{
+	LibUsbOverlapped** link = &m_inflight;
+	while(*link && *link != overlapped)
+		link = &(*link)->next;
+	if(*link)
+		*link = overlapped->next;
+	overlapped->next = NULL;
+}
+
+bool LibUsbTransport::Submit(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+{
+	LibUsbOverlapped* ovl = (LibUsbOverlapped*)overlapped;
+	if(ovl == NULL || isoContext == NULL || isoContext->NumberOfPackets <= 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(ovl->state == TransferQueued)
+	{
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+
+	int packets = isoContext->NumberOfPackets;
+	if(ovl->transfer == NULL || ovl->isoCapacity < packets)
+	{
+		if(ovl->transfer)
+			libusb_free_transfer(ovl->transfer);
+		ovl->transfer = libusb_alloc_transfer(packets);
+		ovl->isoCapacity = ovl->transfer ? packets : 0;
+		if(ovl->transfer == NULL)
+		{
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return FALSE;
+		}
+	}
+
+	//libusb places packets back to back, KISO offsets of the engine are laid out the same way
+	libusb_fill_iso_transfer(ovl->transfer, m_handle, pipeId, buffer, bufferLength, packets, sTransferCallback, ovl, 0);
+	for(int i = 0; i < packets; i++)
+	{
+		UINT end = i + 1 < packets ? isoContext->IsoPackets[i + 1].Offset : bufferLength;
+		ovl->transfer->iso_packet_desc[i].length = end - isoContext->IsoPackets[i].Offset;
+	}
+	isoContext->StartFrame = 0;
+	ovl->isoContext = isoContext;
+	ovl->status = ERROR_SUCCESS;
+	ovl->transferred = 0;
+	ResetEvent(ovl->event);
+
+	EnterCriticalSection(&m_lock);
+	int result = libusb_submit_transfer(ovl->transfer);
+	if(result == LIBUSB_SUCCESS)
+	{
+		ovl->state = TransferQueued;
+		ovl->next = m_inflight;
+		m_inflight = ovl;
+	}
+	LeaveCriticalSection(&m_lock);
+	if(!CheckResult(result))
+		return FALSE;
+	SetLastError(ERROR_IO_PENDING);
+	return FALSE;
+}
+
+void LIBUSB_CALL LibUsbTransport::sTransferCallback(libusb_transfer* transfer)
+{
+	LibUsbOverlapped* overlapped = (LibUsbOverlapped*)transfer->user_data;
+	overlapped->transport->TransferCallback(overlapped);
+}
+
+void LibUsbTransport::TransferCallback(LibUsbOverlapped* overlapped)
+{
+	libusb_transfer* transfer = overlapped->transfer;
+	PKISO_CONTEXT isoContext = overlapped->isoContext;
+	bool in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+	int errors = 0;
+	UINT transferred = 0;
+
+	for(int i = 0; i < transfer->num_iso_packets; i++)
+	{
+		libusb_iso_packet_descriptor& packet = transfer->iso_packet_desc[i];
+		if(packet.status != LIBUSB_TRANSFER_COMPLETED)
+			errors++;
+		isoContext->IsoPackets[i].Status = (USHORT)packet.status;
+		if(in)
+			isoContext->IsoPackets[i].Length = (USHORT)packet.actual_length;
+		transferred += packet.actual_length;
+	}
+	isoContext->ErrorCount = (SHORT)errors;
+
+	DWORD status;
+	switch(transfer->status)
+	{
+		case LIBUSB_TRANSFER_COMPLETED:
+			//as with libusbK the transfer fails only if no packet went through
+			status = errors == transfer->num_iso_packets ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			status = ERROR_OPERATION_ABORTED;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			status = ERROR_DEVICE_NOT_CONNECTED;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			status = ERROR_SEM_TIMEOUT;
+			break;
+		default:
+			status = ERROR_GEN_FAILURE;
+			break;
+	}
+
+	EnterCriticalSection(&m_lock);
+	Unlink(overlapped);
+	overlapped->transferred = in ? transferred : transfer->length;
+	overlapped->status = status;
+	overlapped->state = TransferCompleted;
+	LeaveCriticalSection(&m_lock);
+	SetEvent(overlapped->event);
+}
+
+#endif //_USE_LIBUSB
@@ -0,0 +1,104 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#pragma once
+#ifndef __LIBUSB_TRANSPORT_H__
+#define __LIBUSB_TRANSPORT_H__
+
+#include "usbtransport.h"
+
+#ifdef _USE_LIBUSB
+
+#include <libusb.h>
+
+#ifdef _ENABLE_TRACE
+extern void debugPrintf(const _TCHAR *szFormat, ...);
+#endif
+
+#define LIBUSB_WIDGET_VID		0x16C0
+#define LIBUSB_WIDGET_PID		0x03E8
+
+struct LibUsbOverlapped;
+struct LibUsbPool;
+
+//device opened through libusb-1.0 (Linux, macOS), found by vendor and product id.
+//ISO transfers are asynchronous libusb transfers, their completion callbacks run on one
+//event thread per device and signal the overlapped event, so the engine wakes up from
+//WaitForMultipleObjects as with libusbK. Transfers always start ASAP, libusb has no
+//frame number, so GetCurrentFrameNumber fails and the engine falls back to ASAP scheduling.
+class LibUsbTransport : public USBTransport
+{
+	USHORT					m_vendorId;
+	USHORT					m_productId;
+	libusb_context*			m_context;
+	libusb_device_handle*	m_handle;
+
+	HANDLE					m_eventThread;
+	volatile int			m_exit;
+	//guards transfer state shared with the event thread
+	CRITICAL_SECTION		m_lock;
+	//submitted transfers, AbortPipe cancels them by endpoint
+	LibUsbOverlapped*		m_inflight;
+
+	static DWORD WINAPI sEventThread(LPVOID context);
+	void EventThread();
+	static void LIBUSB_CALL sTransferCallback(libusb_transfer* transfer);
+	void TransferCallback(LibUsbOverlapped* overlapped);
+
+	bool CheckResult(int result);
+	bool Submit(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext);
+	void Unlink(LibUsbOverlapped* overlapped);
+	bool Cancel(LibUsbOverlapped* overlapped, DWORD timeoutMS);
+	bool GetResult(LibUsbOverlapped* overlapped, PUINT transferredLength);
+public:
+	LibUsbTransport(USHORT vendorId = LIBUSB_WIDGET_VID, USHORT productId = LIBUSB_WIDGET_PID);
+	virtual ~LibUsbTransport();
+
+	virtual bool Open();
+	virtual void Close();
+	virtual bool IsOpen()
+	{ return m_handle != NULL; }
+
+	virtual bool GetDeviceSpeed(int* speed);
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+
+	virtual bool ClaimInterface(UCHAR number);
+	virtual bool ReleaseInterface(UCHAR number);
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting);
+
+	virtual bool ResetPipe(UCHAR pipeId);
+	virtual bool AbortPipe(UCHAR pipeId);
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value);
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber);
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount);
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlRelease(KOVL_HANDLE overlapped);
+	virtual bool OvlReUse(KOVL_HANDLE overlapped);
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength);
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength);
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped);
+
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return Submit(pipeId, buffer, bufferLength, overlapped, isoContext); }
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return Submit(pipeId, buffer, bufferLength, overlapped, isoContext); }
+};
+
+#endif //_USE_LIBUSB
+
+#endif //__LIBUSB_TRANSPORT_H__
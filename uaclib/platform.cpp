@@ -0,0 +1,461 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include "platform.h"
+
+#ifndef _WIN32
+
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+//All waitable objects share one lock and condition, waits are rare compared to
+//the work done between them (one per transfer)
+static pthread_mutex_t	s_objectLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	s_objectSignaled;
+static pthread_once_t	s_objectOnce = PTHREAD_ONCE_INIT;
+
+static __thread DWORD	s_lastError = ERROR_SUCCESS;
+static __thread int		s_cancelState;
+
+enum ObjectType
+{
+	ObjectEvent = 0,
+	ObjectMutex,
+	ObjectThread
+};
+
+struct WaitObject
+{
+	int				type;
+	int				refCount;
+	bool			signaled;
+	bool			manualReset;
+	//named mutex
+	char			name[64];
+	WaitObject*		nextNamed;
+	//thread
+	pthread_t		thread;
+	LPTHREAD_START_ROUTINE	startAddress;
+	LPVOID			parameter;
+	bool			started;
+	DWORD			suspendCount;
+	DWORD			exitCode;
+};
+
+static WaitObject*		s_namedObjects = NULL;
+
+static void InitObjects()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s_objectSignaled, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+//waits aren't cancellation points, TerminateThread can't leave the lock held
+static void LockObjects()
+{
+	pthread_once(&s_objectOnce, InitObjects);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &s_cancelState);
+	pthread_mutex_lock(&s_objectLock);
+}
+
+static void UnlockObjects()
+{
+	pthread_mutex_unlock(&s_objectLock);
+	pthread_setcancelstate(s_cancelState, NULL);
+}
+
+static WaitObject* NewObject(int type)
+{
+	WaitObject* object = new WaitObject();
+	memset(object, 0, sizeof(WaitObject));
+	object->type = type;
+	object->refCount = 1;
+	return object;
+}
+
+//object lock is held
+static void ReleaseObject(WaitObject* object)
+{
+	if(--object->refCount > 0)
+		return;
+	if(object->type == ObjectMutex)
+	{
+		WaitObject** link = &s_namedObjects;
+		while(*link != NULL && *link != object)
+			link = &(*link)->nextNamed;
+		if(*link == object)
+			*link = object->nextNamed;
+	}
+	delete object;
+}
+
+static ULONGLONG MonotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_t* mutex = new pthread_mutex_t;
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	cs->mutex = mutex;
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_t* mutex = (pthread_mutex_t*)cs->mutex;
+	if(mutex == NULL)
+		return;
+	pthread_mutex_destroy(mutex);
+	delete mutex;
+	cs->mutex = NULL;
+}
+
+void EnterCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_lock((pthread_mutex_t*)cs->mutex);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_unlock((pthread_mutex_t*)cs->mutex);
+}
+
+HANDLE CreateMutex(void* attributes, BOOL initialOwner, LPCSTR name)
+{
+	LockObjects();
+	WaitObject* object = NULL;
+	if(name != NULL)
+	{
+		for(object = s_namedObjects; object != NULL; object = object->nextNamed)
+			if(!strcmp(object->name, name))
+				break;
+	}
+	if(object != NULL)
+	{
+		object->refCount++;
+		s_lastError = ERROR_ALREADY_EXISTS;
+	}
+	else
+	{
+		object = NewObject(ObjectMutex);
+		object->signaled = TRUE;
+		if(name != NULL)
+		{
+			strncpy(object->name, name, sizeof(object->name) - 1);
+			object->nextNamed = s_namedObjects;
+			s_namedObjects = object;
+		}
+		s_lastError = ERROR_SUCCESS;
+	}
+	UnlockObjects();
+	return object;
+}
+
+HANDLE CreateEvent(void* attributes, BOOL manualReset, BOOL initialState, LPCSTR name)
+{
+	WaitObject* object = NewObject(ObjectEvent);
+	object->manualReset = manualReset != FALSE;
+	object->signaled = initialState != FALSE;
+	return object;
+}
+
+BOOL SetEvent(HANDLE event)
+{
+	WaitObject* object = (WaitObject*)event;
+	if(object == NULL || object->type != ObjectEvent)
+	{
+		s_lastError = ERROR_INVALID_PARAMETER;
+		return FALSE;
+	}
+	LockObjects();
+	object->signaled = TRUE;
+	pthread_cond_broadcast(&s_objectSignaled);
+	UnlockObjects();
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE event)
+{
+	WaitObject* object = (WaitObject*)event;
+	if(object == NULL || object->type != ObjectEvent)
+	{
+		s_lastError = ERROR_INVALID_PARAMETER;
+		return FALSE;
+	}
+	LockObjects();
+	object->signaled = FALSE;
+	UnlockObjects();
+	return TRUE;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+	if(handle == NULL || handle == INVALID_HANDLE_VALUE)
+	{
+		s_lastError = ERROR_INVALID_PARAMETER;
+		return FALSE;
+	}
+	LockObjects();
+	ReleaseObject((WaitObject*)handle);
+	UnlockObjects();
+	return TRUE;
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL waitAll, DWORD milliseconds)
+{
+	if(count == 0 || count > MAXIMUM_WAIT_OBJECTS)
+	{
+		s_lastError = ERROR_INVALID_PARAMETER;
+		return WAIT_FAILED;
+	}
+
+	struct timespec deadline;
+	if(milliseconds != INFINITE)
+	{
+		ULONGLONG ns = MonotonicNs() + (ULONGLONG)milliseconds * 1000000ULL;
+		deadline.tv_sec = (time_t)(ns / 1000000000ULL);
+		deadline.tv_nsec = (long)(ns % 1000000000ULL);
+	}
+
+	LockObjects();
+	DWORD result = WAIT_TIMEOUT;
+	for(;;)
+	{
+		DWORD signaledCount = 0, first = count;
+		for(DWORD i = 0; i < count; i++)
+			if(((WaitObject*)handles[i])->signaled)
+			{
+				signaledCount++;
+				if(first == count)
+					first = i;
+			}
+		if(waitAll ? signaledCount == count : signaledCount > 0)
+		{
+			//auto reset events are consumed by the wait
+			for(DWORD i = waitAll ? 0 : first; i < (waitAll ? count : first + 1); i++)
+			{
+				WaitObject* object = (WaitObject*)handles[i];
+				if(object->type == ObjectEvent && !object->manualReset)
+					object->signaled = FALSE;
+			}
+			result = WAIT_OBJECT_0 + (waitAll ? 0 : first);
+			break;
+		}
+		if(milliseconds == 0)
+			break;
+		if(milliseconds == INFINITE)
+			pthread_cond_wait(&s_objectSignaled, &s_objectLock);
+		else if(pthread_cond_timedwait(&s_objectSignaled, &s_objectLock, &deadline) == ETIMEDOUT)
+			milliseconds = 0; //last check
+	}
+	UnlockObjects();
+	return result;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds)
+{
+	return WaitForMultipleObjects(1, &handle, FALSE, milliseconds);
+}
+
+static void ThreadExited(void* context)
+{
+	WaitObject* object = (WaitObject*)context;
+	LockObjects();
+	object->signaled = TRUE;
+	pthread_cond_broadcast(&s_objectSignaled);
+	ReleaseObject(object);
+	UnlockObjects();
+}
+
+static void* ThreadStart(void* context)
+{
+	WaitObject* object = (WaitObject*)context;
+	pthread_cleanup_push(ThreadExited, object);
+	LockObjects();
+	while(!object->started)
+		pthread_cond_wait(&s_objectSignaled, &s_objectLock);
+	UnlockObjects();
+	object->exitCode = object->startAddress(object->parameter);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+HANDLE CreateThread(void* attributes, size_t stackSize, LPTHREAD_START_ROUTINE startAddress, LPVOID parameter, DWORD creationFlags, DWORD* threadId)
+{
+	WaitObject* object = NewObject(ObjectThread);
+	object->startAddress = startAddress;
+	object->parameter = parameter;
+	object->started = (creationFlags & CREATE_SUSPENDED) == 0;
+	object->suspendCount = object->started ? 0 : 1;
+	object->refCount = 2; //handle and running thread
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(stackSize != 0)
+		pthread_attr_setstacksize(&attr, stackSize);
+	int error = pthread_create(&object->thread, &attr, ThreadStart, object);
+	pthread_attr_destroy(&attr);
+	if(error != 0)
+	{
+		delete object;
+		s_lastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	if(threadId)
+		*threadId = (DWORD)(size_t)object;
+	return object;
+}
+
+DWORD ResumeThread(HANDLE thread)
+{
+	WaitObject* object = (WaitObject*)thread;
+	if(object == NULL || object->type != ObjectThread)
+		return (DWORD)-1;
+	LockObjects();
+	DWORD previous = object->suspendCount;
+	if(object->suspendCount > 0)
+		object->suspendCount--;
+	if(object->suspendCount == 0 && !object->started)
+	{
+		object->started = TRUE;
+		pthread_cond_broadcast(&s_objectSignaled);
+	}
+	UnlockObjects();
+	return previous;
+}
+
+DWORD SuspendThread(HANDLE thread)
+{
+	WaitObject* object = (WaitObject*)thread;
+	if(object == NULL || object->type != ObjectThread)
+		return (DWORD)-1;
+	LockObjects();
+	DWORD previous = object->suspendCount;
+	if(!object->started)
+		object->suspendCount++;
+	UnlockObjects();
+	return previous;
+}
+
+BOOL SetThreadPriority(HANDLE thread, int priority)
+{
+	WaitObject* object = (WaitObject*)thread;
+	if(object == NULL || object->type != ObjectThread)
+		return FALSE;
+	//time critical threads go to the real time class when the process is allowed to
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	int policy = SCHED_OTHER;
+	if(priority >= THREAD_PRIORITY_HIGHEST)
+	{
+		policy = SCHED_FIFO;
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO) - (priority == THREAD_PRIORITY_TIME_CRITICAL ? 1 : 10);
+	}
+	return pthread_setschedparam(object->thread, policy, &param) == 0;
+}
+
+BOOL TerminateThread(HANDLE thread, DWORD exitCode)
+{
+	WaitObject* object = (WaitObject*)thread;
+	if(object == NULL || object->type != ObjectThread)
+		return FALSE;
+	object->exitCode = exitCode;
+	return pthread_cancel(object->thread) == 0;
+}
+
+void ExitThread(DWORD exitCode)
+{
+	pthread_exit(NULL);
+}
+
+void Sleep(DWORD milliseconds)
+{
+	if(milliseconds == 0)
+	{
+		sched_yield();
+		return;
+	}
+	struct timespec ts;
+	ts.tv_sec = milliseconds / 1000;
+	ts.tv_nsec = (long)(milliseconds % 1000) * 1000000L;
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+DWORD GetLastError()
+{
+	return s_lastError;
+}
+
+void SetLastError(DWORD errorCode)
+{
+	s_lastError = errorCode;
+}
+
+DWORD GetTickCount()
+{
+	return (DWORD)(MonotonicNs() / 1000000ULL);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+	counter->QuadPart = (LONGLONG)MonotonicNs();
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency)
+{
+	frequency->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+void* VirtualAlloc(void* address, size_t size, DWORD allocationType, DWORD protect)
+{
+	void* memory = NULL;
+	if(posix_memalign(&memory, 4096, size) != 0)
+	{
+		s_lastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	//committed pages are zeroed
+	memset(memory, 0, size);
+	return memory;
+}
+
+BOOL VirtualFree(void* address, size_t size, DWORD freeType)
+{
+	free(address);
+	return TRUE;
+}
+
+void OutputDebugString(LPCSTR outputString)
+{
+	fputs(outputString, stderr);
+}
+
+#endif //_WIN32
@@ -0,0 +1,341 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+//Windows and libusbK declarations used by uaclib. Elsewhere the same subset is
+//implemented over POSIX threads (platform.cpp), so the engine runs with
+//transports which don't need libusbK
+
+#pragma once
+#ifndef __PLATFORM_H__
+#define __PLATFORM_H__
+
+#ifdef _WIN32
+
+#include "targetver.h"
+#include <stdio.h>
+#include <tchar.h>
+#include <windows.h>
+
+#include <libusbk.h>
+
+#else
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <math.h>
+
+#define WINAPI
+#define __int32		int
+#define __int64		long long
+
+typedef unsigned char		UCHAR, BYTE;
+typedef unsigned char*		PUCHAR;
+typedef unsigned short		USHORT, WORD;
+typedef short				SHORT;
+typedef unsigned int		UINT;
+typedef unsigned int*		PUINT;
+//32 bit as on Windows, interlocked functions and feedback values depend on it
+typedef int					LONG;
+typedef unsigned int		ULONG, DWORD;
+typedef long long			LONGLONG;
+typedef unsigned long long	ULONGLONG;
+typedef int					BOOL;
+typedef void*				HANDLE;
+typedef void*				PVOID;
+typedef void*				LPVOID;
+typedef const char*			LPCSTR;
+typedef LPCSTR				LPCTSTR;
+typedef char				_TCHAR;
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpParameter);
+
+union LARGE_INTEGER
+{
+	struct
+	{
+		DWORD	LowPart;
+		LONG	HighPart;
+	} u;
+	LONGLONG	QuadPart;
+};
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+
+#define _T(x)							x
+#define _stricmp						strcasecmp
+
+#define INFINITE						0xFFFFFFFF
+#define INVALID_HANDLE_VALUE			((HANDLE)(ptrdiff_t)-1)
+
+#define ERROR_SUCCESS					0
+#define ERROR_ACCESS_DENIED				5
+#define ERROR_GEN_FAILURE				31
+#define ERROR_NOT_SUPPORTED				50
+#define ERROR_INVALID_PARAMETER			87
+#define ERROR_SEM_TIMEOUT				121
+#define ERROR_BUSY						170
+#define ERROR_ALREADY_EXISTS			183
+#define ERROR_OPERATION_ABORTED			995
+#define ERROR_IO_PENDING				997
+#define ERROR_NOT_FOUND					1168
+#define ERROR_DEVICE_NOT_CONNECTED		1167
+#define ERROR_NOT_ENOUGH_MEMORY			8
+#define ERROR_TIMEOUT					1460
+
+#define WAIT_OBJECT_0					0
+#define WAIT_TIMEOUT					258
+#define WAIT_FAILED						0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS			64
+
+#define CREATE_SUSPENDED				0x00000004
+#define THREAD_PRIORITY_NORMAL			0
+#define THREAD_PRIORITY_ABOVE_NORMAL	1
+#define THREAD_PRIORITY_HIGHEST			2
+#define THREAD_PRIORITY_TIME_CRITICAL	15
+
+#define MEM_COMMIT						0x00001000
+#define MEM_RESERVE						0x00002000
+#define MEM_RELEASE						0x00008000
+#define PAGE_READWRITE					0x04
+
+//recursive like Windows critical sections
+struct CRITICAL_SECTION
+{
+	void*	mutex;
+};
+
+void InitializeCriticalSection(CRITICAL_SECTION* cs);
+void DeleteCriticalSection(CRITICAL_SECTION* cs);
+void EnterCriticalSection(CRITICAL_SECTION* cs);
+void LeaveCriticalSection(CRITICAL_SECTION* cs);
+
+//named objects are visible inside the process only
+HANDLE CreateMutex(void* attributes, BOOL initialOwner, LPCSTR name);
+HANDLE CreateEvent(void* attributes, BOOL manualReset, BOOL initialState, LPCSTR name);
+BOOL SetEvent(HANDLE event);
+BOOL ResetEvent(HANDLE event);
+BOOL CloseHandle(HANDLE handle);
+DWORD WaitForSingleObject(HANDLE handle, DWORD milliseconds);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL waitAll, DWORD milliseconds);
+
+//threads can't be suspended once running: SuspendThread only returns the count,
+//the first ResumeThread releases a thread created suspended
+HANDLE CreateThread(void* attributes, size_t stackSize, LPTHREAD_START_ROUTINE startAddress, LPVOID parameter, DWORD creationFlags, DWORD* threadId);
+DWORD ResumeThread(HANDLE thread);
+DWORD SuspendThread(HANDLE thread);
+BOOL SetThreadPriority(HANDLE thread, int priority);
+BOOL TerminateThread(HANDLE thread, DWORD exitCode);
+void ExitThread(DWORD exitCode);
+void Sleep(DWORD milliseconds);
+
+DWORD GetLastError();
+void SetLastError(DWORD errorCode);
+DWORD GetTickCount();
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency);
+
+void* VirtualAlloc(void* address, size_t size, DWORD allocationType, DWORD protect);
+BOOL VirtualFree(void* address, size_t size, DWORD freeType);
+
+void OutputDebugString(LPCSTR outputString);
+
+inline LONG InterlockedIncrement(volatile LONG* addend)
+{ return __sync_add_and_fetch(addend, 1); }
+inline LONG InterlockedDecrement(volatile LONG* addend)
+{ return __sync_sub_and_fetch(addend, 1); }
+inline LONG InterlockedExchange(volatile LONG* target, LONG value)
+{ return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchangeAdd(volatile LONG* addend, LONG value)
+{ return __sync_fetch_and_add(addend, value); }
+inline LONG InterlockedCompareExchange(volatile LONG* destination, LONG exchange, LONG comparand)
+{ return __sync_val_compare_and_swap(destination, comparand, exchange); }
+inline LONGLONG InterlockedExchange64(volatile LONGLONG* target, LONGLONG value)
+{ return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+inline LONGLONG InterlockedExchangeAdd64(volatile LONGLONG* addend, LONGLONG value)
+{ return __sync_fetch_and_add(addend, value); }
+inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG* destination, LONGLONG exchange, LONGLONG comparand)
+{ return __sync_val_compare_and_swap(destination, comparand, exchange); }
+inline void MemoryBarrier()
+{ __sync_synchronize(); }
+
+inline int _tcscpy_s(_TCHAR* dst, size_t size, const _TCHAR* src)
+{
+	if(dst == NULL || size == 0)
+		return ERROR_INVALID_PARAMETER;
+	strncpy(dst, src, size - 1);
+	dst[size - 1] = 0;
+	return 0;
+}
+template <size_t size> inline int _tcscpy_s(_TCHAR (&dst)[size], const _TCHAR* src)
+{
+	return _tcscpy_s(dst, size, src);
+}
+
+//libusbK subset used by the engine and the transports
+typedef void*	KOVL_HANDLE;
+typedef void*	KOVL_POOL_HANDLE;
+typedef int		KOVL_WAIT_FLAG;
+
+#define KOVL_WAIT_FLAG_NONE				0
+
+#define LowSpeed						0x01
+#define FullSpeed						0x02
+#define HighSpeed						0x03
+
+//pipe policies
+#define RESET_PIPE_ON_RESUME			0x10
+#define ISO_ALWAYS_START_ASAP			0x21
+
+struct KISO_PACKET
+{
+	UINT	Offset;
+	USHORT	Length;
+	USHORT	Status;
+};
+typedef KISO_PACKET* PKISO_PACKET;
+
+struct KISO_CONTEXT
+{
+	UINT		Flags;
+	UINT		StartFrame;
+	SHORT		ErrorCount;
+	SHORT		NumberOfPackets;
+	UINT		UrbHdrStatus;
+	KISO_PACKET	IsoPackets[1];	//NumberOfPackets entries
+};
+typedef KISO_CONTEXT* PKISO_CONTEXT;
+
+inline BOOL IsoK_SetPackets(PKISO_CONTEXT isoContext, LONG packetSize)
+{
+	for(int i = 0; i < isoContext->NumberOfPackets; i++)
+		isoContext->IsoPackets[i].Offset = i * packetSize;
+	return TRUE;
+}
+
+#define USB_DESCRIPTOR_TYPE_DEVICE					0x01
+#define USB_DESCRIPTOR_TYPE_CONFIGURATION			0x02
+#define USB_DESCRIPTOR_TYPE_STRING					0x03
+#define USB_DESCRIPTOR_TYPE_INTERFACE				0x04
+#define USB_DESCRIPTOR_TYPE_ENDPOINT				0x05
+#define USB_DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION	0x0B
+
+#define USB_ENDPOINT_TYPE_ISOCHRONOUS		0x01
+#define USB_ENDPOINT_DIRECTION_MASK			0x80
+#define USB_ENDPOINT_DIRECTION_OUT(addr)	(!((addr) & USB_ENDPOINT_DIRECTION_MASK))
+#define USB_ENDPOINT_DIRECTION_IN(addr)		((addr) & USB_ENDPOINT_DIRECTION_MASK)
+
+#define USB_REQUEST_GET_DESCRIPTOR			0x06
+#define USB_REQUEST_SET_INTERFACE			0x0B
+
+#define BMREQUEST_DIR_HOST_TO_DEVICE		0
+#define BMREQUEST_DIR_DEVICE_TO_HOST		1
+#define BMREQUEST_TYPE_STANDARD				0
+#define BMREQUEST_TYPE_CLASS				1
+#define BMREQUEST_TYPE_VENDOR				2
+#define BMREQUEST_RECIPIENT_DEVICE			0
+#define BMREQUEST_RECIPIENT_INTERFACE		1
+#define BMREQUEST_RECIPIENT_ENDPOINT		2
+
+#pragma pack(push, 1)
+
+struct USB_DEVICE_DESCRIPTOR
+{
+	UCHAR	bLength;
+	UCHAR	bDescriptorType;
+	USHORT	bcdUSB;
+	UCHAR	bDeviceClass;
+	UCHAR	bDeviceSubClass;
+	UCHAR	bDeviceProtocol;
+	UCHAR	bMaxPacketSize0;
+	USHORT	idVendor;
+	USHORT	idProduct;
+	USHORT	bcdDevice;
+	UCHAR	iManufacturer;
+	UCHAR	iProduct;
+	UCHAR	iSerialNumber;
+	UCHAR	bNumConfigurations;
+};
+
+struct USB_CONFIGURATION_DESCRIPTOR
+{
+	UCHAR	bLength;
+	UCHAR	bDescriptorType;
+	USHORT	wTotalLength;
+	UCHAR	bNumInterfaces;
+	UCHAR	bConfigurationValue;
+	UCHAR	iConfiguration;
+	UCHAR	bmAttributes;
+	UCHAR	MaxPower;
+};
+
+struct USB_INTERFACE_DESCRIPTOR
+{
+	UCHAR	bLength;
+	UCHAR	bDescriptorType;
+	UCHAR	bInterfaceNumber;
+	UCHAR	bAlternateSetting;
+	UCHAR	bNumEndpoints;
+	UCHAR	bInterfaceClass;
+	UCHAR	bInterfaceSubClass;
+	UCHAR	bInterfaceProtocol;
+	UCHAR	iInterface;
+};
+
+struct USB_ENDPOINT_DESCRIPTOR
+{
+	UCHAR	bLength;
+	UCHAR	bDescriptorType;
+	UCHAR	bEndpointAddress;
+	UCHAR	bmAttributes;
+	USHORT	wMaxPacketSize;
+	UCHAR	bInterval;
+};
+
+#pragma pack(pop)
+
+struct WINUSB_SETUP_PACKET
+{
+	UCHAR	RequestType;
+	UCHAR	Request;
+	USHORT	Value;
+	USHORT	Index;
+	USHORT	Length;
+};
+
+struct KUSB_SETUP_PACKET
+{
+	struct
+	{
+		UCHAR	Recipient:2;
+		UCHAR	Reserved:3;
+		UCHAR	Type:2;
+		UCHAR	Dir:1;
+	} BmRequest;
+	UCHAR	Request;
+	USHORT	Value;
+	USHORT	Index;
+	USHORT	Length;
+};
+
+#endif //_WIN32
+
+#endif //__PLATFORM_H__
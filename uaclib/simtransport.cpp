@@ -0,0 +1,1224 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include "simtransport.h"
+
+#define SIM_ASAP_LATENCY		8		//microframes until the first packet of an idle pipe
+#define SIM_WAIT_TIMEOUT		100		//ms
+#define SIM_STALL_TIMEOUT		100		//ms, virtual time advances without the host after this
+#define SIM_FIFO_SERVO			0.2		//feedback correction of the FIFO offset, 1/s
+#define SIM_PACKET_ERROR		0x0F	//status of failed packets
+
+enum SimTransferState
+{
+	TransferIdle = 0,
+	TransferQueued,
+	TransferCompleted
+};
+
+struct SimTransfer
+{
+	SimPool*		pool;
+	HANDLE			event;			//manual reset, signaled on completion
+	bool			acquired;
+	int				state;
+	bool			reaped;			//host took the result
+	SimPipe*		pipe;
+	PUCHAR			buffer;
+	ULONG			bufferLength;
+	PKISO_CONTEXT	isoContext;
+	ULONGLONG		startTime;		//microframe of the first packet
+	ULONGLONG		endTime;		//completion, one interval after the last packet
+	int				latePackets;	//packets scheduled before the submit time
+	DWORD			status;
+	UINT			transferred;
+	SimTransfer*	next;
+};
+
+struct SimPool
+{
+	int				count;
+	SimTransfer*	transfers;
+};
+
+struct SimPipe
+{
+	UCHAR			id;
+	int				iface;
+	bool			feedback;
+	USHORT			maxPacketSize;	//payload per interval
+	int				packetInterval;	//microframes
+	bool			asap;
+	bool			active;			//streaming since the last abort
+	ULONGLONG		nextTime;		//first free microframe after the queued transfers
+	int				injectErrors;
+	int				shortPackets;	//packets InjectShortPackets still has to cut
+	int				shortFrames;
+	SimTransfer*	head;
+	SimTransfer*	tail;
+};
+
+static void PutLE(UCHAR* data, ULONG value, int size)
+{
+	for(int i = 0; i < size; i++)
+		data[i] = (UCHAR)(value >> (8 * i));
+}
+
+static ULONG GetLE(const UCHAR* data, int size)
+{
+	ULONG value = 0;
+	for(int i = 0; i < size; i++)
+		value |= (ULONG)data[i] << (8 * i);
+	return value;
+}
+
+//wMaxPacketSize for the payload, high speed endpoints take up to 3 transactions per microframe
+static USHORT EndpointPacketSize(int bytes, bool highSpeed, int transactions)
+{
+	if(!highSpeed)
+		return (USHORT)(bytes > 1023 ? 1023 : bytes);
+	if(transactions <= 0)
+	{
+		transactions = (bytes + 1023) / 1024;
+		if(transactions > 3)
+			transactions = 3;
+	}
+	int size = (bytes + transactions - 1) / transactions;
+	if(size > 1024)
+		size = 1024;
+	//4 transactions give the reserved value 3
+	return (USHORT)(size | (((transactions - 1) & 0x03) << 11));
+}
+
+SimDeviceConfig::SimDeviceConfig() : speed(HighSpeed), outputChannels(2), inputChannels(2), subslotSize(4), bitResolution(24),
+	formats(AUDIO_FORMAT_TYPE_I_PCM), interval(1), explicitFeedback(TRUE), clockPpm(0), realTime(FALSE), fifoFrames(2048),
+	maxIsoPackets(0), frameNumber(TRUE), transactions(0)
+{
+	static const int defaultRates[] = {44100, 48000, 88200, 96000, 176400, 192000, 0};
+	memset(rates, 0, sizeof(rates));
+	memcpy(rates, defaultRates, sizeof(defaultRates));
+}
+
+SimTransport::SimTransport(const SimDeviceConfig& config) : m_config(config), m_configLength(0), m_outInterface(-1), m_inInterface(-1),
+	m_pipes(NULL), m_pipeCount(0), m_wakeEvent(NULL), m_thread(NULL), m_exit(FALSE), m_open(FALSE),
+	m_busTime(0), m_openCounter(0), m_counterFrequency(1), m_unreaped(0),
+	m_sampleRate(config.rates[0]), m_clockPpm(config.clockPpm), m_inAccumulator(0), m_inSample(0),
+	m_fifoLevel(0), m_fifoTime(0), m_playing(FALSE), m_captureCb(NULL), m_captureCbContext(NULL)
+{
+	memset(m_altSetting, 0, sizeof(m_altSetting));
+	memset(&m_stats, 0, sizeof(m_stats));
+	InitializeCriticalSection(&m_lock);
+	m_pipes = new SimPipe[SIM_MAX_PIPES];
+	BuildDescriptors();
+}
+
+SimTransport::~SimTransport()
+{
+	Close();
+	delete [] m_pipes;
+	DeleteCriticalSection(&m_lock);
+}
+
+void SimTransport::Append(const void* descriptor, int length)
+{
+	if(m_configLength + length > (int)sizeof(m_configDescriptor))
+		return;
+	memcpy(m_configDescriptor + m_configLength, descriptor, length);
+	m_configLength += length;
+}
+
+void SimTransport::AddPipe(UCHAR id, int iface, USHORT maxPacketSize, UCHAR interval)
+{
+	if(m_pipeCount >= SIM_MAX_PIPES)
+		return;
+	SimPipe* pipe = m_pipes + m_pipeCount++;
+	memset(pipe, 0, sizeof(SimPipe));
+	pipe->id = id;
+	pipe->iface = iface;
+	pipe->feedback = USB_ENDPOINT_DIRECTION_IN(id) && iface == m_outInterface;
+	pipe->maxPacketSize = (USHORT)USB_ENDPOINT_MAX_PAYLOAD(maxPacketSize);
+	pipe->packetInterval = (m_config.speed == HighSpeed ? 1 : 8) << (interval - 1);
+}
+
+void SimTransport::BuildDescriptors()
+{
+	bool highSpeed = m_config.speed == HighSpeed;
+	int maxRate = 0;
+	for(int i = 0; i < SIM_MAX_RATES && m_config.rates[i]; i++)
+		if(m_config.rates[i] > maxRate)
+			maxRate = m_config.rates[i];
+	int packetsPerSecond = (highSpeed ? 8000 : 1000) >> (m_config.interval - 1);
+	int maxFrames = maxRate / packetsPerSecond + 1;
+
+	int numInterfaces = 1;
+	if(m_config.outputChannels > 0)
+		m_outInterface = numInterfaces++;
+	if(m_config.inputChannels > 0)
+		m_inInterface = numInterfaces++;
+
+	USB_DEVICE_DESCRIPTOR device = {sizeof(USB_DEVICE_DESCRIPTOR), USB_DESCRIPTOR_TYPE_DEVICE, 0x0200, 0xEF, 0x02, 0x01, 64,
+		0x16C0, 0x03E8, 0x0100, 0, 0, 0, 1};
+	memcpy(m_deviceDescriptor, &device, sizeof(device));
+
+	m_configLength = 0;
+	USB_CONFIGURATION_DESCRIPTOR config = {sizeof(USB_CONFIGURATION_DESCRIPTOR), USB_DESCRIPTOR_TYPE_CONFIGURATION, 0,
+		(UCHAR)numInterfaces, 1, 0, 0x80, 250};
+	Append(&config, sizeof(config));
+	UCHAR iad[8] = {8, USB_DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION, 0, (UCHAR)numInterfaces, AUDIO_CLASS, 0, IP_VERSION_02_00, 0};
+	Append(iad, sizeof(iad));
+
+	//audio control
+	USB_INTERFACE_DESCRIPTOR acInterface = {sizeof(USB_INTERFACE_DESCRIPTOR), USB_DESCRIPTOR_TYPE_INTERFACE, 0, 0, 0,
+		AUDIO_CLASS, AUDIO_INTERFACE_SUBCLASS_AUDIOCONTROL, IP_VERSION_02_00, 0};
+	Append(&acInterface, sizeof(acInterface));
+	int acLength = sizeof(usb_ac_interface_descriptor_2) + sizeof(usb_clock_source_descriptor);
+	if(m_outInterface >= 0)
+		acLength += sizeof(usb_in_ter_descriptor_2) + sizeof(usb_out_ter_descriptor_2);
+	if(m_inInterface >= 0)
+		acLength += sizeof(usb_in_ter_descriptor_2) + sizeof(usb_out_ter_descriptor_2);
+	usb_ac_interface_descriptor_2 acHeader = {sizeof(usb_ac_interface_descriptor_2), CS_INTERFACE, HEADER_SUB_TYPE, 0x0200, 0x0A, (U16)acLength, 0};
+	Append(&acHeader, sizeof(acHeader));
+	//internal programmable clock, frequency control read/write, validity read only
+	usb_clock_source_descriptor clock = {sizeof(usb_clock_source_descriptor), CS_INTERFACE, DESCRIPTOR_SUBTYPE_AUDIO_AC_CLOCK_SOURCE,
+		SIM_CLOCK_ID, 0x03, 0x07, 0, 0};
+	Append(&clock, sizeof(clock));
+	if(m_outInterface >= 0)
+	{
+		usb_in_ter_descriptor_2 usbIn = {sizeof(usb_in_ter_descriptor_2), CS_INTERFACE, INPUT_TERMINAL_SUB_TYPE, 1, 0x0101, 0,
+			SIM_CLOCK_ID, (U8)m_config.outputChannels, 0, 0, 0, 0};
+		usb_out_ter_descriptor_2 speaker = {sizeof(usb_out_ter_descriptor_2), CS_INTERFACE, OUTPUT_TERMINAL_SUB_TYPE, 2, 0x0301, 0, 1,
+			SIM_CLOCK_ID, 0, 0};
+		Append(&usbIn, sizeof(usbIn));
+		Append(&speaker, sizeof(speaker));
+	}
+	if(m_inInterface >= 0)
+	{
+		usb_in_ter_descriptor_2 mic = {sizeof(usb_in_ter_descriptor_2), CS_INTERFACE, INPUT_TERMINAL_SUB_TYPE, 3, 0x0201, 0,
+			SIM_CLOCK_ID, (U8)m_config.inputChannels, 0, 0, 0, 0};
+		usb_out_ter_descriptor_2 usbOut = {sizeof(usb_out_ter_descriptor_2), CS_INTERFACE, OUTPUT_TERMINAL_SUB_TYPE, 4, 0x0101, 0, 3,
+			SIM_CLOCK_ID, 0, 0};
+		Append(&mic, sizeof(mic));
+		Append(&usbOut, sizeof(usbOut));
+	}
+
+	//streaming interfaces, alt 0 is zero bandwidth
+	for(int dir = 0; dir < 2; dir++)
+	{
+		bool input = dir == 1;
+		int iface = input ? m_inInterface : m_outInterface;
+		if(iface < 0)
+			continue;
+		int channels = input ? m_config.inputChannels : m_config.outputChannels;
+		bool feedback = !input && m_config.explicitFeedback;
+		UCHAR endpoint = input ? 0x82 : 0x01;
+
+		USB_INTERFACE_DESCRIPTOR asInterface = {sizeof(USB_INTERFACE_DESCRIPTOR), USB_DESCRIPTOR_TYPE_INTERFACE, (UCHAR)iface, 0, 0,
+			AUDIO_CLASS, AUDIO_INTERFACE_SUBCLASS_AUDIOSTREAMING, IP_VERSION_02_00, 0};
+		Append(&asInterface, sizeof(asInterface));
+		asInterface.bAlternateSetting = 1;
+		asInterface.bNumEndpoints = feedback ? 2 : 1;
+		Append(&asInterface, sizeof(asInterface));
+
+		usb_as_g_interface_descriptor_2 general = {sizeof(usb_as_g_interface_descriptor_2), CS_INTERFACE, GENERAL_SUB_TYPE,
+			(U8)(input ? 4 : 1), 0, 1, m_config.formats, (U8)channels, 0, 0};
+		usb_format_type_2 format = {sizeof(usb_format_type_2), CS_INTERFACE, FORMAT_SUB_TYPE, 1,
+			(U8)m_config.subslotSize, (U8)m_config.bitResolution};
+		Append(&general, sizeof(general));
+		Append(&format, sizeof(format));
+
+		//asynchronous data endpoint
+		USHORT packetSize = EndpointPacketSize(maxFrames * channels * m_config.subslotSize, highSpeed, m_config.transactions);
+		USB_ENDPOINT_DESCRIPTOR audio = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_DESCRIPTOR_TYPE_ENDPOINT, endpoint, 0x05,
+			packetSize, (UCHAR)m_config.interval};
+		usb_endpoint_audio_specific_2 audioCS = {sizeof(usb_endpoint_audio_specific_2), CS_ENDPOINT, GENERAL_SUB_TYPE, 0, 0, 0, 0};
+		Append(&audio, sizeof(audio));
+		Append(&audioCS, sizeof(audioCS));
+		AddPipe(endpoint, iface, packetSize, (UCHAR)m_config.interval);
+
+		if(feedback)
+		{
+			//16.16 every 8 microframes at high speed, 10.14 every frame at full speed
+			USB_ENDPOINT_DESCRIPTOR fb = {sizeof(USB_ENDPOINT_DESCRIPTOR), USB_DESCRIPTOR_TYPE_ENDPOINT, 0x81, 0x11,
+				(USHORT)(highSpeed ? 4 : 3), (UCHAR)(highSpeed ? 4 : 1)};
+			Append(&fb, sizeof(fb));
+			AddPipe(0x81, iface, fb.wMaxPacketSize, fb.bInterval);
+		}
+	}
+
+	((USB_CONFIGURATION_DESCRIPTOR*)m_configDescriptor)->wTotalLength = (USHORT)m_configLength;
+}
+
+bool SimTransport::Open()
+{
+	if(m_open)
+		return TRUE;
+
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	m_openCounter = counter.QuadPart;
+	m_counterFrequency = frequency.QuadPart;
+	m_busTime = 0;
+	m_unreaped = 0;
+	memset(m_altSetting, 0, sizeof(m_altSetting));
+	for(int i = 0; i < m_pipeCount; i++)
+	{
+		m_pipes[i].asap = FALSE;
+		m_pipes[i].active = FALSE;
+		m_pipes[i].nextTime = 0;
+		m_pipes[i].injectErrors = 0;
+		m_pipes[i].shortPackets = 0;
+		m_pipes[i].head = m_pipes[i].tail = NULL;
+	}
+	memset(&m_stats, 0, sizeof(m_stats));
+	ResetStream();
+
+	m_exit = FALSE;
+	m_wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(m_wakeEvent == NULL)
+		return FALSE;
+	m_thread = CreateThread(NULL, 0, sDeviceThread, this, 0, NULL);
+	if(m_thread == NULL)
+	{
+		DWORD errorCode = GetLastError();
+		CloseHandle(m_wakeEvent);
+		m_wakeEvent = NULL;
+		SetLastError(errorCode);
+		return FALSE;
+	}
+	if(m_config.realTime)
+		SetThreadPriority(m_thread, THREAD_PRIORITY_TIME_CRITICAL);
+	m_open = TRUE;
+	return TRUE;
+}
+
+void SimTransport::Close()
+{
+	if(!m_open)
+		return;
+	EnterCriticalSection(&m_lock);
+	for(int i = 0; i < m_pipeCount; i++)
+		CancelPipe(m_pipes + i);
+	m_exit = TRUE;
+	LeaveCriticalSection(&m_lock);
+
+	SetEvent(m_wakeEvent);
+	WaitForSingleObject(m_thread, INFINITE);
+	CloseHandle(m_thread);
+	CloseHandle(m_wakeEvent);
+	m_thread = NULL;
+	m_wakeEvent = NULL;
+	m_open = FALSE;
+}
+
+void SimTransport::ResetStream()
+{
+	m_inAccumulator = 0;
+	m_inSample = 0;
+	m_fifoLevel = 0;
+	m_fifoTime = BusTime();
+	m_playing = FALSE;
+}
+
+ULONGLONG SimTransport::BusTime()
+{
+	if(!m_config.realTime)
+		return m_busTime;
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (ULONGLONG)(counter.QuadPart - m_openCounter) * 8000 / m_counterFrequency;
+}
+
+double SimTransport::DeviceRate()
+{
+	return m_sampleRate * (1.0 + m_clockPpm * 1e-6);
+}
+
+int SimTransport::FrameSize(bool input)
+{
+	return (input ? m_config.inputChannels : m_config.outputChannels) * m_config.subslotSize;
+}
+
+SimPipe* SimTransport::FindPipe(UCHAR pipeId)
+{
+	for(int i = 0; i < m_pipeCount; i++)
+		if(m_pipes[i].id == pipeId)
+			return m_pipes + i;
+	return NULL;
+}
+
+bool SimTransport::IsPipeOpen(SimPipe* pipe)
+{
+	return m_altSetting[pipe->iface] == 1;
+}
+
+bool SimTransport::GetDeviceSpeed(int* speed)
+{
+	*speed = m_config.speed;
+	return TRUE;
+}
+
+bool SimTransport::GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	const UCHAR* descriptor = NULL;
+	UINT length = 0;
+	if(type == USB_DESCRIPTOR_TYPE_DEVICE)
+	{
+		descriptor = m_deviceDescriptor;
+		length = sizeof(m_deviceDescriptor);
+	}
+	else if(type == USB_DESCRIPTOR_TYPE_CONFIGURATION && index == 0)
+	{
+		descriptor = m_configDescriptor;
+		length = m_configLength;
+	}
+	if(descriptor == NULL)
+	{
+		SetLastError(ERROR_GEN_FAILURE);
+		return FALSE;
+	}
+	if(length > bufferLength)
+		length = bufferLength;
+	memcpy(buffer, descriptor, length);
+	if(lengthTransferred)
+		*lengthTransferred = length;
+	return TRUE;
+}
+
+bool SimTransport::Stall()
+{
+	m_stats.controlStalls++;
+	SetLastError(ERROR_GEN_FAILURE);
+	return FALSE;
+}
+
+bool SimTransport::ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	UCHAR type = (setupPacket.RequestType >> 5) & 0x03;
+	UCHAR recipient = setupPacket.RequestType & 0x1F;
+	bool get = (setupPacket.RequestType & 0x80) != 0;
+	bool result;
+
+	if(lengthTransferred)
+		*lengthTransferred = 0;
+	EnterCriticalSection(&m_lock);
+	m_stats.controlRequests++;
+	if(type == BMREQUEST_TYPE_STANDARD && setupPacket.Request == USB_REQUEST_GET_DESCRIPTOR && get)
+	{
+		result = GetDescriptor((UCHAR)(setupPacket.Value >> 8), (UCHAR)setupPacket.Value, setupPacket.Index, buffer, bufferLength, lengthTransferred);
+		if(!result)
+			Stall();
+	}
+	else if(type == BMREQUEST_TYPE_STANDARD && setupPacket.Request == USB_REQUEST_SET_INTERFACE && recipient == BMREQUEST_RECIPIENT_INTERFACE)
+		result = SetAltInterface((UCHAR)setupPacket.Index, (UCHAR)setupPacket.Value);
+	else if(type == BMREQUEST_TYPE_CLASS && recipient == BMREQUEST_RECIPIENT_INTERFACE)
+		result = HandleClassRequest(setupPacket, buffer, bufferLength, lengthTransferred);
+	else
+		result = Stall();
+	LeaveCriticalSection(&m_lock);
+	return result;
+}
+
+bool SimTransport::HandleClassRequest(WINUSB_SETUP_PACKET& setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	UCHAR entity = (UCHAR)(setupPacket.Index >> 8);
+	UCHAR iface = (UCHAR)setupPacket.Index;
+	UCHAR control = (UCHAR)(setupPacket.Value >> 8);
+	bool get = (setupPacket.RequestType & 0x80) != 0;
+	UINT length = 0;
+
+	if(iface != 0 || entity != SIM_CLOCK_ID)
+		return Stall();
+
+	if(control == AUDIO_CS_CONTROL_SAM_FREQ && setupPacket.Request == AUDIO_CS_REQUEST_CUR)
+	{
+		if(bufferLength < 4)
+			return Stall();
+		if(get)
+			PutLE(buffer, m_sampleRate, 4);
+		else
+		{
+			int rate = (int)GetLE(buffer, 4);
+			int i = 0;
+			while(i < SIM_MAX_RATES && m_config.rates[i] && m_config.rates[i] != rate)
+				i++;
+			if(i == SIM_MAX_RATES || m_config.rates[i] == 0)
+				return Stall();
+			if(rate != m_sampleRate)
+			{
+				m_sampleRate = rate;
+				ResetStream();
+			}
+		}
+		length = 4;
+	}
+	else if(control == AUDIO_CS_CONTROL_SAM_FREQ && setupPacket.Request == AUDIO_CS_REQUEST_RANGE && get)
+	{
+		//wNumSubRanges and one discrete subrange per rate, truncated to the request length
+		UCHAR range[2 + SIM_MAX_RATES * sizeof(sample_rate_triplets)];
+		int count = 0;
+		while(count < SIM_MAX_RATES && m_config.rates[count])
+		{
+			UCHAR* triplet = range + 2 + count * sizeof(sample_rate_triplets);
+			PutLE(triplet, m_config.rates[count], 4);
+			PutLE(triplet + 4, m_config.rates[count], 4);
+			PutLE(triplet + 8, 0, 4);
+			count++;
+		}
+		PutLE(range, count, 2);
+		length = 2 + count * sizeof(sample_rate_triplets);
+		if(length > bufferLength)
+			length = bufferLength;
+		memcpy(buffer, range, length);
+	}
+	else if(control == AUDIO_CS_CONTROL_CLOCK_VALID && setupPacket.Request == AUDIO_CS_REQUEST_CUR && get && bufferLength >= 1)
+	{
+		buffer[0] = 1;
+		length = 1;
+	}
+	else
+		return Stall();
+
+	if(lengthTransferred)
+		*lengthTransferred = length;
+	return TRUE;
+}
+
+bool SimTransport::ClaimInterface(UCHAR number)
+{
+	if(number >= 1 + (m_outInterface >= 0) + (m_inInterface >= 0))
+	{
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool SimTransport::ReleaseInterface(UCHAR number)
+{
+	return ClaimInterface(number);
+}
+
+bool SimTransport::SetAltInterface(UCHAR number, UCHAR altSetting)
+{
+	if(!ClaimInterface(number))
+		return FALSE;
+	if(altSetting > (number == 0 ? 0 : 1))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&m_lock);
+	if(m_altSetting[number] != altSetting)
+	{
+		for(int i = 0; i < m_pipeCount; i++)
+			if(m_pipes[i].iface == number)
+			{
+				CancelPipe(m_pipes + i);
+				m_pipes[i].nextTime = 0;
+			}
+		m_altSetting[number] = altSetting;
+		if(number == m_outInterface)
+		{
+			m_fifoLevel = 0;
+			m_playing = FALSE;
+		}
+	}
+	LeaveCriticalSection(&m_lock);
+	return TRUE;
+}
+
+bool SimTransport::ResetPipe(UCHAR pipeId)
+{
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe)
+	{
+		CancelPipe(pipe);
+		pipe->nextTime = 0;
+	}
+	LeaveCriticalSection(&m_lock);
+	if(pipe == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	SetEvent(m_wakeEvent);
+	return TRUE;
+}
+
+bool SimTransport::AbortPipe(UCHAR pipeId)
+{
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe)
+		CancelPipe(pipe);
+	LeaveCriticalSection(&m_lock);
+	if(pipe == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	SetEvent(m_wakeEvent);
+	return TRUE;
+}
+
+bool SimTransport::SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value)
+{
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe && policyType == ISO_ALWAYS_START_ASAP && valueLength >= 1)
+		pipe->asap = *(UCHAR*)value != 0;
+	LeaveCriticalSection(&m_lock);
+	if(pipe == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool SimTransport::GetCurrentFrameNumber(PUINT frameNumber)
+{
+	EnterCriticalSection(&m_lock);
+	m_stats.frameNumberRequests++;
+	bool supported = m_config.frameNumber;
+	if(supported)
+		*frameNumber = (UINT)(BusTime() >> 3);
+	LeaveCriticalSection(&m_lock);
+	if(!supported)
+		SetLastError(ERROR_NOT_SUPPORTED);
+	return supported;
+}
+
+bool SimTransport::OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount)
+{
+	if(maxOverlappedCount <= 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	SimPool* pool = new SimPool();
+	pool->count = maxOverlappedCount;
+	pool->transfers = new SimTransfer[maxOverlappedCount];
+	memset(pool->transfers, 0, maxOverlappedCount * sizeof(SimTransfer));
+	for(int i = 0; i < maxOverlappedCount; i++)
+	{
+		pool->transfers[i].pool = pool;
+		pool->transfers[i].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		pool->transfers[i].reaped = TRUE;
+	}
+	*poolHandle = pool;
+	return TRUE;
+}
+
+bool SimTransport::OvlFree(KOVL_POOL_HANDLE poolHandle)
+{
+	SimPool* pool = (SimPool*)poolHandle;
+	if(pool == NULL)
+		return FALSE;
+	EnterCriticalSection(&m_lock);
+	for(int i = 0; i < pool->count; i++)
+	{
+		SimTransfer* transfer = pool->transfers + i;
+		if(transfer->state == TransferQueued)
+			Unlink(transfer);
+		Reap(transfer);
+		CloseHandle(transfer->event);
+	}
+	LeaveCriticalSection(&m_lock);
+	delete [] pool->transfers;
+	delete pool;
+	if(m_wakeEvent)
+		SetEvent(m_wakeEvent);
+	return TRUE;
+}
+
+bool SimTransport::OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle)
+{
+	SimPool* pool = (SimPool*)poolHandle;
+	EnterCriticalSection(&m_lock);
+	for(int i = 0; pool && i < pool->count; i++)
+		if(!pool->transfers[i].acquired)
+		{
+			SimTransfer* transfer = pool->transfers + i;
+			transfer->acquired = TRUE;
+			transfer->state = TransferIdle;
+			ResetEvent(transfer->event);
+			*overlapped = transfer;
+			LeaveCriticalSection(&m_lock);
+			return TRUE;
+		}
+	LeaveCriticalSection(&m_lock);
+	SetLastError(ERROR_BUSY);
+	return FALSE;
+}
+
+bool SimTransport::OvlRelease(KOVL_HANDLE overlapped)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	if(transfer == NULL)
+		return FALSE;
+	EnterCriticalSection(&m_lock);
+	if(transfer->state == TransferQueued)
+		Unlink(transfer);
+	Reap(transfer);
+	transfer->state = TransferIdle;
+	transfer->acquired = FALSE;
+	LeaveCriticalSection(&m_lock);
+	SetEvent(m_wakeEvent);
+	return TRUE;
+}
+
+bool SimTransport::OvlReUse(KOVL_HANDLE overlapped)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	if(transfer == NULL)
+		return FALSE;
+	EnterCriticalSection(&m_lock);
+	if(transfer->state == TransferQueued)
+	{
+		LeaveCriticalSection(&m_lock);
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+	Reap(transfer);
+	transfer->state = TransferIdle;
+	ResetEvent(transfer->event);
+	LeaveCriticalSection(&m_lock);
+	SetEvent(m_wakeEvent);
+	return TRUE;
+}
+
+bool SimTransport::OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	if(transfer == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(WaitForSingleObject(transfer->event, (DWORD)timeoutMS) != WAIT_OBJECT_0)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	EnterCriticalSection(&m_lock);
+	bool result = GetTransferResult(transfer, transferredLength);
+	DWORD errorCode = GetLastError();
+	LeaveCriticalSection(&m_lock);
+	SetEvent(m_wakeEvent);
+	SetLastError(errorCode);
+	return result;
+}
+
+bool SimTransport::OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	if(transfer == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	WaitForSingleObject(transfer->event, (DWORD)timeoutMS);
+	EnterCriticalSection(&m_lock);
+	if(transfer->state == TransferQueued)
+	{
+		Unlink(transfer);
+		transfer->state = TransferCompleted;
+		transfer->status = ERROR_OPERATION_ABORTED;
+		transfer->transferred = 0;
+		SetEvent(transfer->event);
+	}
+	bool result = GetTransferResult(transfer, transferredLength);
+	DWORD errorCode = GetLastError();
+	LeaveCriticalSection(&m_lock);
+	SetEvent(m_wakeEvent);
+	SetLastError(errorCode);
+	return result;
+}
+
+HANDLE SimTransport::OvlGetEventHandle(KOVL_HANDLE overlapped)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	return transfer ? transfer->event : NULL;
+}
+
+bool SimTransport::GetTransferResult(SimTransfer* transfer, PUINT transferredLength)
+{
+	if(transfer->state != TransferCompleted)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	Reap(transfer);
+	if(transferredLength)
+		*transferredLength = transfer->transferred;
+	if(transfer->status != ERROR_SUCCESS)
+	{
+		SetLastError(transfer->status);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void SimTransport::Reap(SimTransfer* transfer)
+{
+	if(transfer->state == TransferCompleted && !transfer->reaped)
+		m_unreaped--;
+	transfer->reaped = TRUE;
+}
+
+void SimTransport::Unlink(SimTransfer* transfer)
+{
+	SimPipe* pipe = transfer->pipe;
+	SimTransfer* prev = NULL;
+	SimTransfer* current = pipe->head;
+	while(current && current != transfer)
+	{
+		prev = current;
+		current = current->next;
+	}
+	if(current == NULL)
+		return;
+	if(prev)
+		prev->next = transfer->next;
+	else
+		pipe->head = transfer->next;
+	if(pipe->tail == transfer)
+		pipe->tail = prev;
+	transfer->next = NULL;
+}
+
+bool SimTransport::IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+{
+	return Submit(pipeId, FALSE, buffer, bufferLength, overlapped, isoContext);
+}
+
+bool SimTransport::IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+{
+	return Submit(pipeId, TRUE, buffer, bufferLength, overlapped, isoContext);
+}
+
+bool SimTransport::Submit(UCHAR pipeId, bool in, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+{
+	SimTransfer* transfer = (SimTransfer*)overlapped;
+	if(transfer == NULL || isoContext == NULL || isoContext->NumberOfPackets <= 0 ||
+		(m_config.maxIsoPackets > 0 && isoContext->NumberOfPackets > m_config.maxIsoPackets))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe == NULL || (USB_ENDPOINT_DIRECTION_IN(pipeId) != 0) != in || !IsPipeOpen(pipe))
+	{
+		LeaveCriticalSection(&m_lock);
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(transfer->state == TransferQueued)
+	{
+		LeaveCriticalSection(&m_lock);
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+
+	ULONGLONG now = BusTime();
+	ULONGLONG start;
+	int interval = pipe->packetInterval;
+	int packets = isoContext->NumberOfPackets;
+	if(pipe->asap || isoContext->StartFrame == 0)
+	{
+		//continues the stream, an idle pipe starts after a short latency
+		start = pipe->nextTime;
+		if(start <= now)
+			start = (now + SIM_ASAP_LATENCY + interval - 1) / interval * interval;
+	}
+	else
+	{
+		LONGLONG frame = (LONGLONG)(now >> 3) + (LONG)(isoContext->StartFrame - (UINT)(now >> 3));
+		start = frame > 0 ? (ULONGLONG)frame << 3 : 0;
+	}
+	isoContext->StartFrame = (UINT)(start >> 3);
+
+	transfer->latePackets = 0;
+	while(transfer->latePackets < packets && start + transfer->latePackets * interval <= now)
+		transfer->latePackets++;
+	if(transfer->latePackets)
+		m_stats.lateTransfers++;
+
+	Reap(transfer);
+	transfer->reaped = FALSE;
+	transfer->state = TransferQueued;
+	transfer->pipe = pipe;
+	transfer->buffer = buffer;
+	transfer->bufferLength = bufferLength;
+	transfer->isoContext = isoContext;
+	transfer->startTime = start;
+	transfer->endTime = start + (ULONGLONG)packets * interval;
+	transfer->status = ERROR_SUCCESS;
+	transfer->transferred = 0;
+	transfer->next = NULL;
+	//completions of a pipe stay in submit order
+	if(pipe->tail && transfer->endTime < pipe->tail->endTime)
+		transfer->endTime = pipe->tail->endTime;
+	ResetEvent(transfer->event);
+
+	if(pipe->tail)
+		pipe->tail->next = transfer;
+	else
+		pipe->head = transfer;
+	pipe->tail = transfer;
+	if(transfer->endTime > pipe->nextTime)
+		pipe->nextTime = transfer->endTime;
+	pipe->active = TRUE;
+	m_stats.transfers++;
+	LeaveCriticalSection(&m_lock);
+
+	SetEvent(m_wakeEvent);
+	SetLastError(ERROR_IO_PENDING);
+	return FALSE;
+}
+
+void SimTransport::Complete(SimTransfer* transfer, DWORD status)
+{
+	transfer->state = TransferCompleted;
+	transfer->status = status;
+	transfer->reaped = FALSE;
+	m_unreaped++;
+	SetEvent(transfer->event);
+}
+
+void SimTransport::CancelPipe(SimPipe* pipe)
+{
+	while(pipe->head)
+	{
+		SimTransfer* transfer = pipe->head;
+		pipe->head = transfer->next;
+		transfer->next = NULL;
+		transfer->transferred = 0;
+		Complete(transfer, ERROR_OPERATION_ABORTED);
+	}
+	pipe->tail = NULL;
+	pipe->active = FALSE;
+	if(!pipe->feedback && USB_ENDPOINT_DIRECTION_OUT(pipe->id))
+	{
+		m_fifoLevel = 0;
+		m_playing = FALSE;
+	}
+}
+
+void SimTransport::UpdateFifo(ULONGLONG time)
+{
+	if(time <= m_fifoTime)
+		return;
+	if(m_playing)
+	{
+		m_fifoLevel -= DeviceRate() * (time - m_fifoTime) / 8000.0;
+		if(m_fifoLevel < 0)
+		{
+			m_stats.underruns++;
+			m_fifoLevel = 0;
+			m_playing = FALSE;
+		}
+		else if(m_fifoLevel < m_stats.fifoMin)
+			m_stats.fifoMin = m_fifoLevel;
+	}
+	m_fifoTime = time;
+}
+
+void SimTransport::OutputPacket(ULONGLONG time, const UCHAR* data, int length)
+{
+	int frames = length / FrameSize(FALSE);
+	UpdateFifo(time);
+	m_stats.packetsOut++;
+	m_stats.framesOut += frames;
+	m_fifoLevel += frames;
+	if(m_fifoLevel > m_config.fifoFrames)
+	{
+		m_stats.overruns++;
+		m_fifoLevel = m_config.fifoFrames;
+	}
+	if(!m_playing && m_fifoLevel >= m_config.fifoFrames / 2)
+	{
+		m_playing = TRUE;
+		m_stats.fifoMin = m_stats.fifoMax = m_fifoLevel;
+	}
+	if(m_playing && m_fifoLevel > m_stats.fifoMax)
+		m_stats.fifoMax = m_fifoLevel;
+	if(m_captureCb)
+		m_captureCb(m_captureCbContext, data, length);
+}
+
+int SimTransport::InputPacket(SimPipe* pipe, UCHAR* data, int space)
+{
+	int frameSize = FrameSize(TRUE);
+	int maxFrames = (space < pipe->maxPacketSize ? space : pipe->maxPacketSize) / frameSize;
+	m_inAccumulator += DeviceRate() * pipe->packetInterval / 8000.0;
+	int frames = (int)m_inAccumulator;
+	if(frames > maxFrames)
+		frames = maxFrames;
+	if(pipe->shortPackets > 0)
+	{
+		pipe->shortPackets--;
+		if(frames > pipe->shortFrames)
+		{
+			frames = pipe->shortFrames;
+			m_stats.packetsShort++;
+		}
+	}
+	m_inAccumulator -= frames;
+
+	//ramp, channel n of every frame carries the frame counter plus n, MSB justified
+	int shift = m_config.subslotSize * 8 - m_config.bitResolution;
+	ULONG mask = m_config.bitResolution >= 32 ? 0xFFFFFFFF : ((ULONG)1 << m_config.bitResolution) - 1;
+	for(int i = 0; i < frames; i++, m_inSample++)
+		for(int ch = 0; ch < m_config.inputChannels; ch++)
+		{
+			PutLE(data, ((m_inSample + ch) & mask) << shift, m_config.subslotSize);
+			data += m_config.subslotSize;
+		}
+	m_stats.packetsIn++;
+	m_stats.framesIn += frames;
+	return frames * frameSize;
+}
+
+int SimTransport::FeedbackPacket(UCHAR* data, int space)
+{
+	double rate = DeviceRate();
+	//pulls the FIFO back to half full
+	if(m_playing)
+		rate += (m_config.fifoFrames / 2 - m_fifoLevel) * SIM_FIFO_SERVO;
+	m_stats.packetsFeedback++;
+	m_stats.feedbackValue = rate;
+
+	int size;
+	ULONG value;
+	if(m_config.speed == HighSpeed)
+	{
+		size = 4;
+		value = (ULONG)(rate / 8000.0 * 65536.0 + 0.5);
+	}
+	else
+	{
+		size = 3;
+		value = (ULONG)(rate / 1000.0 * 16384.0 + 0.5);
+	}
+	if(size > space)
+		return 0;
+	PutLE(data, value, size);
+	return size;
+}
+
+void SimTransport::ProcessTransfer(SimPipe* pipe, SimTransfer* transfer)
+{
+	PKISO_CONTEXT isoContext = transfer->isoContext;
+	int packets = isoContext->NumberOfPackets;
+	bool in = USB_ENDPOINT_DIRECTION_IN(pipe->id) != 0;
+	int errors = 0;
+	UINT transferred = 0;
+
+	for(int i = 0; i < packets; i++)
+	{
+		KISO_PACKET* packet = isoContext->IsoPackets + i;
+		ULONGLONG time = transfer->startTime + (ULONGLONG)i * pipe->packetInterval;
+		UINT offset = packet->Offset;
+		UINT limit = i + 1 < packets ? isoContext->IsoPackets[i + 1].Offset : transfer->bufferLength;
+		if(limit > transfer->bufferLength)
+			limit = transfer->bufferLength;
+		if(offset > limit)
+			offset = limit;
+		int space = limit - offset;
+
+		bool failed = i < transfer->latePackets;
+		if(!failed && pipe->injectErrors > 0)
+		{
+			pipe->injectErrors--;
+			failed = TRUE;
+		}
+		if(failed)
+		{
+			packet->Status = SIM_PACKET_ERROR;
+			if(in)
+				packet->Length = 0;
+			m_stats.packetsError++;
+			errors++;
+			continue;
+		}
+
+		int length;
+		if(!in)
+		{
+			length = space;
+			OutputPacket(time, transfer->buffer + offset, length);
+		}
+		else if(pipe->feedback)
+			length = FeedbackPacket(transfer->buffer + offset, space);
+		else
+			length = InputPacket(pipe, transfer->buffer + offset, space);
+		packet->Status = 0;
+		if(in)
+			packet->Length = (USHORT)length;
+		transferred += length;
+	}
+	isoContext->ErrorCount = (SHORT)errors;
+	transfer->transferred = in ? transferred : transfer->bufferLength;
+	//libusbK fails the transfer only if no packet went through
+	Complete(transfer, errors == packets ? ERROR_GEN_FAILURE : ERROR_SUCCESS);
+}
+
+SimPipe* SimTransport::NextCompletion()
+{
+	SimPipe* next = NULL;
+	for(int i = 0; i < m_pipeCount; i++)
+	{
+		SimPipe* pipe = m_pipes + i;
+		if(pipe->head && (next == NULL || pipe->head->endTime < next->head->endTime))
+			next = pipe;
+	}
+	return next;
+}
+
+bool SimTransport::CanAdvance()
+{
+	if(m_unreaped > 0)
+		return FALSE;
+	bool queued = FALSE;
+	for(int i = 0; i < m_pipeCount; i++)
+	{
+		SimPipe* pipe = m_pipes + i;
+		if(pipe->active && IsPipeOpen(pipe) && pipe->head == NULL)
+			return FALSE;
+		if(pipe->head)
+			queued = TRUE;
+	}
+	return queued;
+}
+
+DWORD WINAPI SimTransport::sDeviceThread(LPVOID context)
+{
+	SimTransport* transport = (SimTransport*)context;
+	transport->DeviceThread();
+	return 0;
+}
+
+void SimTransport::DeviceThread()
+{
+	DWORD stallStart = 0;
+	while(!m_exit)
+	{
+		DWORD waitTime = SIM_WAIT_TIMEOUT;
+		EnterCriticalSection(&m_lock);
+		SimPipe* pipe = NextCompletion();
+		if(!m_config.realTime && pipe)
+		{
+			//virtual time jumps to the next completion once the host has caught up
+			bool advance = CanAdvance();
+			if(!advance)
+			{
+				if(stallStart == 0)
+					stallStart = GetTickCount() | 1;
+				else if(GetTickCount() - stallStart >= SIM_STALL_TIMEOUT)
+				{
+					m_stats.stalls++;
+					advance = TRUE;
+				}
+			}
+			if(advance)
+			{
+				stallStart = 0;
+				if(pipe->head->endTime > m_busTime)
+					m_busTime = pipe->head->endTime;
+			}
+		}
+		ULONGLONG now = BusTime();
+		while((pipe = NextCompletion()) != NULL && pipe->head->endTime <= now)
+		{
+			SimTransfer* transfer = pipe->head;
+			pipe->head = transfer->next;
+			if(pipe->head == NULL)
+				pipe->tail = NULL;
+			transfer->next = NULL;
+			ProcessTransfer(pipe, transfer);
+		}
+		if(m_config.realTime && pipe)
+		{
+			ULONGLONG ms = (pipe->head->endTime - now + 7) / 8;
+			waitTime = ms < SIM_WAIT_TIMEOUT ? (DWORD)ms : SIM_WAIT_TIMEOUT;
+		}
+		else if(!m_config.realTime && pipe)
+			waitTime = CanAdvance() ? 0 : 10;
+		LeaveCriticalSection(&m_lock);
+		if(waitTime)
+			WaitForSingleObject(m_wakeEvent, waitTime);
+	}
+}
+
+void SimTransport::SetClockPpm(double ppm)
+{
+	EnterCriticalSection(&m_lock);
+	m_clockPpm = ppm;
+	LeaveCriticalSection(&m_lock);
+}
+
+void SimTransport::InjectPacketErrors(UCHAR pipeId, int count)
+{
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe)
+		pipe->injectErrors = count;
+	LeaveCriticalSection(&m_lock);
+}
+
+void SimTransport::InjectShortPackets(UCHAR pipeId, int count, int frames)
+{
+	EnterCriticalSection(&m_lock);
+	SimPipe* pipe = FindPipe(pipeId);
+	if(pipe)
+	{
+		pipe->shortPackets = count;
+		pipe->shortFrames = frames;
+	}
+	LeaveCriticalSection(&m_lock);
+}
+
+void SimTransport::SetCaptureCallback(SimCaptureCallback captureCb, void* context)
+{
+	EnterCriticalSection(&m_lock);
+	m_captureCb = captureCb;
+	m_captureCbContext = context;
+	LeaveCriticalSection(&m_lock);
+}
+
+void SimTransport::GetStatistics(SimStatistics* stats)
+{
+	EnterCriticalSection(&m_lock);
+	m_stats.busTime = BusTime();
+	m_stats.sampleRate = m_sampleRate;
+	m_stats.fifoLevel = m_fifoLevel;
+	memcpy(stats, &m_stats, sizeof(SimStatistics));
+	LeaveCriticalSection(&m_lock);
+}
+
+void SimTransport::ClearStatistics()
+{
+	EnterCriticalSection(&m_lock);
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.fifoMin = m_stats.fifoMax = m_fifoLevel;
+	LeaveCriticalSection(&m_lock);
+}
@@ -0,0 +1,204 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#pragma once
+#ifndef __SIM_TRANSPORT_H__
+#define __SIM_TRANSPORT_H__
+
+#include "usbtransport.h"
+#include "usb_audio.h"
+
+//Software UAC2 device behind the transport interface, runs the engine without hardware.
+//Interface 0 is audio control with one clock source, interface 1 streams output
+//(with explicit feedback endpoint), interface 2 input; alt 1 of a streaming interface
+//carries the audio endpoint.
+//Bus time advances in 125 us microframes. In real time mode it follows the wall clock,
+//otherwise it advances as fast as the host keeps every started pipe queued and has taken
+//all completed transfers, so runs are repeatable and not limited by the clock.
+
+#define SIM_MAX_RATES			16
+#define SIM_MAX_PIPES			3
+#define SIM_CLOCK_ID			0x10
+
+struct SimDeviceConfig
+{
+	int		speed;				//FullSpeed or HighSpeed
+	int		outputChannels;		//0 - no output interface
+	int		inputChannels;		//0 - no input interface
+	int		subslotSize;		//bytes per sample
+	int		bitResolution;
+	DWORD	formats;			//bmFormats of the streaming interfaces
+	int		interval;			//bInterval of the audio endpoints
+	bool	explicitFeedback;	//feedback endpoint in the output alt setting
+	int		rates[SIM_MAX_RATES];	//discrete clock rates, zero terminated
+	double	clockPpm;			//device clock error against the bus clock
+	bool	realTime;
+	int		fifoFrames;			//output FIFO size in audio frames, playback starts half full
+	int		maxIsoPackets;		//packets per transfer the transport takes, 0 - no limit (usbfs: 128)
+	bool	frameNumber;		//GetCurrentFrameNumber works, libusb and usbfs have none
+	int		transactions;		//high speed audio endpoints: transactions per microframe (wMaxPacketSize bits 11..12 + 1),
+								//0 - as few as the packet needs, 4 - the reserved value 3
+
+	SimDeviceConfig();
+};
+
+struct SimStatistics
+{
+	ULONGLONG	busTime;			//microframes since open
+	int			sampleRate;
+	ULONG		transfers;
+	ULONG		lateTransfers;		//scheduled start frame had passed
+	ULONG		packetsOut;
+	ULONG		packetsIn;
+	ULONG		packetsFeedback;
+	ULONG		packetsError;		//injected or late
+	ULONG		packetsShort;		//input packets cut by InjectShortPackets
+	ULONGLONG	framesOut;			//audio frames received
+	ULONGLONG	framesIn;			//audio frames sent
+	double		fifoLevel;			//output FIFO, audio frames
+	double		fifoMin;
+	double		fifoMax;
+	ULONG		underruns;
+	ULONG		overruns;
+	double		feedbackValue;		//last value sent, samples per second
+	ULONG		controlRequests;
+	ULONG		controlStalls;
+	ULONG		stalls;				//virtual time advanced without the host
+	ULONG		frameNumberRequests;	//GetCurrentFrameNumber calls
+};
+
+//every received output packet, called from the device thread
+typedef void (*SimCaptureCallback)(void* context, const UCHAR* data, int length);
+
+struct SimTransfer;
+struct SimPool;
+struct SimPipe;
+
+class SimTransport : public USBTransport
+{
+	SimDeviceConfig		m_config;
+	UCHAR				m_deviceDescriptor[18];
+	UCHAR				m_configDescriptor[512];
+	int					m_configLength;
+	int					m_outInterface;		//-1 if not present
+	int					m_inInterface;
+	int					m_altSetting[3];
+
+	SimPipe*			m_pipes;
+	int					m_pipeCount;
+
+	CRITICAL_SECTION	m_lock;
+	HANDLE				m_wakeEvent;
+	HANDLE				m_thread;
+	volatile bool		m_exit;
+	bool				m_open;
+
+	//bus time
+	ULONGLONG			m_busTime;			//virtual mode
+	LONGLONG			m_openCounter;		//real time mode
+	LONGLONG			m_counterFrequency;
+	LONG				m_unreaped;			//completed transfers the host hasn't taken
+
+	//clock
+	int					m_sampleRate;
+	double				m_clockPpm;
+	double				m_inAccumulator;	//fractional frames of the input stream
+	ULONG				m_inSample;			//ramp value of the next input frame
+	double				m_fifoLevel;		//output FIFO, audio frames
+	ULONGLONG			m_fifoTime;			//bus time of the last FIFO update
+	bool				m_playing;
+
+	SimStatistics		m_stats;
+	SimCaptureCallback	m_captureCb;
+	void*				m_captureCbContext;
+
+	void BuildDescriptors();
+	void Append(const void* descriptor, int length);
+	void AddPipe(UCHAR id, int iface, USHORT maxPacketSize, UCHAR interval);
+	void ResetStream();
+
+	ULONGLONG BusTime();
+	double DeviceRate();
+	int FrameSize(bool input);
+	SimPipe* FindPipe(UCHAR pipeId);
+	bool IsPipeOpen(SimPipe* pipe);
+
+	bool Submit(UCHAR pipeId, bool in, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext);
+	void Complete(SimTransfer* transfer, DWORD status);
+	void CancelPipe(SimPipe* pipe);
+	void ProcessTransfer(SimPipe* pipe, SimTransfer* transfer);
+	void UpdateFifo(ULONGLONG time);
+	void OutputPacket(ULONGLONG time, const UCHAR* data, int length);
+	int InputPacket(SimPipe* pipe, UCHAR* data, int space);
+	int FeedbackPacket(UCHAR* data, int space);
+	SimPipe* NextCompletion();
+	bool CanAdvance();
+	void Reap(SimTransfer* transfer);
+	void Unlink(SimTransfer* transfer);
+	bool GetTransferResult(SimTransfer* transfer, PUINT transferredLength);
+
+	bool HandleClassRequest(WINUSB_SETUP_PACKET& setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+	bool Stall();
+
+	static DWORD WINAPI sDeviceThread(LPVOID context);
+	void DeviceThread();
+public:
+	SimTransport(const SimDeviceConfig& config);
+	virtual ~SimTransport();
+
+	virtual bool Open();
+	virtual void Close();
+	virtual bool IsOpen()
+	{ return m_open; }
+
+	virtual bool GetDeviceSpeed(int* speed);
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+
+	virtual bool ClaimInterface(UCHAR number);
+	virtual bool ReleaseInterface(UCHAR number);
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting);
+
+	virtual bool ResetPipe(UCHAR pipeId);
+	virtual bool AbortPipe(UCHAR pipeId);
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value);
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber);
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount);
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlRelease(KOVL_HANDLE overlapped);
+	virtual bool OvlReUse(KOVL_HANDLE overlapped);
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength);
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength);
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped);
+
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext);
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext);
+	virtual int GetMaxIsoPackets()
+	{ return m_config.maxIsoPackets; }
+
+	//device side
+	void SetClockPpm(double ppm);
+	//next count packets of the pipe fail
+	void InjectPacketErrors(UCHAR pipeId, int count);
+	//next count packets of an input pipe carry at most frames audio frames, the rest follows later
+	void InjectShortPackets(UCHAR pipeId, int count, int frames);
+	void SetCaptureCallback(SimCaptureCallback captureCb, void* context);
+	void GetStatistics(SimStatistics* stats);
+	void ClearStatistics();
+};
+
+#endif //__SIM_TRANSPORT_H__
@@ -17,6 +17,8 @@
 #define __TLIST_T__
 
 
+template <class element, class lockobj> class TList;
+
 template <class element, class list> class TElement
 {
 protected:
@@ -31,7 +33,8 @@ public:
 	virtual ~TElement() {}
 	virtual void Destroy() = 0;
 
-	friend typename list;
+	//list links its elements, friend of every list type (friend of a template parameter isn't C++03)
+	template <class e, class l> friend class TList;
 };
 
 
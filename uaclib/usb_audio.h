@@ -33,6 +33,13 @@
 #define INPUT_TERMINAL_SUB_TYPE         0x02
 #define OUTPUT_TERMINAL_SUB_TYPE        0x03
 
+//! \name Audio Data Format Type I bit allocations (bmFormats), Formats A.2.1
+//! @{
+#define  AUDIO_FORMAT_TYPE_I_PCM                    0x00000001
+#define  AUDIO_FORMAT_TYPE_I_IEEE_FLOAT             0x00000004
+#define  AUDIO_FORMAT_TYPE_I_RAW_DATA               0x80000000
+//! @}
+
 /*! \name Audio specific definitions (Class, subclass and protocol)
  */
 //! @{
@@ -100,9 +107,23 @@
 #define  AUDIO_CS_CONTROL_CLOCK_VALID            0x02
 //! @}
 
+//! \name bmControls pairs pp. 4.7.2: 00 - not present, 01 - read only, 11 - host programmable
+//! @{
+#define  AUDIO_CONTROL_PROGRAMMABLE(bmControls, selector)	((((bmControls) >> (2 * ((selector) - 1))) & 0x03) == 0x03)
+//! @}
+
+//! \name wMaxPacketSize fields pp. USB 2.0 9.6.6
+//! bits 0..10 - transaction size, bits 11..12 - additional transactions per microframe (high-bandwidth endpoints)
+//! bits 11..12 = 3 is reserved: 0 transactions, the endpoint carries nothing
+//! @{
+#define  USB_ENDPOINT_TRANSACTION_SIZE(w)        ((w) & 0x7FF)
+#define  USB_ENDPOINT_TRANSACTIONS(w)            ((((w) >> 11) & 0x03) == 0x03 ? 0 : 1 + (((w) >> 11) & 0x03))
+#define  USB_ENDPOINT_MAX_PAYLOAD(w)             (USB_ENDPOINT_TRANSACTION_SIZE(w) * USB_ENDPOINT_TRANSACTIONS(w))
+//! @}
+
 
 /* ensure byte-packed structures */
-#include <pshpack1.h>
+#pragma pack(push, 1)
 
 struct usb_ac_interface_descriptor_2
 {
@@ -246,4 +267,6 @@ struct sample_rate_triplets
 	int res_freq;
 };
 
+#pragma pack(pop)
+
 #endif
\ No newline at end of file
@@ -0,0 +1,694 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#include "usbfstransport.h"
+
+#ifdef _USE_USBFS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#ifndef USBFS_PATH
+#define USBFS_PATH					"/dev/bus/usb"
+#endif
+#define USBFS_CONTROL_TIMEOUT		1000	//ms
+#define USBFS_CANCEL_TIMEOUT		1000	//ms to wait for a discarded URB to be reaped
+
+//USB_SPEED_* of linux/usb/ch9.h returned by USBDEVFS_GET_SPEED
+#define USBFS_SPEED_LOW				1
+#define USBFS_SPEED_FULL			2
+
+enum UsbFsTransferState
+{
+	TransferIdle = 0,
+	TransferQueued,
+	TransferCompleted
+};
+
+struct UsbFsOverlapped
+{
+	UsbFsTransport*		transport;
+	HANDLE				event;			//manual reset, signaled from the reap thread
+	bool				acquired;
+	volatile int		state;
+	usbdevfs_urb*		urb;
+	int					isoCapacity;	//packets the URB was allocated for
+	PKISO_CONTEXT		isoContext;
+	DWORD				status;
+	UINT				transferred;
+	UsbFsOverlapped*	next;			//in the inflight list
+};
+
+struct UsbFsPool
+{
+	int					count;
+	UsbFsOverlapped*	overlapped;
+};
+
+UsbFsTransport::UsbFsTransport(USHORT vendorId, USHORT productId) : m_vendorId(vendorId), m_productId(productId), m_fd(-1), m_speed(HighSpeed),
+	m_reapThread(NULL), m_exit(0), m_inflight(NULL)
+{
+	m_wakePipe[0] = m_wakePipe[1] = -1;
+	InitializeCriticalSection(&m_lock);
+}
+
+UsbFsTransport::~UsbFsTransport()
+{
+	Close();
+	DeleteCriticalSection(&m_lock);
+}
+
+//ioctl results (errno on failure) to the Win32 codes USBDevice reports
+bool UsbFsTransport::CheckResult(int result)
+{
+	if(result >= 0)
+		return TRUE;
+	int error = errno;
+	DWORD errorCode;
+	switch(error)
+	{
+		case EINVAL:
+			errorCode = ERROR_INVALID_PARAMETER;
+			break;
+		case ENODEV:
+		case ESHUTDOWN:
+			errorCode = ERROR_DEVICE_NOT_CONNECTED;
+			break;
+		case ENOENT:
+			errorCode = ERROR_NOT_FOUND;
+			break;
+		case EBUSY:
+			errorCode = ERROR_BUSY;
+			break;
+		case ETIMEDOUT:
+			errorCode = ERROR_SEM_TIMEOUT;
+			break;
+		case ENOMEM:
+			errorCode = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		case EACCES:
+		case EPERM:
+			errorCode = ERROR_ACCESS_DENIED;
+			break;
+		default:
+			errorCode = ERROR_GEN_FAILURE;
+			break;
+	}
+#ifdef _ENABLE_TRACE
+	debugPrintf("ASIOUAC: usbfs error %d\n", error);
+#endif
+	SetLastError(errorCode);
+	return FALSE;
+}
+
+//reading a usbfs node returns the device descriptor first
+int UsbFsTransport::FindDevice()
+{
+	DIR* busDir = opendir(USBFS_PATH);
+	if(busDir == NULL)
+	{
+		errno = ENODEV;
+		return -1;
+	}
+	int fd = -1;
+	int error = ENODEV;
+	dirent* bus;
+	while(fd < 0 && (bus = readdir(busDir)) != NULL)
+	{
+		if(bus->d_name[0] == '.')
+			continue;
+		char path[PATH_MAX];
+		//names that don't fit can't be opened anyway
+		if(snprintf(path, sizeof(path), USBFS_PATH "/%s", bus->d_name) >= (int)sizeof(path))
+			continue;
+		DIR* deviceDir = opendir(path);
+		if(deviceDir == NULL)
+			continue;
+		dirent* device;
+		while(fd < 0 && (device = readdir(deviceDir)) != NULL)
+		{
+			if(device->d_name[0] == '.')
+				continue;
+			if(snprintf(path, sizeof(path), USBFS_PATH "/%s/%s", bus->d_name, device->d_name) >= (int)sizeof(path))
+				continue;
+			int deviceFd = open(path, O_RDWR | O_CLOEXEC);
+			if(deviceFd < 0)
+			{
+				//remember why a node we can't read was skipped
+				if(errno == EACCES || errno == EPERM)
+					error = errno;
+				continue;
+			}
+			UCHAR descriptor[18];
+			if(read(deviceFd, descriptor, sizeof(descriptor)) == sizeof(descriptor) &&
+				(descriptor[8] | (descriptor[9] << 8)) == m_vendorId &&
+				(descriptor[10] | (descriptor[11] << 8)) == m_productId)
+				fd = deviceFd;
+			else
+				close(deviceFd);
+		}
+		closedir(deviceDir);
+	}
+	closedir(busDir);
+	if(fd < 0)
+		errno = error;
+	return fd;
+}
+
+bool UsbFsTransport::Open()
+{
+	Close();
+
+	m_fd = FindDevice();
+	if(m_fd < 0)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Device %04X:%04X not found or can't be opened\n", m_vendorId, m_productId);
+#endif
+		return CheckResult(-1);
+	}
+
+	//older kernels can't tell, the widget is a high speed device
+	m_speed = HighSpeed;
+#ifdef USBDEVFS_GET_SPEED
+	int speed = ioctl(m_fd, USBDEVFS_GET_SPEED);
+	m_speed = speed == USBFS_SPEED_LOW ? LowSpeed : speed == USBFS_SPEED_FULL ? FullSpeed : HighSpeed;
+#endif
+
+	if(pipe(m_wakePipe) < 0)
+	{
+		CheckResult(-1);
+		close(m_fd);
+		m_fd = -1;
+		return FALSE;
+	}
+	m_exit = 0;
+	m_reapThread = CreateThread(NULL, 0, sReapThread, this, 0, NULL);
+	if(m_reapThread == NULL)
+	{
+		DWORD errorCode = GetLastError();
+		close(m_wakePipe[0]);
+		close(m_wakePipe[1]);
+		close(m_fd);
+		m_wakePipe[0] = m_wakePipe[1] = -1;
+		m_fd = -1;
+		SetLastError(errorCode);
+		return FALSE;
+	}
+	//completion latency of every stream depends on this thread
+	SetThreadPriority(m_reapThread, THREAD_PRIORITY_TIME_CRITICAL);
+	return TRUE;
+}
+
+void UsbFsTransport::Close()
+{
+	if(m_fd < 0)
+		return;
+
+	//discarded URBs still have to be reaped
+	EnterCriticalSection(&m_lock);
+	for(UsbFsOverlapped* overlapped = m_inflight; overlapped; overlapped = overlapped->next)
+		ioctl(m_fd, USBDEVFS_DISCARDURB, overlapped->urb);
+	LeaveCriticalSection(&m_lock);
+	DWORD start = GetTickCount();
+	while(m_inflight != NULL && GetTickCount() - start < USBFS_CANCEL_TIMEOUT)
+		Sleep(1);
+
+	m_exit = 1;
+	char wake = 0;
+	if(write(m_wakePipe[1], &wake, 1) < 0)
+	{
+#ifdef _ENABLE_TRACE
+		debugPrintf("ASIOUAC: Can't wake up the reap thread\n");
+#endif
+	}
+	WaitForSingleObject(m_reapThread, INFINITE);
+	CloseHandle(m_reapThread);
+	m_reapThread = NULL;
+
+	close(m_wakePipe[0]);
+	close(m_wakePipe[1]);
+	close(m_fd);
+	m_wakePipe[0] = m_wakePipe[1] = -1;
+	m_fd = -1;
+}
+
+DWORD WINAPI UsbFsTransport::sReapThread(LPVOID context)
+{
+	UsbFsTransport* transport = (UsbFsTransport*)context;
+	transport->ReapThread();
+	return 0;
+}
+
+//usbfs reports completed URBs as writable
+void UsbFsTransport::ReapThread()
+{
+	pollfd fds[2];
+	fds[0].fd = m_fd;
+	fds[0].events = POLLOUT;
+	fds[1].fd = m_wakePipe[0];
+	fds[1].events = POLLIN;
+	while(!m_exit)
+	{
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(!(fds[0].revents & (POLLOUT | POLLERR | POLLHUP)))
+			continue;
+		for(;;)
+		{
+			usbdevfs_urb* urb = NULL;
+			if(ioctl(m_fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+			{
+				Completed((UsbFsOverlapped*)urb->usercontext);
+				continue;
+			}
+			if(errno == ENODEV)
+			{
+				//everything completed is reaped, the rest won't come back
+				Disconnected();
+				fds[0].fd = -1;
+			}
+			break;
+		}
+	}
+}
+
+void UsbFsTransport::Completed(UsbFsOverlapped* overlapped)
+{
+	usbdevfs_urb* urb = overlapped->urb;
+	PKISO_CONTEXT isoContext = overlapped->isoContext;
+	bool in = (urb->endpoint & USB_ENDPOINT_DIRECTION_MASK) != 0;
+	int errors = 0;
+	UINT transferred = 0;
+
+	for(int i = 0; i < urb->number_of_packets; i++)
+	{
+		usbdevfs_iso_packet_desc& packet = urb->iso_frame_desc[i];
+		if(packet.status != 0)
+			errors++;
+		isoContext->IsoPackets[i].Status = (USHORT)-(int)packet.status;
+		if(in)
+			isoContext->IsoPackets[i].Length = (USHORT)packet.actual_length;
+		transferred += packet.actual_length;
+	}
+	isoContext->ErrorCount = (SHORT)errors;
+
+	DWORD status;
+	switch(-urb->status)
+	{
+		case 0:
+		case EXDEV:
+			//some packets failed, as with libusbK the transfer fails only if none went through
+			status = errors == urb->number_of_packets ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+			break;
+		case ENOENT:
+		case ECONNRESET:
+			status = ERROR_OPERATION_ABORTED;
+			break;
+		case ENODEV:
+		case ESHUTDOWN:
+			status = ERROR_DEVICE_NOT_CONNECTED;
+			break;
+		default:
+			status = ERROR_GEN_FAILURE;
+			break;
+	}
+
+	EnterCriticalSection(&m_lock);
+	Unlink(overlapped);
+	overlapped->transferred = in ? transferred : urb->buffer_length;
+	overlapped->status = status;
+	overlapped->state = TransferCompleted;
+	LeaveCriticalSection(&m_lock);
+	SetEvent(overlapped->event);
+}
+
+void UsbFsTransport::Disconnected()
+{
+	EnterCriticalSection(&m_lock);
+	while(m_inflight)
+	{
+		UsbFsOverlapped* overlapped = m_inflight;
+		m_inflight = overlapped->next;
+		overlapped->next = NULL;
+		overlapped->transferred = 0;
+		overlapped->status = ERROR_DEVICE_NOT_CONNECTED;
+		overlapped->state = TransferCompleted;
+		SetEvent(overlapped->event);
+	}
+	LeaveCriticalSection(&m_lock);
+}
+
+bool UsbFsTransport::GetDeviceSpeed(int* speed)
+{
+	*speed = m_speed;
+	return TRUE;
+}
+
+bool UsbFsTransport::GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	WINUSB_SETUP_PACKET setupPacket;
+	setupPacket.RequestType = USB_ENDPOINT_DIRECTION_MASK;
+	setupPacket.Request = USB_REQUEST_GET_DESCRIPTOR;
+	setupPacket.Value = (USHORT)((type << 8) | index);
+	setupPacket.Index = type == USB_DESCRIPTOR_TYPE_STRING ? languageId : 0;
+	setupPacket.Length = (USHORT)bufferLength;
+	return ControlTransfer(setupPacket, buffer, bufferLength, lengthTransferred);
+}
+
+bool UsbFsTransport::ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred)
+{
+	usbdevfs_ctrltransfer control;
+	control.bRequestType = setupPacket.RequestType;
+	control.bRequest = setupPacket.Request;
+	control.wValue = setupPacket.Value;
+	control.wIndex = setupPacket.Index;
+	control.wLength = (USHORT)bufferLength;
+	control.timeout = USBFS_CONTROL_TIMEOUT;
+	control.data = buffer;
+	int result = ioctl(m_fd, USBDEVFS_CONTROL, &control);
+	if(!CheckResult(result))
+		return FALSE;
+	if(lengthTransferred)
+		*lengthTransferred = result;
+	return TRUE;
+}
+
+bool UsbFsTransport::ClaimInterface(UCHAR number)
+{
+	//snd-usb-audio holds the audio interfaces otherwise, ENODATA if no driver is bound
+	usbdevfs_ioctl command;
+	command.ifno = number;
+	command.ioctl_code = USBDEVFS_DISCONNECT;
+	command.data = NULL;
+	ioctl(m_fd, USBDEVFS_IOCTL, &command);
+
+	unsigned int interfaceNumber = number;
+	return CheckResult(ioctl(m_fd, USBDEVFS_CLAIMINTERFACE, &interfaceNumber));
+}
+
+bool UsbFsTransport::ReleaseInterface(UCHAR number)
+{
+	unsigned int interfaceNumber = number;
+	if(!CheckResult(ioctl(m_fd, USBDEVFS_RELEASEINTERFACE, &interfaceNumber)))
+		return FALSE;
+
+	//give the interface back to the kernel driver
+	usbdevfs_ioctl command;
+	command.ifno = number;
+	command.ioctl_code = USBDEVFS_CONNECT;
+	command.data = NULL;
+	ioctl(m_fd, USBDEVFS_IOCTL, &command);
+	return TRUE;
+}
+
+bool UsbFsTransport::SetAltInterface(UCHAR number, UCHAR altSetting)
+{
+	usbdevfs_setinterface setInterface;
+	setInterface.interface = number;
+	setInterface.altsetting = altSetting;
+	return CheckResult(ioctl(m_fd, USBDEVFS_SETINTERFACE, &setInterface));
+}
+
+//isochronous endpoints have no halt state, a reset drops the queued URBs as WinUSB does
+bool UsbFsTransport::ResetPipe(UCHAR pipeId)
+{
+	return AbortPipe(pipeId);
+}
+
+bool UsbFsTransport::AbortPipe(UCHAR pipeId)
+{
+	EnterCriticalSection(&m_lock);
+	for(UsbFsOverlapped* overlapped = m_inflight; overlapped; overlapped = overlapped->next)
+		if(overlapped->urb->endpoint == pipeId)
+			ioctl(m_fd, USBDEVFS_DISCARDURB, overlapped->urb);
+	LeaveCriticalSection(&m_lock);
+	return TRUE;
+}
+
+//URBs are always queued ASAP, the policies have nothing to change
+bool UsbFsTransport::SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value)
+{
+	return TRUE;
+}
+
+bool UsbFsTransport::GetCurrentFrameNumber(PUINT frameNumber)
+{
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+bool UsbFsTransport::OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount)
+{
+	if(maxOverlappedCount <= 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	UsbFsPool* pool = new UsbFsPool();
+	pool->count = maxOverlappedCount;
+	pool->overlapped = new UsbFsOverlapped[maxOverlappedCount];
+	memset(pool->overlapped, 0, maxOverlappedCount * sizeof(UsbFsOverlapped));
+	for(int i = 0; i < maxOverlappedCount; i++)
+	{
+		pool->overlapped[i].transport = this;
+		pool->overlapped[i].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	*poolHandle = pool;
+	return TRUE;
+}
+
+bool UsbFsTransport::OvlFree(KOVL_POOL_HANDLE poolHandle)
+{
+	UsbFsPool* pool = (UsbFsPool*)poolHandle;
+	if(pool == NULL)
+		return FALSE;
+	for(int i = 0; i < pool->count; i++)
+	{
+		UsbFsOverlapped* overlapped = pool->overlapped + i;
+		if(overlapped->state == TransferQueued && !Cancel(overlapped, USBFS_CANCEL_TIMEOUT))
+		{
+			//the kernel still owns the URB, it can't be freed
+#ifdef _ENABLE_TRACE
+			debugPrintf("ASIOUAC: URB isn't reaped, pool is leaked\n");
+#endif
+			return FALSE;
+		}
+	}
+	for(int i = 0; i < pool->count; i++)
+	{
+		free(pool->overlapped[i].urb);
+		CloseHandle(pool->overlapped[i].event);
+	}
+	delete [] pool->overlapped;
+	delete pool;
+	return TRUE;
+}
+
+bool UsbFsTransport::OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle)
+{
+	UsbFsPool* pool = (UsbFsPool*)poolHandle;
+	for(int i = 0; pool && i < pool->count; i++)
+		if(!pool->overlapped[i].acquired)
+		{
+			pool->overlapped[i].acquired = TRUE;
+			pool->overlapped[i].state = TransferIdle;
+			ResetEvent(pool->overlapped[i].event);
+			*overlapped = pool->overlapped + i;
+			return TRUE;
+		}
+	SetLastError(ERROR_BUSY);
+	return FALSE;
+}
+
+bool UsbFsTransport::OvlRelease(KOVL_HANDLE overlapped)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	if(ovl == NULL)
+		return FALSE;
+	if(ovl->state == TransferQueued && !Cancel(ovl, USBFS_CANCEL_TIMEOUT))
+		return FALSE;
+	ovl->state = TransferIdle;
+	ovl->acquired = FALSE;
+	return TRUE;
+}
+
+bool UsbFsTransport::OvlReUse(KOVL_HANDLE overlapped)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	if(ovl == NULL)
+		return FALSE;
+	if(ovl->state == TransferQueued)
+	{
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+	ovl->state = TransferIdle;
+	ResetEvent(ovl->event);
+	return TRUE;
+}
+
+bool UsbFsTransport::GetResult(UsbFsOverlapped* overlapped, PUINT transferredLength)
+{
+	if(overlapped->state != TransferCompleted)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	if(transferredLength)
+		*transferredLength = overlapped->transferred;
+	if(overlapped->status != ERROR_SUCCESS)
+	{
+		SetLastError(overlapped->status);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool UsbFsTransport::OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	if(ovl == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(WaitForSingleObject(ovl->event, (DWORD)timeoutMS) != WAIT_OBJECT_0)
+	{
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return FALSE;
+	}
+	return GetResult(ovl, transferredLength);
+}
+
+bool UsbFsTransport::OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	if(ovl == NULL)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(WaitForSingleObject(ovl->event, (DWORD)timeoutMS) != WAIT_OBJECT_0)
+		Cancel(ovl, USBFS_CANCEL_TIMEOUT);
+	return GetResult(ovl, transferredLength);
+}
+
+HANDLE UsbFsTransport::OvlGetEventHandle(KOVL_HANDLE overlapped)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	return ovl ? ovl->event : NULL;
+}
+
+//a discarded URB is done when the reap thread has taken it back
+bool UsbFsTransport::Cancel(UsbFsOverlapped* overlapped, DWORD timeoutMS)
+{
+	EnterCriticalSection(&m_lock);
+	if(overlapped->state == TransferQueued)
+		ioctl(m_fd, USBDEVFS_DISCARDURB, overlapped->urb);
+	LeaveCriticalSection(&m_lock);
+	return WaitForSingleObject(overlapped->event, timeoutMS) == WAIT_OBJECT_0;
+}
+
+void UsbFsTransport::Unlink(UsbFsOverlapped* overlapped)
+{
+	UsbFsOverlapped** link = &m_inflight;
+	while(*link && *link != overlapped)
+		link = &(*link)->next;
+	if(*link)
+		*link = overlapped->next;
+	overlapped->next = NULL;
+}
+
+bool UsbFsTransport::Submit(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+{
+	UsbFsOverlapped* ovl = (UsbFsOverlapped*)overlapped;
+	if(ovl == NULL || isoContext == NULL || isoContext->NumberOfPackets <= 0 || isoContext->NumberOfPackets > USBFS_MAX_ISO_PACKETS)
+	{
+#ifdef _ENABLE_TRACE
+		if(isoContext && isoContext->NumberOfPackets > USBFS_MAX_ISO_PACKETS)
+			debugPrintf("ASIOUAC: usbfs takes up to %d packets per URB\n", USBFS_MAX_ISO_PACKETS);
+#endif
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if(ovl->state == TransferQueued)
+	{
+		SetLastError(ERROR_BUSY);
+		return FALSE;
+	}
+
+	//the URB stays with its ISOBuffer, it's allocated on the first submit only
+	int packets = isoContext->NumberOfPackets;
+	if(ovl->urb == NULL || ovl->isoCapacity < packets)
+	{
+		free(ovl->urb);
+		ovl->urb = (usbdevfs_urb*)malloc(sizeof(usbdevfs_urb) + packets * sizeof(usbdevfs_iso_packet_desc));
+		ovl->isoCapacity = ovl->urb ? packets : 0;
+		if(ovl->urb == NULL)
+		{
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return FALSE;
+		}
+	}
+
+	usbdevfs_urb* urb = ovl->urb;
+	memset(urb, 0, sizeof(usbdevfs_urb));
+	urb->type = USBDEVFS_URB_TYPE_ISO;
+	urb->endpoint = pipeId;
+	urb->flags = USBDEVFS_URB_ISO_ASAP;
+	urb->buffer = buffer;
+	urb->buffer_length = bufferLength;
+	urb->number_of_packets = packets;
+	urb->usercontext = ovl;
+	//usbfs places packets back to back, KISO offsets of the engine are laid out the same way
+	for(int i = 0; i < packets; i++)
+	{
+		UINT end = i + 1 < packets ? isoContext->IsoPackets[i + 1].Offset : bufferLength;
+		urb->iso_frame_desc[i].length = end - isoContext->IsoPackets[i].Offset;
+		urb->iso_frame_desc[i].actual_length = 0;
+		urb->iso_frame_desc[i].status = 0;
+	}
+	isoContext->StartFrame = 0;
+	ovl->isoContext = isoContext;
+	ovl->status = ERROR_SUCCESS;
+	ovl->transferred = 0;
+	ResetEvent(ovl->event);
+
+	EnterCriticalSection(&m_lock);
+	bool submitted = CheckResult(ioctl(m_fd, USBDEVFS_SUBMITURB, urb));
+	if(submitted)
+	{
+		ovl->state = TransferQueued;
+		ovl->next = m_inflight;
+		m_inflight = ovl;
+	}
+	LeaveCriticalSection(&m_lock);
+	if(!submitted)
+		return FALSE;
+	SetLastError(ERROR_IO_PENDING);
+	return FALSE;
+}
+
+#endif //_USE_USBFS
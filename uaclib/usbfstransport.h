@@ -0,0 +1,110 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#pragma once
+#ifndef __USBFS_TRANSPORT_H__
+#define __USBFS_TRANSPORT_H__
+
+#include "usbtransport.h"
+
+#ifdef _USE_USBFS
+
+#include <linux/usbdevice_fs.h>
+
+#ifdef _ENABLE_TRACE
+extern void debugPrintf(const _TCHAR *szFormat, ...);
+#endif
+
+#define USBFS_WIDGET_VID		0x16C0
+#define USBFS_WIDGET_PID		0x03E8
+#define USBFS_MAX_ISO_PACKETS	128		//usbfs limit per URB
+
+struct UsbFsOverlapped;
+struct UsbFsPool;
+
+//device opened directly through its usbfs node (/dev/bus/usb/BBB/DDD) on Linux.
+//Every overlapped owns one URB, built once with room for the packets of its ISOBuffer,
+//so a resubmit is one USBDEVFS_SUBMITURB without allocation. The reap thread polls the
+//node, takes completed URBs with USBDEVFS_REAPURBNDELAY and signals their events.
+//Transfers start ASAP, usbfs has no frame number.
+class UsbFsTransport : public USBTransport
+{
+	USHORT				m_vendorId;
+	USHORT				m_productId;
+	int					m_fd;
+	int					m_speed;
+	//wakes the reap thread up on close
+	int					m_wakePipe[2];
+
+	HANDLE				m_reapThread;
+	volatile int		m_exit;
+	//guards URB state shared with the reap thread
+	CRITICAL_SECTION	m_lock;
+	//submitted URBs, AbortPipe discards them by endpoint
+	UsbFsOverlapped*	m_inflight;
+
+	static DWORD WINAPI sReapThread(LPVOID context);
+	void ReapThread();
+	void Completed(UsbFsOverlapped* overlapped);
+	void Disconnected();
+
+	int FindDevice();
+	bool CheckResult(int result);
+	bool Submit(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext);
+	void Unlink(UsbFsOverlapped* overlapped);
+	bool Cancel(UsbFsOverlapped* overlapped, DWORD timeoutMS);
+	bool GetResult(UsbFsOverlapped* overlapped, PUINT transferredLength);
+public:
+	UsbFsTransport(USHORT vendorId = USBFS_WIDGET_VID, USHORT productId = USBFS_WIDGET_PID);
+	virtual ~UsbFsTransport();
+
+	virtual bool Open();
+	virtual void Close();
+	virtual bool IsOpen()
+	{ return m_fd >= 0; }
+
+	virtual bool GetDeviceSpeed(int* speed);
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred);
+
+	virtual bool ClaimInterface(UCHAR number);
+	virtual bool ReleaseInterface(UCHAR number);
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting);
+
+	virtual bool ResetPipe(UCHAR pipeId);
+	virtual bool AbortPipe(UCHAR pipeId);
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value);
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber);
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount);
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle);
+	virtual bool OvlRelease(KOVL_HANDLE overlapped);
+	virtual bool OvlReUse(KOVL_HANDLE overlapped);
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength);
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength);
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped);
+
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return Submit(pipeId, buffer, bufferLength, overlapped, isoContext); }
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext)
+	{ return Submit(pipeId, buffer, bufferLength, overlapped, isoContext); }
+	virtual int GetMaxIsoPackets()
+	{ return USBFS_MAX_ISO_PACKETS; }
+};
+
+#endif //_USE_USBFS
+
+#endif //__USBFS_TRANSPORT_H__
@@ -0,0 +1,73 @@
+/*!
+#
+# Win-Widget. Windows related software for Audio-Widget/SDR-Widget (http://code.google.com/p/sdr-widget/)
+# Copyright (C) 2012 Nikolay Kovbasa
+#
+# Permission to copy, use, modify, sell and distribute this software
+# is granted provided this copyright notice appears in all copies.
+# This software is provided "as is" without express or implied
+# warranty, and with no claim as to its suitability for any purpose.
+#
+#----------------------------------------------------------------------------
+# Contact: nikkov@gmail.com
+#----------------------------------------------------------------------------
+*/
+
+#pragma once
+#ifndef __USB_TRANSPORT_H__
+#define __USB_TRANSPORT_H__
+
+#include "platform.h"
+
+//Access to one USB device, used by USBDevice for everything that goes to the bus.
+//Semantics follow libusbK: functions return FALSE and set the thread last error on failure,
+//ISO transfers are asynchronous and queued ones fail with ERROR_IO_PENDING.
+//Overlapped handles come from a pool of the transport, every handle has a manual reset
+//event signaled on completion, so several pipes can be waited with WaitForMultipleObjects.
+class USBTransport
+{
+public:
+	virtual ~USBTransport() {}
+
+	//finds and opens the device
+	virtual bool Open() = 0;
+	virtual void Close() = 0;
+	virtual bool IsOpen() = 0;
+
+	//LowSpeed=0x01, FullSpeed=0x02, HighSpeed=0x03
+	virtual bool GetDeviceSpeed(int* speed) = 0;
+	virtual bool GetDescriptor(UCHAR type, UCHAR index, USHORT languageId, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred) = 0;
+	//synchronous control transfer on the default pipe
+	virtual bool ControlTransfer(WINUSB_SETUP_PACKET setupPacket, PUCHAR buffer, UINT bufferLength, PUINT lengthTransferred) = 0;
+
+	virtual bool ClaimInterface(UCHAR number) = 0;
+	virtual bool ReleaseInterface(UCHAR number) = 0;
+	virtual bool SetAltInterface(UCHAR number, UCHAR altSetting) = 0;
+
+	virtual bool ResetPipe(UCHAR pipeId) = 0;
+	virtual bool AbortPipe(UCHAR pipeId) = 0;
+	virtual bool SetPipePolicy(UCHAR pipeId, ULONG policyType, ULONG valueLength, PVOID value) = 0;
+	//1 ms bus frames
+	virtual bool GetCurrentFrameNumber(PUINT frameNumber) = 0;
+
+	virtual bool OvlInit(KOVL_POOL_HANDLE* poolHandle, LONG maxOverlappedCount) = 0;
+	virtual bool OvlFree(KOVL_POOL_HANDLE poolHandle) = 0;
+	virtual bool OvlAcquire(KOVL_HANDLE* overlapped, KOVL_POOL_HANDLE poolHandle) = 0;
+	virtual bool OvlRelease(KOVL_HANDLE overlapped) = 0;
+	virtual bool OvlReUse(KOVL_HANDLE overlapped) = 0;
+	//FALSE if the transfer failed or isn't complete after timeoutMS
+	virtual bool OvlWait(KOVL_HANDLE overlapped, LONG timeoutMS, KOVL_WAIT_FLAG waitFlags, PUINT transferredLength) = 0;
+	//cancels the transfer if it isn't complete after timeoutMS
+	virtual bool OvlWaitOrCancel(KOVL_HANDLE overlapped, LONG timeoutMS, PUINT transferredLength) = 0;
+	virtual HANDLE OvlGetEventHandle(KOVL_HANDLE overlapped) = 0;
+
+	//isoContext keeps packet offsets of the buffer on submit, lengths and status of IN packets on completion.
+	//StartFrame of zero or ISO_ALWAYS_START_ASAP policy queue the transfer after the previous one
+	virtual bool IsoWritePipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext) = 0;
+	virtual bool IsoReadPipe(UCHAR pipeId, PUCHAR buffer, ULONG bufferLength, KOVL_HANDLE overlapped, PKISO_CONTEXT isoContext) = 0;
+	//most packets one ISO transfer can carry, 0 - the transport has no limit of its own
+	virtual int GetMaxIsoPackets()
+	{ return 0; }
+};
+
+#endif //__USB_TRANSPORT_H__